@@ -0,0 +1,123 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "blockstore.h"
+
+#include <glog/logging.h>
+
+namespace blockstore {
+
+using epoll_threadpool::FutureBarrier;
+
+namespace {
+/**
+ * Gathers the results of the individual getBlock() calls made by the
+ * default getBlocks().
+ */
+void getBlocksHelper(vector< Future<IOBuffer *> > results,
+                     FutureBarrier *barrier,
+                     Future< vector<IOBuffer *> > ret) {
+  vector<IOBuffer *> blocks;
+  blocks.reserve(results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    blocks.push_back(results[i].get());
+  }
+  ret.set(blocks);
+  delete barrier;
+}
+
+/**
+ * Gathers the results of the individual putBlock() calls made by the
+ * default putBlocks().
+ */
+void putBlocksHelper(vector< Future<bool> > results,
+                     FutureBarrier *barrier,
+                     Future< vector<bool> > ret) {
+  vector<bool> ok;
+  ok.reserve(results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    ok.push_back(results[i].get());
+  }
+  ret.set(ok);
+  delete barrier;
+}
+
+/**
+ * Resolves the default hasBlock() from a getBlock().
+ */
+void hasBlockHelper(Future<IOBuffer *> result, Future<bool> ret) {
+  delete result.get();
+  ret.set(result.get() != NULL);
+}
+}
+
+Future<vector<IOBuffer *> > BlockStore::getBlocks(
+    const vector<string> &keys) {
+  Future< vector<IOBuffer *> > ret;
+  vector< Future<IOBuffer *> > results;
+  FutureBarrier::FutureSet fs;
+  for (size_t i = 0; i < keys.size(); i++) {
+    results.push_back(getBlock(keys[i]));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(
+      std::tr1::bind(&getBlocksHelper, results, barrier, ret));
+  return ret;
+}
+
+Future<vector<bool> > BlockStore::putBlocks(const vector<string> &keys,
+                                            const vector<IOBuffer *> &data) {
+  if (keys.size() != data.size()) {
+    LOG(ERROR) << "putBlocks given " << keys.size() << " keys but "
+               << data.size() << " blocks.";
+    for (size_t i = 0; i < data.size(); i++) {
+      delete data[i];
+    }
+    return vector<bool>(keys.size(), false);
+  }
+  Future< vector<bool> > ret;
+  vector< Future<bool> > results;
+  FutureBarrier::FutureSet fs;
+  for (size_t i = 0; i < keys.size(); i++) {
+    results.push_back(putBlock(keys[i], data[i]));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(
+      std::tr1::bind(&putBlocksHelper, results, barrier, ret));
+  return ret;
+}
+
+Future<bool> BlockStore::hasBlock(const string &key) {
+  Future<bool> ret;
+  Future<IOBuffer *> result = getBlock(key);
+  result.addCallback(std::tr1::bind(&hasBlockHelper, result, ret));
+  return ret;
+}
+}
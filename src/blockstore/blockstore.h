@@ -33,6 +33,7 @@
 
 #include <string>
 #include <tr1/functional>
+#include <vector>
 
 #include <epoll_threadpool/future.h>
 #include <epoll_threadpool/iobuffer.h>
@@ -43,10 +44,16 @@ namespace blockstore {
 
 using std::string;
 using std::tr1::function;
+using std::vector;
 using epoll_threadpool::Future;
 using epoll_threadpool::IOBuffer;
 using util::BloomFilter;
 
+/**
+ * Default capacity of a BlockStore in bytes.
+ */
+const uint64_t kDefaultBlockStoreSize = 16ULL * 1024 * 1024 * 1024;
+
 /**
  * Interface for BlockStore. Used by both concrete classes and proxy objects
  * that operate over the network.
@@ -80,6 +87,37 @@ class BlockStore {
    */
   virtual Future<bool> removeBlock(const string &key) = 0;
 
+  /**
+   * Checks whether a block is stored without transferring its contents.
+   * The default implementation reads the block with getBlock().
+   * @param key the key for this block
+   * @returns true if the block exists.
+   */
+  virtual Future<bool> hasBlock(const string &key);
+
+  /**
+   * Reads several blocks at once. The default implementation issues a
+   * getBlock() for each key concurrently; stores that can do better
+   * (e.g. by ordering disk reads or batching round trips) override it.
+   * @param keys the keys of the blocks to read
+   * @returns one IOBuffer per key, in the same order, with NULL for any
+   *        block that could not be read.
+   * @note Ownership of the returned IOBuffers is passed to the caller.
+   */
+  virtual Future<vector<IOBuffer *> > getBlocks(const vector<string> &keys);
+
+  /**
+   * Writes several blocks at once. The default implementation issues a
+   * putBlock() for each key concurrently.
+   * @param keys the keys of the blocks to write
+   * @param data one block per key, each up to "blocksize" long.
+   * @returns one result per key, in the same order, true if that block
+   *        was written.
+   * @note Ownership of data is transfered to the function.
+   */
+  virtual Future<vector<bool> > putBlocks(const vector<string> &keys,
+                                          const vector<IOBuffer *> &data);
+
   /**
    * Gets the size of blocks on this device.
    * @returns the size of a block in bytes or -1 on error.
@@ -104,6 +142,38 @@ class BlockStore {
    * @return BloomFilter
    */
   virtual Future<BloomFilter> bloomfilter() = 0;
+
+  /**
+   * Returns true while the store may be unreachable, such as a remote
+   * store whose connection has dropped and is being re-established.
+   * Callers should prefer other copies of a block to a suspect store's.
+   */
+  virtual bool isSuspect() const { return false; }
+
+  /**
+   * Returns true while the store answers, but more slowly than usual.
+   * Callers should prefer a healthy copy of a block to a slow store's, and
+   * a slow store's to a suspect one's.
+   */
+  virtual bool isSlow() const { return false; }
+
+  /**
+   * Verifies the checksums of up to maxBlocks stored blocks, carrying on
+   * from where the previous call stopped and wrapping around at the end.
+   * Corrupt blocks are removed so that they can be repaired from another
+   * copy.
+   * @returns the keys of any corrupt blocks found.
+   */
+  virtual Future<vector<string> > scrub(size_t maxBlocks) {
+    return vector<string>();
+  }
+
+  /**
+   * Iterates through the keys of stored blocks one at a time. Returns an
+   * empty string when complete and auto-resets. Stores that can't be
+   * enumerated (such as remote ones) always return an empty string.
+   */
+  virtual string next() { return ""; }
 };
 }
 #endif
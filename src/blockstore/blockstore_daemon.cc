@@ -30,7 +30,13 @@
 #include "blockstore.h"
 #include "blockstore_daemon.h"
 #include "remoteblockstore.h"
+#include "coding/lt.h"
+#include "coding/reedsolomon.h"
+#include "rpc/mesh.h"
 #include "rpc/rpc.h"
+#include "rpc/securetransport.h"
+#include "rpc/service_node.h"
+#include "util/sha256.h"
 #include "util/url.h"
 
 #include <epoll_threadpool/eventmanager.h>
@@ -39,20 +45,29 @@
 #include <epoll_threadpool/notification.h>
 #include <epoll_threadpool/tcp.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <sys/stat.h>
 #include <sys/time.h>
 
 namespace blockstore {
 
+using coding::LTObjectDecoder;
+using coding::ReedSolomon;
 using epoll_threadpool::Future;
 using epoll_threadpool::FutureBarrier;
 using epoll_threadpool::EventManager;
 using epoll_threadpool::IOBuffer;
 using epoll_threadpool::Notification;
 using epoll_threadpool::TcpListenSocket;
-using epoll_threadpool::TcpSocket;
 using msgpack::sbuffer;
 using rpc::RPCServer;
 using rpc::RPCClient;
@@ -64,6 +79,47 @@ namespace {
 
 // The interval in seconds between incremental file processing attempts.
 const double TIMER_INTERVAL = 1.0;
+
+// The number of blocks in each local BlockStore to verify per timer tick.
+const size_t SCRUB_BLOCKS_PER_TICK = 64;
+
+// The number of timer ticks between refreshes of the cached BlockStore
+// bloom filters used to spot duplicate content.
+const int BLOOMFILTER_REFRESH_TICKS = 60;
+
+// The number of blocks in each local BlockStore to walk per timer tick,
+// checking coded blocks' siblings and content blocks against the GC bloom
+// filter.
+const size_t GC_BLOCKS_PER_TICK = 256;
+
+// How long before a GC bloom filter is set a block must already have been
+// seen missing from an earlier filter to be removed. This covers the time
+// taken to build the filter and blocks written but not yet referenced.
+const double GC_GRACE_PERIOD = 3600.0;
+
+// Prefix of content addressed block keys.
+const char CONTENT_KEY_PREFIX[] = "sha256-";
+
+// Size of the chunks objects are split into and the number of chunk
+// requests kept in flight while streaming them.
+const size_t OBJECT_CHUNK_SIZE = 65536;
+const int OBJECT_WINDOW = 32;
+
+// The number of objects repaired at once and the bandwidth repairs may use.
+const int REPAIR_MAX_IN_FLIGHT = 8;
+const uint64_t REPAIR_BYTES_PER_SEC = 32 << 20;
+
+// How long in seconds a peer may stay unreachable before we give up
+// reconnecting and forget it and its BlockStores.
+const double PEER_EXPIRY = 600.0;
+
+// Labels HMACed with the cluster key to derive the block encryption key
+// and the transport pre-shared key, so neither key is ever used for both.
+const char BLOCK_KEY_LABEL[] = "rawdish block key";
+const char TRANSPORT_KEY_LABEL[] = "rawdish transport key";
+
+// Payload size of each fountain coded block, leaving room for its header.
+const size_t FOUNTAIN_SYMBOL_SIZE = 65536 - 16;
  
 /**
  * Helper function called when storing blocks. When both primary and 
@@ -77,40 +133,217 @@ void putBlockHelper(
     Future<uint64_t> fA, Future<uint64_t> fB, 
     FutureBarrier *barrier,
     Future<bool> ret) {
-  if (fA.get() < fB.get()) {
+  if (fA.get() >= fB.get()) {
     ret.set(bsA->putBlock(name, data));
   } else {
     ret.set(bsB->putBlock(name, data));
   }
   delete barrier;
 }
+
+/**
+ * Resolves a putCodedObject() once all of its blocks have been stored.
+ */
+void putCodedHelper(vector< Future<bool> > results, FutureBarrier *barrier,
+                    Future<bool> ret) {
+  bool ok = true;
+  for (size_t i = 0; i < results.size(); i++) {
+    ok = results[i].get() && ok;
+  }
+  ret.set(ok);
+  delete barrier;
+}
+
+/**
+ * Decodes an object once all getCodedObject() block fetches resolve.
+ */
+void getCodedHelper(string name, int k, int m,
+                    vector< Future<IOBuffer *> > results,
+                    FutureBarrier *barrier, Future<IOBuffer *> ret) {
+  vector<string> blocks(results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    IOBuffer *buf = results[i].get();
+    if (buf) {
+      blocks[i].assign((const char *)buf->pulldown(buf->size()),
+                       buf->size());
+      delete buf;
+    }
+  }
+  delete barrier;
+  string object;
+  if (!ReedSolomon(k, m).join(blocks, &object)) {
+    LOG(ERROR) << "Unable to decode object " << name;
+    ret.set(NULL);
+    return;
+  }
+  ret.set(new IOBuffer(object.data(), object.size()));
+}
+
+/**
+ * Returns the name of fountain coded block n of 'total'. These get their
+ * own suffix so they are never mistaken for Reed-Solomon blocks and
+ * "repaired" as such.
+ */
+string fountainBlockName(const string &name, int n, int total) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), ".%d.%d.lt", n, total);
+  return name + buf;
+}
+
+/**
+ * State shared by the block fetches of one getFountainObject().
+ */
+struct FountainFetch {
+  FountainFetch(const string &name, int outstanding,
+                Future<IOBuffer *> ret)
+      : name(name), outstanding(outstanding), finished(false),
+        decoder(outstanding), ret(ret) {
+    pthread_mutex_init(&lock, NULL);
+  }
+  ~FountainFetch() {
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+  string name;
+  int outstanding;
+  bool finished;
+  LTObjectDecoder decoder;
+  Future<IOBuffer *> ret;
+};
+
+/**
+ * Feeds one fetched block of a getFountainObject() to its decoder. The
+ * result is returned as soon as the object decodes, without waiting for
+ * the remaining fetches.
+ */
+void getFountainHelper(FountainFetch *state, Future<IOBuffer *> result) {
+  IOBuffer *buf = result.get();
+  IOBuffer *object = NULL;
+  bool respond = false;
+  pthread_mutex_lock(&state->lock);
+  if (buf && !state->finished) {
+    state->decoder.add((const char *)buf->pulldown(buf->size()),
+                       buf->size());
+    if (state->decoder.done()) {
+      string data;
+      if (state->decoder.object(&data)) {
+        object = new IOBuffer(data.data(), data.size());
+      }
+      state->finished = respond = true;
+    }
+  }
+  const bool last = --state->outstanding == 0;
+  if (last && !state->finished) {
+    LOG(ERROR) << "Unable to decode object " << state->name;
+    state->finished = respond = true;
+  }
+  pthread_mutex_unlock(&state->lock);
+  delete buf;
+
+  if (respond) {
+    state->ret.set(object);
+  }
+  if (last) {
+    delete state;
+  }
+}
+
+/**
+ * Ranks a BlockStore for placement and reads: 0 if healthy, 1 if slow and
+ * 2 if suspect.
+ */
+int unhealthiness(const BlockStore *bs) {
+  return bs->isSuspect() ? 2 : bs->isSlow() ? 1 : 0;
+}
+
+/**
+ * Passes the result of one getBlock() on as the result of another.
+ */
+void forwardBlockHelper(Future<IOBuffer*> src, Future<IOBuffer*> dst) {
+  dst.set(src.get());
+}
+
+void RPCGetBlockHelper(Future< vector<uint8_t> > dst, Future<IOBuffer*> src) {
+  vector<uint8_t> ret;
+  if (src.get() != NULL) {
+    ret.resize(src.get()->size());
+    if (!ret.empty()) {
+      memcpy(&ret[0], src.get()->pulldown(ret.size()), ret.size());
+    }
+    delete src.get();
+  }
+  dst.set(ret);
+}
+/**
+ * Resolves a putContentBlock() once its block has been written.
+ */
+void putContentStoredHelper(string key, Future<bool> stored,
+                            Future<string> ret) {
+  ret.set(stored.get() ? key : "");
+}
 } // end anonmyous namespace
 
+const char BlockStoreNode::kServiceName[] = "blockstore";
+
 BlockStoreNode::BlockStoreNode(EventManager *em, const string& host)
-    : _em(em), _host(host) {
-  
-  shared_ptr<TcpListenSocket> s;
-  while(s == NULL) {
-    _port = rand();
-    s = TcpListenSocket::create(em, _port);
-  }
-  _rpc_server = RPCServer::create(s);
+    : _mesh(Mesh::create(em, host)), _em(em), _host(host),
+      _port(_mesh->port()),
+      _streamer(bind(&BlockStoreNode::putBlock, this, _1, _2),
+                bind(&BlockStoreNode::getBlock, this, _1),
+                OBJECT_CHUNK_SIZE, OBJECT_WINDOW),
+      _repair(bind(&BlockStoreNode::putBlock, this, _1, _2),
+              bind(&BlockStoreNode::getBlock, this, _1),
+              REPAIR_MAX_IN_FLIGHT, REPAIR_BYTES_PER_SEC),
+      _ticks(0), _haveGCBloomFilter(false), _gcFilterTime(0) {
+  init();
+}
+
+BlockStoreNode::BlockStoreNode(shared_ptr<Mesh> mesh)
+    : _mesh(mesh), _em(mesh->getEventManager()), _host(mesh->host()),
+      _port(mesh->port()),
+      _streamer(bind(&BlockStoreNode::putBlock, this, _1, _2),
+                bind(&BlockStoreNode::getBlock, this, _1),
+                OBJECT_CHUNK_SIZE, OBJECT_WINDOW),
+      _repair(bind(&BlockStoreNode::putBlock, this, _1, _2),
+              bind(&BlockStoreNode::getBlock, this, _1),
+              REPAIR_MAX_IN_FLIGHT, REPAIR_BYTES_PER_SEC),
+      _ticks(0), _haveGCBloomFilter(false), _gcFilterTime(0) {
+  init();
+}
+
+void BlockStoreNode::init() {
+  pthread_mutex_init(&_missingLock, NULL);
+  pthread_mutex_init(&_filterLock, NULL);
+  pthread_mutex_init(&_peerLock, NULL);
+
+  // Peers reach us through the Mesh, so the server has no socket.
+  _rpc_server = RPCServer::create(shared_ptr<TcpListenSocket>());
   _rpc_server->registerFunction<bool, string, uint16_t>("addPeer",
       bind(&BlockStoreNode::RPCAddPeer, this, _1, _2));
   _rpc_server->registerFunction<bool, uint64_t>(
       "addBlockStore",
       bind(&BlockStoreNode::RPCAddBlockStore, this, _host, _port, _1));
+  _rpc_server->registerFunction<bool, string, vector<uint8_t> >("putBlock",
+      bind(&BlockStoreNode::RPCPutBlock, this, _1, _2));
+  _rpc_server->registerFunction<vector<uint8_t>, string>("getBlock",
+      bind(&BlockStoreNode::RPCGetBlock, this, _1));
+  _rpc_server->registerFunction<bool, vector<uint8_t> >("setGCBloomFilter",
+      bind(&BlockStoreNode::RPCSetGCBloomFilter, this, _1));
 }
 
 BlockStoreNode::~BlockStoreNode() {
   stop();
+  pthread_mutex_destroy(&_peerLock);
+  pthread_mutex_destroy(&_filterLock);
+  pthread_mutex_destroy(&_missingLock);
 }
 
 void BlockStoreNode::start() {
   EventManager::WallTime t = EventManager::currentTime();
   _em->enqueue(std::tr1::bind(&BlockStoreNode::onTimer, this),
                t + TIMER_INTERVAL);
-  _rpc_server->start();
+  _mesh->addService(kServiceName, _rpc_server);
 }
 
 void BlockStoreNode::stop() {
@@ -123,18 +356,69 @@ bool BlockStoreNode::addPeer(const string &host, uint16_t port) {
   return RPCAddPeer(host, port);
 }
 
+void BlockStoreNode::setEncryptionKey(const string &key) {
+  _cipher.reset(new util::BlockCipher(util::hmacSha256(key, BLOCK_KEY_LABEL)));
+}
+
+shared_ptr<rpc::SecureContext> BlockStoreNode::createSecureContext(
+    const string &key) {
+  return rpc::SecureContext::create(
+      util::hmacSha256(key, TRANSPORT_KEY_LABEL));
+}
+
+void BlockStoreNode::setHeartbeatPolicy(
+    const RPCClient::HeartbeatPolicy &policy) {
+  _heartbeat = policy;
+}
+
+map<string, util::FailureDetector::Stats> BlockStoreNode::getPeerHealth() {
+  map<string, util::FailureDetector::Stats> ret;
+  pthread_mutex_lock(&_peerLock);
+  for (map< PeerAddr, shared_ptr<Peer> >::iterator i = _peers.begin();
+       i != _peers.end(); ++i) {
+    std::ostringstream addr;
+    addr << i->first.host << ":" << i->first.port;
+    ret[addr.str()] = i->second->_control->healthStats();
+  }
+  pthread_mutex_unlock(&_peerLock);
+  return ret;
+}
+
 void BlockStoreNode::addBlockStore(uint64_t bsid, const string &pathname) {
-  _blockstores[bsid] = shared_ptr<BlockStore>(new FileBlockStore(pathname));
+  FileBlockStore *bs = new FileBlockStore(pathname);
+  bs->setCompression(util::CODEC_LZ4);
+  bs->setEncryption(_cipher);
+  _blockstores[bsid] = shared_ptr<BlockStore>(bs);
+  _localBlockStores[bsid] = _blockstores[bsid];
   //RegisterRemoteBlockStore(_rpc_server, _blockstores[bsid], bsid);
   // TODO(aarond10): Tell each of our peers about our new BlockStore.
 }
 
 BlockStore *BlockStoreNode::_findBestLocation(size_t hash) {
-  return NULL;
+  if (_blockstores.empty()) {
+    return NULL;
+  }
+  map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+      _blockstores.upper_bound(hash);
+  if (i == _blockstores.begin()) {
+    i = _blockstores.end();
+  }
+  return (--i)->second.get();
 }
 
 BlockStore *BlockStoreNode::_findNextBestLocation(size_t hash) {
-  return NULL;
+  if (_blockstores.empty()) {
+    return NULL;
+  }
+  map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+      _blockstores.upper_bound(hash);
+  for (int n = 0; n < 2; n++) {
+    if (i == _blockstores.begin()) {
+      i = _blockstores.end();
+    }
+    --i;
+  }
+  return i->second.get();
 }
 
 Future<bool> BlockStoreNode::putBlock(const string &name, IOBuffer *data) {
@@ -142,6 +426,17 @@ Future<bool> BlockStoreNode::putBlock(const string &name, IOBuffer *data) {
   Future<bool> ret;
   BlockStore* bsA = _findBestLocation(std::tr1::hash<string>()(name));
   BlockStore* bsB = _findNextBestLocation(std::tr1::hash<string>()(name));
+  if (!bsA) {
+    LOG(ERROR) << "No BlockStores available to store " << name;
+    delete data;
+    return false;
+  }
+  // Don't wait on a slow or dead peer when the other location is better.
+  const int a = unhealthiness(bsA);
+  const int b = unhealthiness(bsB);
+  if (a != b) {
+    return (a < b ? bsA : bsB)->putBlock(name, data);
+  }
   FutureBarrier::FutureSet fs;
 
   Future<uint64_t> fA = bsA->numFreeBlocks();
@@ -155,60 +450,447 @@ Future<bool> BlockStoreNode::putBlock(const string &name, IOBuffer *data) {
 }
 
 Future<IOBuffer *> BlockStoreNode::getBlock(const string &name) {
-  // Find list of all candidate BlockStores.
-  // If list is empty, search the best 3 candidate BS just in case the block
-  // was added recently.
+  // Blocks are stored at one of the two best locations for their name.
+  // TODO(aarond10): Consult BloomFilters and search further afield for
+  // blocks placed before BlockStores were added.
+  BlockStore *bs = _findBestLocation(std::tr1::hash<string>()(name));
+  if (!bs) {
+    return NULL;
+  }
+  // Read the other copy first while it is healthier than the best one.
+  BlockStore *next = _findNextBestLocation(std::tr1::hash<string>()(name));
+  if (unhealthiness(next) < unhealthiness(bs)) {
+    bs = next;
+  }
+  Future<IOBuffer *> ret;
+  Future<IOBuffer *> first = bs->getBlock(name);
+  first.addCallback(
+      bind(&BlockStoreNode::getBlockHelper, this, name, bs, first, ret));
+  return ret;
+}
+
+void BlockStoreNode::getBlockHelper(string name, BlockStore *tried,
+                                    Future<IOBuffer *> first,
+                                    Future<IOBuffer *> ret) {
+  BlockStore *bsA = _findBestLocation(std::tr1::hash<string>()(name));
+  BlockStore *bsB = _findNextBestLocation(std::tr1::hash<string>()(name));
+  BlockStore *other = tried == bsA ? bsB : bsA;
+  if (first.get() != NULL || other == NULL || other == tried) {
+    ret.set(first.get());
+  } else {
+    Future<IOBuffer *> second = other->getBlock(name);
+    second.addCallback(bind(&forwardBlockHelper, second, ret));
+  }
+}
+
+Future<bool> BlockStoreNode::putCodedObject(const string &name,
+                                            IOBuffer *data, int k, int m) {
+  string object((const char *)data->pulldown(data->size()), data->size());
+  delete data;
+  vector<string> blocks = ReedSolomon(k, m).split(object);
+
+  Future<bool> ret;
+  vector< Future<bool> > results;
+  FutureBarrier::FutureSet fs;
+  for (int i = 0; i < k + m; i++) {
+    results.push_back(putBlock(ReedSolomon::blockName(name, i, k, m),
+                               new IOBuffer(blocks[i].data(),
+                                            blocks[i].size())));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(
+      std::tr1::bind(&putCodedHelper, results, barrier, ret));
+  return ret;
+}
+
+Future<IOBuffer *> BlockStoreNode::getCodedObject(const string &name,
+                                                  int k, int m) {
+  Future<IOBuffer *> ret;
+  vector< Future<IOBuffer *> > results;
+  FutureBarrier::FutureSet fs;
+  for (int i = 0; i < k + m; i++) {
+    results.push_back(getBlock(ReedSolomon::blockName(name, i, k, m)));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(
+      std::tr1::bind(&getCodedHelper, name, k, m, results, barrier, ret));
+  return ret;
+}
+
+Future<bool> BlockStoreNode::putFountainObject(const string &name,
+                                               IOBuffer *data,
+                                               double overhead) {
+  string object((const char *)data->pulldown(data->size()), data->size());
+  delete data;
+  vector<string> blocks = coding::ltEncodeObject(
+      object, FOUNTAIN_SYMBOL_SIZE, overhead,
+      std::tr1::hash<string>()(name));
+
+  Future<bool> ret;
+  vector< Future<bool> > results;
+  FutureBarrier::FutureSet fs;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    results.push_back(putBlock(
+        fountainBlockName(name, i, blocks.size()),
+        new IOBuffer(blocks[i].data(), blocks[i].size())));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(
+      std::tr1::bind(&putCodedHelper, results, barrier, ret));
+  return ret;
+}
+
+Future<IOBuffer *> BlockStoreNode::getFountainObject(const string &name,
+                                                     int total) {
+  Future<IOBuffer *> ret;
+  if (total <= 0) {
+    ret.set(NULL);
+    return ret;
+  }
+  FountainFetch *state = new FountainFetch(name, total, ret);
+  for (int i = 0; i < total; i++) {
+    Future<IOBuffer *> result =
+        getBlock(fountainBlockName(name, i, total));
+    result.addCallback(bind(&getFountainHelper, state, result));
+  }
+  return ret;
+}
+
+bool BlockStoreNode::putObject(const string &name, int fd,
+                               StreamStats *stats) {
+  return _streamer.put(name, fd, stats);
+}
+
+bool BlockStoreNode::getObject(const string &name, int fd,
+                               StreamStats *stats) {
+  return _streamer.get(name, fd, stats);
+}
+
+Future<bool> BlockStoreNode::RPCPutBlock(string name, vector<uint8_t> data) {
+  return putBlock(name, new IOBuffer(
+      data.empty() ? NULL : (const char *)&data[0], data.size()));
+}
+
+Future< vector<uint8_t> > BlockStoreNode::RPCGetBlock(string name) {
+  Future< vector<uint8_t> > ret;
+  Future<IOBuffer *> src = getBlock(name);
+  src.addCallback(bind(&RPCGetBlockHelper, ret, src));
+  return ret;
+}
+
+Future<bool> BlockStoreNode::RPCSetGCBloomFilter(
+    vector<uint8_t> bloomfilter) {
+  BloomFilter filter;
+  filter.deserialize(bloomfilter);
+  setGCBloomFilter(filter);
+  return true;
+}
+
+string BlockStoreNode::contentKey(const char *data, size_t len) {
+  return CONTENT_KEY_PREFIX + util::sha256Hex(data, len);
+}
+
+bool BlockStoreNode::isContentKey(const string &key) {
+  return key.compare(0, sizeof(CONTENT_KEY_PREFIX) - 1,
+                     CONTENT_KEY_PREFIX) == 0;
+}
+
+Future<string> BlockStoreNode::putContentBlock(IOBuffer *data) {
+  if (!data) {
+    return string();
+  }
+  const string key = contentKey(data->pulldown(data->size()), data->size());
+  const size_t hash = std::tr1::hash<string>()(key);
+  BlockStore *locations[] = { _findBestLocation(hash),
+                              _findNextBestLocation(hash) };
+  BlockStore *probe = NULL;
+  pthread_mutex_lock(&_filterLock);
+  _dedupStats.puts++;
+  if (_haveGCBloomFilter) {
+    // The key is live again, whether or not we end up writing it.
+    _gcBloomFilter.set(key);
+    _gcFirstMissed.erase(key);
+  }
+  for (int i = 0; i < 2 && !probe; i++) {
+    map<BlockStore *, BloomFilter>::iterator f =
+        _bloomfilters.find(locations[i]);
+    if (locations[i] && f != _bloomfilters.end() &&
+        f->second.mayContain(key)) {
+      probe = locations[i];
+    }
+  }
+  pthread_mutex_unlock(&_filterLock);
+
+  Future<string> ret;
+  if (probe) {
+    Future<bool> exists = probe->hasBlock(key);
+    exists.addCallback(bind(&BlockStoreNode::putContentHelper, this, key,
+                            data, exists, ret));
+  } else {
+    storeContentBlock(key, data, ret);
+  }
+  return ret;
+}
+
+void BlockStoreNode::putContentHelper(string key, IOBuffer *data,
+                                      Future<bool> exists,
+                                      Future<string> ret) {
+  if (!exists.get()) {
+    storeContentBlock(key, data, ret);
+    return;
+  }
+  pthread_mutex_lock(&_filterLock);
+  _dedupStats.duplicates++;
+  _dedupStats.bytesSaved += data->size();
+  pthread_mutex_unlock(&_filterLock);
+  delete data;
+  ret.set(key);
+}
+
+void BlockStoreNode::storeContentBlock(const string &key, IOBuffer *data,
+                                       Future<string> ret) {
+  const size_t hash = std::tr1::hash<string>()(key);
+  BlockStore *locations[] = { _findBestLocation(hash),
+                              _findNextBestLocation(hash) };
+  pthread_mutex_lock(&_filterLock);
+  for (int i = 0; i < 2; i++) {
+    map<BlockStore *, BloomFilter>::iterator f =
+        _bloomfilters.find(locations[i]);
+    if (f != _bloomfilters.end()) {
+      f->second.set(key);
+    }
+  }
+  pthread_mutex_unlock(&_filterLock);
+
+  Future<bool> stored = putBlock(key, data);
+  stored.addCallback(
+      std::tr1::bind(&putContentStoredHelper, key, stored, ret));
+}
+
+void BlockStoreNode::setGCBloomFilter(const BloomFilter &bloomfilter) {
+  pthread_mutex_lock(&_filterLock);
+  _gcBloomFilter = bloomfilter;
+  _gcFilterTime = EventManager::currentTime();
+  _haveGCBloomFilter = true;
+  pthread_mutex_unlock(&_filterLock);
+}
+
+DedupStats BlockStoreNode::getDedupStats() {
+  pthread_mutex_lock(&_filterLock);
+  DedupStats ret = _dedupStats;
+  pthread_mutex_unlock(&_filterLock);
+  return ret;
+}
+
+void BlockStoreNode::bloomfilterHelper(BlockStore *bs,
+                                       Future<BloomFilter> bloomfilter) {
+  pthread_mutex_lock(&_filterLock);
+  _bloomfilters[bs] = bloomfilter.get();
+  pthread_mutex_unlock(&_filterLock);
+}
+
+void BlockStoreNode::checkSibling(const string &key) {
+  const string sibling = ReedSolomon::nextBlockName(key);
+  if (sibling.empty() || sibling == key) {
+    return;
+  }
+  const size_t hash = std::tr1::hash<string>()(sibling);
+  BlockStore *locations[] = { _findBestLocation(hash),
+                              _findNextBestLocation(hash) };
+  if (!locations[0]) {
+    return;
+  }
+  // A copy on a suspect store is as good as lost until its peer returns.
+  // Stores whose filters we haven't fetched yet are given the benefit of
+  // the doubt.
+  vector<BlockStore *> probe;
+  pthread_mutex_lock(&_filterLock);
+  for (int i = 0; i < 2; i++) {
+    if (i == 1 && locations[1] == locations[0]) {
+      break;
+    }
+    map<BlockStore *, BloomFilter>::iterator f =
+        _bloomfilters.find(locations[i]);
+    if (f == _bloomfilters.end()) {
+      pthread_mutex_unlock(&_filterLock);
+      return;
+    }
+    if (f->second.mayContain(sibling) && !locations[i]->isSuspect()) {
+      pthread_mutex_unlock(&_filterLock);
+      return;
+    }
+    if (!locations[i]->isSuspect()) {
+      probe.push_back(locations[i]);
+    }
+  }
+  pthread_mutex_unlock(&_filterLock);
+
+  // Our filters may predate the block, so ask before reporting it.
+  if (probe.empty()) {
+    LOG(WARNING) << "Sibling " << sibling << " of " << key << " is missing.";
+    pthread_mutex_lock(&_missingLock);
+    _missingBlocks.insert(sibling);
+    pthread_mutex_unlock(&_missingLock);
+    return;
+  }
+  vector< Future<bool> > results;
+  FutureBarrier::FutureSet fs;
+  for (size_t i = 0; i < probe.size(); i++) {
+    results.push_back(probe[i]->hasBlock(sibling));
+    fs.push_back(results.back());
+  }
+  FutureBarrier *barrier = new FutureBarrier(fs);
+  barrier->addCallback(bind(&BlockStoreNode::checkSiblingHelper, this,
+                            sibling, results, barrier));
+}
 
-  return NULL;
+void BlockStoreNode::checkSiblingHelper(string sibling,
+                                        vector< Future<bool> > results,
+                                        FutureBarrier *barrier) {
+  bool found = false;
+  for (size_t i = 0; i < results.size(); i++) {
+    found = found || results[i].get();
+  }
+  if (!found) {
+    LOG(WARNING) << "Sibling " << sibling << " is missing.";
+    pthread_mutex_lock(&_missingLock);
+    _missingBlocks.insert(sibling);
+    pthread_mutex_unlock(&_missingLock);
+  }
+  delete barrier;
+}
+
+vector<string> BlockStoreNode::getMissingBlocks() {
+  pthread_mutex_lock(&_missingLock);
+  vector<string> ret(_missingBlocks.begin(), _missingBlocks.end());
+  _missingBlocks.clear();
+  pthread_mutex_unlock(&_missingLock);
+  return ret;
 }
 
 void BlockStoreNode::onTimer() {
   LOG(INFO) << "Tick";
-  if(_peers.size() && _blockstores.size()) {
-/*
-    // First search for timed out peers and remove them from our connection list.
-    time_t expire_time = time(0) - 60;
-    list<Address> remove_list;
-    for (map<Address, mp::shared_ptr<Peer> >::iterator i = peers->begin();
-	i != peers->end();) {
-      if (i->second->last_update() < expire_time) {
-	remove_list.push_back(i->first);
+
+  // Verify a few local blocks. Corrupt ones are dropped by the store and
+  // reported as missing so they get repaired.
+  for (map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+       _localBlockStores.begin(); i != _localBlockStores.end(); ++i) {
+    vector<string> corrupt = i->second->scrub(SCRUB_BLOCKS_PER_TICK);
+    if (!corrupt.empty()) {
+      pthread_mutex_lock(&_missingLock);
+      _missingBlocks.insert(corrupt.begin(), corrupt.end());
+      pthread_mutex_unlock(&_missingLock);
+    }
+  }
+
+  // Queue missing coded blocks for repair. Anything the repair worker
+  // doesn't understand stays on the list for getMissingBlocks().
+  EventManager::WallTime now = EventManager::currentTime();
+  vector<string> missing = getMissingBlocks();
+  vector<string> unhandled;
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (!_repair.add(missing[i], now)) {
+      unhandled.push_back(missing[i]);
+    }
+  }
+  if (!unhandled.empty()) {
+    pthread_mutex_lock(&_missingLock);
+    _missingBlocks.insert(unhandled.begin(), unhandled.end());
+    pthread_mutex_unlock(&_missingLock);
+  }
+  _repair.tick(now);
+
+  // Forget peers that have been unreachable for too long. Until then their
+  // connections keep retrying in the background.
+  vector<PeerAddr> expired;
+  pthread_mutex_lock(&_peerLock);
+  for (map< PeerAddr, shared_ptr<Peer> >::iterator i = _peers.begin();
+       i != _peers.end(); ++i) {
+    if (i->second->_downSince > 0 &&
+        now - i->second->_downSince >= PEER_EXPIRY) {
+      expired.push_back(i->first);
+    }
+  }
+  pthread_mutex_unlock(&_peerLock);
+  for (size_t i = 0; i < expired.size(); i++) {
+    LOG(WARNING) << "Giving up on peer " << expired[i].host << ":"
+                 << expired[i].port;
+    RemovePeer(expired[i]);
+  }
+
+  // Refresh our copies of every BlockStore's bloom filter now and then so
+  // duplicate content and missing blocks can be spotted without asking.
+  // Filters are replaced in place so there is always one to go by.
+  if (_ticks++ % BLOOMFILTER_REFRESH_TICKS == 0) {
+    pthread_mutex_lock(&_filterLock);
+    std::set<BlockStore *> current;
+    for (map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+         _blockstores.begin(); i != _blockstores.end(); ++i) {
+      current.insert(i->second.get());
+    }
+    for (map<BlockStore *, BloomFilter>::iterator i = _bloomfilters.begin();
+         i != _bloomfilters.end(); ) {
+      if (current.count(i->first)) {
+        ++i;
+      } else {
+        _bloomfilters.erase(i++);
       }
     }
-    for (list<Address>::iterator i = remove_list.begin(); 
-	i != remove_list.end(); ++i) {
-      peers->erase(*i);
+    pthread_mutex_unlock(&_filterLock);
+    for (map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+         _blockstores.begin(); i != _blockstores.end(); ++i) {
+      Future<BloomFilter> f = i->second->bloomfilter();
+      f.addCallback(bind(&BlockStoreNode::bloomfilterHelper, this,
+                         i->second.get(), f));
     }
-	
-    // Validate local blocks
-    string key = _bs->next();
-
-    mp::sync< mp::shared_ptr<util::BloomFilter> >::ref 
-	gc_bloomfilter(_gc_bloomfilter);
-    if (*gc_bloomfilter && !(*gc_bloomfilter)->mayContain(key)) {
-      DVLOG(10) << "Removing " << key << " because it fails to match GC bloomfilter."; 
-      _bs->remove(key);
-    } else {
-      string nextKey = getNextBlockName(key);
-      if (!nextKey.empty()) {
-	// This block key looks like a reed solomon chunk. 
-	// Make sure the next block exists within known reach.
-	int blockFound = false;
-	for(map<Address, mp::shared_ptr<Peer> >::iterator i = 
-	    peers->begin();
-	    i != peers->end(); ++i) {
-	  if (i->second->bloomfilter().mayContain(nextKey)) {
-	    blockFound = true;
-	    break;
-	  }
-	}
-	if (!blockFound) {
-	  mp::sync< set<string> >::ref missingBlocks(_missingBlocks);
-	  missingBlocks->insert(key);
-	}
+  }
+
+  // Walk local blocks. Each coded block checks that the next block of its
+  // object still exists somewhere, which is how blocks lost with a peer get
+  // repaired. Content addressed blocks that are no longer referenced are
+  // dropped, but only once we have seen them unreferenced since well before
+  // the current GC filter was made; anything newer may not be in it yet.
+  pthread_mutex_lock(&_filterLock);
+  const bool gc = _haveGCBloomFilter;
+  pthread_mutex_unlock(&_filterLock);
+  for (map< uint64_t, shared_ptr<BlockStore> >::iterator i =
+       _localBlockStores.begin(); i != _localBlockStores.end(); ++i) {
+    for (size_t n = 0; n < GC_BLOCKS_PER_TICK; n++) {
+      string key = i->second->next();
+      if (key.empty()) {
+        break;
+      }
+      if (!isContentKey(key)) {
+        checkSibling(key);
+        continue;
+      }
+      if (!gc) {
+        continue;
+      }
+      bool remove = false;
+      pthread_mutex_lock(&_filterLock);
+      if (_gcBloomFilter.mayContain(key)) {
+        _gcFirstMissed.erase(key);
+      } else {
+        map<string, EventManager::WallTime>::iterator seen =
+            _gcFirstMissed.find(key);
+        if (seen == _gcFirstMissed.end()) {
+          _gcFirstMissed[key] = now;
+        } else if (seen->second < _gcFilterTime - GC_GRACE_PERIOD) {
+          _gcFirstMissed.erase(seen);
+          remove = true;
+        }
+      }
+      pthread_mutex_unlock(&_filterLock);
+      if (remove) {
+        DVLOG(10) << "Removing " << key
+                  << " because it fails to match GC bloomfilter.";
+        i->second->removeBlock(key);
       }
     }
-*/
   }
 
   if (_rpc_server) {
@@ -229,17 +911,75 @@ Future<IOBuffer *> BlockStoreNode::Peer::getBlock(const string& name) {
 
 }
 
+namespace {
+/**
+ * Returns the cluster key stored at path, generating and storing a new
+ * one if there is none yet. The file must only be accessible to its owner.
+ */
+std::string loadClusterKey(const char *path) {
+  std::string key(util::BlockCipher::kKeySize, '\0');
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    CHECK_EQ(0, fstat(fd, &st)) << "Unable to stat cluster key " << path;
+    CHECK_EQ(0, st.st_mode & (S_IRWXG | S_IRWXO))
+        << "Cluster key " << path << " is accessible to other users";
+    const ssize_t n = read(fd, &key[0], key.size());
+    close(fd);
+    CHECK_EQ((ssize_t)key.size(), n) << "Cluster key " << path
+                                     << " is truncated";
+    return key;
+  }
+  CHECK_EQ(ENOENT, errno) << "Unable to open cluster key " << path << ": "
+                          << strerror(errno);
+  key = util::BlockCipher::generateKey();
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  CHECK(fd >= 0) << "Unable to create cluster key " << path << ": "
+                 << strerror(errno);
+  CHECK_EQ((ssize_t)key.size(), write(fd, key.data(), key.size()));
+  CHECK_EQ(0, fsync(fd));
+  close(fd);
+  return key;
+}
+}  // end anonymous namespace
+
 // TODO(aarond10): Move main() to its own file.
 int main(int argc, char *argv[]) {
   epoll_threadpool::EventManager em;
 
   em.start(5);
 
-  blockstore::BlockStoreNode bsn1(&em, "127.0.0.1");
-  blockstore::BlockStoreNode bsn2(&em, "127.0.0.1");
-  blockstore::BlockStoreNode bsn3(&em, "127.0.0.1");
-  blockstore::BlockStoreNode bsn4(&em, "127.0.0.1");
-  blockstore::BlockStoreNode bsn5(&em, "127.0.0.1");
+  // Blocks and peer connections are encrypted under a key shared by the
+  // whole cluster. Each node's BlockStoreNode and ServiceNode share its
+  // peer connections, which are secured from the moment the Mesh listens.
+  const std::string key = loadClusterKey("./cluster.key");
+  std::tr1::shared_ptr<rpc::Mesh> mesh1 = rpc::Mesh::create(&em, "127.0.0.1",
+      0, blockstore::BlockStoreNode::createSecureContext(key));
+  std::tr1::shared_ptr<rpc::Mesh> mesh2 = rpc::Mesh::create(&em, "127.0.0.1",
+      0, blockstore::BlockStoreNode::createSecureContext(key));
+  std::tr1::shared_ptr<rpc::Mesh> mesh3 = rpc::Mesh::create(&em, "127.0.0.1",
+      0, blockstore::BlockStoreNode::createSecureContext(key));
+  std::tr1::shared_ptr<rpc::Mesh> mesh4 = rpc::Mesh::create(&em, "127.0.0.1",
+      0, blockstore::BlockStoreNode::createSecureContext(key));
+  std::tr1::shared_ptr<rpc::Mesh> mesh5 = rpc::Mesh::create(&em, "127.0.0.1",
+      0, blockstore::BlockStoreNode::createSecureContext(key));
+
+  blockstore::BlockStoreNode bsn1(mesh1);
+  blockstore::BlockStoreNode bsn2(mesh2);
+  blockstore::BlockStoreNode bsn3(mesh3);
+  blockstore::BlockStoreNode bsn4(mesh4);
+  blockstore::BlockStoreNode bsn5(mesh5);
+  bsn1.setEncryptionKey(key);
+  bsn2.setEncryptionKey(key);
+  bsn3.setEncryptionKey(key);
+  bsn4.setEncryptionKey(key);
+  bsn5.setEncryptionKey(key);
+
+  std::tr1::shared_ptr<rpc::ServiceNode> sn1 = rpc::ServiceNode::create(mesh1);
+  std::tr1::shared_ptr<rpc::ServiceNode> sn2 = rpc::ServiceNode::create(mesh2);
+  std::tr1::shared_ptr<rpc::ServiceNode> sn3 = rpc::ServiceNode::create(mesh3);
+  std::tr1::shared_ptr<rpc::ServiceNode> sn4 = rpc::ServiceNode::create(mesh4);
+  std::tr1::shared_ptr<rpc::ServiceNode> sn5 = rpc::ServiceNode::create(mesh5);
 
   // TODO(aarond10): Temporary hard-coded BlockStore
   bsn1.addBlockStore(0x01234567, "./01234567/");
@@ -261,6 +1001,11 @@ int main(int argc, char *argv[]) {
   bsn3.addPeer("127.0.0.1", bsn4.port());
   bsn4.addPeer("127.0.0.1", bsn5.port());
   bsn5.addPeer("127.0.0.1", bsn1.port());
+  sn1->addPeer("127.0.0.1", sn2->port());
+  sn2->addPeer("127.0.0.1", sn3->port());
+  sn3->addPeer("127.0.0.1", sn4->port());
+  sn4->addPeer("127.0.0.1", sn5->port());
+  sn5->addPeer("127.0.0.1", sn1->port());
 
   LOG(INFO) << "Listening on ports "
             << bsn1.port() << ", "
@@ -30,8 +30,12 @@
 #define _BLOCKSTORE_BLOCKSTORE_DAEMON_H_
 
 #include "blockstore/fileblockstore.h"
+#include "blockstore/objectstream.h"
 #include "blockstore/remoteblockstore.h"
+#include "blockstore/repair.h"
+#include "rpc/mesh.h"
 #include "rpc/rpc.h"
+#include "util/blockcipher.h"
 #include "util/bloomfilter.h"
 
 #include <map>
@@ -39,20 +43,22 @@
 #include <string>
 #include <vector>
 
+#include <pthread.h>
 #include <sys/time.h>
 
 namespace epoll_threadpool {
   class EventManager;
+  class FutureBarrier;
   class IOBuffer;
-  class TcpSocket;
 }
 
 namespace blockstore {
 
 using epoll_threadpool::EventManager;
+using epoll_threadpool::FutureBarrier;
 using epoll_threadpool::IOBuffer;
-using epoll_threadpool::TcpSocket;
-using rpc::RPCServer;
+using rpc::Mesh;
+using rpc::Multiplexer;
 using rpc::RPCServer;
 using rpc::RPCClient;
 using std::tr1::function;
@@ -63,14 +69,25 @@ using std::string;
 using std::vector;
 using util::BloomFilter;
 
+/**
+ * Counters describing content addressed puts.
+ */
+struct DedupStats {
+  DedupStats() : puts(0), duplicates(0), bytesSaved(0) { }
+  uint64_t puts;
+  uint64_t duplicates;  // Puts skipped because the block already existed.
+  uint64_t bytesSaved;
+};
+
 /**
  * Represents a single node in a full-mesh network of BlockStore nodes. 
  * This class takes care of maintaining bloom filters for each of the
  * remote BlockStore's in the network, performing incremental checking 
  * of blocks, garbage collection and maintaining connections with peers.
  *
- * Internally, this class sets up an RPC server for incoming peer
- * connections. This RPC server provides "AddPeer" and "AddBlockStore"
+ * Internally, this class registers an RPC service with a Mesh, which
+ * carries it over the same connection to each peer as the node's other
+ * services. This RPC service provides "AddPeer" and "AddBlockStore"
  * methods. The "AddBlockStore" method is ignored unless a known peer is
  * also provided.
  *
@@ -79,8 +96,13 @@ using util::BloomFilter;
  * the RPC returns true. If not, the local node will attempt to initiate
  * a connection to the specified address and call "AddPeer(myname, myport)".
  * If that succeeds, the RPC returns true and the connection is held open 
- * and used for BlockStore requests to the node. If not, false is returned
- * and the Peer is forgotten.
+ * and used for BlockStore requests to the node. Requests and heartbeats
+ * go over a control priority stream and blocks over a bulk one, so a
+ * busy peer isn't mistaken for a dead one. If not, false is returned
+ * and the Peer is forgotten. An established peer that drops is not
+ * forgotten straight away: its connection is retried with backoff and its
+ * BlockStores are avoided while it is down, and only a peer that stays
+ * unreachable for a long time is removed.
  *
  * After a remote node is successfully added as a peer, we send 
  * "AddBlockStore" RPCs to it for each of our registered BlockStores.
@@ -90,9 +112,24 @@ using util::BloomFilter;
  */
 class BlockStoreNode {
  public:
+  /**
+   * Creates a node with a plaintext Mesh of its own listening on a random
+   * port.
+   */
   BlockStoreNode(EventManager *em, const string& host);
+
+  /**
+   * Creates a node that reaches its peers through mesh, sharing the
+   * connections with whatever else runs over it.
+   */
+  explicit BlockStoreNode(shared_ptr<Mesh> mesh);
   virtual ~BlockStoreNode();
 
+  /**
+   * The name BlockStoreNodes register with their Mesh.
+   */
+  static const char kServiceName[];
+
   /**
    * Kicks off the daemon.
    */
@@ -163,21 +200,142 @@ class BlockStoreNode {
   Future<IOBuffer*> getBlock(const string &name);
 
   /**
-   * Sets a garbage collection bloom filter.
-   * Any block names that are not in the filter will be marked as a candidate
-   * for being overwritten. The ownership of bloomfilter will be passed to
-   * the function.
-   * @note Planned but not currently implemented.
+   * Erasure codes an object into k data and m parity blocks, named as
+   * given by ReedSolomon::blockName(name, i, k, m), and stores each of
+   * them. Any k of the blocks are enough to read the object back.
+   * @returns true if every block was stored.
+   * @note This function takes ownership of data.
+   */
+  Future<bool> putCodedObject(const string &name, IOBuffer *data,
+                              int k, int m);
+
+  /**
+   * Fetches the blocks of an object stored by putCodedObject() and decodes
+   * it, tolerating up to m missing blocks.
+   * @returns the object or NULL if too many blocks are missing.
+   */
+  Future<IOBuffer *> getCodedObject(const string &name, int k, int m);
+
+  /**
+   * Fountain codes an object with an LT code, generating (1 + overhead)
+   * times as many blocks as it has source blocks, and stores each of them
+   * as "<name>.<i>.<total>.lt".
+   * @returns true if every block was stored.
+   * @note This function takes ownership of data.
+   */
+  Future<bool> putFountainObject(const string &name, IOBuffer *data,
+                                 double overhead);
+
+  /**
+   * Fetches all 'total' blocks of an object stored by putFountainObject()
+   * at once and decodes them incrementally as they arrive, returning the
+   * object as soon as enough have been received rather than waiting on
+   * slow or missing blocks.
+   * @returns the object or NULL if it could not be decoded.
+   */
+  Future<IOBuffer *> getFountainObject(const string &name, int total);
+
+  /**
+   * Streams the contents of fd into the network as object 'name', split
+   * into block sized chunks with a bounded number of puts in flight.
+   * Blocks until the upload completes; must not be called from one of the
+   * node's EventManager threads.
+   * @param stats if given, receives the size and throughput of the upload.
+   * @returns true on success, false on error.
    */
-  //void setGCBloomFilter(BloomFilter *bloomfilter);
+  bool putObject(const string &name, int fd, StreamStats *stats = NULL);
+
+  /**
+   * Streams object 'name' out of the network into fd, reading ahead a
+   * bounded number of chunks and writing them in order. Blocks until the
+   * download completes; must not be called from one of the node's
+   * EventManager threads.
+   * @param stats if given, receives the size and throughput of the download.
+   * @returns true on success, false on error.
+   */
+  bool getObject(const string &name, int fd, StreamStats *stats = NULL);
+
+  /**
+   * Returns the key a block is stored under by putContentBlock(): "sha256-"
+   * followed by the hex SHA-256 digest of its contents.
+   */
+  static string contentKey(const char *data, size_t len);
+
+  /**
+   * Returns true if key was produced by contentKey().
+   */
+  static bool isContentKey(const string &key);
+
+  /**
+   * Stores a block under the hash of its contents. If the cached bloom
+   * filter of either location the key maps to says the block may already
+   * be there, that store is asked to confirm and the write is skipped when
+   * it does, saving both the disk space and the transfer.
+   * @returns the block's content key, or an empty string on failure.
+   * @note This function takes ownership of data.
+   */
+  Future<string> putContentBlock(IOBuffer *data);
+
+  /**
+   * Sets a garbage collection bloom filter holding every live content key.
+   * Content addressed blocks are shared between objects so they are never
+   * removed when one object is; instead, local content addressed blocks
+   * that are not in the filter are removed by the incremental scan. Keys
+   * put through this node after the filter is set are added to it, so a
+   * block that is deduplicated against survives the next sweep. Blocks
+   * that arrive any other way, such as by putBlock() or from another node,
+   * are protected by a grace period: a block is only removed once the scan
+   * found it missing from a filter at least GC_GRACE_PERIOD before this
+   * one was set. The filter must therefore cover everything referenced by
+   * then. Blocks without a content key are never touched.
+   */
+  void setGCBloomFilter(const BloomFilter &bloomfilter);
+
+  DedupStats getDedupStats();
 
   /**
    * In the process of incremental checking, a node may come across blocks for
-   * which it can't find the next in sequence. The names of these nodes are
-   * stored in a list. This function returns the list and then clears it.
-   * @note Planned but not currently implemented.
+   * which it can't find the next in sequence, or local blocks that fail
+   * their checksum. The names of these blocks are stored in a list. This
+   * function returns the list and then clears it. Reed-Solomon coded
+   * blocks are handed to the node's RepairWorker on each timer tick rather
+   * than waiting here for the layer above.
+   */
+  vector<string> getMissingBlocks();
+
+  /**
+   * Returns counters describing the repair of missing coded blocks.
+   */
+  RepairStats getRepairStats() { return _repair.stats(); }
+
+  /**
+   * Encrypts blocks with AES-256-GCM under a key derived from the cluster
+   * key, both in local BlockStores and on their way to and from peers.
+   * Every node in a cluster must share the key. Must be called before any
+   * BlockStores or peers are added.
+   */
+  void setEncryptionKey(const string &key);
+
+  /**
+   * Returns a SecureContext for the node's Mesh, keyed by a transport key
+   * derived from the cluster key, so peers must hold the cluster key to
+   * connect. Pass it to Mesh::create() so no connection is ever plaintext.
    */
-  //vector<string> getMissingBlocks() const;
+  static shared_ptr<rpc::SecureContext> createSecureContext(
+      const string &key);
+
+  /**
+   * Sets how peers' health is watched. Peers that fall behind on their
+   * heartbeats are slow, and those that stop answering or disconnect are
+   * suspect; puts and reads prefer the healthier of a block's two
+   * locations. Must be called before any peers are added.
+   */
+  void setHeartbeatPolicy(const RPCClient::HeartbeatPolicy &policy);
+
+  /**
+   * Returns each peer's failure detector statistics, keyed by "host:port".
+   */
+  map<string, util::FailureDetector::Stats> getPeerHealth();
 
  private:
   /**
@@ -189,26 +347,44 @@ class BlockStoreNode {
    */
   class Peer {
    public:
-    Peer() { }
+    Peer() : _downSince(0) { }
     virtual ~Peer() {
       LOG(INFO) << "Disconnecting from peer";
+      if (_control) {
+        _control->disconnect();
+      }
+      if (_client) {
+        _client->disconnect();
+      }
     }
 
     /**
      * Connects to a peer and either returns a boolean true if successful.
      * This will request the remote peer connect back to us. If either of
-     * these are unsuccessful, the call will fail.
+     * these are unsuccessful, the call will fail. Once connected, a dropped
+     * connection is re-established in the background.
      */
-    Future<bool> connect(EventManager* em,
-                         const string &myhost, uint16_t myport,
-                         const string &host, uint16_t port) {
-      shared_ptr<TcpSocket> socket = TcpSocket::connect(em, host, port);
-      if (socket == NULL) {
+    Future<bool> connect(shared_ptr<Mesh> mesh,
+                         const string &host, uint16_t port,
+                         const RPCClient::HeartbeatPolicy &heartbeat) {
+      shared_ptr<rpc::Transport> control = mesh->open(
+          host, port, kServiceName, Multiplexer::PRIORITY_CONTROL);
+      shared_ptr<rpc::Transport> bulk = mesh->open(
+          host, port, kServiceName, Multiplexer::PRIORITY_BULK);
+      if (control == NULL || bulk == NULL) {
         return false;
       }
-      _client.reset(new RPCClient(socket));
+      _control.reset(new RPCClient(control));
+      _control->setReconnect(mesh->connector(
+          host, port, kServiceName, Multiplexer::PRIORITY_CONTROL));
+      _control->setHeartbeat(heartbeat);
+      _control->start();
+      _client.reset(new RPCClient(bulk));
+      _client->setReconnect(mesh->connector(
+          host, port, kServiceName, Multiplexer::PRIORITY_BULK));
       _client->start();
-      return _client->call<bool, string, uint16_t>("addPeer", myhost, myport);
+      return _control->call<bool, string, uint16_t>(
+          "addPeer", mesh->host(), mesh->port());
     }
 
     /**
@@ -248,16 +424,27 @@ class BlockStoreNode {
      * Sets a callback to be triggered when this peer disconnects.
      */
     void setDisconnectCallback(function<void()> callback) {
-      _client->setDisconnectCallback(callback);
+      _control->setDisconnectCallback(callback);
+    }
+
+    /**
+     * Sets a callback to be triggered when this peer reconnects.
+     */
+    void setReconnectCallback(function<void()> callback) {
+      _control->setReconnectCallback(callback);
     }
 
     /**
      * Registers a new BlockStore with ID bsid as being available
-     * via this peer.
+     * via this peer. Blocks are encrypted on the wire with cipher if set.
      */
-    shared_ptr<BlockStore> registerBlockStore(uint64_t bsid) {
+    shared_ptr<BlockStore> registerBlockStore(
+        uint64_t bsid, shared_ptr<util::BlockCipher> cipher) {
       _bsids.push_back(bsid);
-      return shared_ptr<BlockStore>(new RemoteBlockStore(_client, bsid));
+      RemoteBlockStore *bs = new RemoteBlockStore(_client, bsid);
+      bs->setHealthClient(_control);
+      bs->setEncryption(cipher);
+      return shared_ptr<BlockStore>(bs);
     }
 
     /**
@@ -267,18 +454,80 @@ class BlockStoreNode {
     const list<uint64_t> &getBlockStoreIDs() const { return _bsids; }
 
    //private:
-    shared_ptr<RPCClient> _client;
+    shared_ptr<RPCClient> _control;  // Peering and heartbeats.
+    shared_ptr<RPCClient> _client;   // BlockStore requests.
     string _ip;
     string _port;
     list<uint64_t> _bsids;
+    EventManager::WallTime _downSince;  // 0 while connected.
     //uint64_t _free_blocks;
     //BloomFilter _bloomfilter;
 
   };
 
+  /**
+   * Sets up locks and the RPC service. Shared by the constructors.
+   */
+  void init();
+
+  /**
+   * Returns the BlockStore with the closest BSID at or below hash, wrapping
+   * around to the highest BSID, or NULL if there are no BlockStores.
+   */
   BlockStore *_findBestLocation(size_t hash);
+
+  /**
+   * Returns the BlockStore immediately below _findBestLocation(hash). This
+   * is the same store when only one is known.
+   */
   BlockStore *_findNextBestLocation(size_t hash);
 
+  /**
+   * Continues a getBlock() that found nothing at its first location.
+   */
+  void getBlockHelper(string name, BlockStore *tried,
+                      Future<IOBuffer *> first, Future<IOBuffer *> ret);
+
+  /**
+   * RPC server functions exposing putBlock() and getBlock() to clients
+   * such as fileutil.
+   */
+  Future<bool> RPCPutBlock(string name, vector<uint8_t> data);
+  Future< vector<uint8_t> > RPCGetBlock(string name);
+
+  /**
+   * RPC server function exposing setGCBloomFilter().
+   */
+  Future<bool> RPCSetGCBloomFilter(vector<uint8_t> bloomfilter);
+
+  /**
+   * Continues a putContentBlock() once the store that may hold the block
+   * has been probed.
+   */
+  void putContentHelper(string key, IOBuffer *data, Future<bool> exists,
+                        Future<string> ret);
+
+  /**
+   * Writes a content addressed block and records its key in the cached
+   * bloom filters of its locations.
+   */
+  void storeContentBlock(const string &key, IOBuffer *data,
+                         Future<string> ret);
+
+  /**
+   * Replaces the cached bloom filter of a BlockStore.
+   */
+  void bloomfilterHelper(BlockStore *bs, Future<BloomFilter> bloomfilter);
+
+  /**
+   * Reports the next block of a coded block's object as missing if none of
+   * its locations has it, counting suspect stores as not having it.
+   */
+  void checkSibling(const string &key);
+  void checkSiblingHelper(string sibling, vector< Future<bool> > results,
+                          FutureBarrier *barrier);
+
+  shared_ptr<Mesh> _mesh;
   EventManager *_em;
   string _host;
   uint16_t _port;
@@ -300,25 +549,74 @@ class BlockStoreNode {
     }
   };
 
+  ObjectStreamer _streamer;
+  RepairWorker _repair;
   shared_ptr<RPCServer> _rpc_server;
+  pthread_mutex_t _peerLock;  // Guards _peers and their _downSince.
   map< PeerAddr, shared_ptr<Peer> > _peers;
   map< uint64_t, shared_ptr<BlockStore> > _blockstores;
+  map< uint64_t, shared_ptr<BlockStore> > _localBlockStores;
+
+  pthread_mutex_t _missingLock;
+  set<string> _missingBlocks;
+
+  shared_ptr<util::BlockCipher> _cipher;
+  RPCClient::HeartbeatPolicy _heartbeat;
+  int _ticks;
+  pthread_mutex_t _filterLock;  // Guards the bloom filters and _dedupStats.
+  map<BlockStore *, BloomFilter> _bloomfilters;
+  bool _haveGCBloomFilter;
+  BloomFilter _gcBloomFilter;
+  EventManager::WallTime _gcFilterTime;  // When _gcBloomFilter was set.
+  // When the scan first found each unreferenced content block.
+  map<string, EventManager::WallTime> _gcFirstMissed;
+  DedupStats _dedupStats;
 
   /**
-   * Helper function that removes a peer that has disconnected.
+   * Helper function that removes a peer that has been unreachable for too
+   * long, along with its BlockStores.
    */
   void RemovePeer(PeerAddr addr) {
-    // TODO: Thread safety.
-    shared_ptr<Peer> peer = _peers[addr];
+    // TODO: Thread safety of _blockstores.
+    pthread_mutex_lock(&_peerLock);
+    map< PeerAddr, shared_ptr<Peer> >::iterator it = _peers.find(addr);
+    if (it == _peers.end()) {
+      pthread_mutex_unlock(&_peerLock);
+      return;
+    }
+    shared_ptr<Peer> peer = it->second;
+    _peers.erase(it);
+    pthread_mutex_unlock(&_peerLock);
 
     // Remove BlockStore's owned by this peer.
     const list<uint64_t> &bsids = peer->getBlockStoreIDs();
     for (list<uint64_t>::const_iterator i = bsids.begin(); i != bsids.end(); ++i) {
       _blockstores.erase(*i);
     }
+  }
 
-    // Remove the peer itself
-    _peers.erase(addr);
+  /**
+   * Helper functions that note when a peer's connection drops and when it
+   * is re-established. Its BlockStores report themselves suspect meanwhile.
+   */
+  void PeerDown(PeerAddr addr) {
+    LOG(WARNING) << "Lost connection to peer " << addr.host << ":"
+                 << addr.port << ", reconnecting";
+    pthread_mutex_lock(&_peerLock);
+    map< PeerAddr, shared_ptr<Peer> >::iterator it = _peers.find(addr);
+    if (it != _peers.end() && it->second->_downSince == 0) {
+      it->second->_downSince = EventManager::currentTime();
+    }
+    pthread_mutex_unlock(&_peerLock);
+  }
+  void PeerUp(PeerAddr addr) {
+    LOG(INFO) << "Reconnected to peer " << addr.host << ":" << addr.port;
+    pthread_mutex_lock(&_peerLock);
+    map< PeerAddr, shared_ptr<Peer> >::iterator it = _peers.find(addr);
+    if (it != _peers.end()) {
+      it->second->_downSince = 0;
+    }
+    pthread_mutex_unlock(&_peerLock);
   }
 
   /**
@@ -326,27 +624,43 @@ class BlockStoreNode {
    */
   Future<bool> RPCAddPeer(string host, uint16_t port) {
     PeerAddr addr(host, port);
+    pthread_mutex_lock(&_peerLock);
     if (_peers.find(addr) != _peers.end()) {
       // Already connected.
+      pthread_mutex_unlock(&_peerLock);
       return true;
     } else {
       shared_ptr<Peer> peer(new Peer());
       _peers[addr] = peer;
-      Future<bool> ret = peer->connect(_em, _host, _port, host, port);
+      pthread_mutex_unlock(&_peerLock);
+      Future<bool> ret = peer->connect(_mesh, host, port, _heartbeat);
+      if (peer->_control == NULL) {
+        pthread_mutex_lock(&_peerLock);
+        _peers.erase(addr);
+        pthread_mutex_unlock(&_peerLock);
+        return ret;
+      }
       peer->setDisconnectCallback(
-          bind(&BlockStoreNode::RemovePeer, this, addr));
+          bind(&BlockStoreNode::PeerDown, this, addr));
+      peer->setReconnectCallback(
+          bind(&BlockStoreNode::PeerUp, this, addr));
 
+      // Hook up the host with our other peers.
+      vector<PeerAddr> others;
+      pthread_mutex_lock(&_peerLock);
       DLOG(INFO) << "Node on port " << _port << " now has " 
                  << _peers.size() << " neighbors.";
-
-      // Hook up the host with our other peers.
       for (map< PeerAddr, shared_ptr<Peer> >::const_iterator i = _peers.begin();
            i != _peers.end(); ++i) {
         if (addr != i->first) {
-          peer->_client->call<bool, string, uint16_t>(
-            "addPeer", i->first.host, i->first.port);
+          others.push_back(i->first);
         }
       }
+      pthread_mutex_unlock(&_peerLock);
+      for (size_t i = 0; i < others.size(); i++) {
+        peer->_control->call<bool, string, uint16_t>(
+          "addPeer", others[i].host, others[i].port);
+      }
       return ret;
     }
   }
@@ -356,13 +670,19 @@ class BlockStoreNode {
    */
   Future<bool> RPCAddBlockStore(string host, uint16_t port, uint64_t bsid) {
     PeerAddr addr(host, port);
-    if (_peers.find(addr) != _peers.end()) {
+    pthread_mutex_lock(&_peerLock);
+    map< PeerAddr, shared_ptr<Peer> >::iterator it = _peers.find(addr);
+    shared_ptr<Peer> peer;
+    if (it != _peers.end()) {
+      peer = it->second;
+    }
+    pthread_mutex_unlock(&_peerLock);
+    if (peer) {
       if (_blockstores.find(bsid) != _blockstores.end()) {
         LOG(WARNING) << "Peer " << host << ":" 
                      << port << "tried to add existing BlockStore " << bsid;
       } else {
-        shared_ptr<Peer> peer = _peers[addr];
-        _blockstores[bsid] = peer->registerBlockStore(bsid);
+        _blockstores[bsid] = peer->registerBlockStore(bsid, _cipher);
         // TODO: Register blockstore as owned by peer at "addr".
         return true;
       }
@@ -0,0 +1,98 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _BLOCKSTORE_BLOCKSTORESERVICE_H_
+#define _BLOCKSTORE_BLOCKSTORESERVICE_H_
+
+#include "rpc/rpc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+namespace blockstore {
+
+using std::string;
+using std::vector;
+
+/**
+ * Blocks sent to a server travel as msgpack raw values, which the server
+ * decodes by reference into the request it received rather than copying.
+ */
+typedef msgpack::type::raw_ref FrameRef;
+
+/**
+ * The RPC interface a BlockStore is exported over. Each method is declared
+ * here once and shared by RegisterRemoteBlockStore() on the server and
+ * RemoteBlockStore on the client, so the two are checked against the same
+ * signatures when they compile. Method names carry the bsid so several
+ * stores can share one RPC endpoint, and are built once per store rather
+ * than on every call. Every method but removeBlock can safely run twice
+ * and so is retryable.
+ */
+class BlockStoreService {
+ public:
+  explicit BlockStoreService(uint64_t bsid)
+      : putBlock(methodName("putBlock", bsid), true),
+        getBlock(methodName("getBlock", bsid), true),
+        getBlocks(methodName("getBlocks", bsid), true),
+        putBlocks(methodName("putBlocks", bsid), true),
+        removeBlock(methodName("removeBlock", bsid)),
+        hasBlock(methodName("hasBlock", bsid), true),
+        blockSize(methodName("blockSize", bsid), true),
+        numFreeBlocks(methodName("numFreeBlocks", bsid), true),
+        numTotalBlocks(methodName("numTotalBlocks", bsid), true),
+        bloomfilter(methodName("bloomfilter", bsid), true) { }
+
+  const rpc::RPCMethod<bool, const string &, const FrameRef &> putBlock;
+  const rpc::RPCMethod<string, const string &> getBlock;
+  const rpc::RPCMethod<vector<string>, const vector<string> &> getBlocks;
+  // Results travel as a byte per block since msgpack has no vector<bool>.
+  const rpc::RPCMethod<vector<uint8_t>, const vector<string> &,
+                       const vector<FrameRef> &> putBlocks;
+  const rpc::RPCMethod<bool, const string &> removeBlock;
+  const rpc::RPCMethod<bool, const string &> hasBlock;
+  const rpc::RPCMethod<uint64_t> blockSize;
+  const rpc::RPCMethod<uint64_t> numFreeBlocks;
+  const rpc::RPCMethod<uint64_t> numTotalBlocks;
+  const rpc::RPCMethod<string> bloomfilter;
+
+ private:
+  static string methodName(const char *method, uint64_t bsid) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "blockstore.%s.%llu", method,
+             (unsigned long long)bsid);
+    return buf;
+  }
+};
+}
+#endif
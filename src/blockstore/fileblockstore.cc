@@ -29,15 +29,64 @@
 #include "fileblockstore.h"
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "util/crc32c.h"
+
 namespace blockstore {
 
+using std::vector;
+
 namespace {
+/**
+ * Size of the checksum trailer at the end of each block file.
+ */
+const size_t kChecksumSize = sizeof(uint32_t);
+
+/**
+ * Granularity with which the space used by block files is charged.
+ */
+const uint64_t kChargeUnit = 4096;
+
+/**
+ * Maximum number of block files getBlocks() holds open at once.
+ */
+const size_t kMaxOpenReads = 128;
+
+/**
+ * A block file opened by getBlocks() that is waiting to be read.
+ */
+struct PendingRead {
+  size_t index;
+  int fd;
+  ino_t inode;
+  bool operator<(const PendingRead &other) const {
+    return inode < other.inode;
+  }
+};
+
+/**
+ * Resolves a batch of putBlocks() results once the group commit covering
+ * them completes.
+ */
+void putBlocksCommitHelper(vector<bool> ok, Future<bool> committed,
+                           Future< vector<bool> > ret) {
+  if (!committed.get()) {
+    ok.assign(ok.size(), false);
+  }
+  ret.set(ok);
+}
+
 /**
  * Combines a path with a key to generate a filename for a given block key.
  */
@@ -50,121 +99,548 @@ string get_fullpath(const string &path, const string &key) {
 }
 }
 
-FileBlockStore::FileBlockStore(const string &path, int blocksize) {
+FileBlockStore::FileBlockStore(const string &path, int blocksize,
+                               uint64_t capacity) {
   _dir = NULL;
+  _dirfd = open(path.c_str(), O_RDONLY|O_DIRECTORY);
   _blocksize = blocksize;
+  _directio = false;
+  _codec = util::CODEC_NONE;
+  _syncmode = SYNC_NONE;
+  _bytesUsed = 0;
+  _pool = BufferPool::get(util::maxFrameSize(blocksize) +
+                          util::BlockCipher::kOverhead + kChecksumSize);
   _path = path;
+  _reservefd = open(get_fullpath(path, ".reserve").c_str(),
+                    O_CREAT|O_RDWR, 0600);
+  if (_reservefd == -1) {
+    LOG(ERROR) << "Unable to open reservation file in " << path;
+  }
+  _capacity = capacity;
+  pthread_mutex_init(&_lock, NULL);
   regenerateBloomFilterAndBlockSet();
 }
 
-Future<bool> FileBlockStore::putBlock(const string &key, IOBuffer *data) {
-  if(_freeBlocks <= 0) {
-    LOG(ERROR) << "No free blocks.";
-    delete data;
+FileBlockStore::~FileBlockStore() {
+  // Flushes and resolves any outstanding group commits.
+  _committer.reset();
+  if (_dir) {
+    closedir(_dir);
+    _dir = NULL;
+  }
+  if (_dirfd != -1) {
+    close(_dirfd);
+  }
+  if (_reservefd != -1) {
+    close(_reservefd);
+  }
+  pthread_mutex_destroy(&_lock);
+}
+
+void FileBlockStore::setSyncMode(SyncMode mode, int maxBatch, double window) {
+  _syncmode = mode;
+  if (mode == SYNC_GROUP_COMMIT) {
+    _committer.reset(new GroupCommitter(
+        bind(&FileBlockStore::syncAll, this), maxBatch, window));
+  } else {
+    _committer.reset();
+  }
+}
+
+bool FileBlockStore::syncAll() {
+  if (_dirfd == -1 || syncfs(_dirfd) != 0) {
+    LOG(ERROR) << "syncfs failed for " << _path;
     return false;
   }
-  int fd = open(get_fullpath(_path, key).c_str(),
-                O_CREAT|O_TRUNC|O_WRONLY, 0777);
-  if (fd == -1) {
-    LOG(ERROR) << "Failed to open file.";
+  return true;
+}
+
+int FileBlockStore::openBlock(const string &key, int flags) const {
+  string fullpath = get_fullpath(_path, key);
+  if (_directio) {
+    int fd = open(fullpath.c_str(), flags | O_DIRECT, 0777);
+    if (fd != -1 || errno != EINVAL) {
+      return fd;
+    }
+    // Filesystem doesn't support O_DIRECT (e.g. tmpfs).
+    DLOG(WARNING) << "O_DIRECT not supported for " << fullpath;
+  }
+  return open(fullpath.c_str(), flags, 0777);
+}
+
+bool FileBlockStore::storeBlock(const string &key, IOBuffer *data,
+                                bool syncFile) {
+  const size_t len = data->size();
+  if (len > _blocksize) {
+    DLOG(ERROR) << "Tried to put a block too big (" << len << ")";
     delete data;
     return false;
   }
-  if (data->size() > _blocksize) {
-    DLOG(ERROR) << "Tried to put a block too big (" << data->size() << ")";
+  char *buf = _pool->acquire();
+  if (!buf) {
     delete data;
     return false;
   }
-  if (write(fd, data->pulldown(data->size()), data->size()) != _blocksize) {
-    delete data;
+
+  // Direct I/O requires the length to be a multiple of the alignment so we
+  // stage the frame and its checksum in a zero padded pool buffer and trim
+  // the file after. The frame is compressed straight into place after room
+  // for the nonce and sealed there.
+  char *frame = _cipher ? buf + util::BlockCipher::kNonceSize : buf;
+  const size_t dataLen =
+      util::compressFrame(_codec, data->pulldown(len), len, frame);
+  delete data;
+  size_t frameLen = dataLen;
+  if (_cipher) {
+    if (!_cipher->encrypt(buf, dataLen, key)) {
+      _pool->release(buf);
+      return false;
+    }
+    frameLen += util::BlockCipher::kOverhead;
+  }
+  const uint32_t crc = util::crc32c(buf, frameLen);
+  for (size_t i = 0; i < kChecksumSize; i++) {
+    buf[frameLen + i] = crc >> (8 * i);
+  }
+  const size_t total = frameLen + kChecksumSize;
+  const size_t padded = BufferPool::align(total);
+  memset(buf + total, 0, padded - total);
+
+  // Overwriting an existing block reuses its space.
+  pthread_mutex_lock(&_lock);
+  map<string, uint64_t>::iterator existing = _blockset.find(key);
+  const uint64_t oldCharge =
+      existing != _blockset.end() ? existing->second : 0;
+  const uint64_t charge = chargeFor(dataLen - util::kFrameHeaderSize);
+  const uint64_t oldBytesUsed = _bytesUsed;
+  if (!setBytesUsed(_bytesUsed - oldCharge + charge)) {
+    pthread_mutex_unlock(&_lock);
+    LOG(ERROR) << "No free blocks.";
+    _pool->release(buf);
+    return false;
+  }
+
+  int fd = openBlock(key, O_CREAT|O_TRUNC|O_WRONLY);
+  bool ok = fd != -1;
+  if (!ok) {
+    LOG(ERROR) << "Failed to open file.";
+  } else {
+    ok = write(fd, buf, _directio ? padded : total) ==
+        (ssize_t)(_directio ? padded : total);
+    if (ok && _directio && padded != total) {
+      ok = ftruncate(fd, total) == 0;
+    }
+    if (ok && syncFile) {
+      // The directory entry needs flushing too for newly created blocks.
+      ok = fdatasync(fd) == 0 && (_dirfd == -1 || fsync(_dirfd) == 0);
+    }
+    close(fd);
+    if (!ok) {
+      LOG(ERROR) << "Failed to write block " << key;
+    }
+  }
+  _pool->release(buf);
+  if (!ok) {
+    if (existing == _blockset.end()) {
+      if (fd != -1) {
+        unlink(get_fullpath(_path, key).c_str());
+      }
+      setBytesUsed(oldBytesUsed);
+    } else {
+      // The old contents are gone, so charge for the new ones in case
+      // part of them made it to disk.
+      existing->second = charge;
+    }
+    pthread_mutex_unlock(&_lock);
     return false;
   }
-  //fsync(fd); // TODO(aarond10): Add this back if we're paranoid. Without it 
-  // we get a 100x performance boost but no guaranteed write at the end of 
-  // this function.
-  close(fd);
-  _freeBlocks--;
-  _usedBlocks++;
   _bloomfilter.set(key);
-  _blockset.insert(key);
-  delete data;
+  _blockset[key] = charge;
+  pthread_mutex_unlock(&_lock);
   return true;
 }
 
+Future<bool> FileBlockStore::putBlock(const string &key, IOBuffer *data) {
+  if (!storeBlock(key, data, _syncmode == SYNC_EVERY_WRITE)) {
+    return false;
+  }
+  if (_syncmode == SYNC_GROUP_COMMIT) {
+    return _committer->commit();
+  }
+  return true;
+}
+
+Future<vector<bool> > FileBlockStore::putBlocks(
+    const vector<string> &keys, const vector<IOBuffer *> &data) {
+  if (keys.size() != data.size()) {
+    return BlockStore::putBlocks(keys, data);
+  }
+  vector<bool> ok;
+  ok.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    ok.push_back(storeBlock(keys[i], data[i], false));
+  }
+
+  // The whole batch shares a single sync.
+  if (_syncmode == SYNC_EVERY_WRITE && !syncAll()) {
+    return vector<bool>(keys.size(), false);
+  } else if (_syncmode == SYNC_GROUP_COMMIT) {
+    Future< vector<bool> > ret;
+    Future<bool> committed = _committer->commit();
+    committed.addCallback(
+        std::tr1::bind(&putBlocksCommitHelper, ok, committed, ret));
+    return ret;
+  }
+  return ok;
+}
+
+ssize_t FileBlockStore::readBlock(int fd, const string &key,
+                                  char *buf) const {
+  char *frame = _pool->acquire();
+  if (!frame) {
+    return -1;
+  }
+  ssize_t r = read(fd, frame, _pool->bufferSize());
+  ssize_t len = -1;
+  const size_t overhead = _cipher ? util::BlockCipher::kOverhead : 0;
+  if (r < (ssize_t)(util::kFrameHeaderSize + overhead + kChecksumSize) ||
+      r > (ssize_t)(util::maxFrameSize(_blocksize) + overhead +
+                    kChecksumSize)) {
+    LOG(INFO) << "block empty or read failed " << r;
+  } else {
+    size_t frameLen = r - kChecksumSize;
+    uint32_t crc = 0;
+    for (size_t i = 0; i < kChecksumSize; i++) {
+      crc |= (uint32_t)(uint8_t)frame[frameLen + i] << (8 * i);
+    }
+    const char *data = frame;
+    if (crc != util::crc32c(frame, frameLen)) {
+      LOG(ERROR) << "Checksum mismatch on block " << key << " in " << _path;
+    } else if (_cipher &&
+               (len = _cipher->decrypt(frame, frameLen, key)) < 0) {
+      LOG(ERROR) << "Unable to decrypt block " << key << " in " << _path;
+    } else {
+      if (_cipher) {
+        data += util::BlockCipher::kNonceSize;
+        frameLen = len;
+      }
+      len = util::decompressFrame(data, frameLen, buf, _blocksize);
+      if (len < 0) {
+        LOG(ERROR) << "Unable to decompress block " << key << " in "
+                   << _path;
+      }
+    }
+  }
+  _pool->release(frame);
+  return len;
+}
+
 Future<IOBuffer *> FileBlockStore::getBlock(const string &key) {
-  int fd = open(get_fullpath(_path, key).c_str(), O_RDONLY);
+  int fd = openBlock(key, O_RDONLY);
   if (fd == -1) {
     return NULL;
   }
-  char *data = new char[_blocksize];
-  int r = read(fd, data, _blocksize);
-  if (r <= 0) {
-    LOG(INFO) << "block empty or read failed " << r;
+  char *data = _pool->acquire();
+  if (!data) {
     close(fd);
-    delete [] data;
     return NULL;
   }
+  ssize_t len = readBlock(fd, key, data);
   close(fd);
-  IOBuffer *ret = new IOBuffer(data, r);
-  delete [] data;
+  IOBuffer *ret = len < 0 ? NULL : new IOBuffer(data, len);
+  _pool->release(data);
+  return ret;
+}
+
+Future<vector<IOBuffer *> > FileBlockStore::getBlocks(
+    const vector<string> &keys) {
+  vector<IOBuffer *> ret(keys.size(), (IOBuffer *)NULL);
+  char *data = _pool->acquire();
+  if (!data) {
+    return ret;
+  }
+  for (size_t start = 0; start < keys.size(); start += kMaxOpenReads) {
+    const size_t end = std::min(keys.size(), start + kMaxOpenReads);
+
+    // Open everything first and hint the kernel so it can fetch the blocks
+    // in parallel, then read them back in inode order which approximates
+    // their order on disk.
+    vector<PendingRead> pending;
+    for (size_t i = start; i < end; i++) {
+      PendingRead p;
+      p.index = i;
+      p.fd = openBlock(keys[i], O_RDONLY);
+      struct stat st;
+      if (p.fd == -1) {
+        continue;
+      }
+      p.inode = fstat(p.fd, &st) == 0 ? st.st_ino : 0;
+      if (!_directio) {
+        posix_fadvise(p.fd, 0, 0, POSIX_FADV_WILLNEED);
+      }
+      pending.push_back(p);
+    }
+    std::sort(pending.begin(), pending.end());
+    for (size_t i = 0; i < pending.size(); i++) {
+      const string &key = keys[pending[i].index];
+      ssize_t len = readBlock(pending[i].fd, key, data);
+      close(pending[i].fd);
+      if (len >= 0) {
+        ret[pending[i].index] = new IOBuffer(data, len);
+      }
+    }
+  }
+  _pool->release(data);
   return ret;
 }
 
 Future<bool> FileBlockStore::removeBlock(const string &key) {
+  pthread_mutex_lock(&_lock);
   int r = unlink(get_fullpath(_path, key).c_str());
   if (r == 0) {
-    //_freeBlocks++;
-    regenerateBloomFilterAndBlockSet();
-    return true;
-  } else {
-    return false;
+    forgetBlock(key);
+  }
+  pthread_mutex_unlock(&_lock);
+  return r == 0;
+}
+
+Future<bool> FileBlockStore::hasBlock(const string &key) {
+  pthread_mutex_lock(&_lock);
+  const bool ret = _blockset.find(key) != _blockset.end();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<uint64_t> FileBlockStore::numFreeBlocks() const {
+  pthread_mutex_lock(&_lock);
+  const uint64_t ret = _slots.numFree();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<uint64_t> FileBlockStore::numTotalBlocks() const {
+  pthread_mutex_lock(&_lock);
+  const uint64_t ret = _slots.numSlots();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<BloomFilter> FileBlockStore::bloomfilter() {
+  pthread_mutex_lock(&_lock);
+  BloomFilter ret(_bloomfilter);
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+void FileBlockStore::forgetBlock(const string &key) {
+  map<string, uint64_t>::iterator i = _blockset.find(key);
+  if (i != _blockset.end()) {
+    setBytesUsed(_bytesUsed - i->second);
+    _blockset.erase(i);
+  }
+  regenerateBloomFilter();
+}
+
+Future<vector<string> > FileBlockStore::scrub(size_t maxBlocks) {
+  vector<string> corrupt;
+  char *buf = _pool->acquire();
+  if (!buf) {
+    return corrupt;
   }
+  // Each block is checked and dealt with under the lock so that it can't
+  // be rewritten in between. The lock is dropped between blocks.
+  for (size_t n = 0; n < maxBlocks; n++) {
+    pthread_mutex_lock(&_lock);
+    if (n >= _blockset.size()) {
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+    map<string, uint64_t>::iterator i = _blockset.upper_bound(_scrubCursor);
+    if (i == _blockset.end()) {
+      i = _blockset.begin();
+    }
+    const string key = i->first;
+    _scrubCursor = key;
+    int fd = openBlock(key, O_RDONLY);
+    if (fd != -1) {
+      if (readBlock(fd, key, buf) < 0) {
+        LOG(WARNING) << "Scrub removing corrupt block " << key << " from "
+                     << _path;
+        corrupt.push_back(key);
+        if (unlink(get_fullpath(_path, key).c_str()) == 0) {
+          forgetBlock(key);
+        }
+      }
+      close(fd);
+    } else if (errno == ENOENT) {
+      // Deleted behind our back, so there is nothing to remove.
+      LOG(WARNING) << "Scrub found block " << key << " missing from "
+                   << _path;
+      forgetBlock(key);
+    } else {
+      // Possibly temporary (e.g. EMFILE), so the block is left alone.
+      LOG(WARNING) << "Scrub unable to open block " << key << " in "
+                   << _path << ": " << strerror(errno);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+  _pool->release(buf);
+  return corrupt;
 }
 
 string FileBlockStore::next() {
+  pthread_mutex_lock(&_lock);
   if (!_dir) {
     _dir = opendir(_path.c_str());
   }
   struct dirent *entry;
-  while ((entry = readdir(_dir))) {
+  while (_dir && (entry = readdir(_dir))) {
     if (entry->d_name[0] == '.' || entry->d_type != DT_REG) {
       continue;
     }
-    return entry->d_name;
+    const string ret(entry->d_name);
+    pthread_mutex_unlock(&_lock);
+    return ret;
   }
   if (_dir) {
     closedir(_dir);
     _dir = NULL;
   }
+  pthread_mutex_unlock(&_lock);
   return "";
 }
 
 void FileBlockStore::regenerateBloomFilterAndBlockSet() {
-  _bloomfilter.reset();
   _blockset.clear();
-  _freeBlocks = 0;
-  _usedBlocks = 0;
+  _usedSlots.clear();
+  _bytesUsed = 0;
+
+  DIR *d = opendir(_path.c_str());
+  struct dirent *entry;
+  if (d) {
+    while ((entry = readdir(d))) {
+      if (entry->d_name[0] == '.' || entry->d_type != DT_REG) {
+        continue;
+      }
+      // Charge each block for the data its file holds.
+      struct stat st;
+      uint64_t charge = _blocksize;
+      if (fstatat(dirfd(d), entry->d_name, &st, 0) == 0 &&
+          st.st_size >= (off_t)(util::kFrameHeaderSize + kChecksumSize)) {
+        charge = chargeFor(
+            st.st_size - util::kFrameHeaderSize - kChecksumSize);
+      }
+      _blockset[entry->d_name] = charge;
+      _bytesUsed += charge;
+    }
+    closedir(d);
+  }
 
+  const uint64_t used = (_bytesUsed + _blocksize - 1) / _blocksize;
+  uint64_t numSlots = _capacity / _blocksize;
+  if (used > numSlots) {
+    LOG(WARNING) << _path << " holds " << used << " blocks of data but has "
+                 << "capacity for only " << numSlots;
+    numSlots = used;
+  }
+  numSlots = reserveSlots(used, numSlots);
+
+  // Existing data takes the leading slots, matching the holes made by
+  // reserveSlots().
+  _slots.reset(numSlots);
+  for (uint64_t i = 0; i < used; i++) {
+    _usedSlots.push_back(_slots.allocate());
+  }
+  regenerateBloomFilter();
+}
+
+void FileBlockStore::regenerateBloomFilter() {
+  _bloomfilter.reset();
+  for (map<string, uint64_t>::iterator i = _blockset.begin();
+       i != _blockset.end(); ++i) {
+    _bloomfilter.set(i->first);
+  }
+}
+
+uint64_t FileBlockStore::reserveSlots(uint64_t used, uint64_t numSlots) {
+  if (_reservefd == -1) {
+    return numSlots;
+  }
+  const off_t usedBytes = used * _blocksize;
+  if (ftruncate(_reservefd, usedBytes) != 0 ||
+      (usedBytes && fallocate(_reservefd,
+                              FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                              0, usedBytes) != 0)) {
+    LOG(WARNING) << "Unable to reset reservation file in " << _path;
+  }
+  if (numSlots == used ||
+      fallocate(_reservefd, 0, usedBytes, (numSlots - used) * _blocksize) == 0) {
+    return numSlots;
+  }
+  if (errno != ENOSPC) {
+    LOG(WARNING) << "Unable to preallocate " << _path
+                 << ". Capacity will not be guaranteed.";
+    ftruncate(_reservefd, numSlots * _blocksize);
+    return numSlots;
+  }
+
+  // Not enough room. Shrink to whatever the filesystem can hold.
+  ftruncate(_reservefd, usedBytes);
+  uint64_t avail = 0;
   struct statfs fs;
-  if(!statfs(_path.c_str(), &fs)) {
-    _freeBlocks = (fs.f_bavail*fs.f_bsize) / _blocksize;
+  if (!statfs(_path.c_str(), &fs)) {
+    avail = (fs.f_bavail * fs.f_bsize) / _blocksize;
+  }
+  if (avail > numSlots - used) {
+    avail = numSlots - used;
   }
+  if (avail && fallocate(_reservefd, 0, usedBytes, avail * _blocksize) != 0) {
+    ftruncate(_reservefd, usedBytes);
+    avail = 0;
+  }
+  LOG(ERROR) << _path << " only has room for " << avail << " of "
+             << (numSlots - used) << " free blocks.";
+  return used + avail;
+}
 
-  DIR *d = opendir(_path.c_str());
-  struct dirent *entry;
-  if (!d) {
+void FileBlockStore::setSlotReserved(uint64_t slot, bool reserved) {
+  if (_reservefd == -1) {
     return;
   }
-  while ((entry = readdir(d))) {
-    if (entry->d_name[0] == '.' || entry->d_type != DT_REG) {
-      continue;
+  int mode = reserved ? 0 : FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE;
+  if (fallocate(_reservefd, mode, slot * _blocksize, _blocksize) != 0) {
+    DLOG(WARNING) << "Unable to update reservation of slot " << slot
+                  << " in " << _path;
+  }
+}
+
+uint64_t FileBlockStore::chargeFor(size_t len) const {
+  const uint64_t charge = (len + kChargeUnit - 1) / kChargeUnit * kChargeUnit;
+  return std::min(charge, (uint64_t)_blocksize);
+}
+
+bool FileBlockStore::setBytesUsed(uint64_t bytesUsed) {
+  const uint64_t needed = (bytesUsed + _blocksize - 1) / _blocksize;
+  const size_t had = _usedSlots.size();
+  while (_usedSlots.size() < needed) {
+    int64_t slot = _slots.allocate();
+    if (slot == -1) {
+      while (_usedSlots.size() > had) {
+        _slots.release(_usedSlots.back());
+        setSlotReserved(_usedSlots.back(), true);
+        _usedSlots.pop_back();
+      }
+      return false;
     }
-    // TODO(aarond10): Check file length too or don't bother 
-    // incurring the cost of the stat() call on each file?
-    _bloomfilter.set(entry->d_name);
-    _blockset.insert(entry->d_name);
-    _usedBlocks++;
+    setSlotReserved(slot, false);
+    _usedSlots.push_back(slot);
+  }
+  while (_usedSlots.size() > needed) {
+    setSlotReserved(_usedSlots.back(), true);
+    _slots.release(_usedSlots.back());
+    _usedSlots.pop_back();
   }
-  closedir(d);
+  _bytesUsed = bytesUsed;
+  return true;
+}
 }
-} 
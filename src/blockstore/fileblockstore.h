@@ -31,25 +31,38 @@
 
 #include <stdint.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <list>
+#include <map>
 #include <string>
 #include <set>
 #include <tr1/functional>
+#include <vector>
 
 #include <epoll_threadpool/notification.h>
 
 #include "blockstore/blockstore.h"
+#include "blockstore/groupcommit.h"
 #include "util/bloomfilter.h"
+#include "util/bufferpool.h"
+#include "util/blockcipher.h"
+#include "util/compression.h"
+#include "util/slotallocator.h"
 
 namespace blockstore {
 
 using std::list;
+using std::map;
 using std::set;
 using std::string;
 using std::tr1::bind;
 using std::tr1::function;
+using std::tr1::shared_ptr;
+using std::vector;
 using util::BloomFilter;
+using util::BufferPool;
+using util::SlotAllocator;
 
 using epoll_threadpool::Notification;
 template<class A>
@@ -63,16 +76,31 @@ void asyncToSyncHelper(A *out, Notification *n, A in) {
  * Blocks are keyed by ASCII string with no directory structure.
  * Intended to be used as a preliminary test version. More efficient methods
  * to follow.
+ *
+ * Each store has a fixed capacity that is preallocated on disk in a
+ * ".reserve" file so it can't be eaten by other stores sharing the same
+ * filesystem. The reservation file is divided into block sized slots;
+ * storing a block punches a hole in one slot, handing its space over to
+ * the block's own file, and removing the block reallocates it.
+ *
+ * Each block file holds the block as a util::compressFrame() frame, which
+ * may be compressed, followed by a 4 byte CRC32C of the frame that is
+ * verified whenever the block is read. Space is accounted by the size of
+ * the stored data rather than by block, so the reservation slots are
+ * blocksize units of space and compressible data leaves more of them free.
+ * When encryption is enabled the frame is sealed with util::BlockCipher,
+ * bound to the block's key, before the checksum is added.
+ *
+ * The store may be used from several threads at once. Writes, removals
+ * and scrub's checks of each block hold a lock over the block's file as
+ * well as the store's metadata, so scrub never sees a half written block.
+ * Reads don't take it.
  */
 class FileBlockStore : public BlockStore {
  public:
-  FileBlockStore(const string &path, int blocksize=65536);
-  virtual ~FileBlockStore() {
-    if (_dir) {
-      closedir(_dir);
-      _dir = NULL;
-    }
-  }
+  FileBlockStore(const string &path, int blocksize=65536,
+                 uint64_t capacity=kDefaultBlockStoreSize);
+  virtual ~FileBlockStore();
 
   /**
    * Attempts to write a block to the block store.
@@ -89,6 +117,23 @@ class FileBlockStore : public BlockStore {
    */
   virtual Future<bool> removeBlock(const string &key);
 
+  /**
+   * Checks the in-memory block set for a block.
+   */
+  virtual Future<bool> hasBlock(const string &key);
+
+  /**
+   * Reads several blocks, hinting the kernel to prefetch them all before
+   * reading them back in on-disk order.
+   */
+  virtual Future<vector<IOBuffer *> > getBlocks(const vector<string> &keys);
+
+  /**
+   * Writes several blocks, sharing a single sync between them.
+   */
+  virtual Future<vector<bool> > putBlocks(const vector<string> &keys,
+                                          const vector<IOBuffer *> &data);
+
   /**
    * Returns the size of a block in bytes.
    */
@@ -97,32 +142,70 @@ class FileBlockStore : public BlockStore {
   }
 
   /**
-   * Gets the free block availability of this device.
+   * Gets the free block availability of this device. Compressed blocks
+   * take up less than a full block so this may grow as data compresses.
    */
-  virtual Future<uint64_t> numFreeBlocks() const {
-    return Future<uint64_t>(_freeBlocks);
-  }
+  virtual Future<uint64_t> numFreeBlocks() const;
 
   /**
    * Gets the total number of blocks of storage in this device.
    */
-  virtual Future<uint64_t> numTotalBlocks() const {
-    return Future<uint64_t>(_usedBlocks + _freeBlocks);
-  }
+  virtual Future<uint64_t> numTotalBlocks() const;
 
   /**
    * Get a bloomfilter that remote hosts can use to try to determine if
    * we have a block or not before requesting it from us.
    */
-  virtual Future<BloomFilter> bloomfilter() {
-    return Future<BloomFilter>(_bloomfilter);
+  virtual Future<BloomFilter> bloomfilter();
+
+  /**
+   * Verifies the checksums of up to maxBlocks blocks, removing any that
+   * are corrupt. Blocks whose files have vanished are forgotten but not
+   * reported, and ones that can't be opened for other reasons are skipped.
+   */
+  virtual Future<vector<string> > scrub(size_t maxBlocks);
+
+  /**
+   * Enables or disables direct I/O. When enabled, blocks are read and
+   * written with O_DIRECT via page aligned buffers from a shared BufferPool,
+   * bypassing the page cache so bulk uploads don't evict the hot working
+   * set. Falls back to buffered I/O on filesystems without O_DIRECT support.
+   */
+  void setDirectIO(bool enable) { _directio = enable; }
+  bool directIO() const { return _directio; }
+
+  /**
+   * Selects the codec new blocks are compressed with. Blocks that don't
+   * compress well are stored uncompressed whatever the setting, and blocks
+   * written with any codec can always be read.
+   */
+  void setCompression(util::Codec codec) { _codec = codec; }
+  util::Codec compression() const { return _codec; }
+
+  /**
+   * Encrypts blocks at rest with cipher, or stops encrypting if it is
+   * empty. Blocks stored under one setting can't be read under another.
+   * Must not be called while operations are in flight.
+   */
+  void setEncryption(shared_ptr<util::BlockCipher> cipher) {
+    _cipher = cipher;
   }
 
+  /**
+   * Selects how durable a block is when putBlock() resolves. In
+   * SYNC_GROUP_COMMIT mode, puts arriving within 'window' seconds of each
+   * other (up to maxBatch of them) share a single syncfs() call and their
+   * Futures are resolved together once it completes.
+   * Must not be called while puts are in flight.
+   */
+  void setSyncMode(SyncMode mode, int maxBatch = 64, double window = 0.002);
+  SyncMode syncMode() const { return _syncmode; }
+
   /**
    * Iterates through block in the store, reading them one at a time.
    * Returns an empty string when complete and auto-resets.
    */
-  string next();
+  virtual string next();
 
  private:
   /**
@@ -130,14 +213,90 @@ class FileBlockStore : public BlockStore {
    * and block set used to speed up queries.
    */
   void regenerateBloomFilterAndBlockSet();
+
+  /**
+   * Rebuilds the bloom filter from the in-memory block set.
+   */
+  void regenerateBloomFilter();
+
+  /**
+   * Drops key from the block set, returning its space, without touching
+   * its file. Must be called with _lock held.
+   */
+  void forgetBlock(const string &key);
+
+  /**
+   * Sizes the reservation file so that the first 'used' slots are holes
+   * and the remainder are preallocated. If the filesystem can't hold
+   * numSlots slots, capacity is reduced to what fits.
+   * @returns the number of slots actually available.
+   */
+  uint64_t reserveSlots(uint64_t used, uint64_t numSlots);
+
+  /**
+   * Preallocates or releases the disk space held for a single slot.
+   */
+  void setSlotReserved(uint64_t slot, bool reserved);
+
+  /**
+   * Returns the space charged for a block whose stored data is len bytes:
+   * len rounded up to a filesystem block, at most a whole slot.
+   */
+  uint64_t chargeFor(size_t len) const;
+
+  /**
+   * Moves the space used by the store from _bytesUsed to bytesUsed,
+   * taking or returning whole slots of the reservation as needed.
+   * Must be called with _lock held.
+   * @returns false if there aren't enough free slots.
+   */
+  bool setBytesUsed(uint64_t bytesUsed);
  
+  /**
+   * Opens the file backing a block, honouring the direct I/O setting.
+   */
+  int openBlock(const string &key, int flags) const;
+
+  /**
+   * Reads the block open on fd into buf, which must come from _pool,
+   * verifying its checksum, decrypting and decompressing it.
+   * @returns the length of the block or -1 if it is short or corrupt.
+   */
+  ssize_t readBlock(int fd, const string &key, char *buf) const;
+
+  /**
+   * Writes a block to disk and updates the in-memory accounting without
+   * waiting for the batch level sync.
+   * @param syncFile flush the block's file and directory before returning.
+   * @note Takes ownership of data.
+   */
+  bool storeBlock(const string &key, IOBuffer *data, bool syncFile);
+
+  /**
+   * Flushes all dirty data on the filesystem holding this store.
+   */
+  bool syncAll();
+
   DIR *_dir;
+  int _dirfd;
   int _blocksize;
+  bool _directio;
+  util::Codec _codec;
+  shared_ptr<util::BlockCipher> _cipher;
+  SyncMode _syncmode;
+  shared_ptr<GroupCommitter> _committer;
+  BufferPool *_pool;
   string _path;
+  int _reservefd;
+  uint64_t _capacity;
+  // Guards the block set, space accounting, bloom filter and iterators.
+  mutable pthread_mutex_t _lock;
   util::BloomFilter _bloomfilter;
-  set<string> _blockset;
-  uint32_t _freeBlocks;
-  uint32_t _usedBlocks;
+  map<string, uint64_t> _blockset;  // Block key to bytes charged.
+  uint64_t _bytesUsed;
+  vector<uint64_t> _usedSlots;  // Slots whose reservation is handed over.
+  string _scrubCursor;  // Last key checked by scrub().
+  SlotAllocator _slots;
 };
 }
 #endif
@@ -0,0 +1,115 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "fileblockstore.h"
+
+#include <epoll_threadpool/eventmanager.h>
+#include <epoll_threadpool/iobuffer.h>
+#include <epoll_threadpool/notification.h>
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <gtest/gtest.h>
+
+using blockstore::FileBlockStore;
+using blockstore::SyncMode;
+using epoll_threadpool::CountingNotification;
+using epoll_threadpool::EventManager;
+using epoll_threadpool::Future;
+using epoll_threadpool::IOBuffer;
+using std::string;
+using std::vector;
+
+namespace {
+
+const int kBlockSize = 65536;
+const int kNumBlocks = 2000;
+
+pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+double total_latency = 0.0;
+
+void onPutComplete(EventManager::WallTime start, CountingNotification *n,
+                   bool result) {
+  CHECK(result);
+  double latency = EventManager::currentTime() - start;
+  pthread_mutex_lock(&m);
+  total_latency += latency;
+  pthread_mutex_unlock(&m);
+  n->signal();
+}
+
+/**
+ * Issues kNumBlocks puts back to back without waiting on each one, then
+ * waits for all of them to resolve. Reports throughput and mean latency.
+ */
+void runBenchmark(const char *name, SyncMode mode) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/bs_bench_%d", mode);
+  mkdir(path, 0777);
+
+  FileBlockStore bs(path, kBlockSize, (uint64_t)kNumBlocks * kBlockSize);
+  bs.setSyncMode(mode);
+
+  vector<char> data(kBlockSize, 'x');
+  CountingNotification n(kNumBlocks);
+  total_latency = 0.0;
+
+  EventManager::WallTime start = EventManager::currentTime();
+  for (int i = 0; i < kNumBlocks; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "block%d", i);
+    EventManager::WallTime t = EventManager::currentTime();
+    bs.putBlock(key, new IOBuffer(&data[0], data.size())).addCallback(
+        std::tr1::bind(&onPutComplete, t, &n, std::tr1::placeholders::_1));
+  }
+  n.wait();
+  double elapsed = EventManager::currentTime() - start;
+
+  LOG(INFO) << name << ": " << (kNumBlocks / elapsed) << " puts/s, "
+            << (kNumBlocks * (double)kBlockSize / elapsed / 1048576.0)
+            << " MB/s, mean latency " << (total_latency / kNumBlocks * 1000.0)
+            << " ms";
+
+  for (int i = 0; i < kNumBlocks; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "block%d", i);
+    bs.removeBlock(key);
+  }
+}
+}  // end anonymous namespace
+
+TEST(FileBlockStore, SyncModeBenchmark) {
+  runBenchmark("SYNC_NONE", blockstore::SYNC_NONE);
+  runBenchmark("SYNC_GROUP_COMMIT", blockstore::SYNC_GROUP_COMMIT);
+  runBenchmark("SYNC_EVERY_WRITE", blockstore::SYNC_EVERY_WRITE);
+}
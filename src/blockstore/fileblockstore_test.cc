@@ -35,15 +35,45 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+using epoll_threadpool::Future;
 using epoll_threadpool::IOBuffer;
 using std::set;
 using std::string;
 
+namespace {
+/**
+ * Repeatedly writes and removes its own set of blocks.
+ */
+void *churnBlocks(void *arg) {
+  blockstore::FileBlockStore *bs = (blockstore::FileBlockStore *)arg;
+  char data[4096];
+  memset(data, 'x', sizeof(data));
+  char key[32];
+  snprintf(key, sizeof(key), "%lx-", (unsigned long)pthread_self());
+  for (int i = 0; i < 200; i++) {
+    const string name = key + string(1, 'a' + i % 8);
+    bs->putBlock(name, new IOBuffer(data, sizeof(data)));
+    if (i % 3 == 0) {
+      bs->removeBlock(name);
+    }
+  }
+  for (int i = 0; i < 8; i++) {
+    bs->removeBlock(key + string(1, 'a' + i));
+  }
+  return NULL;
+}
+}
+
 TEST(FileBlockStoreTest, BasicTests) {
 
   mkdir("/tmp/bs1", 0777);
@@ -51,7 +81,7 @@ TEST(FileBlockStoreTest, BasicTests) {
   char buf1[16];
   IOBuffer *buf;
   memset(buf1, 0, sizeof(buf1));
-  blockstore::FileBlockStore bs1("/tmp/bs1", 16);
+  blockstore::FileBlockStore bs1("/tmp/bs1", 16, 16 * 1024);
 
   EXPECT_TRUE(bs1.getBlock("apple").get() == NULL);
   strcpy((char *)buf1, "apple");
@@ -95,12 +125,344 @@ TEST(FileBlockStoreTest, BasicTests) {
  
   EXPECT_TRUE(bs1.bloomfilter().get().mayContain("banana"));
   EXPECT_FALSE(bs1.bloomfilter().get().mayContain("carrot"));
+  EXPECT_TRUE(bs1.hasBlock("banana"));
+  EXPECT_FALSE(bs1.hasBlock("carrot"));
 
   EXPECT_TRUE(bs1.removeBlock("apple"));
   EXPECT_TRUE(bs1.removeBlock("banana"));
+  EXPECT_FALSE(bs1.hasBlock("banana"));
 
   EXPECT_EQ(string(""), bs1.next());
 
   EXPECT_FALSE(bs1.bloomfilter().get().mayContain("apple"));
   EXPECT_FALSE(bs1.bloomfilter().get().mayContain("banana"));
 }
+
+TEST(FileBlockStoreTest, DirectIO) {
+
+  mkdir("/tmp/bs2", 0777);
+
+  char buf1[100];
+  IOBuffer *buf;
+  memset(buf1, 0, sizeof(buf1));
+  blockstore::FileBlockStore bs1("/tmp/bs2", 8192, 8192 * 16);
+  bs1.setDirectIO(true);
+  EXPECT_TRUE(bs1.directIO());
+
+  // Block sizes that aren't a multiple of the I/O alignment.
+  strcpy((char *)buf1, "apple");
+  EXPECT_TRUE(bs1.putBlock("apple", new IOBuffer(buf1, sizeof(buf1))));
+  buf = bs1.getBlock("apple");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(sizeof(buf1), buf->size());
+  EXPECT_EQ(0, memcmp(buf1, buf->pulldown(buf->size()), buf->size()));
+  delete buf;
+
+  // Blocks larger than the block size are rejected.
+  char *big = new char[8193];
+  EXPECT_FALSE(bs1.putBlock("big", new IOBuffer(big, 8193)));
+  delete [] big;
+
+  EXPECT_TRUE(bs1.removeBlock("apple"));
+  EXPECT_TRUE(bs1.getBlock("apple").get() == NULL);
+}
+
+TEST(FileBlockStoreTest, SyncModes) {
+
+  mkdir("/tmp/bs3", 0777);
+
+  char buf1[16];
+  memset(buf1, 0, sizeof(buf1));
+  blockstore::FileBlockStore bs1("/tmp/bs3", 16, 16 * 1024);
+
+  bs1.setSyncMode(blockstore::SYNC_EVERY_WRITE);
+  EXPECT_EQ(blockstore::SYNC_EVERY_WRITE, bs1.syncMode());
+  EXPECT_TRUE(bs1.putBlock("apple", new IOBuffer(buf1, 16)));
+
+  // Puts issued back to back should all resolve, sharing syncs.
+  bs1.setSyncMode(blockstore::SYNC_GROUP_COMMIT, 8, 0.01);
+  std::vector< Future<bool> > results;
+  for (int i = 0; i < 32; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%d", i);
+    results.push_back(bs1.putBlock(key, new IOBuffer(buf1, 16)));
+  }
+  for (int i = 0; i < 32; i++) {
+    EXPECT_TRUE(results[i].get());
+  }
+
+  bs1.setSyncMode(blockstore::SYNC_NONE);
+  EXPECT_TRUE(bs1.putBlock("banana", new IOBuffer(buf1, 16)));
+
+  EXPECT_TRUE(bs1.removeBlock("apple"));
+  EXPECT_TRUE(bs1.removeBlock("banana"));
+  for (int i = 0; i < 32; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%d", i);
+    EXPECT_TRUE(bs1.removeBlock(key));
+  }
+}
+
+TEST(FileBlockStoreTest, Capacity) {
+
+  mkdir("/tmp/bs4", 0777);
+
+  char buf1[4096];
+  memset(buf1, 0, sizeof(buf1));
+  {
+    blockstore::FileBlockStore bs1("/tmp/bs4", 4096, 4 * 4096);
+    EXPECT_EQ(4, bs1.numTotalBlocks());
+    EXPECT_EQ(4, bs1.numFreeBlocks());
+
+    // Free space for all slots is held in the reservation file.
+    struct stat st;
+    ASSERT_EQ(0, stat("/tmp/bs4/.reserve", &st));
+    EXPECT_EQ(4 * 4096, st.st_size);
+    EXPECT_GE(st.st_blocks * 512, 4 * 4096);
+
+    EXPECT_TRUE(bs1.putBlock("a", new IOBuffer(buf1, 4096)));
+    EXPECT_TRUE(bs1.putBlock("b", new IOBuffer(buf1, 4096)));
+    EXPECT_TRUE(bs1.putBlock("c", new IOBuffer(buf1, 4096)));
+    EXPECT_EQ(1, bs1.numFreeBlocks());
+    ASSERT_EQ(0, stat("/tmp/bs4/.reserve", &st));
+    EXPECT_EQ(4096, st.st_blocks * 512);
+
+    // Overwrites don't consume extra space.
+    EXPECT_TRUE(bs1.putBlock("a", new IOBuffer(buf1, 4096)));
+    EXPECT_EQ(1, bs1.numFreeBlocks());
+
+    EXPECT_TRUE(bs1.putBlock("d", new IOBuffer(buf1, 4096)));
+    EXPECT_EQ(0, bs1.numFreeBlocks());
+    EXPECT_FALSE(bs1.putBlock("e", new IOBuffer(buf1, 4096)));
+
+    EXPECT_TRUE(bs1.removeBlock("b"));
+    EXPECT_EQ(1, bs1.numFreeBlocks());
+    EXPECT_EQ(4, bs1.numTotalBlocks());
+  }
+
+  // Accounting survives a restart.
+  blockstore::FileBlockStore bs2("/tmp/bs4", 4096, 4 * 4096);
+  EXPECT_EQ(4, bs2.numTotalBlocks());
+  EXPECT_EQ(1, bs2.numFreeBlocks());
+  EXPECT_FALSE(bs2.bloomfilter().get().mayContain("b"));
+  EXPECT_TRUE(bs2.bloomfilter().get().mayContain("c"));
+
+  EXPECT_TRUE(bs2.removeBlock("a"));
+  EXPECT_TRUE(bs2.removeBlock("c"));
+  EXPECT_TRUE(bs2.removeBlock("d"));
+  EXPECT_EQ(4, bs2.numFreeBlocks());
+}
+
+TEST(FileBlockStoreTest, Checksums) {
+
+  mkdir("/tmp/bs5", 0777);
+
+  char buf1[16];
+  memset(buf1, 0, sizeof(buf1));
+  blockstore::FileBlockStore bs1("/tmp/bs5", 16, 16 * 1024);
+  strcpy(buf1, "apple");
+  EXPECT_TRUE(bs1.putBlock("apple", new IOBuffer(buf1, 16)));
+  strcpy(buf1, "banana");
+  EXPECT_TRUE(bs1.putBlock("banana", new IOBuffer(buf1, 16)));
+  EXPECT_EQ(0, bs1.scrub(10).get().size());
+
+  // Flip a bit of a stored block behind the store's back.
+  FILE *f = fopen("/tmp/bs5/banana", "r+");
+  ASSERT_TRUE(f != NULL);
+  fseek(f, 2, SEEK_SET);
+  fputc('X', f);
+  fclose(f);
+
+  EXPECT_TRUE(bs1.getBlock("banana").get() == NULL);
+  IOBuffer *buf = bs1.getBlock("apple");
+  ASSERT_TRUE(buf != NULL);
+  delete buf;
+
+  std::vector<string> corrupt = bs1.scrub(10);
+  ASSERT_EQ(1, corrupt.size());
+  EXPECT_EQ("banana", corrupt[0]);
+  EXPECT_FALSE(bs1.bloomfilter().get().mayContain("banana"));
+  EXPECT_EQ(1023, bs1.numFreeBlocks());
+
+  // A block whose file is gone is forgotten without being reported.
+  ASSERT_EQ(0, unlink("/tmp/bs5/apple"));
+  EXPECT_EQ(0, bs1.scrub(10).get().size());
+  EXPECT_FALSE(bs1.bloomfilter().get().mayContain("apple"));
+  EXPECT_EQ(1024, bs1.numFreeBlocks());
+}
+
+TEST(FileBlockStoreTest, Batches) {
+
+  mkdir("/tmp/bs6", 0777);
+
+  char buf1[16];
+  blockstore::FileBlockStore bs1("/tmp/bs6", 16, 16 * 1024);
+  bs1.setSyncMode(blockstore::SYNC_GROUP_COMMIT);
+
+  std::vector<string> keys;
+  std::vector<IOBuffer *> data;
+  for (int i = 0; i < 20; i++) {
+    memset(buf1, 0, sizeof(buf1));
+    snprintf(buf1, sizeof(buf1), "key%d", i);
+    keys.push_back(buf1);
+    data.push_back(new IOBuffer(buf1, 16));
+  }
+  std::vector<bool> ok = bs1.putBlocks(keys, data);
+  ASSERT_EQ(20, ok.size());
+  for (int i = 0; i < 20; i++) {
+    EXPECT_TRUE(ok[i]);
+  }
+
+  // Missing blocks come back as NULL in their position.
+  keys.insert(keys.begin() + 5, "missing");
+  std::vector<IOBuffer *> blocks = bs1.getBlocks(keys);
+  ASSERT_EQ(21, blocks.size());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (i == 5) {
+      EXPECT_TRUE(blocks[i] == NULL);
+      continue;
+    }
+    ASSERT_TRUE(blocks[i] != NULL);
+    EXPECT_STREQ(keys[i].c_str(), (char *)blocks[i]->pulldown(16));
+    delete blocks[i];
+  }
+
+  for (int i = 0; i < 20; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%d", i);
+    EXPECT_TRUE(bs1.removeBlock(key));
+  }
+}
+
+TEST(FileBlockStoreTest, Compression) {
+
+  mkdir("/tmp/bs7", 0777);
+
+  string text;
+  while (text.size() < 65536) {
+    text += "all work and no play makes jack a dull boy. ";
+  }
+  text.resize(65536);
+  string noise(65536, 0);
+  for (size_t i = 0; i < noise.size(); i++) {
+    noise[i] = rand();
+  }
+
+  {
+    blockstore::FileBlockStore bs1("/tmp/bs7", 65536, 16 * 65536);
+    bs1.setCompression(util::CODEC_LZ4);
+    EXPECT_EQ(16, bs1.numFreeBlocks());
+
+    // Compressible blocks take up a fraction of a slot each.
+    for (int i = 0; i < 8; i++) {
+      char key[16];
+      snprintf(key, sizeof(key), "text%d", i);
+      EXPECT_TRUE(bs1.putBlock(key, new IOBuffer(text.data(), text.size())));
+    }
+    EXPECT_EQ(15, bs1.numFreeBlocks());
+    struct stat st;
+    ASSERT_EQ(0, stat("/tmp/bs7/text0", &st));
+    EXPECT_LT(st.st_size, 4096);
+
+    // Incompressible ones are stored as is.
+    EXPECT_TRUE(bs1.putBlock("noise", new IOBuffer(noise.data(),
+                                                   noise.size())));
+    EXPECT_EQ(14, bs1.numFreeBlocks());
+
+    IOBuffer *buf = bs1.getBlock("text3");
+    ASSERT_TRUE(buf != NULL);
+    EXPECT_EQ(text, string(buf->pulldown(buf->size()), buf->size()));
+    delete buf;
+  }
+
+  // Compressed blocks remain readable with compression off, and their
+  // accounting survives a restart.
+  blockstore::FileBlockStore bs2("/tmp/bs7", 65536, 16 * 65536);
+  EXPECT_EQ(14, bs2.numFreeBlocks());
+  IOBuffer *buf = bs2.getBlock("text7");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(text, string(buf->pulldown(buf->size()), buf->size()));
+  delete buf;
+  buf = bs2.getBlock("noise");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(noise, string(buf->pulldown(buf->size()), buf->size()));
+  delete buf;
+
+  // Overwriting with incompressible data charges the full block.
+  EXPECT_TRUE(bs2.putBlock("text0", new IOBuffer(noise.data(),
+                                                 noise.size())));
+  EXPECT_EQ(13, bs2.numFreeBlocks());
+
+  for (int i = 0; i < 8; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "text%d", i);
+    EXPECT_TRUE(bs2.removeBlock(key));
+  }
+  EXPECT_TRUE(bs2.removeBlock("noise"));
+  EXPECT_EQ(16, bs2.numFreeBlocks());
+}
+
+TEST(FileBlockStoreTest, Encryption) {
+
+  mkdir("/tmp/bs8", 0777);
+
+  const string secret = "the quick brown fox jumps over the lazy dog";
+  std::tr1::shared_ptr<util::BlockCipher> cipher(
+      new util::BlockCipher(util::BlockCipher::generateKey()));
+  {
+    blockstore::FileBlockStore bs1("/tmp/bs8", 65536, 16 * 65536);
+    bs1.setEncryption(cipher);
+    EXPECT_TRUE(bs1.putBlock("a", new IOBuffer(secret.data(),
+                                               secret.size())));
+    EXPECT_TRUE(bs1.putBlock("b", new IOBuffer(secret.data(),
+                                               secret.size())));
+    IOBuffer *buf = bs1.getBlock("a");
+    ASSERT_TRUE(buf != NULL);
+    EXPECT_EQ(secret, string(buf->pulldown(buf->size()), buf->size()));
+    delete buf;
+  }
+
+  // Nothing readable reaches the disk.
+  FILE *fp = fopen("/tmp/bs8/a", "rb");
+  ASSERT_TRUE(fp != NULL);
+  char raw[256];
+  size_t n = fread(raw, 1, sizeof(raw), fp);
+  fclose(fp);
+  EXPECT_EQ(string::npos, string(raw, n).find("quick brown fox"));
+
+  // Swapping block files is caught even though their checksums are valid.
+  ASSERT_EQ(0, rename("/tmp/bs8/b", "/tmp/bs8/a"));
+
+  blockstore::FileBlockStore bs2("/tmp/bs8", 65536, 16 * 65536);
+  EXPECT_TRUE(bs2.getBlock("a").get() == NULL);
+  bs2.setEncryption(cipher);
+  EXPECT_TRUE(bs2.getBlock("a").get() == NULL);
+  EXPECT_TRUE(bs2.putBlock("c", new IOBuffer(secret.data(), secret.size())));
+  IOBuffer *buf = bs2.getBlock("c");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(secret, string(buf->pulldown(buf->size()), buf->size()));
+  delete buf;
+  EXPECT_TRUE(bs2.removeBlock("a"));
+  EXPECT_TRUE(bs2.removeBlock("c"));
+  EXPECT_EQ(16, bs2.numFreeBlocks());
+}
+
+TEST(FileBlockStoreTest, Concurrency) {
+
+  mkdir("/tmp/bs9", 0777);
+
+  blockstore::FileBlockStore bs1("/tmp/bs9", 4096, 64 * 4096);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, &churnBlocks, &bs1);
+  }
+  // Scrubbing alongside the writers never mistakes a block for corrupt.
+  for (int i = 0; i < 50; i++) {
+    EXPECT_EQ(0, bs1.scrub(16).get().size());
+    while (bs1.next() != "") { }
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  EXPECT_EQ(64, bs1.numFreeBlocks());
+}
@@ -0,0 +1,120 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "groupcommit.h"
+
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+namespace blockstore {
+
+namespace {
+/**
+ * Returns the absolute time 'seconds' from now in a form usable by
+ * pthread_cond_timedwait().
+ */
+struct timespec deadlineFromNow(double seconds) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  struct timespec ts;
+  long nsec = tv.tv_usec * 1000 + (long)(seconds * 1e9);
+  ts.tv_sec = tv.tv_sec + nsec / 1000000000;
+  ts.tv_nsec = nsec % 1000000000;
+  return ts;
+}
+}
+
+GroupCommitter::GroupCommitter(function<bool()> sync, int maxBatch,
+                               double window)
+    : _sync(sync), _maxBatch(maxBatch), _window(window),
+      _shutdown(false), _syncs(0) {
+  pthread_mutex_init(&_mutex, 0);
+  pthread_cond_init(&_cond, 0);
+  pthread_create(&_thread, NULL, &GroupCommitter::threadMain, this);
+}
+
+GroupCommitter::~GroupCommitter() {
+  pthread_mutex_lock(&_mutex);
+  _shutdown = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+  // The thread flushes anything still pending before exiting.
+  pthread_join(_thread, NULL);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+Future<bool> GroupCommitter::commit() {
+  Future<bool> ret;
+  pthread_mutex_lock(&_mutex);
+  _pending.push_back(ret);
+  if (_pending.size() == 1 || _pending.size() >= _maxBatch) {
+    pthread_cond_signal(&_cond);
+  }
+  pthread_mutex_unlock(&_mutex);
+  return ret;
+}
+
+void *GroupCommitter::threadMain(void *arg) {
+  reinterpret_cast<GroupCommitter *>(arg)->run();
+  return NULL;
+}
+
+void GroupCommitter::run() {
+  pthread_mutex_lock(&_mutex);
+  while (true) {
+    while (_pending.empty() && !_shutdown) {
+      pthread_cond_wait(&_cond, &_mutex);
+    }
+    if (_pending.empty()) {
+      break;
+    }
+    // Give other writers a chance to join this batch.
+    struct timespec deadline = deadlineFromNow(_window);
+    while (_pending.size() < _maxBatch && !_shutdown) {
+      if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    vector< Future<bool> > batch;
+    batch.swap(_pending);
+    _syncs++;
+    pthread_mutex_unlock(&_mutex);
+
+    bool result = _sync();
+    for (vector< Future<bool> >::iterator i = batch.begin();
+         i != batch.end(); ++i) {
+      i->set(result);
+    }
+
+    pthread_mutex_lock(&_mutex);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+}
@@ -0,0 +1,98 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _BLOCKSTORE_GROUPCOMMIT_H_
+#define _BLOCKSTORE_GROUPCOMMIT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <tr1/functional>
+#include <vector>
+
+#include <epoll_threadpool/future.h>
+
+namespace blockstore {
+
+using std::tr1::function;
+using std::vector;
+using epoll_threadpool::Future;
+
+/**
+ * Durability guarantees offered by local BlockStores' putBlock().
+ */
+enum SyncMode {
+  SYNC_NONE,          // Resolve as soon as the block is handed to the OS.
+  SYNC_GROUP_COMMIT,  // Resolve after a sync shared by a batch of puts.
+  SYNC_EVERY_WRITE    // Sync each block before resolving.
+};
+
+/**
+ * Batches durability requests so many writes can share a single sync.
+ * Writers call commit() after handing their data to the OS. A background
+ * thread waits until either maxBatch commits are pending or window seconds
+ * have passed since the first of them arrived, runs the sync function once
+ * and then resolves every pending Future with its result. Commits that
+ * arrive while a sync is in progress are carried into the next batch.
+ */
+class GroupCommitter {
+ public:
+  GroupCommitter(function<bool()> sync, int maxBatch = 64,
+                 double window = 0.002);
+  virtual ~GroupCommitter();
+
+  /**
+   * Returns a Future that is set once a sync issued after this call has
+   * completed. The value is the result of that sync.
+   */
+  Future<bool> commit();
+
+  /**
+   * Returns the number of times the sync function has been called.
+   */
+  uint64_t numSyncs() const { return _syncs; }
+
+ private:
+  GroupCommitter(const GroupCommitter &);
+  GroupCommitter &operator=(const GroupCommitter &);
+
+  static void *threadMain(void *arg);
+  void run();
+
+  function<bool()> _sync;
+  int _maxBatch;
+  double _window;
+  bool _shutdown;
+  uint64_t _syncs;
+  vector< Future<bool> > _pending;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  pthread_t _thread;
+};
+}
+#endif
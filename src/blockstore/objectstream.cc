@@ -0,0 +1,243 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "objectstream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace blockstore {
+
+using std::deque;
+using std::vector;
+
+namespace {
+const char kManifestMagic[4] = { 'R', 'D', 'O', 'B' };
+const size_t kManifestSize = 16;
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Reads up to len bytes, retrying short reads until EOF.
+ */
+ssize_t readFully(int fd, char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = read(fd, buf + done, len - done);
+    if (r == 0) {
+      break;
+    } else if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    done += r;
+  }
+  return done;
+}
+
+bool writeFully(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t r = write(fd, buf, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += r;
+    len -= r;
+  }
+  return true;
+}
+
+void encodeManifest(char *buf, uint32_t chunkSize, uint64_t length) {
+  memcpy(buf, kManifestMagic, sizeof(kManifestMagic));
+  for (int i = 0; i < 4; i++) {
+    buf[4 + i] = chunkSize >> (8 * i);
+  }
+  for (int i = 0; i < 8; i++) {
+    buf[8 + i] = length >> (8 * i);
+  }
+}
+
+bool decodeManifest(IOBuffer *data, uint32_t *chunkSize, uint64_t *length) {
+  if (data->size() != kManifestSize) {
+    return false;
+  }
+  const uint8_t *buf = (const uint8_t *)data->pulldown(kManifestSize);
+  if (memcmp(buf, kManifestMagic, sizeof(kManifestMagic)) != 0) {
+    return false;
+  }
+  *chunkSize = 0;
+  for (int i = 0; i < 4; i++) {
+    *chunkSize |= (uint32_t)buf[4 + i] << (8 * i);
+  }
+  *length = 0;
+  for (int i = 0; i < 8; i++) {
+    *length |= (uint64_t)buf[8 + i] << (8 * i);
+  }
+  return *chunkSize > 0;
+}
+}
+
+ObjectStreamer::ObjectStreamer(PutFunction put, GetFunction get,
+                               size_t chunkSize, int window)
+    : _put(put), _get(get), _chunkSize(chunkSize), _window(window) {
+}
+
+string ObjectStreamer::chunkName(const string &name, uint64_t index) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "#%llu", (unsigned long long)index);
+  return name + buf;
+}
+
+bool ObjectStreamer::put(const string &name, int fd, StreamStats *stats) {
+  const double start = now();
+  vector<char> buf(_chunkSize);
+  deque< Future<bool> > inflight;
+  uint64_t length = 0;
+  uint64_t index = 0;
+  bool ok = true;
+
+  while (ok) {
+    ssize_t r = readFully(fd, &buf[0], _chunkSize);
+    if (r < 0) {
+      LOG(ERROR) << "Failed reading data for object " << name;
+      ok = false;
+      break;
+    }
+    // Empty objects are just a manifest.
+    if (r == 0) {
+      break;
+    }
+    if ((int)inflight.size() >= _window) {
+      ok = inflight.front().get();
+      inflight.pop_front();
+    }
+    inflight.push_back(
+        _put(chunkName(name, index++), new IOBuffer(&buf[0], r)));
+    length += r;
+    if ((size_t)r < _chunkSize) {
+      break;
+    }
+  }
+  while (!inflight.empty()) {
+    ok = inflight.front().get() && ok;
+    inflight.pop_front();
+  }
+  if (ok) {
+    char manifest[kManifestSize];
+    encodeManifest(manifest, _chunkSize, length);
+    ok = _put(name, new IOBuffer(manifest, kManifestSize)).get();
+  }
+  if (!ok) {
+    LOG(ERROR) << "Failed to store object " << name;
+  }
+
+  if (stats) {
+    stats->bytes = length;
+    stats->blocks = index;
+    stats->seconds = now() - start;
+    LOG(INFO) << "Put " << name << ": " << length << " bytes in "
+              << stats->seconds << "s (" << stats->mbPerSec() << " MB/s)";
+  }
+  return ok;
+}
+
+bool ObjectStreamer::get(const string &name, int fd, StreamStats *stats) {
+  const double start = now();
+  IOBuffer *data = _get(name).get();
+  if (!data) {
+    LOG(ERROR) << "No such object " << name;
+    return false;
+  }
+  uint32_t chunkSize;
+  uint64_t length;
+  bool ok = decodeManifest(data, &chunkSize, &length);
+  delete data;
+  if (!ok) {
+    LOG(ERROR) << "Bad manifest for object " << name;
+    return false;
+  }
+
+  const uint64_t numChunks = (length + chunkSize - 1) / chunkSize;
+  deque< Future<IOBuffer *> > inflight;
+  uint64_t next = 0;
+  uint64_t written = 0;
+  for (uint64_t index = 0; index < numChunks; index++) {
+    while (next < numChunks && (int)inflight.size() < _window) {
+      inflight.push_back(_get(chunkName(name, next++)));
+    }
+    IOBuffer *chunk = inflight.front().get();
+    inflight.pop_front();
+    const uint64_t expected = std::min<uint64_t>(chunkSize, length - written);
+    if (!chunk || chunk->size() != expected) {
+      LOG(ERROR) << "Missing or truncated chunk " << index << " of " << name;
+      delete chunk;
+      ok = false;
+      break;
+    }
+    ok = writeFully(fd, (const char *)chunk->pulldown(expected), expected);
+    delete chunk;
+    if (!ok) {
+      LOG(ERROR) << "Failed writing data for object " << name;
+      break;
+    }
+    written += expected;
+  }
+  // Drain reads still in flight after a failure.
+  while (!inflight.empty()) {
+    delete inflight.front().get();
+    inflight.pop_front();
+  }
+
+  if (stats) {
+    stats->bytes = written;
+    stats->blocks = next;
+    stats->seconds = now() - start;
+    LOG(INFO) << "Got " << name << ": " << written << " bytes in "
+              << stats->seconds << "s (" << stats->mbPerSec() << " MB/s)";
+  }
+  return ok;
+}
+}
@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _BLOCKSTORE_OBJECTSTREAM_H_
+#define _BLOCKSTORE_OBJECTSTREAM_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <tr1/functional>
+
+#include <epoll_threadpool/future.h>
+#include <epoll_threadpool/iobuffer.h>
+
+namespace blockstore {
+
+using std::string;
+using std::tr1::function;
+using epoll_threadpool::Future;
+using epoll_threadpool::IOBuffer;
+
+/**
+ * Throughput of a single streamed object transfer.
+ */
+struct StreamStats {
+  StreamStats() : bytes(0), blocks(0), seconds(0) { }
+  uint64_t bytes;
+  uint64_t blocks;
+  double seconds;
+
+  /**
+   * Returns the transfer rate in megabytes per second.
+   */
+  double mbPerSec() const {
+    return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+  }
+};
+
+/**
+ * Streams objects of arbitrary size to and from a block level put/get
+ * interface. An object "name" is split into block sized chunks stored as
+ * "name#0", "name#1", ... plus a small manifest block stored under "name"
+ * recording the object's length. The manifest is written last so a
+ * partially uploaded object is never visible.
+ *
+ * Up to 'window' chunk requests are kept in flight at once, which bounds
+ * memory use to roughly window * chunkSize regardless of object size. Gets
+ * read ahead by the same amount and write chunks out strictly in order.
+ *
+ * The put and get calls block until the transfer completes so they must
+ * not be called from an EventManager thread that the underlying store
+ * needs to make progress.
+ */
+class ObjectStreamer {
+ public:
+  typedef function<Future<bool>(const string &, IOBuffer *)> PutFunction;
+  typedef function<Future<IOBuffer *>(const string &)> GetFunction;
+
+  ObjectStreamer(PutFunction put, GetFunction get,
+                 size_t chunkSize = 65536, int window = 16);
+
+  /**
+   * Reads fd to EOF, storing its contents as object 'name'.
+   * @returns true if every chunk and the manifest were stored.
+   */
+  bool put(const string &name, int fd, StreamStats *stats = NULL);
+
+  /**
+   * Writes the contents of object 'name' to fd.
+   * @returns true if the whole object was retrieved.
+   */
+  bool get(const string &name, int fd, StreamStats *stats = NULL);
+
+  /**
+   * Returns the key under which chunk 'index' of object 'name' is stored.
+   */
+  static string chunkName(const string &name, uint64_t index);
+
+ private:
+  PutFunction _put;
+  GetFunction _get;
+  size_t _chunkSize;
+  int _window;
+};
+}
+#endif
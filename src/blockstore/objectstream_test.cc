@@ -0,0 +1,120 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "fileblockstore.h"
+#include "objectstream.h"
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using blockstore::FileBlockStore;
+using blockstore::ObjectStreamer;
+using blockstore::StreamStats;
+using std::string;
+using std::vector;
+using namespace std::tr1::placeholders;
+
+namespace {
+/**
+ * Writes data to a fresh temporary file and returns an fd positioned at
+ * its start.
+ */
+int makeFile(const char *path, const vector<char> &data) {
+  int fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0600);
+  if (data.size()) {
+    EXPECT_EQ((ssize_t)data.size(), write(fd, &data[0], data.size()));
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+vector<char> readFile(const char *path) {
+  vector<char> ret;
+  FILE *f = fopen(path, "rb");
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    ret.push_back(c);
+  }
+  fclose(f);
+  return ret;
+}
+}
+
+TEST(ObjectStreamerTest, RoundTrip) {
+  mkdir("/tmp/os1", 0777);
+  FileBlockStore bs("/tmp/os1", 4096, 4096 * 1024);
+  ObjectStreamer streamer(
+      std::tr1::bind(&FileBlockStore::putBlock, &bs, _1, _2),
+      std::tr1::bind(&FileBlockStore::getBlock, &bs, _1), 4096, 4);
+
+  // Sizes around chunk boundaries, including an empty object.
+  const size_t sizes[] = { 0, 1, 4096, 4097, 100 * 4096 + 123 };
+  for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+    vector<char> data(sizes[n]);
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = rand();
+    }
+    int in = makeFile("/tmp/os1.in", data);
+    StreamStats stats;
+    EXPECT_TRUE(streamer.put("object", in, &stats));
+    close(in);
+    EXPECT_EQ(sizes[n], stats.bytes);
+
+    int out = open("/tmp/os1.out", O_CREAT|O_TRUNC|O_WRONLY, 0600);
+    EXPECT_TRUE(streamer.get("object", out, &stats));
+    close(out);
+    EXPECT_EQ(sizes[n], stats.bytes);
+    EXPECT_TRUE(data == readFile("/tmp/os1.out"));
+    // Only non-empty chunks are stored.
+    EXPECT_EQ(sizes[n] > 0,
+              bs.hasBlock(ObjectStreamer::chunkName("object", 0)).get());
+  }
+
+  // Missing objects and missing chunks are reported.
+  int out = open("/tmp/os1.out", O_CREAT|O_TRUNC|O_WRONLY, 0600);
+  EXPECT_FALSE(streamer.get("nothing", out));
+  EXPECT_TRUE(bs.removeBlock(ObjectStreamer::chunkName("object", 50)));
+  EXPECT_FALSE(streamer.get("object", out));
+  close(out);
+
+  string key;
+  while ((key = bs.next()) != "") {
+    bs.removeBlock(key);
+  }
+  unlink("/tmp/os1.in");
+  unlink("/tmp/os1.out");
+}
@@ -30,6 +30,7 @@
 #define _BLOCKSTORE_REMOTEBLOCKSTORE_H_
 
 #include "blockstore.h"
+#include "blockstoreservice.h"
 #include "rpc/rpc.h"
 
 #include <stdint.h>
@@ -43,7 +44,9 @@
 #include <epoll_threadpool/future.h>
 #include <epoll_threadpool/iobuffer.h>
 
+#include "util/blockcipher.h"
 #include "util/bloomfilter.h"
+#include "util/compression.h"
 
 namespace blockstore {
 
@@ -59,105 +62,338 @@ using namespace std::tr1::placeholders;
 
 namespace {
 /**
- * Helper function that maps from vector<uint8_t> to IOBuffer*.
+ * Packs a block into a util::compressFrame() frame for the wire. Frames
+ * are never empty so an empty string can stand for a missing block.
+ * If sealed, the frame is compressed straight into place between room for
+ * a util::BlockCipher nonce and tag so sealFrames() can encrypt it there.
+ * @note Takes ownership of data.
  */
-Future<bool> FileBlockStorePutBlockHelper(
-    FileBlockStore *bs, string name, vector<uint8_t> data) {
-  LOG(INFO) << "FileBlockStorePutBlockHelper";
-  IOBuffer* iobuffer = new IOBuffer((const char *)&data[0], data.size());
-  return (*bs).putBlock(name, iobuffer);
+string blockToFrame(util::Codec codec, bool sealed, IOBuffer *data) {
+  const size_t len = data->size();
+  const size_t offset = sealed ? util::BlockCipher::kNonceSize : 0;
+  const size_t overhead = sealed ? util::BlockCipher::kOverhead : 0;
+  string frame(util::maxFrameSize(len) + overhead, '\0');
+  frame.resize(util::compressFrame(codec, data->pulldown(len), len,
+                                   &frame[offset]) + overhead);
+  delete data;
+  return frame;
 }
 
-void FileBlockStoreGetBlockHelperCallback(
-    Future< vector<uint8_t> > dst, Future<IOBuffer*> src) {
-  LOG(INFO) << "FileBlockStoreGetBlockHelperCallback with src " << src.get();
+/**
+ * Encrypts a batch of frames made by blockToFrame() in place, binding each
+ * to its block's key. Empty frames are left alone.
+ * @returns false if any failed.
+ */
+bool sealFrames(util::BlockCipher *cipher, const vector<string> &keys,
+                vector<string> *frames) {
+  vector<char *> bufs;
+  vector<size_t> lens;
+  vector<string> aads;
+  for (size_t i = 0; i < frames->size(); i++) {
+    string &frame = (*frames)[i];
+    if (!frame.empty()) {
+      bufs.push_back(&frame[0]);
+      lens.push_back(frame.size() - util::BlockCipher::kOverhead);
+      aads.push_back(keys[i]);
+    }
+  }
+  return cipher->encryptBlocks(bufs, lens, aads);
+}
+
+/**
+ * Unpacks a batch of frames made by blockToFrame(), first decrypting them
+ * in place if cipher is set. Frame i is lens[i] bytes at bufs[i].
+ * @param maxSize the largest block a frame may unpack to.
+ * @returns one block per frame, NULL where the frame is empty, malformed,
+ *          too large or fails to authenticate.
+ */
+vector<IOBuffer *> framesToBlocks(util::BlockCipher *cipher,
+                                  const vector<string> &keys,
+                                  const vector<char *> &frames,
+                                  const vector<size_t> &frameLens,
+                                  size_t maxSize) {
+  vector<IOBuffer *> ret(frames.size(), (IOBuffer *)NULL);
+  vector<size_t> index;
+  vector<char *> bufs;
+  vector<size_t> lens;
+  vector<string> aads;
+  for (size_t i = 0; i < frames.size(); i++) {
+    if (frameLens[i] != 0) {
+      index.push_back(i);
+      bufs.push_back(frames[i]);
+      lens.push_back(frameLens[i]);
+      aads.push_back(i < keys.size() ? keys[i] : string());
+    }
+  }
+  vector<ssize_t> plain(lens.begin(), lens.end());
+  if (cipher) {
+    plain = cipher->decryptBlocks(bufs, lens, aads);
+  }
+  for (size_t i = 0; i < bufs.size(); i++) {
+    if (plain[i] < 0) {
+      LOG(ERROR) << "Received a forged or damaged block.";
+      continue;
+    }
+    const char *src =
+        bufs[i] + (cipher ? util::BlockCipher::kNonceSize : 0);
+    ssize_t len = util::frameDataSize(src, plain[i], maxSize);
+    if (len < 0) {
+      LOG(ERROR) << "Received a malformed block.";
+      continue;
+    }
+    vector<char> data(len + 1);
+    if (util::decompressFrame(src, plain[i], &data[0], len) != len) {
+      LOG(ERROR) << "Received a corrupt compressed block.";
+      continue;
+    }
+    ret[index[i]] = new IOBuffer(&data[0], len);
+  }
+  return ret;
+}
+
+/**
+ * Unpacks frames received as results, as framesToBlocks(). Nothing else
+ * reads the results so they are decrypted where they lie.
+ */
+vector<IOBuffer *> framesToBlocks(util::BlockCipher *cipher,
+                                  const vector<string> &keys,
+                                  vector<string> *frames,
+                                  size_t maxSize = util::kMaxFrameData) {
+  vector<char *> bufs(frames->size(), (char *)NULL);
+  vector<size_t> lens(frames->size(), 0);
+  for (size_t i = 0; i < frames->size(); i++) {
+    if (!(*frames)[i].empty()) {
+      bufs[i] = &(*frames)[i][0];
+      lens[i] = (*frames)[i].size();
+    }
+  }
+  return framesToBlocks(cipher, keys, bufs, lens, maxSize);
+}
+
+/**
+ * Unpacks frames received as arguments, as framesToBlocks(). The request
+ * they were decoded from belongs to this call alone, so they too are
+ * decrypted where they lie.
+ */
+vector<IOBuffer *> framesToBlocks(util::BlockCipher *cipher,
+                                  const vector<string> &keys,
+                                  const vector<FrameRef> &frames,
+                                  size_t maxSize = util::kMaxFrameData) {
+  vector<char *> bufs(frames.size());
+  vector<size_t> lens(frames.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    bufs[i] = const_cast<char *>(frames[i].ptr);
+    lens[i] = frames[i].size;
+  }
+  return framesToBlocks(cipher, keys, bufs, lens, maxSize);
+}
+
+/**
+ * Packs a single block, as blockToFrame(), sealing it if cipher is set.
+ * @returns the frame or an empty string if encryption failed.
+ * @note Takes ownership of data.
+ */
+string blockToSealedFrame(util::Codec codec, util::BlockCipher *cipher,
+                          const string &key, IOBuffer *data) {
+  vector<string> frames(1);
+  frames[0] = blockToFrame(codec, cipher != NULL, data);
+  if (cipher && !sealFrames(cipher, vector<string>(1, key), &frames)) {
+    return string();
+  }
+  return frames[0];
+}
+
+/**
+ * Helper function that maps from a frame to IOBuffer*.
+ */
+Future<bool> BlockStorePutBlockHelper(
+    BlockStore *bs, shared_ptr<util::BlockCipher> cipher, const string &name,
+    const FrameRef &frame) {
+  IOBuffer* iobuffer = framesToBlocks(cipher.get(), vector<string>(1, name),
+                                      vector<FrameRef>(1, frame))[0];
+  if (!iobuffer) {
+    return false;
+  }
+  return bs->putBlock(name, iobuffer);
+}
+
+void BlockStoreGetBlockHelperCallback(
+    util::Codec codec, shared_ptr<util::BlockCipher> cipher, string name,
+    Future<string> dst, Future<IOBuffer*> src) {
   if (src.get() == NULL) {
-    dst.set(vector<uint8_t>());
+    dst.set(string());
   } else {
-    vector<uint8_t> ret;
-    ret.resize(src.get()->size());
-    memcpy(&ret[0], src.get()->pulldown(src.get()->size()), src.get()->size());
-    delete src.get();
-    dst.set(ret);
+    dst.set(blockToSealedFrame(codec, cipher.get(), name, src.get()));
   }
 }
 
 /**
- * Helper function that maps from vector<uint8_t> to IOBuffer*.
+ * Helper function that maps from IOBuffer* to a frame.
  */
-Future< vector<uint8_t> > FileBlockStoreGetBlockHelper(
-    FileBlockStore *bs, string name) {
-  LOG(INFO) << "FileBlockStoreGetBlockHelper";
-  Future< vector<uint8_t> > dst;
-  Future<IOBuffer*> src = (*bs).getBlock(name);
-  src.addCallback(bind(&FileBlockStoreGetBlockHelperCallback, dst, src));
+Future<string> BlockStoreGetBlockHelper(
+    BlockStore *bs, util::Codec codec, shared_ptr<util::BlockCipher> cipher,
+    const string &name) {
+  Future<string> dst;
+  Future<IOBuffer*> src = bs->getBlock(name);
+  src.addCallback(bind(&BlockStoreGetBlockHelperCallback, codec, cipher,
+                       name, dst, src));
+  return dst;
+}
+
+void BlockStoreGetBlocksHelperCallback(
+    util::Codec codec, shared_ptr<util::BlockCipher> cipher,
+    vector<string> names, Future< vector<string> > dst,
+    Future< vector<IOBuffer *> > src) {
+  const vector<IOBuffer *> &blocks = src.get();
+  vector<string> ret(blocks.size());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (blocks[i]) {
+      ret[i] = blockToFrame(codec, cipher.get() != NULL, blocks[i]);
+    }
+  }
+  if (cipher && !sealFrames(cipher.get(), names, &ret)) {
+    ret.assign(ret.size(), string());
+  }
+  dst.set(ret);
+}
+
+/**
+ * Helper function that maps a batch of IOBuffer* to frames.
+ */
+Future< vector<string> > BlockStoreGetBlocksHelper(
+    BlockStore *bs, util::Codec codec, shared_ptr<util::BlockCipher> cipher,
+    const vector<string> &names) {
+  Future< vector<string> > dst;
+  Future< vector<IOBuffer *> > src = bs->getBlocks(names);
+  src.addCallback(bind(&BlockStoreGetBlocksHelperCallback, codec, cipher,
+                       names, dst, src));
   return dst;
 }
 
+void BlockStorePutBlocksHelperCallback(
+    Future< vector<uint8_t> > dst, Future< vector<bool> > src) {
+  dst.set(vector<uint8_t>(src.get().begin(), src.get().end()));
+}
+
 /**
- * Helper function that maps from vector<uint8_t> to BloomFilter
+ * Helper function that maps a batch of frames to IOBuffer*.
  */
-Future< vector<uint8_t> > FileBlockStoreBloomFilterHelper(FileBlockStore *bs) {
-  LOG(INFO) << "FileBlockStoreBloomFilterHelper";
-  Future< vector<uint8_t> > ret;
-  ret.set((*bs).bloomfilter().get().serialize());
-  return ret;
+Future< vector<uint8_t> > BlockStorePutBlocksHelper(
+    BlockStore *bs, shared_ptr<util::BlockCipher> cipher,
+    const vector<string> &names, const vector<FrameRef> &data) {
+  if (data.size() != names.size()) {
+    return vector<uint8_t>(names.size(), false);
+  }
+  vector<IOBuffer *> iobuffers = framesToBlocks(cipher.get(), names, data);
+  for (size_t i = 0; i < iobuffers.size(); i++) {
+    if (!iobuffers[i]) {
+      for (size_t j = 0; j < iobuffers.size(); j++) {
+        delete iobuffers[j];
+      }
+      return vector<uint8_t>(names.size(), false);
+    }
+  }
+  Future< vector<uint8_t> > dst;
+  Future< vector<bool> > src = bs->putBlocks(names, iobuffers);
+  src.addCallback(bind(&BlockStorePutBlocksHelperCallback, dst, src));
+  return dst;
+}
+
+void BlockStoreBloomFilterHelperCallback(
+    Future<string> dst, Future<BloomFilter> src) {
+  vector<uint8_t> bytes = src.get().serialize();
+  dst.set(string(bytes.begin(), bytes.end()));
 }
 
 /**
- * Builds a BlockStore unique string so multiple BlockStore instances can be
- * run over a single RPC channel.
+ * Helper function that maps from BloomFilter to bytes.
  */
-string MakeString(const char *str, uint64_t bsid) {
-  char buf[128];
-  snprintf(buf, 127, "%s%lu", str, bsid);
-  return buf;
+Future<string> BlockStoreBloomFilterHelper(BlockStore *bs) {
+  Future<string> dst;
+  Future<BloomFilter> src = bs->bloomfilter();
+  src.addCallback(bind(&BlockStoreBloomFilterHelperCallback, dst, src));
+  return dst;
 }
 } // end anonymous namespace
 
 /**
  * Registers a BlockStore with an RPC server instance.
  * This is intended to be used in conjunction with RemoteBlockStore on the
- * client side. It creates per-blockstore unique RPC names to allow
- * multiple BlockStore instances to be shared on a single server endpoint.
+ * client side. It binds each method of BlockStoreService, whose names are
+ * unique to the bsid, to allow multiple BlockStore instances to be shared
+ * on a single server endpoint. Any BlockStore implementation may be
+ * exported. Blocks are sent back to clients compressed with codec. If
+ * cipher is set, blocks in both directions are encrypted with it, so
+ * clients must use the same key.
  */
-void RegisterRemoteBlockStore(shared_ptr<rpc::RPCServer> server,
-                              FileBlockStore *blockstore, uint64_t bsid) {
+void RegisterRemoteBlockStore(
+    shared_ptr<rpc::RPCServer> server, BlockStore *blockstore,
+    uint64_t bsid, util::Codec codec = util::CODEC_LZ4,
+    shared_ptr<util::BlockCipher> cipher = shared_ptr<util::BlockCipher>()) {
   LOG(INFO) << "RegisterRemoteBlockStore";
-  server->registerFunction<bool, string, vector<uint8_t> >(
-      MakeString("putBlock", bsid), 
-      bind(&FileBlockStorePutBlockHelper, blockstore, _1, _2));
-  server->registerFunction<vector<uint8_t>, string>(
-      MakeString("getBlock", bsid),
-      bind(&FileBlockStoreGetBlockHelper, blockstore, _1));
-  server->registerFunction<bool, string>(
-      MakeString("removeBlock", bsid),
-      bind(&FileBlockStore::removeBlock, blockstore, _1));
-  server->registerFunction<uint64_t>(
-      MakeString("blockSize", bsid),
-      bind(&FileBlockStore::blockSize, blockstore));
-  server->registerFunction<uint64_t>(
-      MakeString("numFreeBlocks", bsid),
-      bind(&FileBlockStore::numFreeBlocks, blockstore));
-  server->registerFunction<uint64_t>(
-      MakeString("numTotalBlocks", bsid),
-      bind(&FileBlockStore::numTotalBlocks, blockstore));
-  server->registerFunction< vector<uint8_t> >(
-      MakeString("bloomfilter", bsid),
-      bind(&FileBlockStoreBloomFilterHelper, blockstore));
+  const BlockStoreService service(bsid);
+  server->registerFunction(service.putBlock,
+      bind(&BlockStorePutBlockHelper, blockstore, cipher, _1, _2));
+  server->registerFunction(service.getBlock,
+      bind(&BlockStoreGetBlockHelper, blockstore, codec, cipher, _1));
+  server->registerFunction(service.getBlocks,
+      bind(&BlockStoreGetBlocksHelper, blockstore, codec, cipher, _1));
+  server->registerFunction(service.putBlocks,
+      bind(&BlockStorePutBlocksHelper, blockstore, cipher, _1, _2));
+  server->registerFunction(service.removeBlock,
+      bind(&BlockStore::removeBlock, blockstore, _1));
+  server->registerFunction(service.hasBlock,
+      bind(&BlockStore::hasBlock, blockstore, _1));
+  server->registerFunction(service.blockSize,
+      bind(&BlockStore::blockSize, blockstore));
+  server->registerFunction(service.numFreeBlocks,
+      bind(&BlockStore::numFreeBlocks, blockstore));
+  server->registerFunction(service.numTotalBlocks,
+      bind(&BlockStore::numTotalBlocks, blockstore));
+  server->registerFunction(service.bloomfilter,
+      bind(&BlockStoreBloomFilterHelper, blockstore));
 }
 
 /**
  * An implementation of the BlockStore interface that operates via RPC on
  * a remote instance. Each RemoteBlockStore takes a bsid, allowing multiple
  * BlockStore's to be hosted on a single RPC channel.
+ *
+ * Blocks travel as util::compressFrame() frames, compressed with LZ4 by
+ * default so that compressible data costs less of a peer's uplink. With
+ * encryption enabled each frame is also sealed with util::BlockCipher,
+ * bound to its block's key, so peers on the path can neither read nor
+ * substitute blocks.
  */
 class RemoteBlockStore : public BlockStore {
  public:
   RemoteBlockStore(shared_ptr<rpc::RPCClient> client, uint64_t bsid)
-      : _bsid(bsid), _client(client) { }
+      : _service(bsid), _client(client), _health(client),
+        _codec(util::CODEC_LZ4) { }
   virtual ~RemoteBlockStore() { }
 
+  /**
+   * Judges the peer's health by client rather than the client blocks go
+   * over, e.g. one on a control stream that watches heartbeats.
+   */
+  void setHealthClient(shared_ptr<rpc::RPCClient> client) {
+    _health = client;
+  }
+
+  /**
+   * Selects the codec blocks are compressed with before being sent.
+   */
+  void setCompression(util::Codec codec) { _codec = codec; }
+  util::Codec compression() const { return _codec; }
+
+  /**
+   * Encrypts blocks sent and received with cipher, which must use the same
+   * key the server was registered with, or stops if it is empty.
+   */
+  void setEncryption(shared_ptr<util::BlockCipher> cipher) {
+    _cipher = cipher;
+  }
+
   /**
    * Attempts to write a block to the block store.
    * @param key the key for this block
@@ -166,12 +402,12 @@ class RemoteBlockStore : public BlockStore {
    * @note Ownership of data is transfered to the function.
    */
   virtual Future<bool> putBlock(const string &key, IOBuffer *data) {
-    vector<uint8_t> datavec;
-    datavec.resize(data->size());
-    memcpy(&datavec[0], data->pulldown(data->size()), data->size());
-    delete data;
-    return _client->call<bool, string, vector<uint8_t> >(
-        MakeString("putBlock", _bsid), key, datavec);
+    const string frame = blockToSealedFrame(_codec, _cipher.get(), key, data);
+    if (frame.empty()) {
+      return false;
+    }
+    return _client->call(_service.putBlock, key,
+                         FrameRef(frame.data(), frame.size()));
   }
 
   /**
@@ -183,10 +419,51 @@ class RemoteBlockStore : public BlockStore {
    */
   virtual Future<IOBuffer *> getBlock(const string &key) {
     Future<IOBuffer *> ret;
-    Future< vector<uint8_t> > proxy_ret = 
-        _client->call<vector<uint8_t>, string>(
-            MakeString("getBlock", _bsid), key);
-    proxy_ret.addCallback(bind(&getBlockHelper, proxy_ret, ret));
+    Future<string> proxy_ret = _client->call(_service.getBlock, key);
+    proxy_ret.addCallback(
+        bind(&getBlockHelper, _cipher, key, proxy_ret, ret));
+    return ret;
+  }
+
+  /**
+   * Reads several blocks with a single RPC.
+   * @param keys the keys of the blocks to read
+   * @returns one IOBuffer per key, NULL for blocks that weren't found.
+   * @note Ownership of data is passed to the callback.
+   */
+  virtual Future<vector<IOBuffer *> > getBlocks(const vector<string> &keys) {
+    Future< vector<IOBuffer *> > ret;
+    Future< vector<string> > proxy_ret =
+        _client->call(_service.getBlocks, keys);
+    proxy_ret.addCallback(
+        bind(&getBlocksHelper, _cipher, keys, proxy_ret, ret));
+    return ret;
+  }
+
+  /**
+   * Writes several blocks with a single RPC.
+   * @param keys the keys for these blocks
+   * @param data one block per key, each up to "blocksize" long.
+   * @returns per-key success.
+   * @note Ownership of data is transfered to the function.
+   */
+  virtual Future<vector<bool> > putBlocks(const vector<string> &keys,
+                                          const vector<IOBuffer *> &data) {
+    vector<string> frames(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+      frames[i] = blockToFrame(_codec, _cipher.get() != NULL, data[i]);
+    }
+    if (_cipher && !sealFrames(_cipher.get(), keys, &frames)) {
+      return vector<bool>(keys.size(), false);
+    }
+    vector<FrameRef> refs(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+      refs[i] = FrameRef(frames[i].data(), frames[i].size());
+    }
+    Future< vector<bool> > ret;
+    Future< vector<uint8_t> > proxy_ret =
+        _client->call(_service.putBlocks, keys, refs);
+    proxy_ret.addCallback(bind(&putBlocksHelper, proxy_ret, ret));
     return ret;
   }
 
@@ -196,8 +473,16 @@ class RemoteBlockStore : public BlockStore {
    * @returns true on success, false on failure.
    */
   virtual Future<bool> removeBlock(const string &key) {
-    return _client->call<bool, const string &>(
-        MakeString("removeBlock", _bsid), key);
+    return _client->call(_service.removeBlock, key);
+  }
+
+  /**
+   * Checks whether the remote store holds a block without fetching it.
+   * @param key the key for this block
+   * @returns true if the block exists.
+   */
+  virtual Future<bool> hasBlock(const string &key) {
+    return _client->call(_service.hasBlock, key);
   }
 
   /**
@@ -205,7 +490,7 @@ class RemoteBlockStore : public BlockStore {
    * @returns the size of a block in bytes or -1 on error.
    */
   virtual Future<uint64_t> blockSize() const {
-    return _client->call<uint64_t>(MakeString("blockSize", _bsid));
+    return _client->call(_service.blockSize);
   }
 
   /**
@@ -213,7 +498,7 @@ class RemoteBlockStore : public BlockStore {
    * @returns the num free blocks or -1 on error.
    */
   virtual Future<uint64_t> numFreeBlocks() const {
-    return _client->call<uint64_t>(MakeString("numFreeBlocks", _bsid));
+    return _client->call(_service.numFreeBlocks);
   }
 
   /**
@@ -221,7 +506,7 @@ class RemoteBlockStore : public BlockStore {
    * @returns total blocks on this device or -1 on error.
    */
   virtual Future<uint64_t> numTotalBlocks() const {
-    return _client->call<uint64_t>(MakeString("numTotalBlocks", _bsid));
+    return _client->call(_service.numTotalBlocks);
   }
 
   /**
@@ -231,50 +516,80 @@ class RemoteBlockStore : public BlockStore {
    */
   virtual Future<BloomFilter> bloomfilter() {
     Future<BloomFilter> ret;
-    Future< vector<uint8_t> > proxy_ret = 
-        _client->call< vector<uint8_t> >(MakeString("bloomfilter", _bsid));
+    Future<string> proxy_ret = _client->call(_service.bloomfilter);
     proxy_ret.addCallback(bind(&bloomfilterHelper, proxy_ret, ret));
     return ret;
   }
 
+  /**
+   * Suspect while the connection to the peer is down or the peer has
+   * stopped answering. The store stays usable; retryable calls made while
+   * disconnected are sent once it reconnects.
+   */
+  virtual bool isSuspect() const {
+    return _health->health() == util::FailureDetector::DEAD;
+  }
+
+  /**
+   * Slow while the peer's answers are overdue, if the client watches its
+   * heartbeats.
+   */
+  virtual bool isSlow() const {
+    return _health->health() == util::FailureDetector::SLOW;
+  }
+
  private:
-  uint64_t _bsid;
+  const BlockStoreService _service;
   shared_ptr<rpc::RPCClient> _client;
+  shared_ptr<rpc::RPCClient> _health;
+  util::Codec _codec;
+  shared_ptr<util::BlockCipher> _cipher;
 
   /**
-   * Helper function to map from vector to IOBuffer *
+   * Helper function to map from a frame to IOBuffer *
    */
   static void getBlockHelper(
-      Future< vector<uint8_t> > proxy_ret, Future<IOBuffer *> ret) {
-    LOG(INFO) << "Attempting deserialization";
-    if (proxy_ret.get().size() == 0) {
-      ret.set(NULL);
-    } else {
-      IOBuffer *buf = new IOBuffer((const char *)(&proxy_ret.get()[0]), 
-                                   proxy_ret.get().size());
-      ret.set(buf);
-    }
+      shared_ptr<util::BlockCipher> cipher, string key,
+      Future<string> proxy_ret, Future<IOBuffer *> ret) {
+    vector<string> frames(1);
+    frames[0].swap(const_cast<string &>(proxy_ret.get()));
+    ret.set(framesToBlocks(cipher.get(), vector<string>(1, key), &frames)[0]);
+  }
+
+  /**
+   * Helper function to map from frames to IOBuffer *'s
+   */
+  static void getBlocksHelper(
+      shared_ptr<util::BlockCipher> cipher, vector<string> keys,
+      Future< vector<string> > proxy_ret,
+      Future< vector<IOBuffer *> > ret) {
+    ret.set(framesToBlocks(
+        cipher.get(), keys, &const_cast<vector<string> &>(proxy_ret.get())));
   }
 
   /**
-   * Helper function to map from vector to BloomFilter
+   * Helper function to map from a byte per block to bool
+   */
+  static void putBlocksHelper(
+      Future< vector<uint8_t> > proxy_ret, Future< vector<bool> > ret) {
+    ret.set(vector<bool>(proxy_ret.get().begin(), proxy_ret.get().end()));
+  }
+
+  /**
+   * Helper function to map from bytes to BloomFilter
    */
   static void bloomfilterHelper(
-      Future< vector<uint8_t> > proxy_ret, Future<BloomFilter> ret) {
-    LOG(INFO) << "Attempting deserialization";
-    ret.set(BloomFilter());
-    return;
-    if (proxy_ret.get().size() == 0) {
+      Future<string> proxy_ret, Future<BloomFilter> ret) {
+    const string &bytes = proxy_ret.get();
+    BloomFilter bf;
+    if (bytes.empty()) {
       LOG(ERROR) << "Invalid BloomFilter response.";
-      ret.set(BloomFilter());
     } else {
-      BloomFilter bf;
-      bf.deserialize(proxy_ret.get());
-      ret.set(bf);
+      bf.deserialize(vector<uint8_t>(bytes.begin(), bytes.end()));
     }
+    ret.set(bf);
   }
 
 };
 }
 #endif
-
@@ -76,7 +76,7 @@ TEST(RemoteBlockStore, Basics) {
 
   mkdir("/tmp/bs", 0777);
   mkdir("/tmp/bs/1234", 0777);
-  FileBlockStore *bs = new FileBlockStore("/tmp/bs/1234", 16);
+  FileBlockStore *bs = new FileBlockStore("/tmp/bs/1234", 16, 16 * 1024);
   RegisterRemoteBlockStore(r, bs, 0);
 
   shared_ptr<RPCClient> c(new RPCClient(TcpSocket::connect(&em, "127.0.0.1", port)));
@@ -92,13 +92,113 @@ TEST(RemoteBlockStore, Basics) {
   ASSERT_EQ(16, ret->size());
   ASSERT_EQ(0, memcmp(str, ret->pulldown(ret->size()), ret->size()));
   delete ret;
-  
+
+  vector<string> keys;
+  vector<IOBuffer *> data;
+  keys.push_back("def");
+  data.push_back(new IOBuffer(str, 16));
+  keys.push_back("ghi");
+  data.push_back(new IOBuffer(str, 8));
+  vector<bool> ok = rbs.putBlocks(keys, data);
+  ASSERT_EQ(2, ok.size());
+  EXPECT_TRUE(ok[0]);
+  EXPECT_TRUE(ok[1]);
+
+  keys.push_back("xxx");
+  vector<IOBuffer *> blocks = rbs.getBlocks(keys);
+  ASSERT_EQ(3, blocks.size());
+  ASSERT_TRUE(blocks[0] != NULL);
+  EXPECT_EQ(16, blocks[0]->size());
+  ASSERT_TRUE(blocks[1] != NULL);
+  EXPECT_EQ(8, blocks[1]->size());
+  EXPECT_TRUE(blocks[2] == NULL);
+  delete blocks[0];
+  delete blocks[1];
+  EXPECT_TRUE(rbs.hasBlock("def"));
+  EXPECT_FALSE(rbs.hasBlock("xxx"));
+  EXPECT_TRUE(rbs.removeBlock("def"));
+  EXPECT_FALSE(rbs.hasBlock("def"));
+  EXPECT_TRUE(rbs.removeBlock("ghi"));
+
   LOG(INFO) << "Remove block xxx: " << rbs.removeBlock("xxx");
   LOG(INFO) << "Block Size: " << rbs.blockSize();
   LOG(INFO) << "Free blocks: " << rbs.numFreeBlocks();
   LOG(INFO) << "Total blocks: " << rbs.numTotalBlocks();
   util::BloomFilter bf = rbs.bloomfilter();
-  
+  EXPECT_TRUE(bf.mayContain("abc"));
+
+  // Stores exported under other bsids are distinct methods.
+  RemoteBlockStore other(c, 1);
+  EXPECT_FALSE(other.hasBlock("abc"));
+
   delete bs;
 }
 
+
+TEST(RemoteBlockStore, Encryption) {
+
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+
+  r->start();
+
+  mkdir("/tmp/bs", 0777);
+  mkdir("/tmp/bs/5678", 0777);
+  FileBlockStore *bs = new FileBlockStore("/tmp/bs/5678", 16, 16 * 1024);
+  const string key = util::BlockCipher::generateKey();
+  RegisterRemoteBlockStore(r, bs, 0, util::CODEC_LZ4,
+                           shared_ptr<util::BlockCipher>(
+                               new util::BlockCipher(key)));
+
+  shared_ptr<RPCClient> c(new RPCClient(TcpSocket::connect(&em, "127.0.0.1", port)));
+  c->start();
+  RemoteBlockStore rbs(c, 0);
+  rbs.setEncryption(shared_ptr<util::BlockCipher>(new util::BlockCipher(key)));
+
+  const char *str = "0123456789abcde";
+  ASSERT_TRUE(rbs.putBlock("abc", new IOBuffer(str, 16)));
+  IOBuffer *ret = rbs.getBlock("abc");
+  ASSERT_TRUE(ret != NULL);
+  ASSERT_EQ(16, ret->size());
+  ASSERT_EQ(0, memcmp(str, ret->pulldown(ret->size()), ret->size()));
+  delete ret;
+
+  vector<string> keys;
+  vector<IOBuffer *> data;
+  keys.push_back("def");
+  data.push_back(new IOBuffer(str, 8));
+  vector<bool> ok = rbs.putBlocks(keys, data);
+  ASSERT_EQ(1, ok.size());
+  EXPECT_TRUE(ok[0]);
+  vector<IOBuffer *> blocks = rbs.getBlocks(keys);
+  ASSERT_EQ(1, blocks.size());
+  ASSERT_TRUE(blocks[0] != NULL);
+  EXPECT_EQ(8, blocks[0]->size());
+  delete blocks[0];
+
+  // Clients without the key can neither write nor read blocks.
+  RemoteBlockStore plain(c, 0);
+  EXPECT_FALSE(plain.putBlock("ghi", new IOBuffer(str, 16)));
+  EXPECT_TRUE(plain.getBlock("abc").get() == NULL);
+  RemoteBlockStore wrong(c, 0);
+  wrong.setEncryption(shared_ptr<util::BlockCipher>(
+      new util::BlockCipher(util::BlockCipher::generateKey())));
+  EXPECT_FALSE(wrong.putBlock("ghi", new IOBuffer(str, 16)));
+  EXPECT_TRUE(wrong.getBlock("abc").get() == NULL);
+  EXPECT_FALSE(rbs.hasBlock("ghi"));
+
+  EXPECT_TRUE(rbs.removeBlock("abc"));
+  EXPECT_TRUE(rbs.removeBlock("def"));
+
+  delete bs;
+}
@@ -0,0 +1,311 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "repair.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "coding/reedsolomon.h"
+
+namespace blockstore {
+
+using coding::ReedSolomon;
+
+RepairWorker::RepairWorker(PutFunction put, GetFunction get,
+                           int maxInFlight, uint64_t bytesPerSec)
+    : _put(put), _get(get), _maxInFlight(maxInFlight),
+      _bytesPerSec(bytesPerSec),
+      _now(0), _lastTick(0), _tokens(bytesPerSec), _jobBytes(0), _starting(false),
+      _again(false) {
+  pthread_mutex_init(&_lock, NULL);
+}
+
+RepairWorker::~RepairWorker() {
+  if (!_active.empty()) {
+    LOG(ERROR) << "RepairWorker destroyed with " << _active.size()
+               << " repairs in flight.";
+  }
+  for (map<string, Job *>::iterator i = _queued.begin();
+       i != _queued.end(); ++i) {
+    delete i->second;
+  }
+  pthread_mutex_destroy(&_lock);
+}
+
+bool RepairWorker::add(const string &key, double now) {
+  string name;
+  int n, k, m;
+  if (!ReedSolomon::parseBlockName(key, &name, &n, &k, &m)) {
+    return false;
+  }
+  pthread_mutex_lock(&_lock);
+  Job *&job = _queued[name];
+  if (!job) {
+    job = new Job();
+    job->name = name;
+    job->k = k;
+    job->m = m;
+    job->total = k + m;
+    job->reported = now;
+    job->blocks.resize(k + m);
+    job->length = 0;
+    job->reserved = 0;
+    job->bytes = 0;
+    job->have = 0;
+    job->outstanding = 0;
+    job->stored = 0;
+  }
+  if (job->k == k && job->m == m) {
+    job->missing.insert(n);
+    job->tried.insert(n);
+  }
+  pthread_mutex_unlock(&_lock);
+  return true;
+}
+
+void RepairWorker::tick(double now) {
+  pthread_mutex_lock(&_lock);
+  _tokens = std::min(_bytesPerSec,
+                     _tokens + std::max(0.0, now - _lastTick) * _bytesPerSec);
+  _lastTick = _now = now;
+  pthread_mutex_unlock(&_lock);
+  startJobs();
+}
+
+bool RepairWorker::idle() {
+  pthread_mutex_lock(&_lock);
+  bool ret = _queued.empty() && _active.empty();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+RepairStats RepairWorker::stats() {
+  pthread_mutex_lock(&_lock);
+  RepairStats ret = _stats;
+  ret.queued = _queued.size();
+  ret.inFlight = _active.size();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+void RepairWorker::startJobs() {
+  pthread_mutex_lock(&_lock);
+  // Completions may call back in here from fetch() below. Rather than
+  // recursing, flag the outer loop to go round again.
+  if (_starting) {
+    _again = true;
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  _starting = true;
+  do {
+    _again = false;
+    // Start one job at a time so that, when its blocks are already at
+    // hand, its cost is charged before deciding to start another.
+    while ((int)_active.size() < _maxInFlight && _tokens > 0 &&
+           !_queued.empty()) {
+      // Repair whichever object is closest to being lost.
+      map<string, Job *>::iterator best = _queued.begin();
+      for (map<string, Job *>::iterator i = _queued.begin();
+           i != _queued.end(); ++i) {
+        int survivors = i->second->total - i->second->missing.size();
+        int bestSurvivors = best->second->total - best->second->missing.size();
+        if (survivors < bestSurvivors ||
+            (survivors == bestSurvivors &&
+             i->second->reported < best->second->reported)) {
+          best = i;
+        }
+      }
+      Job *job = best->second;
+      _queued.erase(best);
+      _active.insert(job);
+      // Hold back what a repair typically costs until this one finishes
+      // and its real cost is known.
+      job->reserved = _jobBytes;
+      _tokens -= job->reserved;
+      pthread_mutex_unlock(&_lock);
+      fetch(job);
+      pthread_mutex_lock(&_lock);
+    }
+  } while (_again);
+  _starting = false;
+  pthread_mutex_unlock(&_lock);
+}
+
+void RepairWorker::fetch(Job *job) {
+  const int k = job->k;
+  // One block beyond k lets decode() check the result.
+  const int want = std::min(k + 1, job->total);
+  vector<int> indices;
+  pthread_mutex_lock(&_lock);
+  for (int i = 0; i < job->total &&
+       job->have + (int)indices.size() < want; i++) {
+    if (job->tried.find(i) == job->tried.end()) {
+      indices.push_back(i);
+      job->tried.insert(i);
+    }
+  }
+  job->outstanding = indices.size();
+  pthread_mutex_unlock(&_lock);
+
+  if (indices.empty()) {
+    if (job->have >= k) {
+      decode(job);
+    } else {
+      LOG(ERROR) << "Only " << job->have << " of " << job->total
+                 << " blocks of " << job->name << " remain; can't repair.";
+      finish(job, false);
+    }
+    return;
+  }
+  for (size_t i = 0; i < indices.size(); i++) {
+    Future<IOBuffer *> result =
+        _get(ReedSolomon::blockName(job->name, indices[i], job->k, job->m));
+    result.addCallback(std::tr1::bind(&RepairWorker::fetchHelper, this, job,
+                                      indices[i], result));
+  }
+}
+
+void RepairWorker::fetchHelper(Job *job, int index,
+                               Future<IOBuffer *> result) {
+  IOBuffer *buf = result.get();
+  pthread_mutex_lock(&_lock);
+  if (buf && (job->have == 0 || buf->size() == job->length)) {
+    job->length = buf->size();
+    job->blocks[index].assign((const char *)buf->pulldown(buf->size()),
+                              buf->size());
+    job->have++;
+    job->bytes += buf->size();
+    _tokens -= buf->size();
+    _stats.bytesRead += buf->size();
+  } else {
+    job->missing.insert(index);
+  }
+  bool last = --job->outstanding == 0;
+  pthread_mutex_unlock(&_lock);
+  delete buf;
+  if (last) {
+    fetch(job);
+  }
+}
+
+void RepairWorker::decode(Job *job) {
+  const int k = job->k;
+  const size_t len = job->length;
+  vector<bool> present(job->total, false);
+  int check = -1;
+  for (int i = 0; i < job->total; i++) {
+    // Fetches have all completed, so a block tried but not missing is here.
+    present[i] = job->tried.find(i) != job->tried.end() &&
+                 job->missing.find(i) == job->missing.end();
+    if (present[i]) {
+      check = i;
+    }
+  }
+  string expected;
+  if (job->have > k) {
+    expected.swap(job->blocks[check]);
+    present[check] = false;
+  }
+
+  vector<uint8_t *> ptrs(job->total);
+  for (int i = 0; i < job->total; i++) {
+    job->blocks[i].resize(len);
+    ptrs[i] = len ? (uint8_t *)&job->blocks[i][0] : NULL;
+  }
+  const ReedSolomon rs(k, job->m);
+  if (!rs.decode(&ptrs[0], present, len)) {
+    LOG(ERROR) << "Unable to decode " << job->name << " for repair.";
+    finish(job, false);
+    return;
+  }
+  // With a spare survivor the rebuilt copy of it must match. Otherwise
+  // the best available check is that the data carries a sane length.
+  string object;
+  if (job->have > k ? expected != job->blocks[check]
+                    : !rs.join(job->blocks, &object)) {
+    LOG(ERROR) << "Rebuilt blocks of " << job->name << " don't match the "
+               << "survivors; not repairing it.";
+    finish(job, false);
+    return;
+  }
+
+  vector<int> indices(job->missing.begin(), job->missing.end());
+  pthread_mutex_lock(&_lock);
+  job->outstanding = indices.size();
+  job->bytes += (double)len * indices.size();
+  _tokens -= (double)len * indices.size();
+  _stats.bytesWritten += (uint64_t)len * indices.size();
+  pthread_mutex_unlock(&_lock);
+  for (size_t i = 0; i < indices.size(); i++) {
+    const string &data = job->blocks[indices[i]];
+    Future<bool> result =
+        _put(ReedSolomon::blockName(job->name, indices[i], job->k, job->m),
+             new IOBuffer(data.data(), data.size()));
+    result.addCallback(std::tr1::bind(&RepairWorker::storeHelper, this, job,
+                                      indices[i], result));
+  }
+}
+
+void RepairWorker::storeHelper(Job *job, int index, Future<bool> result) {
+  pthread_mutex_lock(&_lock);
+  if (result.get()) {
+    job->stored++;
+  } else {
+    LOG(ERROR) << "Unable to store repaired block "
+               << ReedSolomon::blockName(job->name, index, job->k, job->m);
+  }
+  bool last = --job->outstanding == 0;
+  pthread_mutex_unlock(&_lock);
+  if (last) {
+    finish(job, job->stored == (int)job->missing.size());
+  }
+}
+
+void RepairWorker::finish(Job *job, bool ok) {
+  pthread_mutex_lock(&_lock);
+  _active.erase(job);
+  _tokens += job->reserved;
+  _jobBytes = 0.75 * _jobBytes + 0.25 * job->bytes;
+  if (ok) {
+    _stats.objectsRepaired++;
+    _stats.blocksRepaired += job->missing.size();
+    _stats.maxRepairSeconds =
+        std::max(_stats.maxRepairSeconds, _now - job->reported);
+  } else {
+    _stats.objectsFailed++;
+  }
+  pthread_mutex_unlock(&_lock);
+  delete job;
+  startJobs();
+}
+}
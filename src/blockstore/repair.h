@@ -0,0 +1,161 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _BLOCKSTORE_REPAIR_H_
+#define _BLOCKSTORE_REPAIR_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <tr1/functional>
+#include <vector>
+
+#include <pthread.h>
+
+#include <epoll_threadpool/future.h>
+#include <epoll_threadpool/iobuffer.h>
+
+namespace blockstore {
+
+using std::map;
+using std::set;
+using std::string;
+using std::tr1::function;
+using std::vector;
+using epoll_threadpool::Future;
+using epoll_threadpool::IOBuffer;
+
+/**
+ * Counters describing the work done by a RepairWorker.
+ */
+struct RepairStats {
+  RepairStats()
+      : queued(0), inFlight(0), objectsRepaired(0), objectsFailed(0),
+        blocksRepaired(0), bytesRead(0), bytesWritten(0),
+        maxRepairSeconds(0) { }
+  size_t queued;
+  size_t inFlight;
+  uint64_t objectsRepaired;
+  uint64_t objectsFailed;
+  uint64_t blocksRepaired;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  // Longest time from a block being reported missing to being rewritten.
+  double maxRepairSeconds;
+};
+
+/**
+ * Rebuilds missing Reed-Solomon coded blocks, named as given by
+ * ReedSolomon::blockName(), and writes them back into the network.
+ *
+ * Missing blocks are grouped by object. Objects with the fewest surviving
+ * blocks are repaired first, at most maxInFlight at a time. Block names
+ * carry the object's k and m. For each object the worker fetches k + 1
+ * siblings in parallel, fetching more if some of them turn out to be
+ * missing too. It then decodes and puts every block found to be missing.
+ * The extra sibling, when one survives, is used to check the decode.
+ * Otherwise the rebuilt data must at least carry a valid object length.
+ * Nothing is written back unless the check passes.
+ *
+ * Repair traffic is throttled by a token bucket refilled at bytesPerSec so
+ * that a large outage doesn't starve client requests. No new repair starts
+ * while the bucket is empty.
+ */
+class RepairWorker {
+ public:
+  typedef function<Future<bool>(const string &, IOBuffer *)> PutFunction;
+  typedef function<Future<IOBuffer *>(const string &)> GetFunction;
+
+  RepairWorker(PutFunction put, GetFunction get, int maxInFlight = 4,
+               uint64_t bytesPerSec = 16 << 20);
+  ~RepairWorker();
+
+  /**
+   * Queues a missing block for repair at time 'now' (in seconds).
+   * @returns false if key isn't a coded block name this worker can repair.
+   */
+  bool add(const string &key, double now);
+
+  /**
+   * Refills the bandwidth budget and starts queued repairs. Call
+   * periodically.
+   */
+  void tick(double now);
+
+  /**
+   * Returns true if no repairs are queued or running.
+   */
+  bool idle();
+
+  RepairStats stats();
+
+ private:
+  struct Job {
+    string name;
+    int k;
+    int m;
+    int total;
+    double reported;
+    set<int> missing;  // Blocks known to need rewriting.
+    set<int> tried;    // Blocks fetched or being fetched.
+    vector<string> blocks;
+    size_t length;     // Size of every block of the object.
+    double reserved;   // Bandwidth held back when the job started.
+    double bytes;      // Bandwidth actually used.
+    int have;
+    int outstanding;
+    int stored;
+  };
+
+  void startJobs();
+  void fetch(Job *job);
+  void fetchHelper(Job *job, int index, Future<IOBuffer *> result);
+  void decode(Job *job);
+  void storeHelper(Job *job, int index, Future<bool> result);
+  void finish(Job *job, bool ok);
+
+  PutFunction _put;
+  GetFunction _get;
+  int _maxInFlight;
+  double _bytesPerSec;
+
+  pthread_mutex_t _lock;
+  double _now;
+  double _lastTick;
+  double _tokens;
+  double _jobBytes;  // Moving average of the bandwidth a repair uses.
+  bool _starting;  // startJobs() is running.
+  bool _again;     // startJobs() should look at the queue again.
+  map<string, Job *> _queued;  // Object name -> pending repair.
+  set<Job *> _active;
+  RepairStats _stats;
+};
+}
+#endif
@@ -0,0 +1,216 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "repair.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "coding/reedsolomon.h"
+
+using blockstore::RepairStats;
+using blockstore::RepairWorker;
+using coding::ReedSolomon;
+using epoll_threadpool::Future;
+using epoll_threadpool::IOBuffer;
+using std::map;
+using std::string;
+using std::vector;
+using namespace std::tr1::placeholders;
+
+namespace {
+/**
+ * Minimal in-memory block store recording the order of writes.
+ */
+class MemoryStore {
+ public:
+  Future<bool> put(const string &key, IOBuffer *data) {
+    _blocks[key].assign((const char *)data->pulldown(data->size()),
+                        data->size());
+    delete data;
+    puts.push_back(key);
+    return true;
+  }
+
+  Future<IOBuffer *> get(const string &key) {
+    map<string, string>::iterator i = _blocks.find(key);
+    if (i == _blocks.end()) {
+      return (IOBuffer *)NULL;
+    }
+    return new IOBuffer(i->second.data(), i->second.size());
+  }
+
+  void storeObject(const string &name, int k, int m, const string &object) {
+    vector<string> blocks = ReedSolomon(k, m).split(object);
+    for (int i = 0; i < k + m; i++) {
+      _blocks[ReedSolomon::blockName(name, i, k, m)] = blocks[i];
+    }
+  }
+
+  string block(const string &key) { return _blocks[key]; }
+  void remove(const string &key) { _blocks.erase(key); }
+  void corrupt(const string &key) {
+    for (size_t i = 0; i < _blocks[key].size(); i++) {
+      _blocks[key][i] ^= 0xff;
+    }
+  }
+  bool contains(const string &key) { return _blocks.count(key) > 0; }
+
+  vector<string> puts;
+
+ private:
+  map<string, string> _blocks;
+};
+
+string randomObject(size_t len) {
+  string ret(len, 0);
+  for (size_t i = 0; i < len; i++) {
+    ret[i] = rand();
+  }
+  return ret;
+}
+}
+
+TEST(RepairWorkerTest, Repair) {
+  MemoryStore store;
+  RepairWorker worker(std::tr1::bind(&MemoryStore::put, &store, _1, _2),
+                      std::tr1::bind(&MemoryStore::get, &store, _1));
+  store.storeObject("obj", 6, 3, randomObject(10000));
+  string b1 = store.block("obj.1.6.3");
+  string b7 = store.block("obj.7.6.3");
+  store.remove("obj.1.6.3");
+  store.remove("obj.7.6.3");
+  // Block 4 is gone too but hasn't been noticed yet.
+  string b4 = store.block("obj.4.6.3");
+  store.remove("obj.4.6.3");
+
+  EXPECT_FALSE(worker.add("not-coded", 0));
+  EXPECT_FALSE(worker.add("obj.1.0.2", 0));  // No data blocks.
+  EXPECT_FALSE(worker.add("obj.9.6.3", 0));  // Past the last block.
+  EXPECT_TRUE(worker.add("obj.1.6.3", 0));
+  EXPECT_TRUE(worker.add("obj.7.6.3", 0));
+  EXPECT_FALSE(worker.idle());
+  EXPECT_EQ(1u, worker.stats().queued);
+
+  worker.tick(5);
+  EXPECT_TRUE(worker.idle());
+  EXPECT_EQ(b1, store.block("obj.1.6.3"));
+  EXPECT_EQ(b4, store.block("obj.4.6.3"));
+  EXPECT_EQ(b7, store.block("obj.7.6.3"));
+
+  RepairStats stats = worker.stats();
+  EXPECT_EQ(1u, stats.objectsRepaired);
+  EXPECT_EQ(0u, stats.objectsFailed);
+  EXPECT_EQ(3u, stats.blocksRepaired);
+  EXPECT_EQ(6 * b1.size(), stats.bytesRead);
+  EXPECT_EQ(3 * b1.size(), stats.bytesWritten);
+  EXPECT_EQ(5.0, stats.maxRepairSeconds);
+}
+
+TEST(RepairWorkerTest, Priority) {
+  MemoryStore store;
+  RepairWorker worker(std::tr1::bind(&MemoryStore::put, &store, _1, _2),
+                      std::tr1::bind(&MemoryStore::get, &store, _1), 1);
+  store.storeObject("a", 4, 3, randomObject(1000));
+  store.storeObject("b", 4, 3, randomObject(1000));
+  store.storeObject("c", 4, 3, randomObject(1000));
+  store.remove("a.0.4.3");
+  worker.add("a.0.4.3", 0);
+  store.remove("b.0.4.3");
+  store.remove("b.1.4.3");
+  store.remove("b.2.4.3");
+  worker.add("b.0.4.3", 1);
+  worker.add("b.1.4.3", 1);
+  worker.add("b.2.4.3", 1);
+  store.remove("c.3.4.3");
+  store.remove("c.5.4.3");
+  worker.add("c.3.4.3", 2);
+  worker.add("c.5.4.3", 2);
+
+  worker.tick(3);
+  EXPECT_TRUE(worker.idle());
+  ASSERT_EQ(6u, store.puts.size());
+  EXPECT_EQ("b.0.4.3", store.puts[0]);
+  EXPECT_EQ("c.3.4.3", store.puts[3]);
+  EXPECT_EQ("a.0.4.3", store.puts[5]);
+}
+
+TEST(RepairWorkerTest, Throttle) {
+  MemoryStore store;
+  // Each repair moves about 24KB, so this allows one every five seconds.
+  RepairWorker worker(std::tr1::bind(&MemoryStore::put, &store, _1, _2),
+                      std::tr1::bind(&MemoryStore::get, &store, _1), 4, 5000);
+  const char *names[] = { "x", "y", "z" };
+  for (int i = 0; i < 3; i++) {
+    store.storeObject(names[i], 4, 2, randomObject(16000));
+    store.remove(ReedSolomon::blockName(names[i], 0, 4, 2));
+    worker.add(ReedSolomon::blockName(names[i], 0, 4, 2), 0);
+  }
+  worker.tick(0);
+  EXPECT_EQ(1u, worker.stats().objectsRepaired);
+  worker.tick(1);
+  EXPECT_EQ(1u, worker.stats().objectsRepaired);
+  worker.tick(10);
+  EXPECT_EQ(2u, worker.stats().objectsRepaired);
+  worker.tick(20);
+  EXPECT_EQ(3u, worker.stats().objectsRepaired);
+  EXPECT_TRUE(worker.idle());
+}
+
+TEST(RepairWorkerTest, Unrepairable) {
+  MemoryStore store;
+  RepairWorker worker(std::tr1::bind(&MemoryStore::put, &store, _1, _2),
+                      std::tr1::bind(&MemoryStore::get, &store, _1));
+
+  // Too few survivors.
+  store.storeObject("lost", 3, 2, randomObject(3000));
+  store.remove("lost.0.3.2");
+  store.remove("lost.2.3.2");
+  store.remove("lost.4.3.2");
+  worker.add("lost.0.3.2", 0);
+
+  // Exactly k survivors, one of them damaged, so there is no spare block
+  // to check against and the rebuilt length is garbage.
+  store.storeObject("bad", 3, 2, randomObject(3000));
+  store.remove("bad.0.3.2");
+  store.remove("bad.4.3.2");
+  store.corrupt("bad.3.3.2");
+  worker.add("bad.0.3.2", 0);
+
+  worker.tick(1);
+  EXPECT_TRUE(worker.idle());
+  EXPECT_EQ(2u, worker.stats().objectsFailed);
+  EXPECT_EQ(0u, worker.stats().objectsRepaired);
+  EXPECT_TRUE(store.puts.empty());
+  EXPECT_FALSE(store.contains("bad.0.3.2"));
+}
@@ -0,0 +1,519 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slotblockstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "util/crc32c.h"
+
+namespace blockstore {
+
+namespace {
+const char kMagic[8] = { 'R', 'D', 'S', 'L', 'O', 'T', '0', '1' };
+const uint32_t kVersion = 1;
+const uint64_t kHeaderSize = 4096;
+
+// Maximum number of adjacent slots scrub() reads with a single pread.
+const uint64_t kScrubBatch = 16;
+
+/**
+ * 64-bit FNV-1a hash of a key.
+ */
+uint64_t hashKey(const string &key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); i++) {
+    h ^= (uint8_t)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+}
+
+const size_t SlotBlockStore::kMaxKeyLength;
+
+SlotBlockStore::SlotBlockStore(const string &filename, int blocksize,
+                               uint64_t capacity)
+    : _fd(-1), _blocksize(blocksize), _syncmode(SYNC_NONE),
+      _pool(BufferPool::get(blocksize)), _dataOffset(0), _generation(0),
+      _cursor(0), _scrubSlot(0), _table(NULL), _tableBytes(0), _indexMask(0),
+      _bloomStale(false) {
+  pthread_mutex_init(&_lock, NULL);
+  if (!open(filename, capacity / blocksize)) {
+    LOG(ERROR) << "Unable to open slot file " << filename;
+    if (_table) {
+      munmap(_table, _tableBytes);
+      _table = NULL;
+    }
+    if (_fd != -1) {
+      close(_fd);
+      _fd = -1;
+    }
+    _slots.reset(0);
+    return;
+  }
+  load();
+}
+
+SlotBlockStore::~SlotBlockStore() {
+  // Flushes and resolves any outstanding group commits.
+  _committer.reset();
+  if (_table) {
+    munmap(_table, _tableBytes);
+  }
+  if (_fd != -1) {
+    close(_fd);
+  }
+  pthread_mutex_destroy(&_lock);
+}
+
+bool SlotBlockStore::open(const string &filename, uint64_t numSlots) {
+  _fd = ::open(filename.c_str(), O_CREAT|O_RDWR, 0600);
+  if (_fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(_fd, &st) != 0) {
+    return false;
+  }
+
+  Header header;
+  if (st.st_size == 0) {
+    _tableBytes = BufferPool::align(numSlots * sizeof(SlotEntry));
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.blocksize = _blocksize;
+    header.numSlots = numSlots;
+    header.tableOffset = kHeaderSize;
+    header.dataOffset = kHeaderSize + _tableBytes;
+    const off_t size = header.dataOffset + numSlots * _blocksize;
+    if (fallocate(_fd, 0, 0, size) != 0) {
+      LOG(WARNING) << "Unable to preallocate " << filename
+                   << ". Capacity will not be guaranteed.";
+      if (ftruncate(_fd, size) != 0) {
+        return false;
+      }
+    }
+    // The header goes last so a partially created file is rejected.
+    if (pwrite(_fd, &header, sizeof(header), 0) != sizeof(header)) {
+      return false;
+    }
+  } else {
+    if (pread(_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kVersion) {
+      LOG(ERROR) << filename << " is not a slot file.";
+      return false;
+    }
+    if (header.blocksize != (uint32_t)_blocksize ||
+        header.numSlots != numSlots) {
+      LOG(ERROR) << filename << " was created with blocksize "
+                 << header.blocksize << " and " << header.numSlots
+                 << " slots.";
+      return false;
+    }
+    _tableBytes = header.dataOffset - header.tableOffset;
+  }
+  _dataOffset = header.dataOffset;
+
+  void *table = mmap(NULL, _tableBytes, PROT_READ|PROT_WRITE, MAP_SHARED,
+                     _fd, header.tableOffset);
+  if (table == MAP_FAILED) {
+    return false;
+  }
+  _table = (SlotEntry *)table;
+  _slots.reset(numSlots);
+  return true;
+}
+
+void SlotBlockStore::load() {
+  const uint64_t numSlots = _slots.numSlots();
+  uint64_t indexSize = 1;
+  while (indexSize < numSlots * 2) {
+    indexSize <<= 1;
+  }
+  _index.assign(indexSize, 0);
+  _indexMask = indexSize - 1;
+
+  for (uint64_t slot = 0; slot < numSlots; slot++) {
+    SlotEntry &entry = _table[slot];
+    if (entry.keylen == 0) {
+      continue;
+    }
+    if (entry.keylen > kMaxKeyLength || entry.length > (uint32_t)_blocksize) {
+      LOG(WARNING) << "Dropping corrupt slot " << slot;
+      memset(&entry, 0, sizeof(entry));
+      continue;
+    }
+    if (entry.generation > _generation) {
+      _generation = entry.generation;
+    }
+
+    // A crash between writing a new copy of a block and freeing the old
+    // one leaves two entries for the key. The newer generation wins.
+    string key(entry.key, entry.keylen);
+    int64_t other = find(key, entry.keyhash);
+    if (other != -1) {
+      uint64_t loser = slot;
+      if (_table[other].generation < entry.generation) {
+        loser = other;
+        indexErase(other);
+        _slots.release(other);
+        indexInsert(entry.keyhash, slot);
+        _slots.allocate(slot);
+      }
+      memset(&_table[loser], 0, sizeof(SlotEntry));
+      continue;
+    }
+    indexInsert(entry.keyhash, slot);
+    _slots.allocate(slot);
+  }
+  regenerateBloomFilter();
+}
+
+int64_t SlotBlockStore::find(const string &key, uint64_t hash) const {
+  if (_index.empty()) {
+    return -1;
+  }
+  for (uint64_t i = hash & _indexMask; _index[i]; i = (i + 1) & _indexMask) {
+    const SlotEntry &entry = _table[_index[i] - 1];
+    if (entry.keyhash == hash && entry.keylen == key.size() &&
+        memcmp(entry.key, key.data(), key.size()) == 0) {
+      return _index[i] - 1;
+    }
+  }
+  return -1;
+}
+
+void SlotBlockStore::indexInsert(uint64_t hash, uint64_t slot) {
+  uint64_t i = hash & _indexMask;
+  while (_index[i]) {
+    i = (i + 1) & _indexMask;
+  }
+  _index[i] = slot + 1;
+}
+
+void SlotBlockStore::indexErase(uint64_t slot) {
+  uint64_t i = _table[slot].keyhash & _indexMask;
+  while (_index[i] != slot + 1) {
+    i = (i + 1) & _indexMask;
+  }
+  // Backward shift deletion keeps probe sequences intact without
+  // tombstones.
+  uint64_t j = i;
+  while (true) {
+    j = (j + 1) & _indexMask;
+    if (!_index[j]) {
+      break;
+    }
+    uint64_t home = _table[_index[j] - 1].keyhash & _indexMask;
+    bool movable = (j > i) ? (home <= i || home > j)
+                           : (home <= i && home > j);
+    if (movable) {
+      _index[i] = _index[j];
+      i = j;
+    }
+  }
+  _index[i] = 0;
+}
+
+void SlotBlockStore::setSyncMode(SyncMode mode, int maxBatch, double window) {
+  _syncmode = mode;
+  if (mode == SYNC_GROUP_COMMIT) {
+    _committer.reset(new GroupCommitter(
+        bind(&SlotBlockStore::syncAll, this), maxBatch, window));
+  } else {
+    _committer.reset();
+  }
+}
+
+bool SlotBlockStore::syncAll() {
+  if (!_table || msync(_table, _tableBytes, MS_SYNC) != 0 ||
+      fdatasync(_fd) != 0) {
+    LOG(ERROR) << "Failed to sync slot file.";
+    return false;
+  }
+  return true;
+}
+
+Future<bool> SlotBlockStore::putBlock(const string &key, IOBuffer *data) {
+  const size_t len = data->size();
+  if (len > (size_t)_blocksize || key.empty() ||
+      key.size() > kMaxKeyLength) {
+    DLOG(ERROR) << "Tried to put a block too big (" << len << ") or with "
+                << "an invalid key.";
+    delete data;
+    return false;
+  }
+
+  // Blocks are normally not overwritten in place. The new copy goes to a
+  // fresh slot and the old one is freed once the new table entry is
+  // written. Only a full store falls back to reusing the old slot, whose
+  // entry is cleared first as its data is about to be overwritten.
+  // Claiming a slot keeps other threads off it, so the data is written
+  // without holding the lock.
+  const uint64_t hash = hashKey(key);
+  pthread_mutex_lock(&_lock);
+  int64_t slot = _slots.allocate();
+  if (slot == -1) {
+    slot = find(key, hash);
+    if (slot == -1) {
+      pthread_mutex_unlock(&_lock);
+      LOG(ERROR) << "No free blocks.";
+      delete data;
+      return false;
+    }
+    indexErase(slot);
+    memset(&_table[slot], 0, sizeof(SlotEntry));
+    _bloomStale = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  const char *bytes = (const char *)data->pulldown(len);
+  const uint32_t crc = util::crc32c(bytes, len);
+  ssize_t r = pwrite(_fd, bytes, len, _dataOffset + slot * _blocksize);
+  delete data;
+  pthread_mutex_lock(&_lock);
+  if (r != (ssize_t)len) {
+    _slots.release(slot);
+    pthread_mutex_unlock(&_lock);
+    LOG(ERROR) << "Failed to write block " << key;
+    return false;
+  }
+
+  SlotEntry &entry = _table[slot];
+  entry.keyhash = hash;
+  entry.length = len;
+  entry.checksum = crc;
+  entry.generation = ++_generation;
+  entry.flags = 0;
+  memcpy(entry.key, key.data(), key.size());
+  entry.keylen = key.size();
+
+  // Whatever copy is current now, perhaps written by another put while
+  // ours was in flight, is replaced.
+  int64_t old = find(key, hash);
+  if (old != -1) {
+    indexErase(old);
+    memset(&_table[old], 0, sizeof(SlotEntry));
+    _slots.release(old);
+  }
+  indexInsert(hash, slot);
+  _bloomfilter.set(key);
+  pthread_mutex_unlock(&_lock);
+
+  if (_syncmode == SYNC_EVERY_WRITE) {
+    return syncAll();
+  } else if (_syncmode == SYNC_GROUP_COMMIT) {
+    return _committer->commit();
+  }
+  return true;
+}
+
+Future<IOBuffer *> SlotBlockStore::getBlock(const string &key) {
+  pthread_mutex_lock(&_lock);
+  int64_t slot = find(key, hashKey(key));
+  if (slot == -1) {
+    pthread_mutex_unlock(&_lock);
+    return NULL;
+  }
+  // If the block is replaced while it is read, the checksum won't match.
+  const uint32_t len = _table[slot].length;
+  const uint32_t checksum = _table[slot].checksum;
+  pthread_mutex_unlock(&_lock);
+  char *buf = _pool->acquire();
+  if (!buf) {
+    return NULL;
+  }
+  ssize_t r = pread(_fd, buf, len, _dataOffset + slot * _blocksize);
+  if (r != (ssize_t)len) {
+    LOG(ERROR) << "Failed to read block " << key;
+    _pool->release(buf);
+    return NULL;
+  }
+  if (util::crc32c(buf, len) != checksum) {
+    LOG(ERROR) << "Checksum mismatch on block " << key;
+    _pool->release(buf);
+    return NULL;
+  }
+  IOBuffer *ret = new IOBuffer(buf, len);
+  _pool->release(buf);
+  return ret;
+}
+
+Future<bool> SlotBlockStore::hasBlock(const string &key) {
+  pthread_mutex_lock(&_lock);
+  const bool ret = find(key, hashKey(key)) != -1;
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<bool> SlotBlockStore::removeBlock(const string &key) {
+  pthread_mutex_lock(&_lock);
+  int64_t slot = find(key, hashKey(key));
+  if (slot != -1) {
+    freeSlot(slot);
+  }
+  pthread_mutex_unlock(&_lock);
+  return slot != -1;
+}
+
+Future<uint64_t> SlotBlockStore::numFreeBlocks() const {
+  pthread_mutex_lock(&_lock);
+  const uint64_t ret = _slots.numFree();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<uint64_t> SlotBlockStore::numTotalBlocks() const {
+  pthread_mutex_lock(&_lock);
+  const uint64_t ret = _slots.numSlots();
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+Future<BloomFilter> SlotBlockStore::bloomfilter() {
+  pthread_mutex_lock(&_lock);
+  if (_bloomStale) {
+    regenerateBloomFilter();
+  }
+  BloomFilter ret(_bloomfilter);
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+void SlotBlockStore::freeSlot(uint64_t slot) {
+  indexErase(slot);
+  memset(&_table[slot], 0, sizeof(SlotEntry));
+  _slots.release(slot);
+  _bloomStale = true;
+}
+
+Future<vector<string> > SlotBlockStore::scrub(size_t maxBlocks) {
+  vector<string> corrupt;
+  const uint64_t numSlots = _slots.numSlots();
+  pthread_mutex_lock(&_lock);
+  if (maxBlocks > _slots.numUsed()) {
+    maxBlocks = _slots.numUsed();
+  }
+  // Runs of adjacent occupied slots are read together so the checksums can
+  // be verified in bulk from one buffer. Their entries are copied so the
+  // read can happen without the lock, and a block is only removed if its
+  // slot still holds the same generation afterwards.
+  vector<char> buf(kScrubBatch * _blocksize);
+  vector<SlotEntry> entries(kScrubBatch);
+  size_t checked = 0;
+  // Slots claimed by puts in flight count as used but have no entry yet,
+  // so the scan also stops after one full pass.
+  uint64_t scanned = 0;
+  while (checked < maxBlocks && scanned < numSlots) {
+    if (_scrubSlot >= numSlots) {
+      _scrubSlot = 0;
+    }
+    if (!_table[_scrubSlot].keylen) {
+      _scrubSlot++;
+      scanned++;
+      continue;
+    }
+    const uint64_t first = _scrubSlot;
+    uint64_t n = 0;
+    do {
+      entries[n] = _table[first + n];
+      n++;
+    } while (n < kScrubBatch && checked + n < maxBlocks &&
+             first + n < numSlots && _table[first + n].keylen);
+    checked += n;
+    scanned += n;
+    _scrubSlot += n;
+    pthread_mutex_unlock(&_lock);
+
+    ssize_t r = pread(_fd, &buf[0], n * _blocksize,
+                      _dataOffset + first * _blocksize);
+    vector<uint64_t> bad;
+    for (uint64_t i = 0; i < n; i++) {
+      const size_t offset = i * _blocksize;
+      if (r < (ssize_t)(offset + entries[i].length) ||
+          util::crc32c(&buf[offset], entries[i].length) !=
+          entries[i].checksum) {
+        bad.push_back(i);
+      }
+    }
+
+    pthread_mutex_lock(&_lock);
+    for (size_t j = 0; j < bad.size(); j++) {
+      const SlotEntry &entry = entries[bad[j]];
+      const uint64_t slot = first + bad[j];
+      if (_table[slot].keylen && _table[slot].generation == entry.generation) {
+        const string key(entry.key, entry.keylen);
+        LOG(WARNING) << "Scrub removing corrupt block " << key;
+        corrupt.push_back(key);
+        freeSlot(slot);
+      }
+    }
+    if (maxBlocks > _slots.numUsed()) {
+      maxBlocks = _slots.numUsed();
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  return corrupt;
+}
+
+string SlotBlockStore::next() {
+  pthread_mutex_lock(&_lock);
+  for (; _cursor < _slots.numSlots(); _cursor++) {
+    if (_table[_cursor].keylen) {
+      const SlotEntry &entry = _table[_cursor++];
+      const string ret(entry.key, entry.keylen);
+      pthread_mutex_unlock(&_lock);
+      return ret;
+    }
+  }
+  _cursor = 0;
+  pthread_mutex_unlock(&_lock);
+  return "";
+}
+
+void SlotBlockStore::regenerateBloomFilter() {
+  _bloomStale = false;
+  _bloomfilter.reset();
+  for (uint64_t slot = 0; slot < _slots.numSlots(); slot++) {
+    if (_table[slot].keylen) {
+      _bloomfilter.set(string(_table[slot].key, _table[slot].keylen));
+    }
+  }
+}
+}
@@ -0,0 +1,242 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _BLOCKSTORE_SLOTBLOCKSTORE_H_
+#define _BLOCKSTORE_SLOTBLOCKSTORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <tr1/functional>
+#include <tr1/memory>
+#include <vector>
+
+#include "blockstore/blockstore.h"
+#include "blockstore/groupcommit.h"
+#include "util/bloomfilter.h"
+#include "util/bufferpool.h"
+#include "util/slotallocator.h"
+
+namespace blockstore {
+
+using std::string;
+using std::tr1::bind;
+using std::tr1::shared_ptr;
+using std::vector;
+using util::BloomFilter;
+using util::BufferPool;
+using util::SlotAllocator;
+
+/**
+ * Stores fixed size blocks in a single preallocated file divided into
+ * block sized slots. Per-slot metadata (key, key hash, length, checksum and
+ * generation) lives in a slot table at the front of the file which is
+ * mmap'd, so a put or get is one positioned read or write of the block
+ * data plus a memory update; no filesystem metadata is touched.
+ *
+ * Free slots are tracked with a SlotAllocator bitmap and keys are located
+ * through an in-memory open addressing index over the slot table. Both are
+ * rebuilt from the table on startup. Block data is checksummed with CRC32C
+ * and verified on every read.
+ *
+ * The store may be used from several threads at once. A put claims its
+ * slot under a lock, writes the data without it and then publishes the
+ * table entry, so only the in-memory metadata is serialized.
+ *
+ * File layout:
+ *   [header, 4KiB][slot table, numSlots * 128 bytes, 4KiB aligned][data]
+ */
+class SlotBlockStore : public BlockStore {
+ public:
+  /**
+   * Longest key that can be stored.
+   */
+  static const size_t kMaxKeyLength = 104;
+
+  /**
+   * Opens or creates a slot file. An existing file must have been created
+   * with the same blocksize and capacity; if not, the store is left with no
+   * capacity and every operation fails.
+   */
+  SlotBlockStore(const string &filename, int blocksize=65536,
+                 uint64_t capacity=kDefaultBlockStoreSize);
+  virtual ~SlotBlockStore();
+
+  /**
+   * Attempts to write a block to the block store.
+   */
+  virtual Future<bool> putBlock(const string &key, IOBuffer *data);
+
+  /**
+   * Attempts to read a block from the block store.
+   */
+  virtual Future<IOBuffer *> getBlock(const string &key);
+
+  /**
+   * Removes a previously stored block.
+   */
+  virtual Future<bool> removeBlock(const string &key);
+
+  /**
+   * Checks the slot index for a block.
+   */
+  virtual Future<bool> hasBlock(const string &key);
+
+  /**
+   * Returns the size of a block in bytes.
+   */
+  virtual Future<uint64_t> blockSize() const {
+    return Future<uint64_t>(_blocksize);
+  }
+
+  /**
+   * Gets the free block availability of this device.
+   */
+  virtual Future<uint64_t> numFreeBlocks() const;
+
+  /**
+   * Gets the total number of blocks of storage in this device.
+   */
+  virtual Future<uint64_t> numTotalBlocks() const;
+
+  /**
+   * Get a bloomfilter that remote hosts can use to try to determine if
+   * we have a block or not before requesting it from us.
+   */
+  virtual Future<BloomFilter> bloomfilter();
+
+  /**
+   * Verifies the checksums of up to maxBlocks blocks, removing any that
+   * are corrupt.
+   */
+  virtual Future<vector<string> > scrub(size_t maxBlocks);
+
+  /**
+   * Selects how durable a block is when putBlock() resolves. Syncing
+   * flushes both the block data and the slot table.
+   * Must not be called while puts are in flight.
+   */
+  void setSyncMode(SyncMode mode, int maxBatch = 64, double window = 0.002);
+  SyncMode syncMode() const { return _syncmode; }
+
+  /**
+   * Iterates through blocks in the store, returning one key at a time.
+   * Returns an empty string when complete and auto-resets.
+   */
+  virtual string next();
+
+ private:
+  /**
+   * One entry of the on-disk slot table. A slot is free when keylen is 0.
+   */
+  struct SlotEntry {
+    uint64_t keyhash;
+    uint32_t length;
+    uint32_t checksum;
+    uint32_t generation;
+    uint16_t keylen;
+    uint16_t flags;
+    char key[kMaxKeyLength];
+  };
+
+  /**
+   * On-disk header occupying the first page of the file.
+   */
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t blocksize;
+    uint64_t numSlots;
+    uint64_t tableOffset;
+    uint64_t dataOffset;
+  };
+
+  SlotBlockStore(const SlotBlockStore &);
+  SlotBlockStore &operator=(const SlotBlockStore &);
+
+  /**
+   * Creates or validates the file and maps the slot table.
+   */
+  bool open(const string &filename, uint64_t numSlots);
+
+  /**
+   * Rebuilds the allocator, index and bloom filter from the slot table.
+   */
+  void load();
+
+  /**
+   * Returns the slot holding key or -1 if it isn't present.
+   */
+  int64_t find(const string &key, uint64_t hash) const;
+
+  void indexInsert(uint64_t hash, uint64_t slot);
+  void indexErase(uint64_t slot);
+
+  /**
+   * Clears a slot's entry and returns it to the allocator. Must be called
+   * with _lock held.
+   */
+  void freeSlot(uint64_t slot);
+
+  /**
+   * Rebuilds the bloom filter from the slot table. Removing a key can't
+   * clear its bits, so removals only mark the filter stale and it is
+   * rebuilt once when next asked for. Until then removed keys are merely
+   * false positives.
+   */
+  void regenerateBloomFilter();
+
+  /**
+   * Flushes block data and the slot table to disk.
+   */
+  bool syncAll();
+
+  int _fd;
+  int _blocksize;
+  SyncMode _syncmode;
+  shared_ptr<GroupCommitter> _committer;
+  BufferPool *_pool;
+  uint64_t _dataOffset;
+  uint32_t _generation;
+  uint64_t _cursor;
+  uint64_t _scrubSlot;
+
+  // Guards the slot table, allocator, index, bloom filter and cursors.
+  // Block data is read and written without it.
+  mutable pthread_mutex_t _lock;
+  SlotEntry *_table;
+  size_t _tableBytes;
+  SlotAllocator _slots;
+  vector<uint32_t> _index;  // Slot number + 1, or 0 if empty.
+  uint64_t _indexMask;
+  BloomFilter _bloomfilter;
+  bool _bloomStale;
+};
+}
+#endif
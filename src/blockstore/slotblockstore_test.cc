@@ -0,0 +1,242 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slotblockstore.h"
+
+#include <gtest/gtest.h>
+
+#include <epoll_threadpool/iobuffer.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using epoll_threadpool::IOBuffer;
+using std::set;
+using std::string;
+using std::vector;
+
+TEST(SlotBlockStoreTest, BasicTests) {
+  unlink("/tmp/slots1");
+
+  char buf1[16];
+  IOBuffer *buf;
+  memset(buf1, 0, sizeof(buf1));
+  blockstore::SlotBlockStore bs1("/tmp/slots1", 16, 16 * 1024);
+  EXPECT_EQ(1024, bs1.numTotalBlocks().get());
+  EXPECT_EQ(1024, bs1.numFreeBlocks().get());
+
+  EXPECT_TRUE(bs1.getBlock("apple").get() == NULL);
+  strcpy(buf1, "apple");
+  EXPECT_TRUE(bs1.putBlock("apple", new IOBuffer(buf1, 16)));
+  strcpy(buf1, "banana");
+  EXPECT_TRUE(bs1.putBlock("banana", new IOBuffer(buf1, 7)));
+  EXPECT_EQ(1022, bs1.numFreeBlocks().get());
+
+  buf = bs1.getBlock("banana");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(7, buf->size());
+  EXPECT_STREQ("banana", (char *)buf->pulldown(buf->size()));
+  delete buf;
+
+  // Overwrites move the block but don't use more space.
+  strcpy(buf1, "apricot");
+  EXPECT_TRUE(bs1.putBlock("apple", new IOBuffer(buf1, 16)));
+  EXPECT_EQ(1022, bs1.numFreeBlocks().get());
+  buf = bs1.getBlock("apple");
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_STREQ("apricot", (char *)buf->pulldown(buf->size()));
+  delete buf;
+
+  set<string> expected_blocks;
+  expected_blocks.insert("apple");
+  expected_blocks.insert("banana");
+  string key;
+  while ((key = bs1.next()) != "") {
+    EXPECT_TRUE(expected_blocks.find(key) != expected_blocks.end());
+    expected_blocks.erase(key);
+  }
+  EXPECT_EQ(0, expected_blocks.size());
+
+  EXPECT_TRUE(bs1.bloomfilter().get().mayContain("banana"));
+  EXPECT_FALSE(bs1.bloomfilter().get().mayContain("carrot"));
+  EXPECT_TRUE(bs1.hasBlock("banana"));
+  EXPECT_FALSE(bs1.hasBlock("carrot"));
+
+  EXPECT_TRUE(bs1.removeBlock("apple"));
+  EXPECT_FALSE(bs1.removeBlock("apple"));
+  EXPECT_FALSE(bs1.hasBlock("apple"));
+  EXPECT_TRUE(bs1.getBlock("apple").get() == NULL);
+  EXPECT_FALSE(bs1.bloomfilter().get().mayContain("apple"));
+  EXPECT_EQ(1023, bs1.numFreeBlocks().get());
+
+  // Keys that don't fit in a slot entry are rejected.
+  EXPECT_FALSE(bs1.putBlock(string(200, 'k'), new IOBuffer(buf1, 16)));
+  unlink("/tmp/slots1");
+}
+
+TEST(SlotBlockStoreTest, Reopen) {
+  unlink("/tmp/slots2");
+  char buf1[16];
+  memset(buf1, 0, sizeof(buf1));
+  {
+    blockstore::SlotBlockStore bs("/tmp/slots2", 16, 16 * 64);
+    bs.setSyncMode(blockstore::SYNC_GROUP_COMMIT);
+    for (int i = 0; i < 64; i++) {
+      snprintf(buf1, sizeof(buf1), "block%d", i);
+      EXPECT_TRUE(bs.putBlock(buf1, new IOBuffer(buf1, 16)).get());
+    }
+    EXPECT_EQ(0, bs.numFreeBlocks().get());
+    EXPECT_FALSE(bs.putBlock("full", new IOBuffer(buf1, 16)));
+    // Overwrites still succeed when full.
+    snprintf(buf1, sizeof(buf1), "block1");
+    EXPECT_TRUE(bs.putBlock(buf1, new IOBuffer(buf1, 16)).get());
+    for (int i = 0; i < 64; i += 2) {
+      snprintf(buf1, sizeof(buf1), "block%d", i);
+      EXPECT_TRUE(bs.removeBlock(buf1));
+    }
+  }
+
+  blockstore::SlotBlockStore bs("/tmp/slots2", 16, 16 * 64);
+  EXPECT_EQ(64, bs.numTotalBlocks().get());
+  EXPECT_EQ(32, bs.numFreeBlocks().get());
+  for (int i = 0; i < 64; i++) {
+    snprintf(buf1, sizeof(buf1), "block%d", i);
+    IOBuffer *buf = bs.getBlock(buf1);
+    if (i % 2) {
+      ASSERT_TRUE(buf != NULL);
+      EXPECT_STREQ(buf1, (char *)buf->pulldown(buf->size()));
+      delete buf;
+    } else {
+      EXPECT_TRUE(buf == NULL);
+    }
+  }
+
+  // A store with different geometry refuses to open the file.
+  blockstore::SlotBlockStore other("/tmp/slots2", 32, 16 * 64);
+  EXPECT_EQ(0, other.numTotalBlocks().get());
+  EXPECT_FALSE(other.putBlock("x", new IOBuffer(buf1, 16)));
+  unlink("/tmp/slots2");
+}
+
+TEST(SlotBlockStoreTest, Checksums) {
+  unlink("/tmp/slots4");
+  char buf1[16];
+  memset(buf1, 0, sizeof(buf1));
+  blockstore::SlotBlockStore bs("/tmp/slots4", 16, 16 * 64);
+  for (int i = 0; i < 40; i++) {
+    snprintf(buf1, sizeof(buf1), "block%d", i);
+    EXPECT_TRUE(bs.putBlock(buf1, new IOBuffer(buf1, 16)));
+  }
+  EXPECT_EQ(0, bs.scrub(100).get().size());
+
+  // Corrupt one block's data directly in the file. Data follows the slot
+  // table so the last copy of the key is the block itself.
+  FILE *f = fopen("/tmp/slots4", "r+");
+  ASSERT_TRUE(f != NULL);
+  string contents;
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    contents += (char)c;
+  }
+  size_t pos = contents.rfind(string("block17", 8));
+  ASSERT_NE(string::npos, pos);
+  fseek(f, pos, SEEK_SET);
+  fputc('B', f);
+  fclose(f);
+
+  EXPECT_TRUE(bs.getBlock("block17").get() == NULL);
+  vector<string> corrupt = bs.scrub(40);
+  ASSERT_EQ(1, corrupt.size());
+  EXPECT_EQ("block17", corrupt[0]);
+  EXPECT_EQ(25, bs.numFreeBlocks().get());
+  unlink("/tmp/slots4");
+}
+
+TEST(SlotBlockStoreTest, Batches) {
+  unlink("/tmp/slots5");
+  blockstore::SlotBlockStore bs("/tmp/slots5", 16, 16 * 64);
+  char buf1[16];
+  vector<string> keys;
+  vector<IOBuffer *> data;
+  for (int i = 0; i < 8; i++) {
+    memset(buf1, 0, sizeof(buf1));
+    snprintf(buf1, sizeof(buf1), "key%d", i);
+    keys.push_back(buf1);
+    data.push_back(new IOBuffer(buf1, 16));
+  }
+  vector<bool> ok = bs.putBlocks(keys, data);
+  ASSERT_EQ(8, ok.size());
+  EXPECT_EQ(8, std::count(ok.begin(), ok.end(), true));
+
+  keys.push_back("missing");
+  vector<IOBuffer *> blocks = bs.getBlocks(keys);
+  ASSERT_EQ(9, blocks.size());
+  EXPECT_TRUE(blocks[8] == NULL);
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(blocks[i] != NULL);
+    EXPECT_STREQ(keys[i].c_str(), (char *)blocks[i]->pulldown(16));
+    delete blocks[i];
+  }
+  unlink("/tmp/slots5");
+}
+
+TEST(SlotBlockStoreTest, Churn) {
+  unlink("/tmp/slots3");
+  blockstore::SlotBlockStore bs("/tmp/slots3", 16, 16 * 256);
+  set<string> present;
+  char buf1[16];
+  srand(1);
+  for (int i = 0; i < 5000; i++) {
+    memset(buf1, 0, sizeof(buf1));
+    snprintf(buf1, sizeof(buf1), "k%d", rand() % 300);
+    if (rand() % 3 == 0) {
+      EXPECT_EQ(present.erase(buf1) == 1, bs.removeBlock(buf1).get());
+    } else if (present.size() < 256 || present.count(buf1)) {
+      EXPECT_TRUE(bs.putBlock(buf1, new IOBuffer(buf1, 16)).get());
+      present.insert(buf1);
+    }
+  }
+  EXPECT_EQ(256 - present.size(), bs.numFreeBlocks().get());
+  for (int i = 0; i < 300; i++) {
+    snprintf(buf1, sizeof(buf1), "k%d", i);
+    IOBuffer *buf = bs.getBlock(buf1);
+    EXPECT_EQ(present.count(buf1) == 1, buf != NULL);
+    if (buf) {
+      EXPECT_STREQ(buf1, (char *)buf->pulldown(buf->size()));
+      delete buf;
+    }
+  }
+  unlink("/tmp/slots3");
+}
@@ -0,0 +1,107 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "gf256.h"
+#include "reedsolomon.h"
+
+#include <gtest/gtest.h>
+#include <glog/logging.h>
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <vector>
+
+using coding::ReedSolomon;
+using std::vector;
+
+namespace gf256 = coding::gf256;
+
+namespace {
+
+const int kDataBlocks = 10;
+const int kParityBlocks = 4;
+const size_t kBlockSize = 65536;
+const int kIterations = 200;
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Encodes kIterations stripes, then decodes as many with the maximum number
+ * of data blocks lost. Reports throughput in terms of data bytes.
+ */
+void runBenchmark(const char *name, gf256::Kernel kernel) {
+  if (!gf256::setKernel(kernel)) {
+    LOG(INFO) << name << ": not supported on this CPU";
+    return;
+  }
+  ReedSolomon rs(kDataBlocks, kParityBlocks);
+  const int total = kDataBlocks + kParityBlocks;
+  vector<uint8_t> buf(kBlockSize * total);
+  for (size_t i = 0; i < buf.size(); i++) {
+    buf[i] = rand();
+  }
+  vector<uint8_t *> blocks(total);
+  for (int i = 0; i < total; i++) {
+    blocks[i] = &buf[i * kBlockSize];
+  }
+  const double mb = kIterations * kDataBlocks * (double)kBlockSize / 1048576.0;
+
+  double start = now();
+  for (int i = 0; i < kIterations; i++) {
+    rs.encode(&blocks[0], &blocks[kDataBlocks], kBlockSize);
+  }
+  double encode = now() - start;
+
+  vector<bool> present(total, true);
+  for (int i = 0; i < kParityBlocks; i++) {
+    present[i] = false;
+  }
+  start = now();
+  for (int i = 0; i < kIterations; i++) {
+    CHECK(rs.decode(&blocks[0], present, kBlockSize));
+  }
+  double decode = now() - start;
+
+  LOG(INFO) << name << " RS(" << kDataBlocks << "," << kParityBlocks
+            << "): encode " << (mb / encode) << " MB/s, decode "
+            << (mb / decode) << " MB/s";
+}
+}  // end anonymous namespace
+
+TEST(ReedSolomon, CodingBenchmark) {
+  const gf256::Kernel original = gf256::kernel();
+  runBenchmark("scalar", gf256::KERNEL_SCALAR);
+  runBenchmark("SSSE3", gf256::KERNEL_SSSE3);
+  runBenchmark("AVX2", gf256::KERNEL_AVX2);
+  gf256::setKernel(original);
+}
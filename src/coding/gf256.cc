@@ -0,0 +1,328 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "gf256.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace coding {
+namespace gf256 {
+
+namespace {
+const unsigned kPolynomial = 0x11d;
+
+/**
+ * Log/exp tables for single element arithmetic plus, for each constant,
+ * the products with every low and high nibble used by the SIMD kernels.
+ */
+struct Tables {
+  uint8_t log[256];
+  uint8_t exp[512];
+  uint8_t lo[256][16];
+  uint8_t hi[256][16];
+
+  Tables() {
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+      exp[i] = x;
+      exp[i + 255] = x;
+      log[x] = i;
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= kPolynomial;
+      }
+    }
+    exp[510] = exp[0];
+    exp[511] = exp[1];
+    log[0] = 0;
+    for (int c = 0; c < 256; c++) {
+      for (int n = 0; n < 16; n++) {
+        lo[c][n] = slowMul(c, n);
+        hi[c][n] = slowMul(c, n << 4);
+      }
+    }
+  }
+
+  uint8_t slowMul(uint8_t a, uint8_t b) const {
+    if (!a || !b) {
+      return 0;
+    }
+    return exp[log[a] + log[b]];
+  }
+};
+const Tables kTables;
+
+void addScalar(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t d, s;
+    memcpy(&d, dst + i, 8);
+    memcpy(&s, src + i, 8);
+    d ^= s;
+    memcpy(dst + i, &d, 8);
+  }
+  for (; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const uint8_t *lo = kTables.lo[c];
+  const uint8_t *hi = kTables.hi[c];
+  for (size_t i = 0; i < len; i++) {
+    dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+  }
+}
+
+void mulScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const uint8_t *lo = kTables.lo[c];
+  const uint8_t *hi = kTables.hi[c];
+  for (size_t i = 0; i < len; i++) {
+    dst[i] = lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+  }
+}
+
+#if defined(__x86_64__)
+void addSSE2(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    for (int j = 0; j < 64; j += 16) {
+      __m128i d = _mm_loadu_si128((const __m128i *)(dst + i + j));
+      __m128i s = _mm_loadu_si128((const __m128i *)(src + i + j));
+      _mm_storeu_si128((__m128i *)(dst + i + j), _mm_xor_si128(d, s));
+    }
+  }
+  addScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+void addAVX2(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    for (int j = 0; j < 128; j += 32) {
+      __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i + j));
+      __m256i s = _mm256_loadu_si256((const __m256i *)(src + i + j));
+      _mm256_storeu_si256((__m256i *)(dst + i + j), _mm256_xor_si256(d, s));
+    }
+  }
+  addScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("ssse3")))
+void mulAddSSSE3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const __m128i lo = _mm_loadu_si128((const __m128i *)kTables.lo[c]);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)kTables.hi[c]);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+    __m128i h = _mm_shuffle_epi8(
+        hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+  mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("ssse3")))
+void mulSSSE3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const __m128i lo = _mm_loadu_si128((const __m128i *)kTables.lo[c]);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)kTables.hi[c]);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+    __m128i h = _mm_shuffle_epi8(
+        hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(l, h));
+  }
+  mulScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void mulAddAVX2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const __m256i lo = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)kTables.lo[c]));
+  const __m256i hi = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)kTables.hi[c]));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+    __m256i h = _mm256_shuffle_epi8(
+        hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+    d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+    _mm256_storeu_si256((__m256i *)(dst + i), d);
+  }
+  mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void mulAVX2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const __m256i lo = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)kTables.lo[c]));
+  const __m256i hi = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)kTables.hi[c]));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+    __m256i h = _mm256_shuffle_epi8(
+        hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(l, h));
+  }
+  mulScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+bool supported(Kernel k) {
+  switch (k) {
+    case KERNEL_SCALAR:
+      return true;
+#if defined(__x86_64__)
+    case KERNEL_SSSE3:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("ssse3");
+    case KERNEL_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+Kernel bestKernel() {
+  if (supported(KERNEL_AVX2)) {
+    return KERNEL_AVX2;
+  } else if (supported(KERNEL_SSSE3)) {
+    return KERNEL_SSSE3;
+  }
+  return KERNEL_SCALAR;
+}
+
+Kernel currentKernel = bestKernel();
+}
+
+uint8_t mul(uint8_t a, uint8_t b) {
+  return kTables.slowMul(a, b);
+}
+
+uint8_t div(uint8_t a, uint8_t b) {
+  if (!a) {
+    return 0;
+  }
+  return kTables.exp[kTables.log[a] + 255 - kTables.log[b]];
+}
+
+uint8_t inv(uint8_t a) {
+  return kTables.exp[255 - kTables.log[a]];
+}
+
+void addRegion(uint8_t *dst, const uint8_t *src, size_t len) {
+  switch (currentKernel) {
+#if defined(__x86_64__)
+    case KERNEL_AVX2:
+      addAVX2(dst, src, len);
+      break;
+    case KERNEL_SSSE3:
+      addSSE2(dst, src, len);
+      break;
+#endif
+    default:
+      addScalar(dst, src, len);
+  }
+}
+
+void mulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  } else if (c == 1) {
+    addRegion(dst, src, len);
+    return;
+  }
+  switch (currentKernel) {
+#if defined(__x86_64__)
+    case KERNEL_AVX2:
+      mulAddAVX2(dst, src, c, len);
+      break;
+    case KERNEL_SSSE3:
+      mulAddSSSE3(dst, src, c, len);
+      break;
+#endif
+    default:
+      mulAddScalar(dst, src, c, len);
+  }
+}
+
+void mulRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    memset(dst, 0, len);
+    return;
+  } else if (c == 1) {
+    memmove(dst, src, len);
+    return;
+  }
+  switch (currentKernel) {
+#if defined(__x86_64__)
+    case KERNEL_AVX2:
+      mulAVX2(dst, src, c, len);
+      break;
+    case KERNEL_SSSE3:
+      mulSSSE3(dst, src, c, len);
+      break;
+#endif
+    default:
+      mulScalar(dst, src, c, len);
+  }
+}
+
+Kernel kernel() {
+  return currentKernel;
+}
+
+bool setKernel(Kernel k) {
+  if (!supported(k)) {
+    return false;
+  }
+  currentKernel = k;
+  return true;
+}
+
+}  // namespace gf256
+}
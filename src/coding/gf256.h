@@ -0,0 +1,88 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _CODING_GF256_H_
+#define _CODING_GF256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace coding {
+
+/**
+ * Arithmetic over GF(2^8) using the polynomial x^8 + x^4 + x^3 + x^2 + 1
+ * (0x11d). Addition is XOR. Bulk region operations pick the fastest kernel
+ * the CPU supports at startup: AVX2 or SSSE3 split-nibble table lookups
+ * (vpshufb/pshufb) with a scalar fallback. addRegion() uses plain vector
+ * XORs.
+ */
+namespace gf256 {
+
+enum Kernel {
+  KERNEL_SCALAR,
+  KERNEL_SSSE3,
+  KERNEL_AVX2
+};
+
+/**
+ * Multiplies, divides and inverts single elements. div() and inv() require
+ * a non-zero divisor.
+ */
+uint8_t mul(uint8_t a, uint8_t b);
+uint8_t div(uint8_t a, uint8_t b);
+uint8_t inv(uint8_t a);
+
+/**
+ * dst[i] ^= src[i] for i in [0, len). This is addition in GF(2^8).
+ */
+void addRegion(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * dst[i] ^= c * src[i] for i in [0, len).
+ */
+void mulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/**
+ * dst[i] = c * src[i] for i in [0, len). dst and src may be equal.
+ */
+void mulRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/**
+ * Returns the kernel currently used by the region operations.
+ */
+Kernel kernel();
+
+/**
+ * Forces a particular kernel, for tests and benchmarks.
+ * @returns false (leaving the kernel unchanged) if the CPU lacks support.
+ */
+bool setKernel(Kernel k);
+
+}  // namespace gf256
+}
+#endif
@@ -0,0 +1,91 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "gf256.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <vector>
+
+using namespace coding;
+using std::vector;
+
+TEST(GF256Test, Arithmetic) {
+  EXPECT_EQ(0, gf256::mul(0, 123));
+  EXPECT_EQ(123, gf256::mul(1, 123));
+  EXPECT_EQ(0x1d, gf256::mul(0x80, 2));
+  for (int a = 1; a < 256; a++) {
+    EXPECT_EQ(1, gf256::mul(a, gf256::inv(a)));
+    for (int b = 1; b < 256; b += 7) {
+      EXPECT_EQ(gf256::mul(a, b), gf256::mul(b, a));
+      EXPECT_EQ(a, gf256::div(gf256::mul(a, b), b));
+    }
+  }
+}
+
+TEST(GF256Test, KernelsAgree) {
+  // Odd lengths exercise each kernel's scalar tail.
+  const size_t len = 1000 + 27;
+  vector<uint8_t> src(len), expected(len), dst(len);
+  for (size_t i = 0; i < len; i++) {
+    src[i] = rand();
+    expected[i] = rand();
+  }
+  const uint8_t c = 0xa7;
+  vector<uint8_t> base = expected;
+  for (size_t i = 0; i < len; i++) {
+    expected[i] ^= gf256::mul(c, src[i]);
+  }
+
+  const gf256::Kernel original = gf256::kernel();
+  const gf256::Kernel kernels[] = {
+    gf256::KERNEL_SCALAR, gf256::KERNEL_SSSE3, gf256::KERNEL_AVX2
+  };
+  for (int k = 0; k < 3; k++) {
+    if (!gf256::setKernel(kernels[k])) {
+      continue;
+    }
+    dst = base;
+    gf256::mulAddRegion(&dst[0], &src[0], c, len);
+    EXPECT_TRUE(dst == expected) << "kernel " << k;
+
+    dst = base;
+    gf256::addRegion(&dst[0], &src[0], len);
+    for (size_t i = 0; i < len; i++) {
+      ASSERT_EQ(base[i] ^ src[i], dst[i]) << "kernel " << k;
+    }
+
+    gf256::mulRegion(&dst[0], &src[0], c, len);
+    for (size_t i = 0; i < len; i++) {
+      ASSERT_EQ(gf256::mul(c, src[i]), dst[i]) << "kernel " << k;
+    }
+  }
+  gf256::setKernel(original);
+}
@@ -0,0 +1,318 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "lt.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "coding/gf256.h"
+
+namespace coding {
+
+namespace {
+// Bytes of object length stored at the front of the first source block.
+const size_t kLengthSize = 8;
+// Bytes of header in front of each encoded object block.
+const size_t kHeaderSize = 16;
+// Most distinct unconfirmed headers an LTObjectDecoder holds on to.
+const size_t kMaxUnconfirmed = 8;
+
+/**
+ * splitmix64, used to derive each encoded block's neighbours.
+ */
+uint64_t nextRandom(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void putLE32(char *buf, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = v >> (8 * i);
+  }
+}
+
+uint32_t getLE32(const char *buf) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)(uint8_t)buf[i] << (8 * i);
+  }
+  return v;
+}
+}
+
+LTCode::LTCode(int k, uint32_t seed, double c, double delta)
+    : _k(k), _seed(seed), _cdf(k) {
+  CHECK(k > 0);
+  // Robust soliton distribution: the ideal soliton rho plus a boost tau
+  // for low degrees and a spike at k/R so the peeling process rarely
+  // stalls.
+  const double R = std::max(1.0, c * log(k / delta) * sqrt((double)k));
+  const int spike = std::min(k, std::max(1, (int)(k / R)));
+  vector<double> mu(k + 1, 0.0);
+  double total = 0;
+  for (int d = 1; d <= k; d++) {
+    double rho = d == 1 ? 1.0 / k : 1.0 / ((double)d * (d - 1));
+    double tau = 0;
+    if (d < spike) {
+      tau = R / ((double)d * k);
+    } else if (d == spike) {
+      tau = R * log(R / delta) / k;
+    }
+    mu[d] = rho + std::max(0.0, tau);
+    total += mu[d];
+  }
+  double sum = 0;
+  for (int d = 1; d <= k; d++) {
+    sum += mu[d] / total;
+    _cdf[d - 1] = sum;
+  }
+  _cdf[k - 1] = 1.0;
+}
+
+void LTCode::neighbours(uint32_t id, vector<int> *out) const {
+  uint64_t state = ((uint64_t)_seed << 32) | id;
+  nextRandom(&state);
+  double u = (nextRandom(&state) >> 11) * (1.0 / 9007199254740992.0);
+  int degree = std::lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin() + 1;
+  degree = std::min(degree, _k);
+
+  out->clear();
+  while ((int)out->size() < degree) {
+    while ((int)out->size() < degree) {
+      out->push_back(nextRandom(&state) % _k);
+    }
+    std::sort(out->begin(), out->end());
+    out->erase(std::unique(out->begin(), out->end()), out->end());
+  }
+}
+
+LTEncoder::LTEncoder(const LTCode &code, const uint8_t * const *source,
+                     size_t blockSize)
+    : _code(code), _source(source), _blockSize(blockSize) {
+}
+
+void LTEncoder::encode(uint32_t id, uint8_t *out) const {
+  vector<int> n;
+  _code.neighbours(id, &n);
+  memcpy(out, _source[n[0]], _blockSize);
+  for (size_t i = 1; i < n.size(); i++) {
+    gf256::addRegion(out, _source[n[i]], _blockSize);
+  }
+}
+
+LTDecoder::LTDecoder(const LTCode &code, size_t blockSize)
+    : _code(code), _blockSize(blockSize), _numRecovered(0),
+      _source(code.sourceBlocks() * blockSize),
+      _recovered(code.sourceBlocks(), false),
+      _waiting(code.sourceBlocks()) {
+}
+
+bool LTDecoder::add(uint32_t id, const uint8_t *data) {
+  if (done() || !_seen.insert(id).second) {
+    return done();
+  }
+  vector<int> n;
+  _code.neighbours(id, &n);
+
+  // Strip out everything we already know.
+  Pending p;
+  p.data.assign(data, data + _blockSize);
+  for (size_t i = 0; i < n.size(); i++) {
+    if (_recovered[n[i]]) {
+      gf256::addRegion(&p.data[0], block(n[i]), _blockSize);
+    } else {
+      p.neighbours.push_back(n[i]);
+    }
+  }
+
+  if (p.neighbours.size() == 1) {
+    recover(p.neighbours[0], &p.data[0]);
+  } else if (p.neighbours.size() > 1) {
+    for (size_t i = 0; i < p.neighbours.size(); i++) {
+      _waiting[p.neighbours[i]].push_back(_pending.size());
+    }
+    _pending.push_back(p);
+  }
+  return done();
+}
+
+void LTDecoder::recover(int index, const uint8_t *data) {
+  memcpy(&_source[index * _blockSize], data, _blockSize);
+  _recovered[index] = true;
+  _numRecovered++;
+
+  // Peel: each newly recovered block is XORed out of the pending blocks
+  // that contain it, which may leave them with a single unknown.
+  vector<int> queue(1, index);
+  while (!queue.empty()) {
+    const int s = queue.back();
+    queue.pop_back();
+    vector<int> waiting;
+    waiting.swap(_waiting[s]);
+    for (size_t i = 0; i < waiting.size(); i++) {
+      Pending &p = _pending[waiting[i]];
+      vector<int>::iterator it =
+          std::find(p.neighbours.begin(), p.neighbours.end(), s);
+      if (it == p.neighbours.end()) {
+        continue;
+      }
+      p.neighbours.erase(it);
+      gf256::addRegion(&p.data[0], block(s), _blockSize);
+      if (p.neighbours.size() == 1 && !_recovered[p.neighbours[0]]) {
+        const int t = p.neighbours[0];
+        memcpy(&_source[t * _blockSize], &p.data[0], _blockSize);
+        _recovered[t] = true;
+        _numRecovered++;
+        queue.push_back(t);
+        p.neighbours.clear();
+      }
+      if (p.neighbours.size() <= 1) {
+        // Nothing more to learn from this block.
+        p.neighbours.clear();
+        vector<uint8_t>().swap(p.data);
+      }
+    }
+  }
+}
+
+vector<string> ltEncodeObject(const string &object, size_t symbolSize,
+                              double overhead, uint32_t seed) {
+  const size_t total = object.size() + kLengthSize;
+  const int k = (total + symbolSize - 1) / symbolSize;
+  vector<uint8_t> buf(k * symbolSize, 0);
+  for (size_t i = 0; i < kLengthSize; i++) {
+    buf[i] = (uint64_t)object.size() >> (8 * i);
+  }
+  if (object.size()) {
+    memcpy(&buf[kLengthSize], object.data(), object.size());
+  }
+  vector<const uint8_t *> source(k);
+  for (int i = 0; i < k; i++) {
+    source[i] = &buf[i * symbolSize];
+  }
+
+  LTCode code(k, seed);
+  LTEncoder encoder(code, &source[0], symbolSize);
+  const int n = std::max(2, (int)ceil(k * (1.0 + overhead)));
+  vector<string> ret(n);
+  vector<uint8_t> block(kHeaderSize + symbolSize);
+  for (int id = 0; id < n; id++) {
+    putLE32((char *)&block[0], k);
+    putLE32((char *)&block[4], seed);
+    putLE32((char *)&block[8], id);
+    putLE32((char *)&block[12], symbolSize);
+    encoder.encode(id, &block[kHeaderSize]);
+    ret[id].assign((const char *)&block[0], block.size());
+  }
+  return ret;
+}
+
+LTObjectDecoder::LTObjectDecoder(uint32_t maxSourceBlocks)
+    : _maxSourceBlocks(maxSourceBlocks), _decoder(NULL), _k(0), _seed(0),
+      _symbolSize(0) {
+}
+
+LTObjectDecoder::~LTObjectDecoder() {
+  delete _decoder;
+}
+
+bool LTObjectDecoder::add(const char *data, size_t len) {
+  if (len < kHeaderSize) {
+    return false;
+  }
+  const uint32_t k = getLE32(data);
+  const uint32_t seed = getLE32(data + 4);
+  const uint32_t id = getLE32(data + 8);
+  const uint32_t symbolSize = getLE32(data + 12);
+  if (k == 0 || k > _maxSourceBlocks || symbolSize == 0 ||
+      len != kHeaderSize + symbolSize) {
+    return false;
+  }
+  if (_decoder) {
+    if (k != _k || seed != _seed || symbolSize != _symbolSize) {
+      return false;
+    }
+    _decoder->add(id, (const uint8_t *)data + kHeaderSize);
+    return true;
+  }
+
+  const string header = string(data, 8) + string(data + 12, 4);
+  map<string, string>::iterator first = _unconfirmed.find(header);
+  if (first == _unconfirmed.end()) {
+    if (_unconfirmed.size() >= kMaxUnconfirmed) {
+      return false;
+    }
+    _unconfirmed[header].assign(data, len);
+    return true;
+  }
+  if (getLE32(first->second.data() + 8) == id) {
+    // The same block twice confirms nothing.
+    return true;
+  }
+  _k = k;
+  _seed = seed;
+  _symbolSize = symbolSize;
+  _decoder = new LTDecoder(LTCode(k, seed), symbolSize);
+  _decoder->add(getLE32(first->second.data() + 8),
+                (const uint8_t *)first->second.data() + kHeaderSize);
+  _decoder->add(id, (const uint8_t *)data + kHeaderSize);
+  _unconfirmed.clear();
+  return true;
+}
+
+bool LTObjectDecoder::done() const {
+  return _decoder && _decoder->done();
+}
+
+bool LTObjectDecoder::object(string *out) const {
+  if (!done()) {
+    return false;
+  }
+  vector<uint8_t> buf(_k * _symbolSize);
+  for (uint32_t i = 0; i < _k; i++) {
+    memcpy(&buf[i * _symbolSize], _decoder->block(i), _symbolSize);
+  }
+  uint64_t size = 0;
+  for (size_t i = 0; i < kLengthSize; i++) {
+    size |= (uint64_t)buf[i] << (8 * i);
+  }
+  if (size > buf.size() - kLengthSize) {
+    LOG(ERROR) << "Decoded object has an invalid length.";
+    return false;
+  }
+  out->assign((const char *)&buf[kLengthSize], size);
+  return true;
+}
+}
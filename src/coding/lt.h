@@ -0,0 +1,190 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _CODING_LT_H_
+#define _CODING_LT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace coding {
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+/**
+ * Parameters shared by the encoder and decoder of a Luby Transform
+ * (fountain) code over k source blocks. Encoded block 'id' is the XOR of a
+ * set of source blocks chosen pseudo-randomly from (seed, id) with a degree
+ * drawn from the robust soliton distribution, so any number of encoded
+ * blocks can be generated and the decoder needs only their ids. Roughly
+ * k * (1 + epsilon) encoded blocks, for a small epsilon, are needed to
+ * decode.
+ */
+class LTCode {
+ public:
+  LTCode(int k, uint32_t seed, double c = 0.03, double delta = 0.5);
+
+  int sourceBlocks() const { return _k; }
+  uint32_t seed() const { return _seed; }
+
+  /**
+   * Fills out with the distinct source block indices encoded block id is
+   * made from.
+   */
+  void neighbours(uint32_t id, vector<int> *out) const;
+
+ private:
+  int _k;
+  uint32_t _seed;
+  vector<double> _cdf;  // _cdf[d - 1] = P(degree <= d)
+};
+
+/**
+ * Produces encoded blocks from k source blocks of blockSize bytes.
+ */
+class LTEncoder {
+ public:
+  LTEncoder(const LTCode &code, const uint8_t * const *source,
+            size_t blockSize);
+
+  /**
+   * Writes encoded block id to out, which must hold blockSize bytes.
+   */
+  void encode(uint32_t id, uint8_t *out) const;
+
+ private:
+  LTCode _code;
+  const uint8_t * const *_source;
+  size_t _blockSize;
+};
+
+/**
+ * Streaming peeling decoder. Encoded blocks may be added in any order as
+ * they arrive; each one is reduced against the source blocks already
+ * recovered and any block left with a single unknown neighbour releases
+ * it, which in turn may release others. Decoding finishes as soon as
+ * enough blocks have arrived, whichever ones they are.
+ */
+class LTDecoder {
+ public:
+  LTDecoder(const LTCode &code, size_t blockSize);
+
+  /**
+   * Adds encoded block id. Duplicate and redundant blocks are ignored.
+   * @returns true once every source block has been recovered.
+   */
+  bool add(uint32_t id, const uint8_t *data);
+
+  bool done() const { return _numRecovered == _code.sourceBlocks(); }
+  int numRecovered() const { return _numRecovered; }
+
+  /**
+   * Returns source block i, valid once it has been recovered.
+   */
+  const uint8_t *block(int i) const { return &_source[i * _blockSize]; }
+
+ private:
+  struct Pending {
+    vector<uint8_t> data;
+    vector<int> neighbours;  // Unrecovered source blocks still XORed in.
+  };
+
+  void recover(int index, const uint8_t *data);
+
+  LTCode _code;
+  size_t _blockSize;
+  int _numRecovered;
+  vector<uint8_t> _source;
+  vector<bool> _recovered;
+  set<uint32_t> _seen;
+  vector<Pending> _pending;
+  vector< vector<int> > _waiting;  // Source block -> indices into _pending.
+};
+
+/**
+ * Splits an object into fountain coded blocks, each a 16 byte header
+ * followed by symbolSize bytes. The header identifies the code so a
+ * decoder can be set up from whichever blocks arrive first. At least two
+ * blocks are generated so a decoder can confirm the header.
+ * @param overhead the fraction of extra blocks to generate beyond the
+ *        number of source blocks.
+ */
+vector<string> ltEncodeObject(const string &object, size_t symbolSize,
+                              double overhead, uint32_t seed);
+
+/**
+ * Incrementally decodes an object produced by ltEncodeObject(). The code
+ * parameters in a block header aren't trusted until a second block agrees
+ * with them, so one corrupt block can neither set up a decoder that
+ * rejects every good block nor make it allocate a huge buffer.
+ */
+class LTObjectDecoder {
+ public:
+  /**
+   * @param maxSourceBlocks blocks claiming more source blocks than this
+   *        are rejected. An object stored as n blocks has at most n.
+   */
+  explicit LTObjectDecoder(uint32_t maxSourceBlocks = 1 << 16);
+  ~LTObjectDecoder();
+
+  /**
+   * Adds one encoded block.
+   * @returns false if the block is malformed or belongs to another object.
+   */
+  bool add(const char *data, size_t len);
+
+  bool done() const;
+
+  /**
+   * Retrieves the decoded object once done() is true.
+   */
+  bool object(string *out) const;
+
+ private:
+  LTObjectDecoder(const LTObjectDecoder &);
+  LTObjectDecoder &operator=(const LTObjectDecoder &);
+
+  uint32_t _maxSourceBlocks;
+  // Blocks whose header no other block has confirmed yet, by header with
+  // the block id left out.
+  map<string, string> _unconfirmed;
+  LTDecoder *_decoder;
+  uint32_t _k;
+  uint32_t _seed;
+  uint32_t _symbolSize;
+};
+}
+#endif
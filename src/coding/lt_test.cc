@@ -0,0 +1,163 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "lt.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using coding::LTCode;
+using coding::LTDecoder;
+using coding::LTEncoder;
+using coding::LTObjectDecoder;
+using coding::ltEncodeObject;
+using std::string;
+using std::vector;
+
+TEST(LTTest, Neighbours) {
+  LTCode code(100, 1234);
+  LTCode same(100, 1234);
+  for (uint32_t id = 0; id < 1000; id++) {
+    vector<int> a, b;
+    code.neighbours(id, &a);
+    same.neighbours(id, &b);
+    ASSERT_EQ(a, b);
+    ASSERT_FALSE(a.empty());
+    for (size_t i = 0; i < a.size(); i++) {
+      ASSERT_GE(a[i], 0);
+      ASSERT_LT(a[i], 100);
+      if (i > 0) {
+        ASSERT_LT(a[i - 1], a[i]);
+      }
+    }
+  }
+}
+
+TEST(LTTest, StreamingDecode) {
+  const size_t blockSize = 256;
+  const int ks[] = { 1, 2, 10, 100, 500 };
+  for (size_t t = 0; t < sizeof(ks) / sizeof(ks[0]); t++) {
+    const int k = ks[t];
+    srand(k);
+    vector<uint8_t> data(k * blockSize);
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = rand();
+    }
+    vector<const uint8_t *> source(k);
+    for (int i = 0; i < k; i++) {
+      source[i] = &data[i * blockSize];
+    }
+    LTCode code(k, 42 + k);
+    LTEncoder encoder(code, &source[0], blockSize);
+
+    // Feed blocks from a shuffled stream until the decoder finishes.
+    vector<uint32_t> ids;
+    for (uint32_t id = 0; id < (uint32_t)k * 3 + 20; id++) {
+      ids.push_back(id);
+    }
+    std::random_shuffle(ids.begin(), ids.end());
+    LTDecoder decoder(code, blockSize);
+    vector<uint8_t> block(blockSize);
+    size_t used = 0;
+    while (!decoder.done() && used < ids.size()) {
+      encoder.encode(ids[used], &block[0]);
+      decoder.add(ids[used], &block[0]);
+      used++;
+    }
+    ASSERT_TRUE(decoder.done()) << "k=" << k;
+    if (k >= 100) {
+      EXPECT_LT(used, k * 1.5) << "k=" << k;
+    }
+    for (int i = 0; i < k; i++) {
+      ASSERT_EQ(0, memcmp(source[i], decoder.block(i), blockSize));
+    }
+  }
+}
+
+TEST(LTTest, Objects) {
+  string object;
+  for (int i = 0; i < 100000; i++) {
+    object += (char)(i * 7);
+  }
+  vector<string> blocks = ltEncodeObject(object, 1024, 0.5, 99);
+  ASSERT_EQ(147u, blocks.size());
+  std::random_shuffle(blocks.begin(), blocks.end());
+
+  LTObjectDecoder decoder;
+  string out;
+  EXPECT_FALSE(decoder.object(&out));
+  EXPECT_FALSE(decoder.add("short", 5));
+  for (size_t i = 0; i < blocks.size() && !decoder.done(); i++) {
+    ASSERT_TRUE(decoder.add(blocks[i].data(), blocks[i].size()));
+  }
+  ASSERT_TRUE(decoder.done());
+  ASSERT_TRUE(decoder.object(&out));
+  EXPECT_EQ(object, out);
+
+  // Blocks from a different object are rejected.
+  vector<string> other = ltEncodeObject("other", 1024, 0.5, 7);
+  EXPECT_FALSE(decoder.add(other[0].data(), other[0].size()));
+
+  // Empty objects round trip too.
+  vector<string> empty = ltEncodeObject("", 64, 0.0, 1);
+  ASSERT_EQ(2u, empty.size());
+  LTObjectDecoder emptyDecoder;
+  ASSERT_TRUE(emptyDecoder.add(empty[0].data(), empty[0].size()));
+  EXPECT_FALSE(emptyDecoder.done());
+  ASSERT_TRUE(emptyDecoder.add(empty[1].data(), empty[1].size()));
+  ASSERT_TRUE(emptyDecoder.object(&out));
+  EXPECT_EQ("", out);
+}
+
+TEST(LTTest, CorruptHeaders) {
+  string object(10000, 'x');
+  vector<string> blocks = ltEncodeObject(object, 1024, 0.5, 5);
+
+  // Implausible source block counts are rejected outright.
+  LTObjectDecoder decoder(blocks.size());
+  string huge = blocks[0];
+  huge[0] = huge[1] = huge[2] = huge[3] = (char)0xff;
+  EXPECT_FALSE(decoder.add(huge.data(), huge.size()));
+
+  // A corrupt first block doesn't stop the good ones decoding.
+  string corrupt = blocks[0];
+  corrupt[0] = 3;
+  ASSERT_TRUE(decoder.add(corrupt.data(), corrupt.size()));
+  for (size_t i = 0; i < blocks.size() && !decoder.done(); i++) {
+    ASSERT_TRUE(decoder.add(blocks[i].data(), blocks[i].size()));
+  }
+  string out;
+  ASSERT_TRUE(decoder.object(&out));
+  EXPECT_EQ(object, out);
+}
@@ -0,0 +1,270 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "reedsolomon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "coding/gf256.h"
+
+namespace coding {
+
+namespace {
+// Bytes of object length stored at the front of the first data block.
+const size_t kLengthSize = 8;
+
+/**
+ * Inverts an n x n matrix in place by Gauss-Jordan elimination.
+ * @returns false if the matrix is singular.
+ */
+bool invert(vector<uint8_t> &a, int n) {
+  vector<uint8_t> inv(n * n, 0);
+  for (int i = 0; i < n; i++) {
+    inv[i * n + i] = 1;
+  }
+  for (int col = 0; col < n; col++) {
+    int pivot = col;
+    while (pivot < n && a[pivot * n + col] == 0) {
+      pivot++;
+    }
+    if (pivot == n) {
+      return false;
+    }
+    if (pivot != col) {
+      for (int j = 0; j < n; j++) {
+        std::swap(a[pivot * n + j], a[col * n + j]);
+        std::swap(inv[pivot * n + j], inv[col * n + j]);
+      }
+    }
+    uint8_t scale = gf256::inv(a[col * n + col]);
+    gf256::mulRegion(&a[col * n], &a[col * n], scale, n);
+    gf256::mulRegion(&inv[col * n], &inv[col * n], scale, n);
+    for (int row = 0; row < n; row++) {
+      uint8_t f = a[row * n + col];
+      if (row != col && f) {
+        gf256::mulAddRegion(&a[row * n], &a[col * n], f, n);
+        gf256::mulAddRegion(&inv[row * n], &inv[col * n], f, n);
+      }
+    }
+  }
+  a.swap(inv);
+  return true;
+}
+}
+
+ReedSolomon::ReedSolomon(int k, int m) : _k(k), _m(m) {
+  CHECK(k > 0 && m >= 0 && k + m <= 256);
+  // Cauchy matrix 1 / (x_i + y_j) with x_i = k + i and y_j = j. All x's
+  // and y's are distinct so every square submatrix is invertible.
+  _parity.resize(m * k);
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < k; j++) {
+      _parity[i * k + j] = gf256::inv((uint8_t)((k + i) ^ j));
+    }
+  }
+}
+
+void ReedSolomon::encode(const uint8_t * const *data,
+                         uint8_t * const *parity, size_t len) const {
+  for (int i = 0; i < _m; i++) {
+    gf256::mulRegion(parity[i], data[0], _parity[i * _k], len);
+    for (int j = 1; j < _k; j++) {
+      gf256::mulAddRegion(parity[i], data[j], _parity[i * _k + j], len);
+    }
+  }
+}
+
+bool ReedSolomon::decode(uint8_t * const *blocks,
+                         const vector<bool> &present, size_t len) const {
+  // Pick the first k present blocks and build the matrix mapping the data
+  // blocks onto them.
+  vector<int> rows;
+  for (int i = 0; i < _k + _m && (int)rows.size() < _k; i++) {
+    if (present[i]) {
+      rows.push_back(i);
+    }
+  }
+  if ((int)rows.size() < _k) {
+    return false;
+  }
+
+  bool missingData = false;
+  for (int i = 0; i < _k; i++) {
+    missingData = missingData || !present[i];
+  }
+  if (missingData) {
+    vector<uint8_t> matrix(_k * _k, 0);
+    for (int r = 0; r < _k; r++) {
+      if (rows[r] < _k) {
+        matrix[r * _k + rows[r]] = 1;
+      } else {
+        memcpy(&matrix[r * _k], &_parity[(rows[r] - _k) * _k], _k);
+      }
+    }
+    if (!invert(matrix, _k)) {
+      return false;
+    }
+    // Row i of the inverse expresses data block i in terms of the blocks
+    // we have.
+    for (int i = 0; i < _k; i++) {
+      if (present[i]) {
+        continue;
+      }
+      gf256::mulRegion(blocks[i], blocks[rows[0]], matrix[i * _k], len);
+      for (int r = 1; r < _k; r++) {
+        gf256::mulAddRegion(blocks[i], blocks[rows[r]], matrix[i * _k + r],
+                            len);
+      }
+    }
+  }
+
+  // With all data blocks available, missing parity is simply re-encoded.
+  for (int i = 0; i < _m; i++) {
+    if (present[_k + i]) {
+      continue;
+    }
+    gf256::mulRegion(blocks[_k + i], blocks[0], _parity[i * _k], len);
+    for (int j = 1; j < _k; j++) {
+      gf256::mulAddRegion(blocks[_k + i], blocks[j], _parity[i * _k + j],
+                          len);
+    }
+  }
+  return true;
+}
+
+vector<string> ReedSolomon::split(const string &object) const {
+  const size_t total = object.size() + kLengthSize;
+  const size_t len = (total + _k - 1) / _k;
+  vector<uint8_t> buf(len * (_k + _m), 0);
+  for (size_t i = 0; i < kLengthSize; i++) {
+    buf[i] = (uint64_t)object.size() >> (8 * i);
+  }
+  if (object.size()) {
+    memcpy(&buf[kLengthSize], object.data(), object.size());
+  }
+
+  vector<uint8_t *> blocks(_k + _m);
+  for (int i = 0; i < _k + _m; i++) {
+    blocks[i] = &buf[i * len];
+  }
+  encode(&blocks[0], &blocks[_k], len);
+
+  vector<string> ret(_k + _m);
+  for (int i = 0; i < _k + _m; i++) {
+    ret[i].assign((const char *)blocks[i], len);
+  }
+  return ret;
+}
+
+bool ReedSolomon::join(const vector<string> &blocks, string *object) const {
+  if ((int)blocks.size() != _k + _m) {
+    return false;
+  }
+  size_t len = 0;
+  vector<bool> present(_k + _m, false);
+  for (int i = 0; i < _k + _m; i++) {
+    if (blocks[i].empty()) {
+      continue;
+    }
+    if (len && blocks[i].size() != len) {
+      LOG(ERROR) << "Coded blocks have mismatched sizes.";
+      return false;
+    }
+    len = blocks[i].size();
+    present[i] = true;
+  }
+  if (len == 0) {
+    return false;
+  }
+
+  vector<uint8_t> buf(len * (_k + _m), 0);
+  vector<uint8_t *> ptrs(_k + _m);
+  for (int i = 0; i < _k + _m; i++) {
+    ptrs[i] = &buf[i * len];
+    if (present[i]) {
+      memcpy(ptrs[i], blocks[i].data(), len);
+    }
+  }
+  if (!decode(&ptrs[0], present, len)) {
+    return false;
+  }
+
+  uint64_t size = 0;
+  for (size_t i = 0; i < kLengthSize; i++) {
+    size |= (uint64_t)buf[i] << (8 * i);
+  }
+  if (size > len * _k - kLengthSize) {
+    LOG(ERROR) << "Coded object has an invalid length.";
+    return false;
+  }
+  object->assign((const char *)&buf[kLengthSize], size);
+  return true;
+}
+
+string ReedSolomon::blockName(const string &name, int n, int k, int m) {
+  char buf[48];
+  snprintf(buf, sizeof(buf), ".%d.%d.%d", n, k, m);
+  return name + buf;
+}
+
+bool ReedSolomon::parseBlockName(const string &key, string *name, int *n,
+                                 int *k, int *m) {
+  // Split off the last three dot separated fields, which must be numbers.
+  int *fields[] = { m, k, n };
+  size_t end = key.size();
+  for (int i = 0; i < 3; i++) {
+    size_t dot = end ? key.rfind('.', end - 1) : string::npos;
+    if (dot == string::npos || dot + 1 == end ||
+        key.find_first_not_of("0123456789", dot + 1) < end) {
+      return false;
+    }
+    *fields[i] = atoi(key.substr(dot + 1, end - dot - 1).c_str());
+    end = dot;
+  }
+  if (end == 0 || *k <= 0 || *m < 0 || *k + *m > 256 || *n >= *k + *m) {
+    return false;
+  }
+  *name = key.substr(0, end);
+  return true;
+}
+
+string ReedSolomon::nextBlockName(const string &key) {
+  string name;
+  int n, k, m;
+  if (!parseBlockName(key, &name, &n, &k, &m)) {
+    return "";
+  }
+  return blockName(name, (n + 1) % (k + m), k, m);
+}
+}
@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _CODING_REEDSOLOMON_H_
+#define _CODING_REEDSOLOMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace coding {
+
+using std::string;
+using std::vector;
+
+/**
+ * Systematic Reed-Solomon erasure code over GF(2^8) with k data blocks and
+ * m parity blocks. Parity rows come from a Cauchy matrix so that any k of
+ * the k + m blocks are enough to rebuild the rest. k + m may be at most
+ * 256.
+ */
+class ReedSolomon {
+ public:
+  ReedSolomon(int k, int m);
+
+  int dataBlocks() const { return _k; }
+  int parityBlocks() const { return _m; }
+  int totalBlocks() const { return _k + _m; }
+
+  /**
+   * Computes m parity blocks of len bytes from k data blocks of len bytes.
+   */
+  void encode(const uint8_t * const *data, uint8_t * const *parity,
+              size_t len) const;
+
+  /**
+   * Rebuilds missing blocks in place. blocks holds k + m buffers of len
+   * bytes, data blocks first; present[i] says whether blocks[i] is valid.
+   * @returns false if fewer than k blocks are present.
+   */
+  bool decode(uint8_t * const *blocks, const vector<bool> &present,
+              size_t len) const;
+
+  /**
+   * Splits an object into k + m equally sized blocks. The object's length
+   * is stored in front of the data so that join() can strip the padding.
+   */
+  vector<string> split(const string &object) const;
+
+  /**
+   * Reassembles an object from the blocks produced by split(). Missing
+   * blocks are given as empty strings.
+   * @returns false if the object can't be recovered.
+   */
+  bool join(const vector<string> &blocks, string *object) const;
+
+  /**
+   * Returns the name of block n of an object coded with k data and m
+   * parity blocks, "name.n.k.m". Carrying the code in the name lets any
+   * single block be rebuilt without knowing how its object was stored.
+   */
+  static string blockName(const string &name, int n, int k, int m);
+
+  /**
+   * Parses a name produced by blockName().
+   * @returns false if key isn't a coded block name.
+   */
+  static bool parseBlockName(const string &key, string *name, int *n,
+                             int *k, int *m);
+
+  /**
+   * Returns the block after key in its object's sequence, that is block
+   * (n + 1) % (k + m), or "" if key isn't a coded block name. The node
+   * checks each local block's successor exists somewhere in the network.
+   */
+  static string nextBlockName(const string &key);
+
+ private:
+  int _k;
+  int _m;
+  vector<uint8_t> _parity;  // m x k coding matrix, row major.
+};
+}
+#endif
@@ -0,0 +1,124 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "reedsolomon.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using coding::ReedSolomon;
+using std::string;
+using std::vector;
+
+TEST(ReedSolomonTest, RecoversAnyErasures) {
+  const int k = 4, m = 3;
+  const size_t len = 100;
+  ReedSolomon rs(k, m);
+
+  vector<uint8_t> original(len * (k + m));
+  for (size_t i = 0; i < len * k; i++) {
+    original[i] = rand();
+  }
+  vector<uint8_t *> ptrs(k + m);
+  for (int i = 0; i < k + m; i++) {
+    ptrs[i] = &original[i * len];
+  }
+  rs.encode(&ptrs[0], &ptrs[k], len);
+
+  // Every pattern of up to m lost blocks must be recoverable.
+  for (int mask = 0; mask < (1 << (k + m)); mask++) {
+    int lost = __builtin_popcount(mask);
+    vector<uint8_t> damaged = original;
+    vector<bool> present(k + m, true);
+    vector<uint8_t *> blocks(k + m);
+    for (int i = 0; i < k + m; i++) {
+      blocks[i] = &damaged[i * len];
+      if (mask & (1 << i)) {
+        present[i] = false;
+        memset(blocks[i], 0xee, len);
+      }
+    }
+    if (lost > m) {
+      EXPECT_FALSE(rs.decode(&blocks[0], present, len));
+      continue;
+    }
+    ASSERT_TRUE(rs.decode(&blocks[0], present, len)) << mask;
+    EXPECT_TRUE(damaged == original) << mask;
+  }
+}
+
+TEST(ReedSolomonTest, SplitAndJoin) {
+  ReedSolomon rs(10, 4);
+  string object;
+  for (int i = 0; i < 12345; i++) {
+    object += (char)rand();
+  }
+  vector<string> blocks = rs.split(object);
+  ASSERT_EQ(14, blocks.size());
+
+  blocks[0].clear();
+  blocks[3].clear();
+  blocks[9].clear();
+  blocks[12].clear();
+  string out;
+  ASSERT_TRUE(rs.join(blocks, &out));
+  EXPECT_TRUE(object == out);
+
+  blocks[1].clear();
+  EXPECT_FALSE(rs.join(blocks, &out));
+
+  EXPECT_TRUE(rs.join(rs.split(""), &out));
+  EXPECT_EQ("", out);
+}
+
+TEST(ReedSolomonTest, BlockNames) {
+  EXPECT_EQ("file.v1.3.10.4", ReedSolomon::blockName("file.v1", 3, 10, 4));
+  string name;
+  int n, k, m;
+  ASSERT_TRUE(ReedSolomon::parseBlockName("file.v1.3.10.4", &name, &n, &k,
+                                          &m));
+  EXPECT_EQ("file.v1", name);
+  EXPECT_EQ(3, n);
+  EXPECT_EQ(10, k);
+  EXPECT_EQ(4, m);
+  EXPECT_FALSE(ReedSolomon::parseBlockName("file.v1", &name, &n, &k, &m));
+  EXPECT_FALSE(ReedSolomon::parseBlockName("file.3.14", &name, &n, &k, &m));
+  EXPECT_FALSE(ReedSolomon::parseBlockName("f.14.10.4", &name, &n, &k, &m));
+  EXPECT_FALSE(ReedSolomon::parseBlockName("f.0.0.4", &name, &n, &k, &m));
+  EXPECT_FALSE(ReedSolomon::parseBlockName(".1.2.3", &name, &n, &k, &m));
+  EXPECT_FALSE(ReedSolomon::parseBlockName("f.1.2.3.lt", &name, &n, &k, &m));
+
+  EXPECT_EQ("x.4.10.4", ReedSolomon::nextBlockName("x.3.10.4"));
+  EXPECT_EQ("x.0.10.4", ReedSolomon::nextBlockName("x.13.10.4"));
+  EXPECT_EQ("", ReedSolomon::nextBlockName("plainblock"));
+}
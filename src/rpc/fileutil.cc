@@ -26,12 +26,81 @@
  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
  THE POSSIBILITY OF SUCH DAMAGE.
 */
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <string>
+#include <vector>
+
+#include <epoll_threadpool/eventmanager.h>
+#include <epoll_threadpool/future.h>
+#include <epoll_threadpool/iobuffer.h>
+#include <epoll_threadpool/tcp.h>
+
+#include "blockstore/objectstream.h"
+#include "rpc/mesh.h"
 #include "rpc/rpc.h"
 #include "util/url.h"
 
+using blockstore::ObjectStreamer;
+using blockstore::StreamStats;
+using epoll_threadpool::EventManager;
+using epoll_threadpool::Future;
+using epoll_threadpool::IOBuffer;
+using rpc::Mesh;
+using rpc::Multiplexer;
+using rpc::RPCClient;
+using rpc::Transport;
+using std::string;
+using std::tr1::shared_ptr;
+using std::vector;
+using namespace std::tr1::placeholders;
+
+namespace {
+/**
+ * Stores a single chunk via a BlockStoreNode's putBlock RPC.
+ */
+Future<bool> putBlockHelper(shared_ptr<RPCClient> client,
+                            const string &name, IOBuffer *data) {
+  vector<uint8_t> datavec(data->size());
+  if (!datavec.empty()) {
+    memcpy(&datavec[0], data->pulldown(data->size()), data->size());
+  }
+  delete data;
+  return client->call<bool, string, vector<uint8_t> >(
+      "putBlock", name, datavec);
+}
+
+/**
+ * The RPC can't tell a missing block from an empty one, but ObjectStreamer
+ * never stores empty blocks, so an empty reply means missing.
+ */
+void getBlockHelperCallback(Future< vector<uint8_t> > src,
+                            Future<IOBuffer *> dst) {
+  if (src.get().size() == 0) {
+    dst.set(NULL);
+  } else {
+    dst.set(new IOBuffer((const char *)&src.get()[0], src.get().size()));
+  }
+}
+
+/**
+ * Fetches a single chunk via a BlockStoreNode's getBlock RPC.
+ */
+Future<IOBuffer *> getBlockHelper(shared_ptr<RPCClient> client,
+                                  const string &name) {
+  Future<IOBuffer *> ret;
+  Future< vector<uint8_t> > src =
+      client->call<vector<uint8_t>, string>("getBlock", name);
+  src.addCallback(std::tr1::bind(&getBlockHelperCallback, src, ret));
+  return ret;
+}
+}
+
 int main(int argc, char *argv[]) {
 
 /*  int opt;
@@ -45,7 +114,7 @@ int main(int argc, char *argv[]) {
   while ((opt = getopt_long_only(argc, argv, long_opts, &option_index);
   // TODO: Switch to getopts*/
   if (argc < 4) {
-    fprintf(stderr, "Usage: %s <host> <port> [get|put|remove|addpeer] ...\n", argv[0]);
+    fprintf(stderr, "Usage: %s <host> <port> [get|put|addpeer] ...\n", argv[0]);
     return 1;
   }
 
@@ -53,7 +122,26 @@ int main(int argc, char *argv[]) {
   uint16_t port = atoi(argv[2]);
   string cmd = argv[3];
 
-  rpc::RPCClient client(rpc::TcpSocket::connect(host, port));
+  EventManager em;
+  em.start(2);
+  // Blocks go over a bulk stream, as they do between peers.
+  shared_ptr<Mesh> mesh = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<Transport> stream;
+  if (mesh != NULL) {
+    stream = mesh->open(host, port, "blockstore", Multiplexer::PRIORITY_BULK);
+  }
+  if (stream == NULL) {
+    fprintf(stderr, "Unable to connect to %s:%d\n", host.c_str(), port);
+    return 1;
+  }
+  shared_ptr<RPCClient> client(new RPCClient(stream));
+  client->start();
+
+  // Objects are streamed a block at a time so files needn't fit in memory.
+  ObjectStreamer streamer(std::tr1::bind(&putBlockHelper, client, _1, _2),
+                          std::tr1::bind(&getBlockHelper, client, _1),
+                          65536, 32);
+  StreamStats stats;
 
   if (cmd == "get") {
     if (argc < 6) {
@@ -62,10 +150,16 @@ int main(int argc, char *argv[]) {
     }
     string key = argv[4];
     string dest = argv[5];
-    string ref = client.call("get", key).get<msgpack::type::raw_ref>().str();
-    FILE *f = fopen(dest.c_str(), "wb");
-    fwrite(ref.c_str(), 1, ref.size(), f);
-    fclose(f);
+    int fd = open(dest.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "Unable to open %s\n", dest.c_str());
+      return 1;
+    }
+    bool ok = streamer.get(key, fd, &stats);
+    close(fd);
+    fprintf(stderr, "Returned: %d (%llu bytes, %.1f MB/s)\n", ok,
+            (unsigned long long)stats.bytes, stats.mbPerSec());
+    return ok ? 0 : 1;
   } else if (cmd == "put") {
     if (argc < 6) {
       fprintf(stderr, "Usage: %s <host> <port> put <src_filename> <dst_key>\n", argv[0]);
@@ -73,23 +167,16 @@ int main(int argc, char *argv[]) {
     }
     string src = argv[4];
     string key = argv[5];
-    FILE *f = fopen(src.c_str(), "rb");
-    fseek(f, 0, SEEK_END);
-    size_t s = ftell(f);
-    fprintf(stderr, "Uploading file of size: %d\n", s);
-    fseek(f, 0, SEEK_SET);
-    vector<uint8_t> data;
-    data.resize(s);
-    fread(&data[0], 1, s, f);
-    fclose(f);
-    fprintf(stderr, "Returned: %d\n", client.call("put", key, msgpack::type::raw_ref((char *)&data[0], s)).get<bool>());
-  } else if (cmd == "remove") {
-    if (argc < 5) {
-      fprintf(stderr, "Usage: %s <host> <port> remove <key>\n", argv[0]);
+    int fd = open(src.c_str(), O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "Unable to open %s\n", src.c_str());
       return 1;
     }
-    string key = argv[4];
-    fprintf(stderr, "Returned: %d\n", client.call("remove", key).get<bool>());
+    bool ok = streamer.put(key, fd, &stats);
+    close(fd);
+    fprintf(stderr, "Returned: %d (%llu bytes, %.1f MB/s)\n", ok,
+            (unsigned long long)stats.bytes, stats.mbPerSec());
+    return ok ? 0 : 1;
   } else if (cmd == "addpeer") {
     if (argc < 6) {
       fprintf(stderr, "Usage: %s <host> <port> addpeer <host_b> <port_b>\n", argv[0]);
@@ -97,7 +184,8 @@ int main(int argc, char *argv[]) {
     }
     string hostb = argv[4];
     uint16_t portb = atoi(argv[5]);
-    fprintf(stderr, "Returned: %d\n", client.call("addpeer", hostb, portb).get<bool>());
+    fprintf(stderr, "Returned: %d\n",
+            client->call<bool, string, uint16_t>("addPeer", hostb, portb).get());
   } else {
     fprintf(stderr, "Unknown command %s\n", cmd.c_str());
     return 1;
@@ -105,5 +193,3 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
-
-
@@ -0,0 +1,320 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "mesh.h"
+#include "securetransport.h"
+
+#include <stdlib.h>
+
+#include <sstream>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace rpc {
+
+using std::vector;
+
+namespace {
+// Carries the dialing side's listening address, as "host:port\n".
+const char kHelloService[] = "mesh.hello";
+}  // end anonymous namespace
+
+shared_ptr<Mesh> Mesh::create(EventManager *em, const string &host,
+                              uint16_t port,
+                              shared_ptr<SecureContext> secure) {
+  shared_ptr<TcpListenSocket> s;
+  if (port) {
+    s = TcpListenSocket::create(em, port);
+  } else {
+    while (s.get() == NULL) {
+      port = (rand() % 40000) + 1024;
+      s = TcpListenSocket::create(em, port);
+    }
+  }
+  if (s == NULL) {
+    return shared_ptr<Mesh>();
+  }
+  shared_ptr<Mesh> mesh(new Mesh(em, host, port, s, secure));
+  s->setAcceptCallback(std::tr1::bind(&Mesh::acceptThunk,
+                                      weak_ptr<Mesh>(mesh),
+                                      std::tr1::placeholders::_1));
+  return mesh;
+}
+
+Mesh::Mesh(EventManager *em, const string &host, uint16_t port,
+           shared_ptr<TcpListenSocket> listener,
+           shared_ptr<SecureContext> secure)
+    : _em(em), _host(host), _port(port), _listener(listener),
+      _secure(secure) {
+  pthread_mutex_init(&_lock, NULL);
+}
+
+Mesh::~Mesh() {
+  shutdown();
+  pthread_mutex_destroy(&_lock);
+}
+
+void Mesh::addService(const string &service, shared_ptr<RPCServer> server) {
+  vector< shared_ptr<Multiplexer> > connections;
+  pthread_mutex_lock(&_lock);
+  _services[service] = server;
+  for (map<Multiplexer *, shared_ptr<Multiplexer> >::iterator i =
+       _connections.begin(); i != _connections.end(); ++i) {
+    connections.push_back(i->second);
+  }
+  pthread_mutex_unlock(&_lock);
+  for (size_t i = 0; i < connections.size(); i++) {
+    connections[i]->setServiceHandler(service, std::tr1::bind(
+        &Mesh::serveThunk, weak_ptr<RPCServer>(server),
+        std::tr1::placeholders::_1));
+  }
+}
+
+shared_ptr<Transport> Mesh::open(const string &host, uint16_t port,
+                                 const string &service,
+                                 Multiplexer::Priority priority) {
+  shared_ptr<Multiplexer> mux = connect(PeerAddr(host, port));
+  if (!mux) {
+    return shared_ptr<Transport>();
+  }
+  return mux->open(service, priority);
+}
+
+function<shared_ptr<Transport>()> Mesh::connector(
+    const string &host, uint16_t port, const string &service,
+    Multiplexer::Priority priority) {
+  return std::tr1::bind(&Mesh::openThunk, weak_ptr<Mesh>(shared_from_this()),
+                        host, port, service, priority);
+}
+
+size_t Mesh::numConnections() {
+  pthread_mutex_lock(&_lock);
+  size_t n = _connections.size();
+  pthread_mutex_unlock(&_lock);
+  return n;
+}
+
+void Mesh::shutdown() {
+  map<Multiplexer *, shared_ptr<Multiplexer> > connections;
+  pthread_mutex_lock(&_lock);
+  if (_listener) {
+    _listener->setAcceptCallback(NULL);
+    _listener.reset();
+  }
+  connections.swap(_connections);
+  _peers.clear();
+  pthread_mutex_unlock(&_lock);
+  for (map<Multiplexer *, shared_ptr<Multiplexer> >::iterator i =
+       connections.begin(); i != connections.end(); ++i) {
+    i->second->setDisconnectCallback(NULL);
+    i->second->disconnect();
+  }
+}
+
+void Mesh::acceptThunk(weak_ptr<Mesh> mesh, shared_ptr<TcpSocket> s) {
+  shared_ptr<Mesh> self = mesh.lock();
+  if (!self) {
+    s->disconnect();
+    return;
+  }
+  shared_ptr<Transport> t = TcpTransport::create(s);
+  if (self->_secure) {
+    t = self->_secure->serverTransport(t);
+  }
+  shared_ptr<Multiplexer> mux = self->attach(t, false);
+  if (mux) {
+    mux->start();
+  }
+}
+
+void Mesh::disconnectThunk(weak_ptr<Mesh> mesh, Multiplexer *mux) {
+  shared_ptr<Mesh> self = mesh.lock();
+  if (self) {
+    self->onDisconnect(mux);
+  }
+}
+
+void Mesh::helloThunk(weak_ptr<Mesh> mesh, weak_ptr<Multiplexer> mux,
+                      shared_ptr<Transport> stream) {
+  stream->setReceiveCallback(std::tr1::bind(
+      &Mesh::helloReceived, mesh, mux, stream.get(),
+      std::tr1::placeholders::_1));
+  stream->start();
+}
+
+void Mesh::helloReceived(weak_ptr<Mesh> mesh, weak_ptr<Multiplexer> mux,
+                         Transport *stream, IOBuffer *buf) {
+  // The hello is written at once and is far smaller than a frame, so it
+  // arrives whole.
+  const size_t len = buf->size();
+  const char *data = len ? buf->pulldown(len) : NULL;
+  const string hello(data ? data : "", data ? len : 0);
+  buf->consume(len);
+  stream->disconnect();
+  shared_ptr<Mesh> self = mesh.lock();
+  shared_ptr<Multiplexer> m = mux.lock();
+  const size_t colon = hello.rfind(':');
+  if (!self || !m || colon == string::npos ||
+      hello.empty() || hello[hello.size() - 1] != '\n') {
+    return;
+  }
+  PeerAddr addr(hello.substr(0, colon),
+                atoi(hello.c_str() + colon + 1));
+  pthread_mutex_lock(&self->_lock);
+  shared_ptr<Multiplexer> existing = self->_peers[addr].lock();
+  if (!existing || existing->isDisconnected()) {
+    self->_peers[addr] = m;
+  }
+  pthread_mutex_unlock(&self->_lock);
+}
+
+void Mesh::serveThunk(weak_ptr<RPCServer> server,
+                      shared_ptr<Transport> stream) {
+  shared_ptr<RPCServer> s = server.lock();
+  if (s) {
+    s->serve(stream);
+  } else {
+    stream->disconnect();
+  }
+}
+
+shared_ptr<Transport> Mesh::openThunk(weak_ptr<Mesh> mesh, string host,
+                                      uint16_t port, string service,
+                                      Multiplexer::Priority priority) {
+  shared_ptr<Mesh> self = mesh.lock();
+  if (!self) {
+    return shared_ptr<Transport>();
+  }
+  return self->open(host, port, service, priority);
+}
+
+shared_ptr<Multiplexer> Mesh::attach(shared_ptr<Transport> t,
+                                     bool initiator) {
+  if (!t) {
+    return shared_ptr<Multiplexer>();
+  }
+  shared_ptr<Multiplexer> mux = Multiplexer::create(t, initiator);
+  weak_ptr<Mesh> self(shared_from_this());
+  mux->setDisconnectCallback(std::tr1::bind(&Mesh::disconnectThunk, self,
+                                            mux.get()));
+  mux->setServiceHandler(kHelloService, std::tr1::bind(
+      &Mesh::helloThunk, self, weak_ptr<Multiplexer>(mux),
+      std::tr1::placeholders::_1));
+  pthread_mutex_lock(&_lock);
+  for (map<string, weak_ptr<RPCServer> >::iterator i = _services.begin();
+       i != _services.end(); ++i) {
+    mux->setServiceHandler(i->first, std::tr1::bind(
+        &Mesh::serveThunk, i->second, std::tr1::placeholders::_1));
+  }
+  const bool closed = !_listener;
+  if (!closed) {
+    _connections[mux.get()] = mux;
+  }
+  pthread_mutex_unlock(&_lock);
+  if (closed) {
+    t->disconnect();
+    return shared_ptr<Multiplexer>();
+  }
+  return mux;
+}
+
+shared_ptr<Multiplexer> Mesh::connect(const PeerAddr &addr) {
+  pthread_mutex_lock(&_lock);
+  map<PeerAddr, weak_ptr<Multiplexer> >::iterator i = _peers.find(addr);
+  shared_ptr<Multiplexer> mux;
+  if (i != _peers.end()) {
+    mux = i->second.lock();
+  }
+  pthread_mutex_unlock(&_lock);
+  if (mux && !mux->isDisconnected()) {
+    return mux;
+  }
+
+  shared_ptr<Transport> t = TcpTransport::connect(_em, addr.first,
+                                                 addr.second);
+  if (_secure) {
+    // Keyed by address so a redial finds the peer's session ticket.
+    std::ostringstream peer;
+    peer << addr.first << ":" << addr.second;
+    t = _secure->clientTransport(t, peer.str());
+  }
+  mux = attach(t, true);
+  if (!mux) {
+    DLOG(INFO) << "Failed to connect to peer at " << addr.first << ":"
+               << addr.second;
+    return mux;
+  }
+  // Another thread may have got there first. Its connection wins and
+  // ours is dropped.
+  pthread_mutex_lock(&_lock);
+  shared_ptr<Multiplexer> existing = _peers[addr].lock();
+  const bool raced = existing && !existing->isDisconnected();
+  if (!raced) {
+    _peers[addr] = mux;
+  }
+  pthread_mutex_unlock(&_lock);
+  if (raced) {
+    mux->disconnect();
+    onDisconnect(mux.get());
+    return existing;
+  }
+
+  mux->start();
+  std::ostringstream hello;
+  hello << _host << ":" << _port << "\n";
+  shared_ptr<Transport> stream =
+      mux->open(kHelloService, Multiplexer::PRIORITY_CONTROL);
+  stream->write(new IOBuffer(hello.str().data(), hello.str().size()));
+  stream->disconnect();
+  return mux;
+}
+
+void Mesh::onDisconnect(Multiplexer *mux) {
+  shared_ptr<Multiplexer> dropped;
+  pthread_mutex_lock(&_lock);
+  map<Multiplexer *, shared_ptr<Multiplexer> >::iterator i =
+      _connections.find(mux);
+  if (i != _connections.end()) {
+    dropped = i->second;
+    _connections.erase(i);
+  }
+  for (map<PeerAddr, weak_ptr<Multiplexer> >::iterator j = _peers.begin();
+       j != _peers.end(); ) {
+    shared_ptr<Multiplexer> m = j->second.lock();
+    if (!m || m.get() == mux) {
+      _peers.erase(j++);
+    } else {
+      ++j;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  // dropped is released here, outside the lock.
+}
+
+}  // end rpc namespace
@@ -0,0 +1,169 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _RPC_MESH_H_
+#define _RPC_MESH_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <tr1/memory>
+
+#include "rpc/multiplexer.h"
+#include "rpc/rpc.h"
+
+namespace rpc {
+
+class SecureContext;
+
+using epoll_threadpool::TcpListenSocket;
+using std::map;
+using std::string;
+using std::tr1::enable_shared_from_this;
+using std::tr1::weak_ptr;
+
+/**
+ * The connections between this node and its peers, shared by every
+ * service the node runs.
+ *
+ * A Mesh listens on one port and keeps a single Multiplexer per peer,
+ * whichever side dialed. Services register an RPCServer under a name and
+ * reach the same service on a peer with open(). That dials the peer the
+ * first time and after that only opens another stream on the existing
+ * connection. Each stream has its own priority, so bulk block transfers
+ * can't hold up membership and heartbeat traffic.
+ *
+ * The dialing side sends the address it listens on over a short-lived
+ * hello stream. If the other side later opens a stream back, it reuses
+ * the connection it accepted instead of dialing a second one.
+ *
+ * Created with a SecureContext, every connection runs over a SecureTransport.
+ * A peer that is redialed resumes its session with the ticket it was
+ * given, so reconnects skip the key exchange.
+ */
+class Mesh : public enable_shared_from_this<Mesh> {
+ public:
+  /**
+   * Listens on port, or on a random free port if port is 0. With secure
+   * set, every connection made or accepted is authenticated and encrypted
+   * with it, from the first one on. Every node in the mesh must use the
+   * same key. Without it connections are plaintext.
+   * @returns NULL if the port can't be listened on.
+   */
+  static shared_ptr<Mesh> create(
+      EventManager *em, const string &host, uint16_t port = 0,
+      shared_ptr<SecureContext> secure = shared_ptr<SecureContext>());
+  virtual ~Mesh();
+
+  const string &host() const { return _host; }
+  uint16_t port() const { return _port; }
+  EventManager *getEventManager() { return _em; }
+
+  /**
+   * Serves streams that peers open to service with server. The Mesh
+   * holds only a weak reference, so destroying the server removes it.
+   */
+  void addService(const string &service, shared_ptr<RPCServer> server);
+
+  /**
+   * Opens a stream to service on the peer listening at host:port. Reuses
+   * the connection to the peer if there is one.
+   * @returns NULL if the peer can't be reached.
+   */
+  shared_ptr<Transport> open(const string &host, uint16_t port,
+                             const string &service,
+                             Multiplexer::Priority priority);
+
+  /**
+   * Returns a connector for RPCClient::setReconnect() that calls open().
+   * It doesn't keep the Mesh alive.
+   */
+  function<shared_ptr<Transport>()> connector(const string &host,
+                                              uint16_t port,
+                                              const string &service,
+                                              Multiplexer::Priority priority);
+
+  /**
+   * Returns the number of peer connections, dialed or accepted.
+   */
+  size_t numConnections();
+
+  /**
+   * Stops accepting connections and drops every open one.
+   */
+  void shutdown();
+
+ private:
+  typedef std::pair<string, uint16_t> PeerAddr;
+
+  Mesh(EventManager *em, const string &host, uint16_t port,
+       shared_ptr<TcpListenSocket> listener,
+       shared_ptr<SecureContext> secure);
+
+  static void acceptThunk(weak_ptr<Mesh> mesh, shared_ptr<TcpSocket> s);
+  static void disconnectThunk(weak_ptr<Mesh> mesh, Multiplexer *mux);
+  static void helloThunk(weak_ptr<Mesh> mesh, weak_ptr<Multiplexer> mux,
+                         shared_ptr<Transport> stream);
+  static void helloReceived(weak_ptr<Mesh> mesh, weak_ptr<Multiplexer> mux,
+                            Transport *stream, IOBuffer *buf);
+  static void serveThunk(weak_ptr<RPCServer> server,
+                         shared_ptr<Transport> stream);
+  static shared_ptr<Transport> openThunk(weak_ptr<Mesh> mesh, string host,
+                                         uint16_t port, string service,
+                                         Multiplexer::Priority priority);
+
+  /**
+   * Wraps a new connection in a Multiplexer offering our services and
+   * starts tracking it.
+   */
+  shared_ptr<Multiplexer> attach(shared_ptr<Transport> t, bool initiator);
+
+  /**
+   * Returns the connection to addr, dialing it if there is none.
+   */
+  shared_ptr<Multiplexer> connect(const PeerAddr &addr);
+
+  void onDisconnect(Multiplexer *mux);
+
+  EventManager *_em;
+  string _host;
+  uint16_t _port;
+  shared_ptr<TcpListenSocket> _listener;
+  const shared_ptr<SecureContext> _secure;
+
+  pthread_mutex_t _lock;  // Guards the fields below.
+  map<string, weak_ptr<RPCServer> > _services;
+  map<Multiplexer *, shared_ptr<Multiplexer> > _connections;
+  map<PeerAddr, weak_ptr<Multiplexer> > _peers;
+};
+
+}  // end rpc namespace
+#endif
@@ -0,0 +1,216 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "mesh.h"
+#include "securetransport.h"
+
+#include <epoll_threadpool/eventmanager.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using epoll_threadpool::EventManager;
+using rpc::Mesh;
+using rpc::Multiplexer;
+using rpc::RPCClient;
+using rpc::RPCServer;
+using rpc::SecureContext;
+using rpc::Transport;
+using std::tr1::shared_ptr;
+using std::string;
+
+namespace {
+string toUpperStr(string in) {
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = ::toupper(in[i]);
+  }
+  return in;
+}
+
+string reverseStr(string in) {
+  return string(in.rbegin(), in.rend());
+}
+
+const rpc::RPCMethod<string, string> kToUpper("toUpper", true);
+const rpc::RPCMethod<string, string> kReverse("reverse");
+
+shared_ptr<RPCServer> makeServer(const string &name,
+                                 string (*func)(string)) {
+  shared_ptr<RPCServer> server(
+      RPCServer::create(shared_ptr<epoll_threadpool::TcpListenSocket>()));
+  server->registerFunction<string, string>(name, func);
+  return server;
+}
+}
+
+TEST(MeshTest, OneConnectionPerPeer) {
+  EventManager em;
+  em.start(4);
+
+  shared_ptr<Mesh> a = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<Mesh> b = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<RPCServer> reverse = makeServer("reverse", &reverseStr);
+  shared_ptr<RPCServer> upper = makeServer("toUpper", &toUpperStr);
+  a->addService("reverse", reverse);
+  b->addService("upper", upper);
+
+  // a dials b.
+  RPCClient toB(a->open("127.0.0.1", b->port(), "upper",
+                        Multiplexer::PRIORITY_CONTROL));
+  toB.start();
+  EXPECT_EQ("ABC", toB.call(kToUpper, "abc").get());
+
+  // Streams back the other way and further streams at other priorities
+  // share that connection.
+  RPCClient toA(b->open("127.0.0.1", a->port(), "reverse",
+                        Multiplexer::PRIORITY_BULK));
+  toA.start();
+  EXPECT_EQ("cba", toA.call(kReverse, "abc").get());
+  RPCClient bulkToB(a->open("127.0.0.1", b->port(), "upper",
+                            Multiplexer::PRIORITY_BULK));
+  bulkToB.start();
+  EXPECT_EQ("XYZ", bulkToB.call(kToUpper, "xyz").get());
+  EXPECT_EQ(1u, a->numConnections());
+  EXPECT_EQ(1u, b->numConnections());
+
+  toA.disconnect();
+  toB.disconnect();
+  bulkToB.disconnect();
+  a->shutdown();
+  b->shutdown();
+}
+
+TEST(MeshTest, Reconnect) {
+  EventManager em;
+  em.start(4);
+
+  shared_ptr<Mesh> a = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<Mesh> b = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<RPCServer> upper = makeServer("toUpper", &toUpperStr);
+  b->addService("upper", upper);
+
+  RPCClient::ReconnectPolicy policy;
+  policy.minDelay = 0.1;
+  RPCClient c(a->open("127.0.0.1", b->port(), "upper",
+                      Multiplexer::PRIORITY_CONTROL));
+  c.setReconnect(a->connector("127.0.0.1", b->port(), "upper",
+                              Multiplexer::PRIORITY_CONTROL), policy);
+  c.start();
+  EXPECT_EQ("A", c.call(kToUpper, "a").get());
+
+  // Dropping the connection closes every stream on it. The client dials
+  // again through the mesh and carries on.
+  a->shutdown();
+  a = Mesh::create(&em, "127.0.0.1");
+  c.setReconnect(a->connector("127.0.0.1", b->port(), "upper",
+                              Multiplexer::PRIORITY_CONTROL), policy);
+  EXPECT_EQ("B", c.call(kToUpper, "b").get());
+  c.disconnect();
+}
+
+TEST(MeshTest, Failures) {
+  EventManager em;
+  em.start(4);
+
+  shared_ptr<Mesh> a = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<Mesh> b = Mesh::create(&em, "127.0.0.1");
+  EXPECT_TRUE(Mesh::create(&em, "127.0.0.1", b->port()) == NULL);
+
+  // Nobody is listening.
+  const uint16_t port = b->port();
+  b.reset();
+  EXPECT_TRUE(a->open("127.0.0.1", port, "upper",
+                      Multiplexer::PRIORITY_CONTROL) == NULL);
+
+  // A service whose server has gone closes the stream.
+  b = Mesh::create(&em, "127.0.0.1");
+  shared_ptr<RPCServer> upper = makeServer("toUpper", &toUpperStr);
+  b->addService("upper", upper);
+  upper.reset();
+  RPCClient c(a->open("127.0.0.1", b->port(), "upper",
+                      Multiplexer::PRIORITY_CONTROL));
+  c.start();
+  EXPECT_EQ("", c.call(kToUpper, "a").get());
+  c.disconnect();
+}
+
+TEST(MeshTest, Secure) {
+  EventManager em;
+  em.start(4);
+
+  const string key(SecureContext::kKeySize, 'k');
+  shared_ptr<SecureContext> aCtx = SecureContext::create(key);
+  shared_ptr<SecureContext> bCtx = SecureContext::create(key);
+  shared_ptr<Mesh> a = Mesh::create(&em, "127.0.0.1", 0, aCtx);
+  shared_ptr<Mesh> b = Mesh::create(&em, "127.0.0.1", 0, bCtx);
+  shared_ptr<RPCServer> upper = makeServer("toUpper", &toUpperStr);
+  b->addService("upper", upper);
+
+  RPCClient::ReconnectPolicy policy;
+  policy.minDelay = 0.1;
+  RPCClient c(a->open("127.0.0.1", b->port(), "upper",
+                      Multiplexer::PRIORITY_CONTROL));
+  c.setReconnect(a->connector("127.0.0.1", b->port(), "upper",
+                              Multiplexer::PRIORITY_CONTROL), policy);
+  c.start();
+  EXPECT_EQ("A", c.call(kToUpper, "a").get());
+  EXPECT_EQ(1, aCtx->stats().fullHandshakes);
+  EXPECT_EQ(1, bCtx->stats().fullHandshakes);
+
+  // The redial resumes the session rather than repeating the handshake.
+  a->shutdown();
+  a = Mesh::create(&em, "127.0.0.1", 0, aCtx);
+  c.setReconnect(a->connector("127.0.0.1", b->port(), "upper",
+                              Multiplexer::PRIORITY_CONTROL), policy);
+  EXPECT_EQ("B", c.call(kToUpper, "b").get());
+  EXPECT_EQ(1, aCtx->stats().fullHandshakes);
+  EXPECT_EQ(1, aCtx->stats().resumedHandshakes);
+  c.disconnect();
+
+  // A node with another key is refused.
+  shared_ptr<SecureContext> strangerCtx =
+      SecureContext::create(string(SecureContext::kKeySize, 'x'));
+  shared_ptr<Mesh> stranger =
+      Mesh::create(&em, "127.0.0.1", 0, strangerCtx);
+  RPCClient s(stranger->open("127.0.0.1", b->port(), "upper",
+                             Multiplexer::PRIORITY_CONTROL));
+  s.start();
+  EXPECT_EQ("", s.call(kToUpper, "c").get());
+  EXPECT_EQ(1, strangerCtx->stats().failedHandshakes);
+  s.disconnect();
+
+  // So is one that doesn't encrypt at all.
+  shared_ptr<Mesh> plain = Mesh::create(&em, "127.0.0.1");
+  RPCClient p(plain->open("127.0.0.1", b->port(), "upper",
+                          Multiplexer::PRIORITY_CONTROL));
+  p.start();
+  EXPECT_EQ("", p.call(kToUpper, "d").get());
+  EXPECT_EQ(1, bCtx->stats().fullHandshakes);
+  p.disconnect();
+}
@@ -0,0 +1,513 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "multiplexer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace rpc {
+
+namespace {
+// Frame types.
+const uint8_t kOpen = 1;    // Payload is the priority then service name.
+const uint8_t kData = 2;
+const uint8_t kWindow = 3;  // Payload is a 4 byte credit. Stream 0 is the
+                            // connection.
+const uint8_t kClose = 4;
+
+// Stream id, type and payload length.
+const size_t kFrameHeaderSize = 9;
+
+void putLE(char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+uint32_t getLE(const char *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)(uint8_t)p[i] << (8 * i);
+  }
+  return v;
+}
+
+void appendHeader(string *out, uint32_t id, uint8_t type, size_t len) {
+  char hdr[kFrameHeaderSize];
+  putLE(hdr, id);
+  hdr[4] = type;
+  putLE(hdr + 5, len);
+  out->append(hdr, sizeof(hdr));
+}
+
+string encodeCredit(uint32_t credit) {
+  string s(4, 0);
+  putLE(&s[0], credit);
+  return s;
+}
+}  // end anonymous namespace
+
+/**
+ * One logical stream. All state apart from the callbacks is guarded by
+ * the owning Multiplexer's lock.
+ */
+class Multiplexer::Stream : public Transport {
+ public:
+  Stream(shared_ptr<Multiplexer> mux, uint32_t id, Priority priority,
+         const string &service)
+      : _mux(mux), _id(id), _priority(priority), _service(service),
+        _started(false), _paused(false),
+        _draining(false), _closing(false), _closed(false), _sendOffset(0),
+        _sendWindow(kStreamWindow), _unacked(0) { }
+  virtual ~Stream() { }
+
+  virtual void start() {
+    pthread_mutex_lock(&_mux->_lock);
+    _started = true;
+    pthread_mutex_unlock(&_mux->_lock);
+    _mux->drain(shared_ptr<Stream>(_self));
+  }
+  virtual void write(IOBuffer *buf) { _mux->write(this, buf); }
+  virtual void disconnect() { _mux->close(this); }
+  virtual bool isDisconnected() const {
+    pthread_mutex_lock(&_mux->_lock);
+    bool closed = _closing || _closed;
+    pthread_mutex_unlock(&_mux->_lock);
+    return closed;
+  }
+  virtual void setReceiveCallback(function<void(IOBuffer *)> cb) {
+    _receiveCallback = cb;
+  }
+  virtual void setDisconnectCallback(function<void()> cb) {
+    _disconnectCallback = cb;
+  }
+  virtual EventManager *getEventManager() {
+    return _mux->_lower->getEventManager();
+  }
+
+  /**
+   * Holds back data, and the credit for it, while paused. Delivery
+   * resumes on the EventManager rather than in this call, so it may be
+   * made from within the receive callback or under its locks.
+   */
+  virtual void setPaused(bool paused) {
+    pthread_mutex_lock(&_mux->_lock);
+    _paused = paused;
+    pthread_mutex_unlock(&_mux->_lock);
+    if (!paused) {
+      getEventManager()->enqueue(std::tr1::bind(
+          &Multiplexer::drain, _mux, shared_ptr<Stream>(_self)));
+    }
+  }
+
+  /** Bytes written but not yet framed. */
+  size_t pending() const { return _sendq.size() - _sendOffset; }
+
+  weak_ptr<Stream> _self;
+  shared_ptr<Multiplexer> _mux;
+  const uint32_t _id;
+  const Priority _priority;
+  const string _service;
+  function<void(IOBuffer *)> _receiveCallback;
+  function<void()> _disconnectCallback;
+
+  bool _started;
+  bool _paused;    // See setPaused().
+  bool _draining;
+  bool _closing;  // disconnect() called, CLOSE goes out after the data.
+  bool _closed;
+  string _sendq;
+  size_t _sendOffset;
+  int64_t _sendWindow;
+  string _recvq;
+  uint32_t _unacked;  // Bytes consumed but not yet credited to the peer.
+};
+
+Multiplexer::Multiplexer(shared_ptr<Transport> lower, bool initiator)
+    : _lower(lower), _initiator(initiator), _closed(false),
+      _nextId(initiator ? 1 : 2), _connWindow(kConnectionWindow),
+      _connUnacked(0) {
+  pthread_mutex_init(&_lock, NULL);
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    _cursor[i] = 0;
+  }
+}
+
+Multiplexer::~Multiplexer() {
+  _lower->setReceiveCallback(NULL);
+  _lower->setDisconnectCallback(NULL);
+  _lower->disconnect();
+  pthread_mutex_destroy(&_lock);
+}
+
+void Multiplexer::receiveThunk(weak_ptr<Multiplexer> m, IOBuffer *buf) {
+  shared_ptr<Multiplexer> p = m.lock();
+  if (p) {
+    p->onReceive(buf);
+  }
+}
+
+void Multiplexer::disconnectThunk(weak_ptr<Multiplexer> m) {
+  shared_ptr<Multiplexer> p = m.lock();
+  if (p) {
+    p->onLowerDisconnect();
+  }
+}
+
+void Multiplexer::start() {
+  weak_ptr<Multiplexer> self(shared_from_this());
+  _lower->setReceiveCallback(std::tr1::bind(
+      &Multiplexer::receiveThunk, self, std::tr1::placeholders::_1));
+  _lower->setDisconnectCallback(std::tr1::bind(
+      &Multiplexer::disconnectThunk, self));
+  _lower->start();
+}
+
+shared_ptr<Transport> Multiplexer::open(const string &service,
+                                        Priority priority) {
+  pthread_mutex_lock(&_lock);
+  shared_ptr<Stream> s(new Stream(shared_from_this(), _nextId, priority,
+                                   service));
+  s->_self = s;
+  _nextId += 2;
+  if (_closed) {
+    s->_closed = true;
+  } else {
+    _streams[s->_id] = s;
+    queueFrame(s->_id, kOpen, string(1, (char)priority) + service);
+    pump();
+  }
+  pthread_mutex_unlock(&_lock);
+  return s;
+}
+
+void Multiplexer::setServiceHandler(const string &service,
+                                    ServiceHandler handler) {
+  pthread_mutex_lock(&_lock);
+  _services[service] = handler;
+  pthread_mutex_unlock(&_lock);
+}
+
+void Multiplexer::disconnect() {
+  _lower->disconnect();
+  teardown();
+}
+
+bool Multiplexer::isDisconnected() {
+  pthread_mutex_lock(&_lock);
+  bool closed = _closed;
+  pthread_mutex_unlock(&_lock);
+  return closed;
+}
+
+void Multiplexer::setDisconnectCallback(function<void()> cb) {
+  _disconnectCallback = cb;
+}
+
+size_t Multiplexer::numStreams() {
+  pthread_mutex_lock(&_lock);
+  size_t n = _streams.size();
+  pthread_mutex_unlock(&_lock);
+  return n;
+}
+
+void Multiplexer::onLowerDisconnect() {
+  teardown();
+  if (_disconnectCallback) {
+    _disconnectCallback();
+  }
+}
+
+void Multiplexer::teardown() {
+  map<uint32_t, shared_ptr<Stream> > streams;
+  pthread_mutex_lock(&_lock);
+  _closed = true;
+  streams.swap(_streams);
+  for (map<uint32_t, shared_ptr<Stream> >::iterator i = streams.begin();
+       i != streams.end(); ++i) {
+    i->second->_closed = true;
+  }
+  pthread_mutex_unlock(&_lock);
+  for (map<uint32_t, shared_ptr<Stream> >::iterator i = streams.begin();
+       i != streams.end(); ++i) {
+    if (i->second->_disconnectCallback) {
+      i->second->_disconnectCallback();
+    }
+  }
+}
+
+void Multiplexer::write(Stream *s, IOBuffer *buf) {
+  const size_t len = buf->size();
+  pthread_mutex_lock(&_lock);
+  if (!s->_closing && !s->_closed && len) {
+    s->_sendq.append(buf->pulldown(len), len);
+    pump();
+  }
+  pthread_mutex_unlock(&_lock);
+  delete buf;
+}
+
+void Multiplexer::close(Stream *s) {
+  pthread_mutex_lock(&_lock);
+  if (!s->_closing && !s->_closed) {
+    s->_closing = true;
+    pump();
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void Multiplexer::drain(shared_ptr<Stream> s) {
+  // Only one thread delivers to a stream at a time, which keeps its data
+  // in order and its receive callback single threaded.
+  pthread_mutex_lock(&_lock);
+  if (!s->_started || s->_draining) {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  s->_draining = true;
+  while (!s->_recvq.empty() && !s->_paused) {
+    string data;
+    data.swap(s->_recvq);
+    pthread_mutex_unlock(&_lock);
+    IOBuffer buf(data.data(), data.size());
+    if (s->_receiveCallback) {
+      s->_receiveCallback(&buf);
+    }
+    pthread_mutex_lock(&_lock);
+    s->_unacked += data.size();
+    if (s->_unacked >= kStreamWindow / 4 && !s->_closed) {
+      queueFrame(s->_id, kWindow, encodeCredit(s->_unacked));
+      s->_unacked = 0;
+    }
+  }
+  s->_draining = false;
+  pump();
+  pthread_mutex_unlock(&_lock);
+}
+
+void Multiplexer::queueFrame(uint32_t id, uint8_t type,
+                             const string &payload) {
+  appendHeader(&_control, id, type, payload.size());
+  _control += payload;
+}
+
+Multiplexer::Stream *Multiplexer::nextReady() {
+  for (int p = 0; p < NUM_PRIORITIES; p++) {
+    if (p != PRIORITY_CONTROL && _connWindow <= 0) {
+      break;
+    }
+    // Round robin: start after the last stream served at this priority.
+    map<uint32_t, shared_ptr<Stream> >::iterator start =
+        _streams.upper_bound(_cursor[p]);
+    for (size_t n = 0; n < _streams.size(); n++, ++start) {
+      if (start == _streams.end()) {
+        start = _streams.begin();
+      }
+      Stream *s = start->second.get();
+      if (s->_priority == p && s->pending() && s->_sendWindow > 0) {
+        _cursor[p] = s->_id;
+        return s;
+      }
+    }
+  }
+  return NULL;
+}
+
+void Multiplexer::pump() {
+  if (_closed) {
+    _control.clear();
+    return;
+  }
+  string out;
+  out.swap(_control);
+  while (Stream *s = nextReady()) {
+    size_t n = std::min(s->pending(), kMaxFrame);
+    n = std::min(n, (size_t)s->_sendWindow);
+    if (s->_priority != PRIORITY_CONTROL) {
+      n = std::min(n, (size_t)_connWindow);
+      _connWindow -= n;
+    }
+    s->_sendWindow -= n;
+    appendHeader(&out, s->_id, kData, n);
+    out.append(s->_sendq, s->_sendOffset, n);
+    s->_sendOffset += n;
+    if (s->_sendOffset > s->_sendq.size() / 2) {
+      s->_sendq.erase(0, s->_sendOffset);
+      s->_sendOffset = 0;
+    }
+  }
+
+  // Streams being closed go once everything they wrote has been framed.
+  for (map<uint32_t, shared_ptr<Stream> >::iterator i = _streams.begin();
+       i != _streams.end(); ) {
+    Stream *s = i->second.get();
+    if (s->_closing && !s->pending()) {
+      appendHeader(&out, s->_id, kClose, 0);
+      s->_closed = true;
+      _streams.erase(i++);
+    } else {
+      ++i;
+    }
+  }
+  if (!out.empty()) {
+    _lower->write(new IOBuffer(out.data(), out.size()));
+  }
+}
+
+void Multiplexer::onReceive(IOBuffer *buf) {
+  const size_t len = buf->size();
+  if (len) {
+    const char *data = buf->pulldown(len);
+    _rbuf.insert(_rbuf.end(), data, data + len);
+    buf->consume(len);
+  }
+
+  vector< shared_ptr<Stream> > deliver;
+  vector< shared_ptr<Stream> > accepted;
+  vector< shared_ptr<Stream> > closed;
+  bool ok = true;
+  size_t off = 0;
+  pthread_mutex_lock(&_lock);
+  while (ok && _rbuf.size() - off >= kFrameHeaderSize) {
+    const char *hdr = &_rbuf[off];
+    const size_t n = getLE(hdr + 5);
+    if (n > kMaxFrame) {
+      ok = false;
+      break;
+    }
+    if (_rbuf.size() - off - kFrameHeaderSize < n) {
+      break;
+    }
+    ok = onFrame(getLE(hdr), hdr[4], hdr + kFrameHeaderSize, n, &deliver,
+                 &accepted, &closed);
+    off += kFrameHeaderSize + n;
+  }
+  if (_connUnacked >= kConnectionWindow / 4) {
+    queueFrame(0, kWindow, encodeCredit(_connUnacked));
+    _connUnacked = 0;
+  }
+  pump();
+  pthread_mutex_unlock(&_lock);
+  _rbuf.erase(_rbuf.begin(), _rbuf.begin() + off);
+
+  if (!ok) {
+    LOG(ERROR) << "Multiplexer protocol error, disconnecting.";
+    _lower->disconnect();
+    onLowerDisconnect();
+    return;
+  }
+  for (size_t i = 0; i < accepted.size(); i++) {
+    pthread_mutex_lock(&_lock);
+    ServiceHandler handler = _services[accepted[i]->_service];
+    pthread_mutex_unlock(&_lock);
+    handler(accepted[i]);
+  }
+  for (size_t i = 0; i < deliver.size(); i++) {
+    drain(deliver[i]);
+  }
+  for (size_t i = 0; i < closed.size(); i++) {
+    if (closed[i]->_disconnectCallback) {
+      closed[i]->_disconnectCallback();
+    }
+  }
+}
+
+bool Multiplexer::onFrame(uint32_t id, uint8_t type, const char *data,
+                          size_t len,
+                          vector< shared_ptr<Stream> > *deliver,
+                          vector< shared_ptr<Stream> > *accepted,
+                          vector< shared_ptr<Stream> > *closed) {
+  if (type == kWindow) {
+    if (len != 4) {
+      return false;
+    }
+    if (id == 0) {
+      _connWindow += getLE(data);
+    } else if (_streams.find(id) != _streams.end()) {
+      _streams[id]->_sendWindow += getLE(data);
+    }
+    return true;
+  }
+
+  map<uint32_t, shared_ptr<Stream> >::iterator i = _streams.find(id);
+  shared_ptr<Stream> s = i == _streams.end() ? shared_ptr<Stream>() : i->second;
+  switch (type) {
+    case kOpen: {
+      // Peers open streams from their own half of the id space.
+      const bool theirs = (id % 2 == 1) != _initiator;
+      if (len < 1 || s || id == 0 || !theirs ||
+          (uint8_t)data[0] >= NUM_PRIORITIES) {
+        return false;
+      }
+      const string service(data + 1, len - 1);
+      if (_services.find(service) == _services.end()) {
+        LOG(WARNING) << "Peer opened a stream to unknown service "
+                     << service;
+        queueFrame(id, kClose, "");
+        return true;
+      }
+      s.reset(new Stream(shared_from_this(), id, (Priority)data[0],
+                         service));
+      s->_self = s;
+      _streams[id] = s;
+      accepted->push_back(s);
+      return true;
+    }
+    case kData:
+      if (!s || s->_priority != PRIORITY_CONTROL) {
+        _connUnacked += len;
+      }
+      if (!s || s->_closed) {
+        // Raced with a close; the data is dropped.
+        return true;
+      }
+      if (s->_recvq.size() + len > kStreamWindow) {
+        return false;
+      }
+      s->_recvq.append(data, len);
+      if (std::find(deliver->begin(), deliver->end(), s) == deliver->end()) {
+        deliver->push_back(s);
+      }
+      return true;
+    case kClose:
+      if (s) {
+        s->_closed = true;
+        _streams.erase(i);
+        closed->push_back(s);
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // end rpc namespace
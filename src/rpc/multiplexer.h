@@ -0,0 +1,176 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _RPC_MULTIPLEXER_H_
+#define _RPC_MULTIPLEXER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+#include "rpc/transport.h"
+
+namespace rpc {
+
+using std::map;
+using std::string;
+using std::tr1::enable_shared_from_this;
+using std::tr1::weak_ptr;
+using std::vector;
+
+/**
+ * Carries any number of logical streams between two peers over a single
+ * Transport, so every service a pair of nodes share can use one
+ * connection. Each stream is itself a Transport, so an RPCClient can run
+ * over one and an RPCServer can serve one.
+ *
+ * Streams are opened by name to services registered on the other side
+ * and given a priority that applies in both directions. Outgoing data is
+ * cut into frames of at most kMaxFrame bytes and sent strictly by
+ * priority, round robin between streams of the same priority.
+ *
+ * Each stream may have at most kStreamWindow bytes unconsumed by its peer,
+ * so a stream nobody reads from can't exhaust the receiver's memory or
+ * stall the others. The connection as a whole has at most
+ * kConnectionWindow bytes in flight. PRIORITY_CONTROL streams are exempt
+ * from the connection window, so bulk transfers can't queue more than
+ * that much ahead of control traffic in the socket's buffers.
+ *
+ * Streams live until either end calls disconnect() on them or the
+ * connection drops. Open streams keep their Multiplexer alive, so it must
+ * be disconnected to release a connection that still has streams.
+ */
+class Multiplexer : public enable_shared_from_this<Multiplexer> {
+ public:
+  enum Priority {
+    PRIORITY_CONTROL = 0,
+    PRIORITY_INTERACTIVE,
+    PRIORITY_BULK,
+    NUM_PRIORITIES
+  };
+
+  static const size_t kMaxFrame = 16384;
+  static const uint32_t kStreamWindow = 256 * 1024;
+  static const uint32_t kConnectionWindow = 1024 * 1024;
+
+  typedef function<void(shared_ptr<Transport>)> ServiceHandler;
+
+  /**
+   * @param initiator true on the side that opened the connection. The two
+   *        ends number their streams from separate spaces.
+   */
+  static shared_ptr<Multiplexer> create(shared_ptr<Transport> lower,
+                                        bool initiator) {
+    return shared_ptr<Multiplexer>(new Multiplexer(lower, initiator));
+  }
+  virtual ~Multiplexer();
+
+  /**
+   * Starts processing traffic. Services should be registered first.
+   */
+  void start();
+
+  /**
+   * Opens a stream to the named service on the peer. Data may be written
+   * to it straight away. If the peer has no such service the stream is
+   * disconnected.
+   */
+  shared_ptr<Transport> open(const string &service, Priority priority);
+
+  /**
+   * Registers a handler that is passed each stream the peer opens to
+   * service. The handler must start() the stream to receive data.
+   */
+  void setServiceHandler(const string &service, ServiceHandler handler);
+
+  void disconnect();
+  bool isDisconnected();
+  void setDisconnectCallback(function<void()> cb);
+
+  /**
+   * Returns the number of open streams.
+   */
+  size_t numStreams();
+
+ private:
+  class Stream;
+  friend class Stream;
+
+  Multiplexer(shared_ptr<Transport> lower, bool initiator);
+
+  static void receiveThunk(weak_ptr<Multiplexer> m, IOBuffer *buf);
+  static void disconnectThunk(weak_ptr<Multiplexer> m);
+
+  void onReceive(IOBuffer *buf);
+  void onLowerDisconnect();
+
+  /**
+   * Closes every stream, notifying their owners.
+   */
+  void teardown();
+
+  /**
+   * Handles one frame. Returns false on a protocol error.
+   */
+  bool onFrame(uint32_t id, uint8_t type, const char *data, size_t len,
+               vector< shared_ptr<Stream> > *deliver,
+               vector< shared_ptr<Stream> > *accepted,
+               vector< shared_ptr<Stream> > *closed);
+
+  // Called by Stream.
+  void write(Stream *s, IOBuffer *buf);
+  void close(Stream *s);
+  void drain(shared_ptr<Stream> s);
+
+  // The following are called with _lock held.
+  void queueFrame(uint32_t id, uint8_t type, const string &payload);
+  Stream *nextReady();
+  void pump();
+
+  shared_ptr<Transport> _lower;
+  bool _initiator;
+  function<void()> _disconnectCallback;
+  vector<char> _rbuf;
+
+  pthread_mutex_t _lock;  // Guards everything below and stream state.
+  bool _closed;
+  uint32_t _nextId;
+  map<uint32_t, shared_ptr<Stream> > _streams;
+  map<string, ServiceHandler> _services;
+  string _control;  // Frames that go out ahead of any data.
+  int64_t _connWindow;
+  uint32_t _connUnacked;
+  uint32_t _cursor[NUM_PRIORITIES];  // Last stream served per priority.
+};
+
+}  // end rpc namespace
+#endif
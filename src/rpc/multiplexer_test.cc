@@ -0,0 +1,264 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "multiplexer.h"
+#include "rpc.h"
+
+#include <epoll_threadpool/eventmanager.h>
+#include <epoll_threadpool/notification.h>
+#include <epoll_threadpool/tcp.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using epoll_threadpool::EventManager;
+using epoll_threadpool::IOBuffer;
+using epoll_threadpool::Notification;
+using epoll_threadpool::TcpListenSocket;
+using epoll_threadpool::TcpSocket;
+using rpc::Multiplexer;
+using rpc::RPCClient;
+using rpc::RPCServer;
+using rpc::TcpTransport;
+using rpc::Transport;
+using std::tr1::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace {
+string toUpperStr(string in) {
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = ::toupper(in[i]);
+  }
+  return in;
+}
+
+string reverseStr(string in) {
+  return string(in.rbegin(), in.rend());
+}
+
+/**
+ * Wraps each accepted connection in a Multiplexer with a fixed set of
+ * services.
+ */
+class MuxServer {
+ public:
+  explicit MuxServer(EventManager *em) {
+    while(_socket.get() == NULL) {
+      _port = (rand()%40000) + 1024;
+      _socket = TcpListenSocket::create(em, _port);
+    }
+  }
+  ~MuxServer() {
+    _socket->setAcceptCallback(NULL);
+    for (size_t i = 0; i < _muxes.size(); i++) {
+      _muxes[i]->disconnect();
+    }
+  }
+
+  void setServiceHandler(const string &name,
+                         Multiplexer::ServiceHandler handler) {
+    _services.push_back(std::make_pair(name, handler));
+  }
+  void start() {
+    _socket->setAcceptCallback(std::tr1::bind(
+        &MuxServer::onAccept, this, std::tr1::placeholders::_1));
+  }
+  int port() const { return _port; }
+
+ private:
+  void onAccept(shared_ptr<TcpSocket> s) {
+    shared_ptr<Multiplexer> mux =
+        Multiplexer::create(TcpTransport::create(s), false);
+    for (size_t i = 0; i < _services.size(); i++) {
+      mux->setServiceHandler(_services[i].first, _services[i].second);
+    }
+    _muxes.push_back(mux);
+    mux->start();
+  }
+
+  int _port;
+  shared_ptr<TcpListenSocket> _socket;
+  vector< std::pair<string, Multiplexer::ServiceHandler> > _services;
+  vector< shared_ptr<Multiplexer> > _muxes;
+};
+
+/**
+ * Accepts raw streams, recording how much bulk data had arrived by the
+ * time the first control message did.
+ */
+class Recorder {
+ public:
+  Recorder() : _bulk(0), _bulkAtControl(-1) {
+    pthread_mutex_init(&_lock, NULL);
+  }
+  ~Recorder() {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void onBulkStream(shared_ptr<Transport> t) {
+    t->setReceiveCallback(std::tr1::bind(
+        &Recorder::onBulk, this, std::tr1::placeholders::_1));
+    _streams.push_back(t);
+    t->start();
+  }
+  void onControlStream(shared_ptr<Transport> t) {
+    t->setReceiveCallback(std::tr1::bind(
+        &Recorder::onControl, this, std::tr1::placeholders::_1));
+    _streams.push_back(t);
+    t->start();
+  }
+
+  Notification bulkDone;
+  Notification controlDone;
+  size_t _bulk;
+  ssize_t _bulkAtControl;
+
+ private:
+  void onBulk(IOBuffer *buf) {
+    pthread_mutex_lock(&_lock);
+    _bulk += buf->size();
+    buf->consume(buf->size());
+    if (_bulk == 8 << 20) {
+      bulkDone.signal();
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+  void onControl(IOBuffer *buf) {
+    pthread_mutex_lock(&_lock);
+    buf->consume(buf->size());
+    if (_bulkAtControl < 0) {
+      _bulkAtControl = _bulk;
+      controlDone.signal();
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+
+  pthread_mutex_t _lock;
+  vector< shared_ptr<Transport> > _streams;
+};
+}
+
+TEST(Multiplexer, SharedConnection) {
+  EventManager em;
+  em.start(4);
+
+  // Two independent RPC services reached over one TCP connection.
+  shared_ptr<RPCServer> upper = RPCServer::create(
+      shared_ptr<TcpListenSocket>());
+  upper->registerFunction<string, string>("call", &toUpperStr);
+  shared_ptr<RPCServer> reverse = RPCServer::create(
+      shared_ptr<TcpListenSocket>());
+  reverse->registerFunction<string, string>("call", &reverseStr);
+  MuxServer server(&em);
+  server.setServiceHandler("upper", std::tr1::bind(
+      &RPCServer::serve, upper.get(), std::tr1::placeholders::_1));
+  server.setServiceHandler("reverse", std::tr1::bind(
+      &RPCServer::serve, reverse.get(), std::tr1::placeholders::_1));
+  server.start();
+
+  shared_ptr<Multiplexer> mux = Multiplexer::create(TcpTransport::create(
+      TcpSocket::connect(&em, "127.0.0.1", server.port())), true);
+  mux->start();
+  RPCClient a(mux->open("upper", Multiplexer::PRIORITY_INTERACTIVE));
+  RPCClient b(mux->open("reverse", Multiplexer::PRIORITY_BULK));
+  a.start();
+  b.start();
+  EXPECT_EQ(2u, mux->numStreams());
+
+  for (int i = 0; i < 10; i++) {
+    string ret = a.call<string, string>("call", "hello");
+    EXPECT_EQ("HELLO", ret);
+    ret = b.call<string, string>("call", "hello");
+    EXPECT_EQ("olleh", ret);
+  }
+  // Larger than a frame and a stream window.
+  string big(1000000, 'x');
+  big[0] = 'y';
+  string ret = b.call<string, string>("call", big);
+  EXPECT_EQ(string(big.rbegin(), big.rend()), ret);
+
+  a.disconnect();
+  b.disconnect();
+  mux->disconnect();
+}
+
+TEST(Multiplexer, ControlNotBlockedByBulk) {
+  EventManager em;
+  em.start(4);
+
+  Recorder recorder;
+  MuxServer server(&em);
+  server.setServiceHandler("bulk", std::tr1::bind(
+      &Recorder::onBulkStream, &recorder, std::tr1::placeholders::_1));
+  server.setServiceHandler("control", std::tr1::bind(
+      &Recorder::onControlStream, &recorder, std::tr1::placeholders::_1));
+  server.start();
+
+  shared_ptr<Multiplexer> mux = Multiplexer::create(TcpTransport::create(
+      TcpSocket::connect(&em, "127.0.0.1", server.port())), true);
+  mux->start();
+  shared_ptr<Transport> bulk = mux->open("bulk", Multiplexer::PRIORITY_BULK);
+  string chunk(65536, 'b');
+  for (int i = 0; i < 128; i++) {
+    bulk->write(new IOBuffer(chunk.data(), chunk.size()));
+  }
+  shared_ptr<Transport> control =
+      mux->open("control", Multiplexer::PRIORITY_CONTROL);
+  control->write(new IOBuffer("ping", 4));
+
+  // The control message only waits for what is already in flight, which
+  // the connection window bounds.
+  recorder.controlDone.wait();
+  EXPECT_LE(recorder._bulkAtControl,
+            2 * (ssize_t)Multiplexer::kConnectionWindow);
+  recorder.bulkDone.wait();
+  mux->disconnect();
+}
+
+TEST(Multiplexer, UnknownService) {
+  EventManager em;
+  em.start(4);
+
+  MuxServer server(&em);
+  server.start();
+
+  shared_ptr<Multiplexer> mux = Multiplexer::create(TcpTransport::create(
+      TcpSocket::connect(&em, "127.0.0.1", server.port())), true);
+  mux->start();
+  Notification n;
+  shared_ptr<Transport> t = mux->open("missing", Multiplexer::PRIORITY_BULK);
+  t->setDisconnectCallback(std::tr1::bind(&Notification::signal, &n));
+  t->start();
+  n.wait();
+  EXPECT_EQ(0u, mux->numStreams());
+  EXPECT_FALSE(mux->isDisconnected());
+  mux->disconnect();
+}
@@ -35,40 +35,313 @@
 #include <glog/logging.h>
 #include <msgpack.hpp>
 
+#include <algorithm>
+#include <deque>
+
 namespace rpc {
 
-RPCServer::RPCServer(shared_ptr<TcpListenSocket> s) 
-    : _funcs(new map<string, RPCFunc>()), _socket(s) {
+using std::deque;
+
+namespace {
+// Status sent in place of a result when a request is shed.
+const int kOverloaded = 1;
+
+// Built in method clients call to check that a quiet server is still up.
+const char kHeartbeat[] = "rpc.heartbeat";
+
+bool heartbeat() {
+  return true;
+}
+
+/**
+ * Roughly how many bytes obj took on the wire, for admission control.
+ */
+size_t encodedSize(const msgpack::object &obj) {
+  switch (obj.type) {
+    case msgpack::type::RAW:
+      return obj.via.raw.size + 1;
+    case msgpack::type::ARRAY: {
+      size_t n = 1;
+      for (uint32_t i = 0; i < obj.via.array.size; i++) {
+        n += encodedSize(obj.via.array.ptr[i]);
+      }
+      return n;
+    }
+    case msgpack::type::MAP: {
+      size_t n = 1;
+      for (uint32_t i = 0; i < obj.via.map.size; i++) {
+        n += encodedSize(obj.via.map.ptr[i].key);
+        n += encodedSize(obj.via.map.ptr[i].val);
+      }
+      return n;
+    }
+    default:
+      return 1;
+  }
+}
+}
+
+/**
+ * Queues requests per priority and per connection and hands them to
+ * worker threads, at most _maxRunning at a time. The highest priority with
+ * anything waiting is always served first. Within a priority connections
+ * take turns so one busy peer can't hold up the rest; each turn runs up to
+ * the connection's weight in requests, so busy connections share the
+ * workers in proportion to their weights.
+ *
+ * Also keeps the server wide counts that Limits are checked against.
+ */
+class RPCServer::Scheduler : public enable_shared_from_this<Scheduler> {
+ public:
+  explicit Scheduler(int maxRunning)
+      : _maxRunning(maxRunning), _running(0), _connections(0),
+        _requests(0), _bytes(0), _buffered(0) {
+    pthread_mutex_init(&_lock, NULL);
+    for (int i = 0; i < NUM_REQUEST_PRIORITIES; i++) {
+      _cursor[i] = NULL;
+      _turn[i] = 0;
+    }
+  }
+  ~Scheduler() {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void setMaxRunning(int n) {
+    pthread_mutex_lock(&_lock);
+    _maxRunning = n;
+    pthread_mutex_unlock(&_lock);
+    dispatch();
+  }
+
+  Limits getLimits() {
+    pthread_mutex_lock(&_lock);
+    Limits limits = _limits;
+    pthread_mutex_unlock(&_lock);
+    return limits;
+  }
+  void setLimits(const Limits &limits) {
+    pthread_mutex_lock(&_lock);
+    _limits = limits;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /**
+   * Reserves a connection slot. Returns false if none are free.
+   */
+  bool addConnection() {
+    pthread_mutex_lock(&_lock);
+    const bool ok = _connections < _limits.maxConnections;
+    if (ok) {
+      _connections++;
+    }
+    pthread_mutex_unlock(&_lock);
+    return ok;
+  }
+  void removeConnection() {
+    pthread_mutex_lock(&_lock);
+    _connections--;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /**
+   * Counts a request with the given argument size against the server
+   * wide limits. Returns false, counting nothing, if it would exceed them.
+   */
+  bool admit(size_t bytes) {
+    pthread_mutex_lock(&_lock);
+    const bool ok = _requests < _limits.maxRequests &&
+                    _bytes + bytes <= _limits.maxBytes;
+    if (ok) {
+      _requests++;
+      _bytes += bytes;
+    }
+    pthread_mutex_unlock(&_lock);
+    return ok;
+  }
+  void release(size_t bytes) {
+    pthread_mutex_lock(&_lock);
+    _requests--;
+    _bytes -= bytes;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /**
+   * Updates a connection's count of buffered input from oldBytes to
+   * newBytes. Returns false if it grew and the server now buffers more
+   * than maxBufferedBytes.
+   */
+  bool setBuffered(size_t oldBytes, size_t newBytes) {
+    pthread_mutex_lock(&_lock);
+    _buffered += newBytes;
+    _buffered -= oldBytes;
+    const bool ok = newBytes <= oldBytes ||
+                    _buffered <= _limits.maxBufferedBytes;
+    pthread_mutex_unlock(&_lock);
+    return ok;
+  }
+
+  /**
+   * Queues call to be run on em on behalf of conn.
+   */
+  void submit(RequestPriority priority, const void *conn, int weight,
+              EventManager *em, function<void()> call) {
+    pthread_mutex_lock(&_lock);
+    Flow &flow = _queues[priority][conn];
+    flow.weight = std::max(weight, 1);
+    flow.tasks.push_back(Task(em, call));
+    pthread_mutex_unlock(&_lock);
+    dispatch();
+  }
+
+ private:
+  struct Task {
+    Task(EventManager *em, function<void()> call) : em(em), call(call) { }
+    EventManager *em;
+    function<void()> call;
+  };
+  struct Flow {
+    Flow() : weight(1) { }
+    deque<Task> tasks;
+    int weight;
+  };
+  typedef map<const void *, Flow> Queue;
+
+  /**
+   * Starts as many queued requests as there are free slots.
+   */
+  void dispatch() {
+    vector<Task> ready;
+    pthread_mutex_lock(&_lock);
+    while (_running < _maxRunning) {
+      int p = 0;
+      while (p < NUM_REQUEST_PRIORITIES && _queues[p].empty()) {
+        p++;
+      }
+      if (p == NUM_REQUEST_PRIORITIES) {
+        break;
+      }
+      // Weighted round robin: the last connection served keeps its turn
+      // until it has had its weight in requests, then the next one's
+      // starts.
+      Queue::iterator i = _queues[p].find(_cursor[p]);
+      if (i == _queues[p].end() || _turn[p] >= i->second.weight) {
+        i = _queues[p].upper_bound(_cursor[p]);
+        if (i == _queues[p].end()) {
+          i = _queues[p].begin();
+        }
+        _cursor[p] = i->first;
+        _turn[p] = 0;
+      }
+      _turn[p]++;
+      ready.push_back(i->second.tasks.front());
+      i->second.tasks.pop_front();
+      if (i->second.tasks.empty()) {
+        _queues[p].erase(i);
+      }
+      _running++;
+    }
+    pthread_mutex_unlock(&_lock);
+    for (size_t i = 0; i < ready.size(); i++) {
+      ready[i].em->enqueue(std::tr1::bind(
+          &Scheduler::run, shared_from_this(), ready[i].call));
+    }
+  }
+
+  void run(function<void()> call) {
+    call();
+    pthread_mutex_lock(&_lock);
+    _running--;
+    pthread_mutex_unlock(&_lock);
+    dispatch();
+  }
+
+  pthread_mutex_t _lock;
+  int _maxRunning;
+  int _running;
+  Queue _queues[NUM_REQUEST_PRIORITIES];
+  const void *_cursor[NUM_REQUEST_PRIORITIES];  // Whose turn it is.
+  int _turn[NUM_REQUEST_PRIORITIES];  // Requests run in that turn so far.
+
+  Limits _limits;
+  size_t _connections;
+  size_t _requests;
+  size_t _bytes;
+  size_t _buffered;  // Input read but not yet parsed, over all connections.
+};
+
+RPCServer::RPCServer(shared_ptr<TcpListenSocket> s, TransportFactory wrap) 
+    : _funcs(new map<string, RPCFunc>()),
+      _scheduler(new Scheduler(kDefaultMaxRunning)), _socket(s),
+      _wrap(wrap) {
+  pthread_mutex_init(&_lock, NULL);
+  registerFunction<bool>(kHeartbeat, &heartbeat);
 }
 
 RPCServer::~RPCServer() {
-  _socket->setAcceptCallback(NULL);
+  if (_socket) {
+    _socket->setAcceptCallback(NULL);
+  }
+  pthread_mutex_destroy(&_lock);
 }
 
 void RPCServer::start() {
-  _socket->setAcceptCallback(std::tr1::bind(
-      &RPCServer::onAccept, this, std::tr1::placeholders::_1));
+  if (_socket) {
+    _socket->setAcceptCallback(std::tr1::bind(
+        &RPCServer::onAccept, this, std::tr1::placeholders::_1));
+  }
 }
 
 void RPCServer::setAcceptCallback(
     std::tr1::function<void(shared_ptr<Connection>)> cb) {
   _acceptCallback = cb;
+  pthread_mutex_lock(&_lock);
   _connections.clear();
+  pthread_mutex_unlock(&_lock);
+}
+
+void RPCServer::setMaxRunning(int n) {
+  _scheduler->setMaxRunning(n);
+}
+
+RPCServer::Limits::Limits()
+    : maxConnections(1024), maxRequests(4096), maxBytes(1024 << 20),
+      maxConnectionRequests(256), maxConnectionBytes(128 << 20),
+      maxBufferedBytes(256 << 20) {
+}
+
+void RPCServer::setLimits(const Limits &limits) {
+  _scheduler->setLimits(limits);
 }
 
 void RPCServer::onAccept(shared_ptr<TcpSocket> s) {
-  shared_ptr<Connection> r(new Connection(_funcs, s));
+  shared_ptr<Transport> t = TcpTransport::create(s);
+  if (_wrap) {
+    t = _wrap(t);
+  }
+  serve(t);
+}
+
+void RPCServer::serve(shared_ptr<Transport> t) {
+  if (!_scheduler->addConnection()) {
+    LOG(WARNING) << "Too many connections. Dropping new connection.";
+    t->disconnect();
+    return;
+  }
+  shared_ptr<Connection> r(new Connection(_funcs, _scheduler, t));
   if (_acceptCallback) {
     _acceptCallback(r);
   } else {
+    pthread_mutex_lock(&_lock);
     _connections.insert(r);
+    pthread_mutex_unlock(&_lock);
     r->start();
   }
 }
 
 RPCServer::Connection::Connection(
-    shared_ptr< map<string, RPCFunc> > funcs, shared_ptr<TcpSocket> s) 
-        : _internal(new Internal(funcs, s)) {
+    shared_ptr< map<string, RPCFunc> > funcs,
+    shared_ptr<Scheduler> scheduler, shared_ptr<Transport> s)
+        : _internal(new Internal(funcs, scheduler, s)) {
 }
 
 RPCServer::Connection::~Connection() {
@@ -88,14 +361,27 @@ void RPCServer::Connection::setDisconnectCallback(
   _internal->setDisconnectCallback(cb);
 }
 
+void RPCServer::Connection::setWeight(int weight) {
+  pthread_mutex_lock(&_internal->_lock);
+  _internal->_weight = weight;
+  pthread_mutex_unlock(&_internal->_lock);
+}
+
 RPCServer::Connection::Internal::Internal(
-    shared_ptr< map< string, RPCFunc > > funcs, shared_ptr<TcpSocket> s)
-        : _funcs(funcs), _socket(s) {
+    shared_ptr< map< string, RPCFunc > > funcs,
+    shared_ptr<Scheduler> scheduler, shared_ptr<Transport> s)
+        : _funcs(funcs), _scheduler(scheduler), _socket(s), _inFlight(0),
+          _inFlightBytes(0), _buffered(0), _paused(false),
+          _readPaused(false), _weight(1) {
+  pthread_mutex_init(&_lock, NULL);
 }
 
 RPCServer::Connection::Internal::~Internal() {
   _socket->setReceiveCallback(NULL);
   _socket->setDisconnectCallback(NULL);
+  _scheduler->setBuffered(_buffered, 0);
+  _scheduler->removeConnection();
+  pthread_mutex_destroy(&_lock);
 }
 
 void RPCServer::Connection::Internal::start() {
@@ -114,28 +400,49 @@ void RPCServer::Connection::Internal::disconnect() {
 }
 
 void RPCServer::Connection::Internal::responseCallback(
-    uint64_t id, Future<IOBuffer*> obj) {
-  msgpack::type::tuple<uint64_t, msgpack::type::raw_ref> ret(id, 
-      msgpack::type::raw_ref(
-          obj.get()->pulldown(obj.get()->size()),
-          obj.get()->size()));
+    uint64_t id, bool legacy, size_t bytes, Future<SlabBuffer*> obj) {
   IOBuffer *buf = new IOBuffer();
-  msgpack::pack(*buf, ret);
+  if (legacy) {
+    msgpack::type::tuple<uint64_t, msgpack::type::raw_ref> ret(id, 
+        msgpack::type::raw_ref(
+            obj.get()->data(), obj.get()->size()));
+    msgpack::pack(*buf, ret);
+  } else {
+    // The result is already msgpack encoded so it is copied in as is.
+    msgpack::packer<IOBuffer> pk(buf);
+    pk.pack_array(3);
+    pk.pack(id);
+    pk.pack(0);
+    buf->write(obj.get()->data(), obj.get()->size());
+  }
   delete obj.get();
   _socket->write(buf);
+
+  pthread_mutex_lock(&_lock);
+  _inFlight--;
+  _inFlightBytes -= bytes;
+  const bool paused = _paused;
+  _paused = false;
+  pthread_mutex_unlock(&_lock);
+  _scheduler->release(bytes);
+  if (paused) {
+    _socket->getEventManager()->enqueue(std::tr1::bind(
+        &Connection::Internal::resume, shared_from_this()));
+  }
 }
 
 void RPCServer::Connection::Internal::deferredRPCCall(
-    uint64_t id,
-    function<Future<IOBuffer*>(IOBuffer*)> func,
-    IOBuffer* args) {
-  Future<IOBuffer*> ret = func(args);
-  ret.addCallback(bind(&Connection::Internal::responseCallback, shared_from_this(), id, ret));
+    uint64_t id, bool legacy, size_t bytes,
+    function<Future<SlabBuffer*>(Payload*)> func,
+    Payload* args) {
+  Future<SlabBuffer*> ret = func(args);
+  ret.addCallback(bind(&Connection::Internal::responseCallback, shared_from_this(), id, legacy, bytes, ret));
 }
 
 void RPCServer::Connection::Internal::onReceive(IOBuffer *buf) {
-  // Note that this will never be called simultaneously from two threads so
-  // we're safe to process buffers here. 
+  // Note that this will never be called simultaneously from two threads but
+  // resume() may run alongside it.
+  pthread_mutex_lock(&_lock);
   const int buf_size = buf->size();
   const char *data = buf->pulldown(buf_size);
   if (data) {
@@ -143,32 +450,120 @@ void RPCServer::Connection::Internal::onReceive(IOBuffer *buf) {
     if (_pac.buffer_capacity() < buf_size) {
       LOG(ERROR) << "buf->size(): " << buf_size
                  << ", _pac.buffer_capacity(): " << _pac.buffer_capacity();
+      pthread_mutex_unlock(&_lock);
       return;
     }
     memcpy(_pac.buffer(), data, buf_size);
     _pac.buffer_consumed(buf_size);
     buf->consume(buf_size);
   }
+  parse();
+  pthread_mutex_unlock(&_lock);
+}
+
+void RPCServer::Connection::Internal::resume() {
+  pthread_mutex_lock(&_lock);
+  parse();
+  pthread_mutex_unlock(&_lock);
+}
+
+void RPCServer::Connection::Internal::parse() {
+  const Limits limits = _scheduler->getLimits();
   msgpack::unpacked result;
-  while (_pac.next(&result)) {
-    msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req;
-    result.get().convert(&req);
-    uint64_t id = req.get<0>();
-    string name = req.get<1>();
-    if (_funcs->find(name) != _funcs->end()) {
-      // Its bad mojo to do processing from the onReceive handler since its
-      // blocking further reads so we enqueue the function on a worker
-      // thread. Unfortuntely, msgpack hasn't been written with decent support
-      // for deep copying of objects so we pass a buffer around here that needs
-      // to be unpacked in the other thread.
-      _socket->getEventManager()->enqueue(bind(
-          &Connection::Internal::deferredRPCCall, shared_from_this(), id, 
-          _funcs->at(name), new IOBuffer(req.get<2>().ptr, req.get<2>().size)));
-    } else {
+  _paused = false;
+  for (;;) {
+    // A connection with too much running is left alone until its buffered
+    // input grows past its byte limit. Requests beyond that are shed.
+    const bool full = _inFlight >= limits.maxConnectionRequests;
+    if (full && _pac.nonparsed_size() <= limits.maxConnectionBytes) {
+      _paused = true;
+      break;
+    }
+    if (!_pac.next(&result)) {
+      break;
+    }
+    const msgpack::object &req = result.get();
+    if (req.type != msgpack::type::ARRAY || req.via.array.size < 3) {
+      LOG(ERROR) << "Malformed RPC request. Disconnecting.";
+      _socket->getEventManager()->enqueue(
+          std::tr1::bind(&Connection::Internal::disconnect, shared_from_this()));
+      break;
+    }
+    uint64_t id;
+    req.via.array.ptr[0].convert(&id);
+    string name;
+    req.via.array.ptr[1].convert(&name);
+    const msgpack::object &args = req.via.array.ptr[2];
+    const bool legacy = args.type == msgpack::type::RAW;
+    // Older clients don't send a priority.
+    int priority = REQUEST_CLIENT;
+    if (req.via.array.size > 3) {
+      req.via.array.ptr[3].convert(&priority);
+    }
+    if (priority < 0 || priority >= NUM_REQUEST_PRIORITIES) {
+      priority = REQUEST_BACKGROUND;
+    }
+    if (_funcs->find(name) == _funcs->end()) {
       LOG(ERROR) << "Unknown RPC method: " << name << ". Disconnecting.";
       _socket->getEventManager()->enqueue(
           std::tr1::bind(&Connection::Internal::disconnect, shared_from_this()));
+      continue;
+    }
+    const size_t bytes = legacy ? args.via.raw.size : encodedSize(args);
+    if (full || _inFlightBytes + bytes > limits.maxConnectionBytes ||
+        !_scheduler->admit(bytes)) {
+      IOBuffer *buf = new IOBuffer();
+      if (legacy) {
+        msgpack::type::tuple<uint64_t, msgpack::type::raw_ref, int> ret(
+            id, msgpack::type::raw_ref(NULL, 0), kOverloaded);
+        msgpack::pack(*buf, ret);
+      } else {
+        msgpack::packer<IOBuffer> pk(buf);
+        pk.pack_array(3);
+        pk.pack(id);
+        pk.pack(kOverloaded);
+        pk.pack_nil();
+      }
+      _socket->write(buf);
+      continue;
     }
+    _inFlight++;
+    _inFlightBytes += bytes;
+    // Its bad mojo to do processing from the onReceive handler since its
+    // blocking further reads so we queue the function to run on a worker
+    // thread. The arguments go with the zone they were decoded into;
+    // legacy ones are copied and unpacked in the other thread.
+    Payload *payload = legacy ?
+        new Payload(args.via.raw.ptr, args.via.raw.size) :
+        new Payload(args, result.zone().release());
+    _scheduler->submit((RequestPriority)priority, this, _weight,
+        _socket->getEventManager(), bind(
+        &Connection::Internal::deferredRPCCall, shared_from_this(), id, 
+        legacy, bytes, _funcs->at(name), payload));
+  }
+
+  // Whatever is left over is at most one partial request, or requests
+  // held back while paused, which stay within maxConnectionBytes.
+  const size_t buffered = _pac.nonparsed_size();
+  const bool serverOk = _scheduler->setBuffered(_buffered, buffered);
+  _buffered = buffered;
+  if (buffered > limits.maxConnectionBytes) {
+    LOG(ERROR) << "Request larger than " << limits.maxConnectionBytes
+               << " bytes. Disconnecting.";
+    _socket->getEventManager()->enqueue(
+        std::tr1::bind(&Connection::Internal::disconnect, shared_from_this()));
+  } else if (!serverOk) {
+    LOG(ERROR) << "Server buffering more than " << limits.maxBufferedBytes
+               << " bytes of requests. Disconnecting.";
+    _socket->getEventManager()->enqueue(
+        std::tr1::bind(&Connection::Internal::disconnect, shared_from_this()));
+  }
+
+  // Stop reading while paused so the rest waits with the client. The
+  // transport doesn't call back from setPaused() so _lock can stay held.
+  if (_paused != _readPaused) {
+    _readPaused = _paused;
+    _socket->setPaused(_paused);
   }
 }
 
@@ -184,6 +579,10 @@ void RPCServer::Connection::Internal::onDisconnect() {
 }
 
 RPCClient::RPCClient(shared_ptr<TcpSocket> s)
+    : _internal(new Internal(TcpTransport::create(s))) {
+}
+
+RPCClient::RPCClient(shared_ptr<Transport> s)
     : _internal(new Internal(s)) {
 }
 
@@ -204,11 +603,97 @@ void RPCClient::setDisconnectCallback(std::tr1::function<void()> callback) {
   _internal->setDisconnectCallback(callback);
 }
 
-RPCClient::Internal::Internal(shared_ptr<TcpSocket> s)
-    : _socket(s), _reqId(0) {
+void RPCClient::setPriority(RequestPriority priority) {
+  _internal->_priority = priority;
+}
+
+void RPCClient::setOverloadCallback(std::tr1::function<void()> callback) {
+  _internal->_overloadCallback = callback;
+}
+
+void RPCClient::setLegacyFormat(bool legacy) {
+  _internal->_legacy = legacy;
+}
+
+RPCClient::ReconnectPolicy::ReconnectPolicy()
+    : minDelay(0.1), maxDelay(30.0), retryWindow(10.0) {
+}
+
+void RPCClient::setReconnect(
+    std::tr1::function<shared_ptr<Transport>()> connector,
+    const ReconnectPolicy &policy) {
+  pthread_mutex_lock(&_internal->_lock);
+  _internal->_connector = connector;
+  _internal->_policy = policy;
+  pthread_mutex_unlock(&_internal->_lock);
+}
+
+void RPCClient::setReconnectCallback(std::tr1::function<void()> callback) {
+  _internal->_reconnectCallback = callback;
+}
+
+bool RPCClient::isConnected() const {
+  pthread_mutex_lock(&_internal->_lock);
+  const bool connected = _internal->_connected;
+  pthread_mutex_unlock(&_internal->_lock);
+  return connected;
+}
+
+RPCClient::HeartbeatPolicy::HeartbeatPolicy() : interval(1.0) {
+}
+
+void RPCClient::setHeartbeat(const HeartbeatPolicy &policy) {
+  const EventManager::WallTime now = EventManager::currentTime();
+  pthread_mutex_lock(&_internal->_lock);
+  const bool started = _internal->_heartbeating;
+  _internal->_heartbeating = true;
+  _internal->_heartbeat = policy;
+  // Start the clock now so a server that never answers is found dead.
+  _internal->_detector = util::FailureDetector(policy.detector);
+  _internal->_detector.heartbeat(now);
+  _internal->_lastHeard = _internal->_lastHeartbeat = now;
+  pthread_mutex_unlock(&_internal->_lock);
+  if (!started) {
+    _internal->_em->enqueue(std::tr1::bind(&RPCClient::Internal::tickLater,
+                                           weak_ptr<Internal>(_internal)),
+                            now + policy.interval / 2);
+  }
+}
+
+util::FailureDetector::State RPCClient::health() const {
+  const EventManager::WallTime now = EventManager::currentTime();
+  util::FailureDetector::State state = util::FailureDetector::ALIVE;
+  pthread_mutex_lock(&_internal->_lock);
+  if (!_internal->_connected) {
+    state = util::FailureDetector::DEAD;
+  } else if (_internal->_heartbeating) {
+    state = _internal->_detector.state(now);
+  }
+  pthread_mutex_unlock(&_internal->_lock);
+  return state;
+}
+
+util::FailureDetector::Stats RPCClient::healthStats() const {
+  const EventManager::WallTime now = EventManager::currentTime();
+  pthread_mutex_lock(&_internal->_lock);
+  util::FailureDetector::Stats stats = _internal->_detector.stats(now);
+  if (!_internal->_connected) {
+    stats.state = util::FailureDetector::DEAD;
+  }
+  pthread_mutex_unlock(&_internal->_lock);
+  return stats;
+}
+
+RPCClient::Internal::Internal(shared_ptr<Transport> s)
+    : _em(s ? s->getEventManager() : NULL), _priority(REQUEST_CLIENT), _legacy(false),
+      _socket(s), _reqId(0), _connected(true), _closed(false), _delay(0),
+      _heartbeating(false), _pinging(false), _lastHeard(0),
+      _lastHeartbeat(0) {
+  pthread_mutex_init(&_lock, NULL);
 }
 
 RPCClient::Internal::~Internal() {
+  pthread_mutex_destroy(&_lock);
 }
 
 void RPCClient::Internal::start() {
@@ -222,21 +707,66 @@ void RPCClient::Internal::start() {
 }
 
 void RPCClient::Internal::disconnect() {
-  _socket->setReceiveCallback(NULL);
-  _socket->setDisconnectCallback(NULL);
-  _socket->disconnect();
-  for(map< uint64_t, function<void(IOBuffer*)> >::iterator i = 
-      _respCallbacks.begin(); i != _respCallbacks.end(); i++) {
+  map<uint64_t, Request> requests;
+  pthread_mutex_lock(&_lock);
+  _closed = true;
+  _connected = false;
+  shared_ptr<Transport> socket = _socket;
+  requests.swap(_requests);
+  pthread_mutex_unlock(&_lock);
+
+  socket->setReceiveCallback(NULL);
+  socket->setDisconnectCallback(NULL);
+  socket->disconnect();
+  for(map<uint64_t, Request>::iterator i = requests.begin();
+      i != requests.end(); i++) {
     LOG(WARNING) << "Pending callbacks for RPCClient will be aborted.";
-    i->second(NULL);
+    i->second.callback(NULL);
   }
-  _respCallbacks.clear();
 }
 
 void RPCClient::Internal::setDisconnectCallback(std::tr1::function<void()> callback) {
   _disconnectCallback = callback;
 }
 
+uint64_t RPCClient::Internal::nextId() {
+  pthread_mutex_lock(&_lock);
+  const uint64_t id = _reqId++;
+  pthread_mutex_unlock(&_lock);
+  return id;
+}
+
+void RPCClient::Internal::send(
+    uint64_t id, IOBuffer *buf,
+    std::tr1::function<void(Payload*)> callback, bool retryable) {
+  pthread_mutex_lock(&_lock);
+  retryable = retryable && _connector && !_closed;
+  if (!_connected && !retryable) {
+    pthread_mutex_unlock(&_lock);
+    delete buf;
+    _em->enqueue(std::tr1::bind(callback, (Payload *)NULL));
+    return;
+  }
+  Request &request = _requests[id];
+  request.callback = callback;
+  if (retryable) {
+    request.data.assign(buf->pulldown(buf->size()), buf->size());
+    request.deadline = EventManager::currentTime() + _policy.retryWindow;
+  }
+  // While the connection is down the request waits for reconnect().
+  shared_ptr<Transport> socket;
+  if (_connected) {
+    socket = _socket;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (socket) {
+    socket->write(buf);
+  } else {
+    delete buf;
+  }
+}
+
 void RPCClient::Internal::onReceive(IOBuffer *buf) {
   const int buf_size = buf->size();
   const char *data = buf->pulldown(buf_size);
@@ -253,31 +783,245 @@ void RPCClient::Internal::onReceive(IOBuffer *buf) {
     buf->consume(buf_size);
   }
   msgpack::unpacked result;
+  bool heardAny = false;
   while (_pac.next(&result)) {
-    msgpack::type::tuple<uint64_t, msgpack::type::raw_ref> req;
-    result.get().convert(&req);
-    uint64_t id = req.get<0>();
-    if (_respCallbacks.find(id) != _respCallbacks.end()) {
-      // Its bad mojo to do processing from the onReceive handler since its
-      // blocking further reads so we enqueue the function on a worker
-      // thread. Unfortuntely, msgpack hasn't been written with decent support
-      // for deep copying of objects so we pass a buffer around here that needs
-      // to be unpacked in the other thread.
-      _socket->getEventManager()->enqueue(std::tr1::bind(
-          _respCallbacks[id], 
-          new IOBuffer(req.get<1>().ptr, req.get<1>().size)));
-      _respCallbacks.erase(id);
-    } else {
+    const msgpack::object &resp = result.get();
+    if (resp.type != msgpack::type::ARRAY || resp.via.array.size < 2) {
+      LOG(ERROR) << "Malformed RPC response.";
+      continue;
+    }
+    if (!heardAny) {
+      heardAny = true;
+      heard(EventManager::currentTime());
+    }
+    uint64_t id;
+    resp.via.array.ptr[0].convert(&id);
+    pthread_mutex_lock(&_lock);
+    map<uint64_t, Request>::iterator request = _requests.find(id);
+    std::tr1::function<void(Payload*)> callback;
+    if (request != _requests.end()) {
+      callback = request->second.callback;
+      _requests.erase(request);
+    }
+    pthread_mutex_unlock(&_lock);
+    if (!callback) {
       LOG(ERROR) << "Unknown RPC response for ID: " << id;
+      continue;
+    }
+    // Legacy responses carry the result as a nested raw string.
+    const msgpack::object &second = resp.via.array.ptr[1];
+    int status = 0;
+    Payload *payload = NULL;
+    if (second.type == msgpack::type::RAW) {
+      if (resp.via.array.size > 2) {
+        resp.via.array.ptr[2].convert(&status);
+      }
+      if (status == 0) {
+        payload = new Payload(second.via.raw.ptr, second.via.raw.size);
+      }
+    } else {
+      second.convert(&status);
+      if (status == 0 && resp.via.array.size > 2) {
+        payload = new Payload(resp.via.array.ptr[2],
+                              result.zone().release());
+      }
     }
+    if (status == kOverloaded) {
+      LOG(WARNING) << "RPC server overloaded, call " << id << " rejected.";
+    }
+    // Its bad mojo to do processing from the onReceive handler since its
+    // blocking further reads so we enqueue the function on a worker
+    // thread.
+    _em->enqueue(std::tr1::bind(callback, payload));
+    if (status == kOverloaded && _overloadCallback) {
+      _overloadCallback();
+    }
+  }
+}
+
+void RPCClient::Internal::heard(EventManager::WallTime now) {
+  pthread_mutex_lock(&_lock);
+  _lastHeard = now;
+  // Responses to a busy connection arrive far more often than heartbeats
+  // would. Feeding every one to the detector would teach it to expect
+  // that, and suspect the server as soon as the connection goes quiet.
+  if (_heartbeating && now - _lastHeartbeat >= _heartbeat.interval / 2) {
+    _detector.heartbeat(now);
+    _lastHeartbeat = now;
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void RPCClient::Internal::tickLater(weak_ptr<Internal> internal) {
+  shared_ptr<Internal> self = internal.lock();
+  if (self) {
+    self->tick();
+  }
+}
+
+void RPCClient::Internal::tick() {
+  const EventManager::WallTime now = EventManager::currentTime();
+  pthread_mutex_lock(&_lock);
+  if (_closed) {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  const double period = _heartbeat.interval / 2;
+  const bool ping = _connected && !_pinging && now - _lastHeard >= period;
+  _pinging = _pinging || ping;
+  pthread_mutex_unlock(&_lock);
+
+  if (ping) {
+    const uint64_t id = nextId();
+    send(id, serializeRequest(id, kHeartbeat, REQUEST_CONTROL, _legacy,
+                              msgpack::type::make_define()),
+         std::tr1::bind(&RPCClient::Internal::onHeartbeat,
+                        weak_ptr<Internal>(shared_from_this()),
+                        std::tr1::placeholders::_1),
+         false);
+  }
+  _em->enqueue(std::tr1::bind(&RPCClient::Internal::tickLater,
+                              weak_ptr<Internal>(shared_from_this())),
+               now + period);
+}
+
+void RPCClient::Internal::onHeartbeat(weak_ptr<Internal> internal,
+                                      Payload *payload) {
+  delete payload;
+  shared_ptr<Internal> self = internal.lock();
+  if (self) {
+    pthread_mutex_lock(&self->_lock);
+    self->_pinging = false;
+    pthread_mutex_unlock(&self->_lock);
   }
 }
 
 void RPCClient::Internal::onDisconnect() {
+  vector< std::tr1::function<void(Payload*)> > failed;
+  pthread_mutex_lock(&_lock);
+  const bool reconnecting = _connector && !_closed;
+  _connected = false;
+  if (reconnecting) {
+    _delay = _policy.minDelay;
+  }
+  // Only retryable requests outlive the connection.
+  for (map<uint64_t, Request>::iterator i = _requests.begin();
+       i != _requests.end();) {
+    if (!reconnecting || i->second.data.empty()) {
+      failed.push_back(i->second.callback);
+      _requests.erase(i++);
+    } else {
+      ++i;
+    }
+  }
+  expire(EventManager::currentTime(), &failed);
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t i = 0; i < failed.size(); i++) {
+    _em->enqueue(std::tr1::bind(failed[i], (Payload *)NULL));
+  }
+  if (reconnecting) {
+    LOG(WARNING) << "RPC connection lost, reconnecting.";
+    scheduleReconnect();
+  }
   if (_disconnectCallback) {
     _disconnectCallback();
   }
 }
 
+void RPCClient::Internal::scheduleReconnect() {
+  pthread_mutex_lock(&_lock);
+  const double delay = _delay * (0.5 + 0.5 * rand() / RAND_MAX);
+  pthread_mutex_unlock(&_lock);
+  _em->enqueue(std::tr1::bind(&RPCClient::Internal::reconnectLater,
+                              weak_ptr<Internal>(shared_from_this())),
+               EventManager::currentTime() + delay);
+}
+
+void RPCClient::Internal::expire(
+    EventManager::WallTime now,
+    vector< std::tr1::function<void(Payload*)> > *failed) {
+  for (map<uint64_t, Request>::iterator i = _requests.begin();
+       i != _requests.end();) {
+    if (!i->second.data.empty() && now >= i->second.deadline) {
+      failed->push_back(i->second.callback);
+      _requests.erase(i++);
+    } else {
+      ++i;
+    }
+  }
+}
+
+void RPCClient::Internal::reconnectLater(weak_ptr<Internal> internal) {
+  shared_ptr<Internal> self = internal.lock();
+  if (self) {
+    self->reconnect();
+  }
+}
+
+void RPCClient::Internal::reconnect() {
+  pthread_mutex_lock(&_lock);
+  if (_closed || _connected) {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  std::tr1::function<shared_ptr<Transport>()> connector = _connector;
+  pthread_mutex_unlock(&_lock);
+
+  shared_ptr<Transport> socket = connector();
+
+  vector< std::tr1::function<void(Payload*)> > failed;
+  vector<IOBuffer *> resend;
+  pthread_mutex_lock(&_lock);
+  if (_closed) {
+    pthread_mutex_unlock(&_lock);
+    if (socket) {
+      socket->disconnect();
+    }
+    return;
+  }
+  // Whether or not we got through, give up on calls that have been
+  // retried for too long.
+  expire(EventManager::currentTime(), &failed);
+  if (socket) {
+    // Nothing reads the old connection any more, so drop what was left
+    // of it.
+    _pac.reset();
+    _pac.remove_nonparsed_buffer();
+    _socket = socket;
+    _connected = true;
+    // The outage says nothing about how often the server normally answers.
+    const EventManager::WallTime now = EventManager::currentTime();
+    _detector = util::FailureDetector(_heartbeat.detector);
+    _detector.heartbeat(now);
+    _lastHeard = _lastHeartbeat = now;
+    for (map<uint64_t, Request>::iterator i = _requests.begin();
+         i != _requests.end(); ++i) {
+      resend.push_back(new IOBuffer(i->second.data.data(),
+                                    i->second.data.size()));
+    }
+  } else {
+    _delay = std::min(_delay * 2, _policy.maxDelay);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t i = 0; i < failed.size(); i++) {
+    _em->enqueue(std::tr1::bind(failed[i], (Payload *)NULL));
+  }
+  if (!socket) {
+    scheduleReconnect();
+    return;
+  }
+  LOG(INFO) << "RPC connection re-established, resending "
+            << resend.size() << " calls.";
+  start();
+  for (size_t i = 0; i < resend.size(); i++) {
+    socket->write(resend[i]);
+  }
+  if (_reconnectCallback) {
+    _reconnectCallback();
+  }
+}
+
 }
 
@@ -29,6 +29,8 @@
 #ifndef _RPC_RPC_H_
 #define _RPC_RPC_H_
 
+#include <pthread.h>
+
 #include <map>
 #include <set>
 #include <string>
@@ -43,6 +45,10 @@
 #include <epoll_threadpool/iobuffer.h>
 #include <epoll_threadpool/tcp.h>
 
+#include "rpc/transport.h"
+#include "util/failuredetector.h"
+#include "util/slaballocator.h"
+
 namespace rpc {
 
 using epoll_threadpool::Future;
@@ -59,13 +65,160 @@ using std::tr1::function;
 using std::tr1::shared_ptr;
 using std::tr1::weak_ptr;
 using std::vector;
+using util::SlabBuffer;
 
 using namespace std::tr1;
 using namespace std::tr1::placeholders;
 
+/**
+ * Scheduling class of a request. It travels with the request and decides
+ * the order in which a busy server runs queued requests: a class is only
+ * served once every class before it has nothing waiting. Client reads and
+ * writes can therefore starve background scrub, GC and rebalance work, but
+ * never the other way round.
+ */
+enum RequestPriority {
+  REQUEST_CONTROL = 0,  // Membership and other cluster housekeeping.
+  REQUEST_CLIENT,       // Work a user is waiting on.
+  REQUEST_BACKGROUND,   // Scrub, repair, GC and rebalancing.
+  NUM_REQUEST_PRIORITIES
+};
+
+/**
+ * The arguments of a request or the result of a call as received. Either
+ * a msgpack object decoded in place from the connection, along with the
+ * zone that owns its memory, or, for the legacy format, a nested msgpack
+ * blob that is only unpacked when first needed.
+ */
+class Payload {
+ public:
+  /**
+   * Takes ownership of zone.
+   */
+  Payload(const msgpack::object &obj, msgpack::zone *zone)
+      : _obj(obj), _zone(zone), _decoded(true) { }
+  Payload(const char *data, size_t len)
+      : _zone(NULL), _raw(data, len), _decoded(false) { }
+  ~Payload() { delete _zone; }
+
+  const msgpack::object &get() {
+    if (!_decoded) {
+      msgpack::unpack(&_unpacked, _raw.data(), _raw.size());
+      _obj = _unpacked.get();
+      _decoded = true;
+    }
+    return _obj;
+  }
+
+ private:
+  Payload(const Payload &);
+  Payload &operator=(const Payload &);
+
+  msgpack::object _obj;
+  msgpack::zone *_zone;
+  msgpack::unpacked _unpacked;
+  SlabBuffer _raw;
+  bool _decoded;
+};
+
+/**
+ * Strips const and reference from an RPC argument type, giving the type
+ * the argument is decoded into. Functions may take arguments by const
+ * reference to use the decoded value in place instead of a copy.
+ */
+template<class T> struct RPCValue { typedef T type; };
+template<class T> struct RPCValue<const T> { typedef T type; };
+template<class T> struct RPCValue<T &> { typedef T type; };
+template<class T> struct RPCValue<const T &> { typedef T type; };
+
+/**
+ * How RPCClient::call() takes an argument of type T: by const reference,
+ * so it is packed straight from the caller's copy.
+ */
+template<class T> struct RPCArg {
+  typedef const typename RPCValue<T>::type &type;
+};
+template<> struct RPCArg<void> { };
+
+/**
+ * Names T without letting the compiler deduce template arguments from it.
+ */
+template<class T> struct RPCIdentity { typedef T type; };
+
+/**
+ * Describes an RPC method: its name, result type A and argument types
+ * A0 to A7. Define one per method in a header shared by a server and its
+ * clients, e.g.
+ *
+ *   const RPCMethod<string, const string &> kToUpper("toUpper");
+ *
+ * and pass it to RPCServer::registerFunction() and RPCClient::call() in
+ * place of the name. Both sides are then checked against the same
+ * signature when they are compiled.
+ *
+ * Methods that do no harm if run twice, such as reads, should be marked
+ * retryable so that a reconnecting client may resend them.
+ */
+template<class A, class A0 = void, class A1 = void, class A2 = void,
+         class A3 = void, class A4 = void, class A5 = void, class A6 = void,
+         class A7 = void>
+class RPCMethod {
+ public:
+  explicit RPCMethod(const string &name, bool retryable = false)
+      : _name(name), _retryable(retryable) { }
+
+  const string &name() const { return _name; }
+  bool retryable() const { return _retryable; }
+
+ private:
+  string _name;
+  bool _retryable;
+};
+
+/**
+ * Code that handles every arity is written once below and stamped out for
+ * 0 to 8 arguments. RPC_REPEAT_n(m) expands to m(0), ..., m(n-1) and
+ * RPC_COMMA_n to a comma when n is non-zero.
+ */
+#define RPC_REPEAT_0(m)
+#define RPC_REPEAT_1(m) m(0)
+#define RPC_REPEAT_2(m) RPC_REPEAT_1(m), m(1)
+#define RPC_REPEAT_3(m) RPC_REPEAT_2(m), m(2)
+#define RPC_REPEAT_4(m) RPC_REPEAT_3(m), m(3)
+#define RPC_REPEAT_5(m) RPC_REPEAT_4(m), m(4)
+#define RPC_REPEAT_6(m) RPC_REPEAT_5(m), m(5)
+#define RPC_REPEAT_7(m) RPC_REPEAT_6(m), m(6)
+#define RPC_REPEAT_8(m) RPC_REPEAT_7(m), m(7)
+#define RPC_COMMA_0
+#define RPC_COMMA_1 ,
+#define RPC_COMMA_2 ,
+#define RPC_COMMA_3 ,
+#define RPC_COMMA_4 ,
+#define RPC_COMMA_5 ,
+#define RPC_COMMA_6 ,
+#define RPC_COMMA_7 ,
+#define RPC_COMMA_8 ,
+
+#define RPC_CLASS(n) class A##n
+#define RPC_TYPE(n) A##n
+#define RPC_VALUE(n) typename RPCValue<A##n>::type
+#define RPC_PARAM(n) typename RPCArg<A##n>::type a##n
+#define RPC_ARG(n) a##n
+#define RPC_GET(n) tup.template get<n>()
+
 /**
  * Various helper functions used to serialize and deserialize arguments and
  * return values to msgpack format.
+ *
+ * Requests are (id, name, args, priority) and responses (id, status,
+ * result), where args and result are ordinary msgpack values written in
+ * the same pass as the header and read back without a second parse.
+ *
+ * The legacy format nests args and result as msgpack encoded raw strings
+ * instead: requests are (id, name, raw args[, priority]) and responses
+ * (id, raw result[, status]). Servers answer each request in the format it
+ * arrived in and clients read either, so old and new peers interoperate.
+ * Servers treat a request without a priority as REQUEST_CLIENT.
  */
 namespace {
 
@@ -74,23 +227,20 @@ namespace {
  * msgpack::object.
  */
 template<class A>
-void serializeFuture(Future<A> src, Future<IOBuffer*> dst) {
-  IOBuffer *buf = new IOBuffer();
+void serializeFuture(Future<A> src, Future<SlabBuffer*> dst) {
+  SlabBuffer *buf = new SlabBuffer();
   msgpack::pack(buf, src.get());
   dst.set(buf);
 }
 
 /**
- * Helper callback for Future that converts from type IOBuffer* to type A.
+ * Helper callback for Future that converts from type Payload* to type A.
  */
 template<class A>
-void deserializeFuture(Future<A> dst, Future<IOBuffer*> src) {
+void deserializeFuture(Future<A> dst, Future<Payload*> src) {
   if (src.get()) {
-    msgpack::unpacked msg;
-    msgpack::unpack(&msg, src.get()->pulldown(src.get()->size()), src.get()->size());
-    msgpack::object obj = msg.get();
     A a;
-    obj.convert(&a);
+    src.get()->get().convert(&a);
     dst.set(a);
     delete src.get();
   } else {
@@ -100,175 +250,53 @@ void deserializeFuture(Future<A> dst, Future<IOBuffer*> src) {
 }
 
 /**
- * Helper functions that converts 0-5 arguments into a valid msgpack object.
+ * Writes a request whose arguments are packed as args.
  */
-IOBuffer* serializeArgs(uint64_t id, const string& name) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<>());
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0> 
-IOBuffer* serializeArgs(uint64_t id, const string& name, A0 a0) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0>(a0));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0, class A1> 
-IOBuffer* serializeArgs(uint64_t id, const string& name, A0 a0, A1 a1) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0, A1>(a0, a1));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0, class A1, class A2> 
-IOBuffer* serializeArgs(uint64_t id, const string& name, A0 a0, A1 a1, A2 a2) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0, A1, A2>(a0, a1, a2));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0, class A1, class A2, class A3> 
-IOBuffer* serializeArgs(uint64_t id, const string& name, A0 a0, A1 a1, A2 a2, A3 a3) { 
+template<class T>
+IOBuffer* serializeRequest(uint64_t id, const string &name, int priority,
+                           bool legacy, const T &args) {
   IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0, A1, A2, A3>(a0, a1, a2, a3));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0, class A1, class A2, class A3, class A4> 
-IOBuffer* serializeArgs(uint64_t id, const string& name, A0 a0, A1 a1, A2 a2, A3 a3, A4 a4) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0, A1, A2, A3, A4>(a0, a1, a2, a3, a4));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
-  return buf;
-}
-template<class A0, class A1, class A2, class A3, class A4, class A5> 
-IOBuffer* serializeArgs(uint64_t id, const string &name, A0 a0, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5) { 
-  IOBuffer* buf = new IOBuffer();
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, msgpack::type::tuple<A0, A1, A2, A3, A4, A5>(a0, a1, a2, a3, a4, a5));
-  msgpack::type::tuple<uint64_t, string, msgpack::type::raw_ref> req(
-      id, name, msgpack::type::raw_ref(sbuf.data(), sbuf.size()));
-  msgpack::pack(buf, req);
+  msgpack::packer<IOBuffer> pk(buf);
+  pk.pack_array(4);
+  pk.pack(id);
+  pk.pack(name);
+  if (legacy) {
+    SlabBuffer sbuf;
+    msgpack::pack(sbuf, args);
+    pk.pack_raw(sbuf.size());
+    pk.pack_raw_body(sbuf.data(), sbuf.size());
+  } else {
+    pk.pack(args);
+  }
+  pk.pack(priority);
   return buf;
 }
 
 /**
- * Helper functions that converts a msgpack object back into 0-5 arguments.
+ * Decodes the arguments of a request and calls func with them.
  */
-template<class A>
-Future<IOBuffer*> deserializeArgs(function<Future<A>()> func, IOBuffer* args) {
-  Future<A> src = func();
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0, class A1>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0, A1> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>(), tup.template get<1>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0, class A1, class A2>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1, A2)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0, A1, A2> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>(),
-                       tup.template get<1>(), 
-                       tup.template get<2>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0, class A1, class A2, class A3>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1, A2, A3)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0, A1, A2, A3> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>(),
-                       tup.template get<1>(), 
-                       tup.template get<2>(), 
-                       tup.template get<3>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0, class A1, class A2, class A3, class A4>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1, A2, A3, A4)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0, A1, A2, A3, A4> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>(),
-                       tup.template get<1>(), 
-                       tup.template get<2>(), 
-                       tup.template get<3>(), 
-                       tup.template get<4>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
-}
-template<class A, class A0, class A1, class A2, class A3, class A4, class A5>
-Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1, A2, A3, A4, A5)> func, IOBuffer* args) {
-  msgpack::unpacked msg;
-  msgpack::unpack(&msg, args->pulldown(args->size()), args->size());
-  msgpack::type::tuple<A0, A1, A2, A3, A4, A5> tup;
-  msg.get().convert(&tup);
-  Future<A> src = func(tup.template get<0>(),
-                       tup.template get<1>(), 
-                       tup.template get<2>(), 
-                       tup.template get<3>(), 
-                       tup.template get<4>(), 
-                       tup.template get<5>());
-  Future<IOBuffer*> dst;
-  src.addCallback(bind(&serializeFuture<A>, src, dst));
-  delete args;
-  return dst;
+#define RPC_DESERIALIZE_ARGS(N) \
+template<class A RPC_COMMA_##N RPC_REPEAT_##N(RPC_CLASS)> \
+Future<SlabBuffer*> deserializeArgs( \
+    function<Future<A>(RPC_REPEAT_##N(RPC_TYPE))> func, Payload* args) { \
+  msgpack::type::tuple<RPC_REPEAT_##N(RPC_VALUE)> tup; \
+  args->get().convert(&tup); \
+  Future<A> src = func(RPC_REPEAT_##N(RPC_GET)); \
+  Future<SlabBuffer*> dst; \
+  src.addCallback(bind(&serializeFuture<A>, src, dst)); \
+  delete args; \
+  return dst; \
 }
+RPC_DESERIALIZE_ARGS(0)
+RPC_DESERIALIZE_ARGS(1)
+RPC_DESERIALIZE_ARGS(2)
+RPC_DESERIALIZE_ARGS(3)
+RPC_DESERIALIZE_ARGS(4)
+RPC_DESERIALIZE_ARGS(5)
+RPC_DESERIALIZE_ARGS(6)
+RPC_DESERIALIZE_ARGS(7)
+RPC_DESERIALIZE_ARGS(8)
+#undef RPC_DESERIALIZE_ARGS
 
 } // end anonymous namespace 
 
@@ -281,11 +309,15 @@ Future<IOBuffer*> deserializeArgs(function<Future<A>(A0, A1, A2, A3, A4, A5)> fu
  * callback can be used to keep track of these connections. If
  * not provided, the default behaviour is to store a reference to
  * all connections in the RPCServer itself, destroying them when
- * the server is shut down.
+ * the server is shut down. Accepted sockets may be wrapped in another
+ * Transport, such as SecureTransport, before being served. Transports
+ * obtained elsewhere, such as Multiplexer streams, can be passed to
+ * serve().
  */
 class RPCServer {
  private:
-  typedef function<Future<IOBuffer*>(IOBuffer*)> RPCFunc;
+  typedef function<Future<SlabBuffer*>(Payload*)> RPCFunc;
+  class Scheduler;
 
  public:
   /**
@@ -303,46 +335,76 @@ class RPCServer {
     void disconnect();
     void setDisconnectCallback(function<void()> f);
 
+    /**
+     * Sets this connection's share of the workers relative to others
+     * with requests of the same priority waiting: one of weight 2 has
+     * twice as many run as one of weight 1. Defaults to 1.
+     */
+    void setWeight(int weight);
+
    private:
     friend class RPCServer;
     Connection(shared_ptr< map<string, RPCFunc> > funcs, 
-               shared_ptr<TcpSocket> s);
+               shared_ptr<Scheduler> scheduler,
+               shared_ptr<Transport> s);
 
     class Internal : public enable_shared_from_this<Internal> {
      public:
       Internal(shared_ptr< map<string, RPCFunc> > funcs, 
-               shared_ptr<TcpSocket> s);
+               shared_ptr<Scheduler> scheduler,
+               shared_ptr<Transport> s);
       virtual ~Internal();
 
       void start();
       void disconnect();
       void setDisconnectCallback(function<void()> f);
 
-      void responseCallback(uint64_t id, Future<IOBuffer*> obj);
-      void deferredRPCCall(uint64_t id, 
-          function<Future<IOBuffer*>(IOBuffer*)> func,
-          IOBuffer* args);
+      void responseCallback(uint64_t id, bool legacy, size_t bytes,
+                            Future<SlabBuffer*> obj);
+      void deferredRPCCall(uint64_t id, bool legacy, size_t bytes,
+          function<Future<SlabBuffer*>(Payload*)> func,
+          Payload* args);
       void onReceive(IOBuffer *buf);
       void onDisconnect();
 
+      /**
+       * Takes requests off the unpacker, subject to the server's limits.
+       * Called with _lock held.
+       */
+      void parse();
+      void resume();
+
       static void cleanup(shared_ptr<Internal> ptr) {
         ptr.reset();
       }
 
-      shared_ptr<TcpSocket> _socket;
+      shared_ptr<Transport> _socket;
       msgpack::unpacker _pac;
       shared_ptr< map< string, RPCFunc > > _funcs;
+      shared_ptr<Scheduler> _scheduler;
       function<void()> _disconnectCallback;
+
+      pthread_mutex_t _lock;  // Guards _pac and the fields below.
+      size_t _inFlight;       // Requests admitted but not yet answered.
+      size_t _inFlightBytes;  // Argument bytes of those requests.
+      size_t _buffered;       // Unparsed input counted by the Scheduler.
+      bool _paused;           // Parsing stopped at the request limit.
+      bool _readPaused;       // Whether _socket has been paused.
+      int _weight;            // See setWeight().
     };
     shared_ptr<Internal> _internal;
   };
 
   /**
    * Consumes a TcpListenSocket, using it to run
-   * an RPC service.
+   * an RPC service. The socket may be null if connections are only
+   * passed in through serve().
+   * @param wrap optionally builds the transport each accepted connection
+   *        is served over.
    */
-  static shared_ptr<RPCServer> create(shared_ptr<TcpListenSocket> s) {
-    return shared_ptr<RPCServer>(new RPCServer(s));
+  static shared_ptr<RPCServer> create(shared_ptr<TcpListenSocket> s,
+                                      TransportFactory wrap = NULL) {
+    return shared_ptr<RPCServer>(new RPCServer(s, wrap));
   }
   virtual ~RPCServer();
 
@@ -358,65 +420,92 @@ class RPCServer {
    */
   void setAcceptCallback(function<void(shared_ptr<Connection>)> f);
 
+  /**
+   * Sets how many requests may run on worker threads at once. Requests
+   * beyond this wait in per-priority queues, served weighted round robin
+   * between connections within a priority (see Connection::setWeight()).
+   * Defaults to kDefaultMaxRunning.
+   */
+  void setMaxRunning(int n);
+  static const int kDefaultMaxRunning = 16;
+
+  /**
+   * Bounds the work the server takes on. Requests count against the
+   * limits from when they are read until their response is written.
+   *
+   * A connection at its request limit is no longer parsed or read from,
+   * leaving later requests buffered, until its buffered input reaches
+   * maxConnectionBytes. Requests beyond that, or beyond any of the other
+   * limits, are answered straight away with an overload response so the
+   * client can back off or try another replica. A single request larger
+   * than maxConnectionBytes disconnects the client, as does input that
+   * takes the server's unparsed input past maxBufferedBytes. Connections
+   * past maxConnections are closed as soon as they are accepted.
+   */
+  struct Limits {
+    Limits();
+
+    size_t maxConnections;
+    size_t maxRequests;            // In flight over all connections.
+    size_t maxBytes;               // Argument bytes over all connections.
+    size_t maxConnectionRequests;  // In flight on one connection.
+    size_t maxConnectionBytes;     // Buffered or in flight on one.
+    size_t maxBufferedBytes;       // Unparsed input over all connections.
+  };
+  void setLimits(const Limits &limits);
+
+  /**
+   * Serves RPCs over an already connected transport, handling it
+   * exactly as an accepted connection.
+   */
+  void serve(shared_ptr<Transport> t);
+
   /**
    * Registers RPC functions. Functions *must* return results via a Future.
+   * They take up to 8 arguments, by value or by const reference, and are
+   * registered under a name or, better, an RPCMethod.
    */
-  template<class A>
-  void registerFunction(const string name, function<Future<A>()> f);
-  template<class A, class B>
-  void registerFunction(const string name, function<Future<A>(B)> f);
-  template<class A, class B, class C>
-  void registerFunction(const string name, function<Future<A>(B,C)> f);
-  template<class A, class B, class C, class D>
-  void registerFunction(const string name, function<Future<A>(B,C,D)> f);
-  template<class A, class B, class C, class D, class E>
-  void registerFunction(const string name, function<Future<A>(B,C,D,E)> f);
-  template<class A, class B, class C, class D, class E, class F>
-  void registerFunction(const string name, function<Future<A>(B,C,D,E,F)> f);
+#define RPC_REGISTER_FUNCTION(N) \
+  template<class A RPC_COMMA_##N RPC_REPEAT_##N(RPC_CLASS)> \
+  void registerFunction(const string &name, \
+                        function<Future<A>(RPC_REPEAT_##N(RPC_TYPE))> f) { \
+    (*_funcs)[name] = bind( \
+        &deserializeArgs<A RPC_COMMA_##N RPC_REPEAT_##N(RPC_TYPE)>, f, _1); \
+  } \
+  template<class A RPC_COMMA_##N RPC_REPEAT_##N(RPC_CLASS)> \
+  void registerFunction( \
+      const RPCMethod<A RPC_COMMA_##N RPC_REPEAT_##N(RPC_TYPE)> &method, \
+      function<typename RPCIdentity< \
+          Future<A>(RPC_REPEAT_##N(RPC_TYPE))>::type> f) { \
+    registerFunction<A RPC_COMMA_##N RPC_REPEAT_##N(RPC_TYPE)>( \
+        method.name(), f); \
+  }
+  RPC_REGISTER_FUNCTION(0)
+  RPC_REGISTER_FUNCTION(1)
+  RPC_REGISTER_FUNCTION(2)
+  RPC_REGISTER_FUNCTION(3)
+  RPC_REGISTER_FUNCTION(4)
+  RPC_REGISTER_FUNCTION(5)
+  RPC_REGISTER_FUNCTION(6)
+  RPC_REGISTER_FUNCTION(7)
+  RPC_REGISTER_FUNCTION(8)
+#undef RPC_REGISTER_FUNCTION
 
  protected:
-  RPCServer(shared_ptr<TcpListenSocket> s);
+  RPCServer(shared_ptr<TcpListenSocket> s, TransportFactory wrap);
 
  private:
   void onAccept(shared_ptr<TcpSocket> s);
 
   shared_ptr<TcpListenSocket> _socket;
+  TransportFactory _wrap;
   shared_ptr< map< string, RPCFunc > > _funcs;
+  shared_ptr<Scheduler> _scheduler;
+  pthread_mutex_t _lock;  // Guards _connections.
   set< shared_ptr<Connection> > _connections;
   function<void(shared_ptr<Connection> conn)> _acceptCallback;
 };
 
-template<class A>
-void RPCServer::registerFunction(
-    const string name, function<Future<A>()> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A>, f, _1);
-}
-template<class A, class B>
-void RPCServer::registerFunction(const string name, 
-    function<Future<A>(B)> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A, B>, f, _1);
-}
-template<class A, class B, class C>
-void RPCServer::registerFunction(
-    const string name, function<Future<A>(B, C)> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A, B, C>, f, _1);
-}
-template<class A, class B, class C, class D>
-void RPCServer::registerFunction(
-    const string name, function<Future<A>(B, C, D)> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A, B, C, D>, f, _1);
-}
-template<class A, class B, class C, class D, class E>
-void RPCServer::registerFunction(
-    const string name, function<Future<A>(B, C, D, E)> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A, B, C, D, E>, f, _1);
-}
-template<class A, class B, class C, class D, class E, class F>
-void RPCServer::registerFunction(
-    const string name, function<Future<A>(B, C, D, E, F)> f) {
-  (*_funcs)[name] = bind(&deserializeArgs<A, B, C, D, E, F>, f, _1);
-}
-
 /**
  * Connects to a given RPC server and maintains the connection.
  * Will optionally notify on disconnect and provide a blocking
@@ -425,6 +514,7 @@ void RPCServer::registerFunction(
 class RPCClient {
  public:
   RPCClient(shared_ptr<TcpSocket> s);
+  RPCClient(shared_ptr<Transport> s);
   virtual ~RPCClient();
 
   /**
@@ -439,25 +529,142 @@ class RPCClient {
    */
   void disconnect();
 
-  template<class A>
-  Future<A> call(const string name);
-  template<class A, class B>
-  Future<A> call(const string name, B a1);
-  template<class A, class B, class C>
-  Future<A> call(const string name, B a1, C a2);
-  template<class A, class B, class C, class D>
-  Future<A> call(const string name, B a1, C a2, D a3);
-  template<class A, class B, class C, class D, class E>
-  Future<A> call(const string name, B a1, C a2, D a3, E a4);
-  template<class A, class B, class C, class D, class E, class F>
-  Future<A> call(const string name, B a1, C a2, D a3, E a4, F a5);
+  /**
+   * Calls a function on the server, by name or by RPCMethod, with up to 8
+   * arguments. The returned Future is set to a default value if the call
+   * fails.
+   */
+#define RPC_CALL(N) \
+  template<class A RPC_COMMA_##N RPC_REPEAT_##N(RPC_CLASS)> \
+  Future<A> call(const string &name RPC_COMMA_##N \
+                 RPC_REPEAT_##N(RPC_PARAM)) { \
+    return send<A>(name, false, \
+                   msgpack::type::make_define(RPC_REPEAT_##N(RPC_ARG))); \
+  } \
+  template<class A RPC_COMMA_##N RPC_REPEAT_##N(RPC_CLASS)> \
+  Future<A> call( \
+      const RPCMethod<A RPC_COMMA_##N RPC_REPEAT_##N(RPC_TYPE)> &method \
+      RPC_COMMA_##N RPC_REPEAT_##N(RPC_PARAM)) { \
+    return send<A>(method.name(), method.retryable(), \
+                   msgpack::type::make_define(RPC_REPEAT_##N(RPC_ARG))); \
+  }
+  RPC_CALL(0)
+  RPC_CALL(1)
+  RPC_CALL(2)
+  RPC_CALL(3)
+  RPC_CALL(4)
+  RPC_CALL(5)
+  RPC_CALL(6)
+  RPC_CALL(7)
+  RPC_CALL(8)
+#undef RPC_CALL
 
   void setDisconnectCallback(function<void()> callback);
 
+  /**
+   * Sets the priority of subsequent calls. Defaults to REQUEST_CLIENT.
+   */
+  void setPriority(RequestPriority priority);
+
+  /**
+   * Registers a callback to run whenever the server turns a call away
+   * because it is overloaded. The call's Future is set to a default
+   * value, as it is when the connection drops.
+   */
+  void setOverloadCallback(function<void()> callback);
+
+  /**
+   * Sends subsequent calls in the legacy nested format, for servers that
+   * predate the single pass one.
+   */
+  void setLegacyFormat(bool legacy);
+
+  /**
+   * How a client reconnects after setReconnect().
+   */
+  struct ReconnectPolicy {
+    ReconnectPolicy();
+
+    double minDelay;     // Seconds before the first attempt.
+    double maxDelay;     // Longest wait between attempts.
+    double retryWindow;  // How long retryable calls may keep being resent.
+  };
+
+  /**
+   * Makes the client reconnect through connector whenever its connection
+   * drops rather than fail for good. The delay between attempts doubles
+   * from minDelay up to maxDelay, each randomly shortened by up to half so
+   * that peers who lost each other at once don't retry in step.
+   *
+   * Calls to retryable RPCMethods that were in flight when the connection
+   * dropped, or that are made while it is down, are sent once it is back.
+   * Once retryWindow has passed since one was first made it fails at the
+   * next drop or reconnect attempt, even if the connection keeps coming
+   * back. Other calls fail straight away, as the server may already have
+   * run them.
+   */
+  void setReconnect(function<shared_ptr<Transport>()> connector,
+                    const ReconnectPolicy &policy = ReconnectPolicy());
+
+  /**
+   * Registers a callback to run each time the connection is re-established.
+   * The disconnect callback runs each time it drops.
+   */
+  void setReconnectCallback(function<void()> callback);
+
+  /**
+   * Returns false while the connection is down.
+   */
+  bool isConnected() const;
+
+  /**
+   * How a client watches its server's health after setHeartbeat().
+   */
+  struct HeartbeatPolicy {
+    HeartbeatPolicy();
+
+    double interval;  // Longest an idle connection goes without a heartbeat.
+    util::FailureDetector::Options detector;
+  };
+
+  /**
+   * Tracks the server's health with a phi accrual failure detector. Every
+   * response counts as a heartbeat, so a busy connection costs nothing
+   * extra; one that has been quiet for half the interval sends a small
+   * control priority heartbeat call. Only servers built with this call
+   * answer it, and older ones drop the connection instead.
+   */
+  void setHeartbeat(const HeartbeatPolicy &policy = HeartbeatPolicy());
+
+  /**
+   * Returns DEAD while the connection is down. Otherwise returns the
+   * failure detector's view of the server, or ALIVE without one.
+   */
+  util::FailureDetector::State health() const;
+
+  /**
+   * Returns the failure detector's statistics, for monitoring.
+   */
+  util::FailureDetector::Stats healthStats() const;
+
  private:
+  /**
+   * Writes a request for name with the packed arguments args.
+   */
+  template<class A, class T>
+  Future<A> send(const string &name, bool retryable, const T &args) {
+    Future<A> ret;
+    const uint64_t id = _internal->nextId();
+    _internal->send(id, serializeRequest(id, name, _internal->_priority,
+                                         _internal->_legacy, args),
+                    bind(&deserializeFuture<A>, ret, placeholders::_1),
+                    retryable);
+    return ret;
+  }
+
   class Internal : public enable_shared_from_this<Internal> {
    public:
-    Internal(shared_ptr<TcpSocket> s);
+    Internal(shared_ptr<Transport> s);
     virtual ~Internal();
 
     void start();
@@ -466,69 +673,73 @@ class RPCClient {
     void onReceive(IOBuffer *buf);
     void onDisconnect();
 
+    uint64_t nextId();
+    void send(uint64_t id, IOBuffer *buf, function<void(Payload*)> callback,
+              bool retryable);
+
+    /**
+     * Attempts to reconnect, scheduling another attempt if it fails.
+     */
+    void reconnect();
+    void scheduleReconnect();
+
+    /**
+     * Removes requests past their retry deadline, collecting their
+     * callbacks. Call with _lock held.
+     */
+    void expire(EventManager::WallTime now,
+                vector< function<void(Payload*)> > *failed);
+    static void reconnectLater(weak_ptr<Internal> internal);
+
+    /**
+     * Feeds the failure detector as responses arrive, and sends a
+     * heartbeat call when the connection has been quiet.
+     */
+    void heard(EventManager::WallTime now);
+    void tick();
+    static void tickLater(weak_ptr<Internal> internal);
+    static void onHeartbeat(weak_ptr<Internal> internal, Payload *payload);
+
+    /**
+     * A call awaiting its response. Retryable calls keep a copy of their
+     * request to resend after reconnecting, until retryWindow after they
+     * were first sent.
+     */
+    struct Request {
+      Request() : deadline(0) { }
+
+      function<void(Payload*)> callback;
+      string data;
+      EventManager::WallTime deadline;
+    };
+
    //private:
     function<void()> _disconnectCallback;
-    shared_ptr<TcpSocket> _socket;
+    function<void()> _reconnectCallback;
+    function<void()> _overloadCallback;
+    function<shared_ptr<Transport>()> _connector;
+    ReconnectPolicy _policy;
+    EventManager *_em;
     msgpack::unpacker _pac;
+    int _priority;
+    bool _legacy;
+
+    mutable pthread_mutex_t _lock;  // Guards the fields below.
+    shared_ptr<Transport> _socket;
     uint64_t _reqId;
-    map< uint64_t, function<void(IOBuffer*)> > _respCallbacks;
+    map<uint64_t, Request> _requests;
+    bool _connected;
+    bool _closed;                     // disconnect() was called.
+    double _delay;                    // Before the next reconnect attempt.
+    bool _heartbeating;               // setHeartbeat() was called.
+    bool _pinging;                    // A heartbeat call is in flight.
+    HeartbeatPolicy _heartbeat;
+    util::FailureDetector _detector;
+    EventManager::WallTime _lastHeard;      // Any response.
+    EventManager::WallTime _lastHeartbeat;  // Last fed to _detector.
   };
   shared_ptr<Internal> _internal;
 };
 
-template<class A>
-Future<A> RPCClient::call(const string name) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs(
-      _internal->_reqId++, name));
-  return ret;
-}
-template<class A, class A0>
-Future<A> RPCClient::call(const string name, A0 a0) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs<A0>(
-      _internal->_reqId++, name, a0));
-  return ret;
-}
-template<class A, class A0, class A1>
-Future<A> RPCClient::call(const string name, A0 a0, A1 a1) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs<A0, A1>(
-      _internal->_reqId++, name, a0, a1));
-  return ret;
-}
-template<class A, class A0, class A1, class A2>
-Future<A> RPCClient::call(const string name, A0 a0, A1 a1, A2 a2) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs<A0, A1, A2>(
-      _internal->_reqId++, name, a0, a1, a2));
-  return ret;
-}
-template<class A, class A0, class A1, class A2, class A3>
-Future<A> RPCClient::call(const string name, A0 a0, A1 a1, A2 a2, A3 a3) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs<A0, A1, A2>(
-      _internal->_reqId++, name, a0, a1, a2, a3));
-  return ret;
-}
-template<class A, class A0, class A1, class A2, class A3, class A4>
-Future<A> RPCClient::call(const string name, A0 a0, A1 a1, A2 a2, A3 a3, A4 a4) {
-  Future<A> ret;
-  _internal->_respCallbacks[_internal->_reqId] =
-      bind(&deserializeFuture<A>, ret, placeholders::_1);
-  _internal->_socket->write(serializeArgs<A0, A1, A2, A3, A4>(
-      _internal->_reqId++, name, a0, a1, a2, a3, a4));
-  return ret;
-}
 }  // end rpc namespace
 #endif
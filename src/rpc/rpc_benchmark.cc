@@ -28,6 +28,7 @@
 */
 #include "rpc.h"
 
+#include "util/slaballocator.h"
 #include "util/url.h"
 
 #include <epoll_threadpool/eventmanager.h>
@@ -107,6 +108,7 @@ TEST(RPCClient, Benchmark) {
   CountingNotification *n[kNumThreads];
   shared_ptr<RPCClient> c[kNumThreads];
 
+  const util::SlabAllocator::Stats before = util::SlabAllocator::stats();
   LOG(INFO) << "Launching";
   for (int i = 0; i < kNumThreads; i++) {
     c[i].reset(new RPCClient(TcpSocket::connect(&em, "127.0.0.1", port)));
@@ -127,5 +129,13 @@ TEST(RPCClient, Benchmark) {
   }
   LOG(INFO) << "Done";
 
+  // Frame buffers should come from the slab free lists once warmed up.
+  const util::SlabAllocator::Stats after = util::SlabAllocator::stats();
+  LOG(INFO) << "Slab buffers: "
+            << (after.allocations - before.allocations) << " malloced, "
+            << (after.reuses - before.reuses) << " reused, "
+            << (after.frees - before.frees) << " freed over "
+            << kNumCalls << " calls.";
+
   pthread_mutex_destroy(&m);
 }
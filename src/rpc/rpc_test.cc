@@ -35,13 +35,17 @@
 #include <epoll_threadpool/tcp.h>
 #include <msgpack.hpp>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include <pthread.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include <gtest/gtest.h>
 
 using epoll_threadpool::EventManager;
+using epoll_threadpool::Future;
 using epoll_threadpool::Notification;
 using epoll_threadpool::TcpListenSocket;
 using epoll_threadpool::TcpSocket;
@@ -100,6 +104,14 @@ int addArgs5(int a, int b, int c, int d, int e) {
   return a + b + c + d + e;
 }
 
+int addArgs8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a + b + c + d + e + f + g + h;
+}
+
+size_t totalSize(const string &a, const vector<int> &b) {
+  return a.size() + b.size();
+}
+
 string toUpperStr(string in) {
   for (size_t i = 0; i < in.size(); ++i) {
     in[i] = ::toupper(in[i]);
@@ -290,5 +302,491 @@ TEST(RPCClient, Basics) {
   c.disconnect();
 }
 
+TEST(RPCClient, LegacyFormat) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<string, string>("toUpper", &toUpperStr);
+  r->registerFunction< int, vector<int> >("complexArgs", &complexArgs);
+  r->registerFunction< vector<int> >("complexRet", &complexRet);
+  r->registerFunction<int, int, int>("addArgs2", &addArgs2);
+  r->start();
+
+  // The server answers both formats on the same connection.
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  c.start();
+  vector<int> vec(3, 5);
+  for (int legacy = 0; legacy < 2; legacy++) {
+    c.setLegacyFormat(legacy);
+    string upper = c.call<string, string>("toUpper", "string");
+    EXPECT_EQ("STRING", upper);
+    int sum = c.call< int, vector<int> >("complexArgs", vec);
+    EXPECT_EQ(15, sum);
+    vector<int> ret = c.call< vector<int> >("complexRet");
+    EXPECT_EQ(3, ret.size());
+    sum = c.call<int, int, int>("addArgs2", 3, 4);
+    EXPECT_EQ(7, sum);
+  }
+  c.disconnect();
+}
+
+const rpc::RPCMethod<string, string> kToUpper("toUpper");
+const rpc::RPCMethod<int, int, int, int, int, int, int, int, int>
+    kAddArgs8("addArgs8");
+const rpc::RPCMethod<size_t, const string &, const vector<int> &>
+    kTotalSize("totalSize");
+
+TEST(RPCClient, Methods) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction(kToUpper, &toUpperStr);
+  r->registerFunction(kAddArgs8, &addArgs8);
+  r->registerFunction(kTotalSize, &totalSize);
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  c.start();
+  string upper = c.call(kToUpper, "string");
+  EXPECT_EQ("STRING", upper);
+  int sum = c.call(kAddArgs8, 1, 2, 3, 4, 5, 6, 7, 8);
+  EXPECT_EQ(36, sum);
+  size_t size = c.call(kTotalSize, string(1000, 'x'), vector<int>(24));
+  EXPECT_EQ(1024, size);
+
+  // Methods are registered by name, so name based calls reach them too.
+  sum = c.call<int, int, int, int, int, int, int, int, int>(
+      "addArgs8", 1, 1, 1, 1, 1, 1, 1, 1);
+  EXPECT_EQ(8, sum);
+  c.disconnect();
+}
+
+const rpc::RPCMethod<string, string> kToUpperRetryable("toUpper", true);
+pthread_mutex_t acceptedLock = PTHREAD_MUTEX_INITIALIZER;
+vector< shared_ptr<RPCServer::Connection> > accepted;
+
+void keepConnectionCallback(shared_ptr<RPCServer::Connection> c) {
+  pthread_mutex_lock(&acceptedLock);
+  accepted.push_back(c);
+  pthread_mutex_unlock(&acceptedLock);
+  c->start();
+}
+
+TEST(RPCClient, Reconnect) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction(kToUpper, &toUpperStr);
+  r->setAcceptCallback(std::tr1::bind(&keepConnectionCallback,
+                                      std::tr1::placeholders::_1));
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  RPCClient::ReconnectPolicy policy;
+  policy.minDelay = 0.5;
+  c.setReconnect(std::tr1::bind(&rpc::TcpTransport::connect, &em,
+                                "127.0.0.1", port), policy);
+  Notification down, up;
+  c.setDisconnectCallback(std::tr1::bind(&Notification::signal, &down));
+  c.setReconnectCallback(std::tr1::bind(&Notification::signal, &up));
+  c.start();
+  EXPECT_EQ("A", c.call(kToUpper, "a").get());
+  EXPECT_TRUE(c.isConnected());
+
+  // Drop the connection from the server end.
+  pthread_mutex_lock(&acceptedLock);
+  vector< shared_ptr<RPCServer::Connection> > conns(accepted);
+  pthread_mutex_unlock(&acceptedLock);
+  ASSERT_EQ(1u, conns.size());
+  conns[0]->disconnect();
+  down.wait();
+  EXPECT_FALSE(c.isConnected());
+
+  // Calls that aren't safe to repeat fail while the connection is down.
+  EXPECT_EQ("", c.call(kToUpper, "b").get());
+
+  // Retryable ones wait for the connection to come back.
+  Future<string> retried = c.call(kToUpperRetryable, "c");
+  up.wait();
+  EXPECT_TRUE(c.isConnected());
+  EXPECT_EQ("C", retried.get());
+  EXPECT_EQ("D", c.call(kToUpper, "d").get());
+  c.disconnect();
+  accepted.clear();
+}
+
+void dropConnectionCallback(shared_ptr<RPCServer::Connection> c) {
+  c->disconnect();
+}
+
+TEST(RPCClient, RetryDeadline) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction(kToUpper, &toUpperStr);
+  r->setAcceptCallback(std::tr1::bind(&keepConnectionCallback,
+                                      std::tr1::placeholders::_1));
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  RPCClient::ReconnectPolicy policy;
+  policy.minDelay = 0.1;
+  policy.maxDelay = 0.2;
+  policy.retryWindow = 1.0;
+  c.setReconnect(std::tr1::bind(&rpc::TcpTransport::connect, &em,
+                                "127.0.0.1", port), policy);
+  Notification down;
+  c.setDisconnectCallback(std::tr1::bind(&Notification::signal, &down));
+  c.start();
+  EXPECT_EQ("A", c.call(kToUpper, "a").get());
+
+  // From now on the server drops every connection as soon as it is made,
+  // so reconnecting keeps succeeding but the call is never answered.
+  r->setAcceptCallback(std::tr1::bind(&dropConnectionCallback,
+                                      std::tr1::placeholders::_1));
+  pthread_mutex_lock(&acceptedLock);
+  vector< shared_ptr<RPCServer::Connection> > conns(accepted);
+  accepted.clear();
+  pthread_mutex_unlock(&acceptedLock);
+  ASSERT_EQ(1u, conns.size());
+  conns[0]->disconnect();
+  down.wait();
+
+  Future<string> retried = c.call(kToUpperRetryable, "b");
+  EXPECT_EQ("", retried.get());
+  c.disconnect();
+}
+
+Notification gateEntered;
+Notification gateOpen;
+pthread_mutex_t runOrderLock = PTHREAD_MUTEX_INITIALIZER;
+vector<string> runOrder;
+
+int gate() {
+  gateEntered.signal();
+  gateOpen.wait();
+  return 0;
+}
+
+int record(string tag) {
+  pthread_mutex_lock(&runOrderLock);
+  runOrder.push_back(tag);
+  pthread_mutex_unlock(&runOrderLock);
+  return 0;
+}
+
+TEST(RPCServer, PriorityOrder) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<int>("gate", &gate);
+  r->registerFunction<int, string>("record", &record);
+  r->setMaxRunning(1);
+  r->start();
+
+  RPCClient background(TcpSocket::connect(&em, "127.0.0.1", port));
+  background.setPriority(rpc::REQUEST_BACKGROUND);
+  background.start();
+  RPCClient client(TcpSocket::connect(&em, "127.0.0.1", port));
+  client.start();
+
+  // Occupy the only slot so everything after this has to queue.
+  Future<int> blocked = background.call<int>("gate");
+  gateEntered.wait();
+  vector< Future<int> > calls;
+  for (int i = 0; i < 5; i++) {
+    calls.push_back(background.call<int, string>("record", "background"));
+  }
+  usleep(100000);
+  calls.push_back(client.call<int, string>("record", "client"));
+  usleep(100000);
+  gateOpen.signal();
+  blocked.wait();
+  for (size_t i = 0; i < calls.size(); i++) {
+    calls[i].wait();
+  }
+
+  // The client request arrived last but ran first.
+  ASSERT_EQ(6, runOrder.size());
+  EXPECT_EQ("client", runOrder[0]);
+  background.disconnect();
+  client.disconnect();
+}
+
+Notification weightGateEntered;
+Notification weightGateOpen;
+
+int weightGate() {
+  weightGateEntered.signal();
+  weightGateOpen.wait();
+  return 0;
+}
+
+void weightConnectionCallback(shared_ptr<RPCServer::Connection> c) {
+  pthread_mutex_lock(&acceptedLock);
+  // The first connection gets twice the share of the second.
+  c->setWeight(accepted.empty() ? 2 : 1);
+  accepted.push_back(c);
+  pthread_mutex_unlock(&acceptedLock);
+  c->start();
+}
+
+TEST(RPCServer, WeightedShare) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<int>("gate", &weightGate);
+  r->registerFunction<int, string>("record", &record);
+  r->setMaxRunning(1);
+  pthread_mutex_lock(&acceptedLock);
+  accepted.clear();
+  pthread_mutex_unlock(&acceptedLock);
+  r->setAcceptCallback(std::tr1::bind(&weightConnectionCallback,
+                                      std::tr1::placeholders::_1));
+  r->start();
+
+  RPCClient heavy(TcpSocket::connect(&em, "127.0.0.1", port));
+  heavy.start();
+  heavy.call<int, string>("record", "warmup").wait();
+  RPCClient light(TcpSocket::connect(&em, "127.0.0.1", port));
+  light.start();
+  pthread_mutex_lock(&runOrderLock);
+  runOrder.clear();
+  pthread_mutex_unlock(&runOrderLock);
+
+  // Occupy the only slot so everything after this has to queue.
+  Future<int> blocked = light.call<int>("gate");
+  weightGateEntered.wait();
+  vector< Future<int> > calls;
+  for (int i = 0; i < 6; i++) {
+    calls.push_back(heavy.call<int, string>("record", "heavy"));
+    calls.push_back(light.call<int, string>("record", "light"));
+  }
+  usleep(100000);
+  weightGateOpen.signal();
+  blocked.wait();
+  for (size_t i = 0; i < calls.size(); i++) {
+    calls[i].wait();
+  }
+
+  // While both had work queued, heavy ran two requests for each of light's.
+  ASSERT_EQ(12, runOrder.size());
+  const int heavyFirst =
+      std::count(runOrder.begin(), runOrder.begin() + 9, string("heavy"));
+  EXPECT_EQ(6, heavyFirst);
+  heavy.disconnect();
+  light.disconnect();
+  pthread_mutex_lock(&acceptedLock);
+  accepted.clear();
+  pthread_mutex_unlock(&acceptedLock);
+}
+
+Notification busyOpen;
+
+int busy() {
+  busyOpen.wait();
+  return 0;
+}
+
+void countOverload(int *n) {
+  __sync_fetch_and_add(n, 1);
+}
+
+TEST(RPCServer, Overload) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<int>("busy", &busy);
+  r->registerFunction<int, string>("record", &record);
+  RPCServer::Limits limits;
+  limits.maxConnectionRequests = 1;
+  limits.maxConnectionBytes = 4096;
+  r->setLimits(limits);
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  int overloads = 0;
+  c.setOverloadCallback(std::tr1::bind(&countOverload, &overloads));
+  c.start();
+
+  // With the one request slot taken, later requests are buffered until
+  // they pass the byte limit and are turned away after that.
+  Future<int> blocked = c.call<int>("busy");
+  vector< Future<int> > calls;
+  for (int i = 0; i < 20; i++) {
+    calls.push_back(c.call<int, string>("record", string(1000, 'x')));
+  }
+  usleep(100000);
+  EXPECT_LT(0, overloads);
+  EXPECT_GT(20, overloads);
+  busyOpen.signal();
+  blocked.wait();
+  for (size_t i = 0; i < calls.size(); i++) {
+    calls[i].wait();
+  }
+  c.disconnect();
+}
+
+TEST(RPCServer, OversizedRequest) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<int, string>("record", &record);
+  RPCServer::Limits limits;
+  limits.maxConnectionBytes = 4096;
+  r->setLimits(limits);
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  Notification down;
+  c.setDisconnectCallback(std::tr1::bind(&Notification::signal, &down));
+  c.start();
+
+  // A single request that can never fit is cut off even though no
+  // request slot is busy.
+  Future<int> f = c.call<int, string>("record", string(16384, 'x'));
+  down.wait();
+  EXPECT_FALSE(c.isConnected());
+}
+
+Notification stallOpen;
+
+int stall() {
+  stallOpen.wait();
+  return 0;
+}
+
+// Polls c until its health differs from state or timeout seconds pass.
+util::FailureDetector::State waitForChange(
+    const RPCClient &c, util::FailureDetector::State state, double timeout) {
+  for (int i = 0; i < timeout * 100 && c.health() == state; i++) {
+    usleep(10000);
+  }
+  return c.health();
+}
+
+TEST(RPCClient, Heartbeat) {
+  int port;
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(&em, port);
+  }
+  shared_ptr<RPCServer> r(RPCServer::create(s));
+  s.reset();
+  r->registerFunction<int>("stall", &stall);
+  r->setMaxRunning(1);
+  r->start();
+
+  RPCClient c(TcpSocket::connect(&em, "127.0.0.1", port));
+  RPCClient::HeartbeatPolicy policy;
+  policy.interval = 0.2;
+  policy.detector.minStdDev = 0.05;
+  policy.detector.acceptablePause = 0.1;
+  c.setHeartbeat(policy);
+  c.start();
+
+  // An idle connection is kept alive by heartbeats alone.
+  usleep(1000000);
+  EXPECT_EQ(util::FailureDetector::ALIVE, c.health());
+  EXPECT_LE(5u, c.healthStats().heartbeats);
+
+  // A server too busy to answer is first slow, then dead, while still
+  // connected.
+  RPCClient other(TcpSocket::connect(&em, "127.0.0.1", port));
+  other.start();
+  Future<int> stalled = other.call<int>("stall");
+  EXPECT_EQ(util::FailureDetector::SLOW,
+            waitForChange(c, util::FailureDetector::ALIVE, 5.0));
+  EXPECT_EQ(util::FailureDetector::DEAD,
+            waitForChange(c, util::FailureDetector::SLOW, 5.0));
+  EXPECT_TRUE(c.isConnected());
+
+  stallOpen.signal();
+  stalled.wait();
+  EXPECT_EQ(util::FailureDetector::ALIVE,
+            waitForChange(c, util::FailureDetector::DEAD, 5.0));
+  EXPECT_EQ(1u, c.healthStats().falseDeaths);
+  other.disconnect();
+  c.disconnect();
+  EXPECT_EQ(util::FailureDetector::DEAD, c.health());
+}
+
 // TODO: Test what happens when we leave an RPCServer connected to an RPCClient and go out of scope. Client should close then server.
 // TODO: Test what happens when we delete a server with active client.
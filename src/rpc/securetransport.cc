@@ -0,0 +1,626 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "securetransport.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <glog/logging.h>
+
+#include "util/sha256.h"
+
+namespace rpc {
+
+using util::BlockCipher;
+
+namespace {
+const uint8_t kVersion = 1;
+
+// Handshake message types.
+const uint8_t kClientHello = 1;
+const uint8_t kServerHello = 2;
+const uint8_t kClientFinished = 3;
+
+// ServerHello modes.
+const uint8_t kModeFull = 0;
+const uint8_t kModeResumed = 1;
+
+const size_t kRandomSize = 32;
+const size_t kPublicKeySize = 32;
+const size_t kMacSize = 32;
+
+/**
+ * Every record is preceded by its length as a 4 byte little endian value.
+ */
+const size_t kLengthSize = 4;
+
+// type, version, random, public key, ticket length.
+const size_t kClientHelloSize = 2 + kRandomSize + kPublicKeySize + 2;
+// type, mode, random, public key.
+const size_t kServerHelloCoreSize = 2 + kRandomSize + kPublicKeySize;
+
+// Ticket contents: resumption secret and expiry time.
+const size_t kTicketDataSize = SecureContext::kKeySize + 8;
+const size_t kTicketSize = kTicketDataSize + BlockCipher::kOverhead;
+
+void putLE(char *p, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+uint64_t getLE(const char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++) {
+    v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+  }
+  return v;
+}
+
+string encodeLE(uint64_t v, size_t n) {
+  string s(n, 0);
+  putLE(&s[0], v, n);
+  return s;
+}
+
+string hmac(const string &key, const string &data) {
+  unsigned char out[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  HMAC(EVP_sha256(), key.data(), key.size(),
+       (const unsigned char *)data.data(), data.size(), out, &len);
+  return string((const char *)out, len);
+}
+
+bool macEqual(const string &a, const char *b) {
+  return a.size() == kMacSize && CRYPTO_memcmp(a.data(), b, kMacSize) == 0;
+}
+
+string randomBytes(size_t n) {
+  string s(n, 0);
+  if (RAND_bytes((unsigned char *)&s[0], n) != 1) {
+    LOG(FATAL) << "Unable to generate random bytes.";
+  }
+  return s;
+}
+
+/**
+ * Generates an ephemeral X25519 key pair, returning its public half.
+ */
+EVP_PKEY *generateKey(string *pub) {
+  EVP_PKEY *key = NULL;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+  size_t len = kPublicKeySize;
+  pub->assign(kPublicKeySize, 0);
+  if (!ctx || EVP_PKEY_keygen_init(ctx) != 1 ||
+      EVP_PKEY_keygen(ctx, &key) != 1 ||
+      EVP_PKEY_get_raw_public_key(key, (unsigned char *)&(*pub)[0],
+                                  &len) != 1) {
+    LOG(FATAL) << "Unable to generate an X25519 key.";
+  }
+  EVP_PKEY_CTX_free(ctx);
+  return key;
+}
+
+/**
+ * Computes the X25519 shared secret between key and a peer's public key.
+ */
+bool agree(EVP_PKEY *key, const char *peerPub, string *secret) {
+  EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(
+      EVP_PKEY_X25519, NULL, (const unsigned char *)peerPub, kPublicKeySize);
+  EVP_PKEY_CTX *ctx = peer ? EVP_PKEY_CTX_new(key, NULL) : NULL;
+  size_t len = 32;
+  secret->assign(len, 0);
+  bool ok = ctx && EVP_PKEY_derive_init(ctx) == 1 &&
+      EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+      EVP_PKEY_derive(ctx, (unsigned char *)&(*secret)[0], &len) == 1;
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(peer);
+  return ok;
+}
+}  // end anonymous namespace
+
+SecureContext::SecureContext(const string &psk, int ticketLifetime)
+    : _psk(psk), _ticketLifetime(ticketLifetime),
+      _tickets(hmac(psk, "rawdish session ticket key")) {
+  CHECK_EQ(kKeySize, psk.size());
+  pthread_mutex_init(&_lock, NULL);
+}
+
+SecureContext::~SecureContext() {
+  pthread_mutex_destroy(&_lock);
+}
+
+shared_ptr<Transport> SecureContext::clientTransport(
+    shared_ptr<Transport> lower, const string &peer) {
+  if (!lower) {
+    return lower;
+  }
+  return shared_ptr<Transport>(
+      new SecureTransport(shared_from_this(), lower, true, peer));
+}
+
+shared_ptr<Transport> SecureContext::serverTransport(
+    shared_ptr<Transport> lower) {
+  if (!lower) {
+    return lower;
+  }
+  return shared_ptr<Transport>(
+      new SecureTransport(shared_from_this(), lower, false, ""));
+}
+
+void SecureContext::forgetSession(const string &peer) {
+  pthread_mutex_lock(&_lock);
+  _sessions.erase(peer);
+  pthread_mutex_unlock(&_lock);
+}
+
+SecureContext::Stats SecureContext::stats() {
+  pthread_mutex_lock(&_lock);
+  Stats ret = _stats;
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+bool SecureContext::findSession(const string &peer, Session *session) {
+  pthread_mutex_lock(&_lock);
+  map<string, Session>::iterator i = _sessions.find(peer);
+  bool found = i != _sessions.end();
+  if (found) {
+    *session = i->second;
+  }
+  pthread_mutex_unlock(&_lock);
+  return found;
+}
+
+void SecureContext::saveSession(const string &peer, const Session &session) {
+  pthread_mutex_lock(&_lock);
+  _sessions[peer] = session;
+  pthread_mutex_unlock(&_lock);
+}
+
+string SecureContext::sealTicket(const string &secret) {
+  string ticket(kTicketSize, 0);
+  char *data = &ticket[BlockCipher::kNonceSize];
+  memcpy(data, secret.data(), kKeySize);
+  putLE(data + kKeySize, time(NULL) + _ticketLifetime, 8);
+  if (!_tickets.encrypt(&ticket[0], kTicketDataSize, "ticket")) {
+    return "";
+  }
+  return ticket;
+}
+
+bool SecureContext::openTicket(const string &ticket, string *secret) {
+  if (ticket.size() != kTicketSize) {
+    return false;
+  }
+  string buf = ticket;
+  if (_tickets.decrypt(&buf[0], buf.size(), "ticket") !=
+      (ssize_t)kTicketDataSize) {
+    return false;
+  }
+  const char *data = &buf[BlockCipher::kNonceSize];
+  if ((time_t)getLE(data + kKeySize, 8) < time(NULL)) {
+    return false;
+  }
+  secret->assign(data, kKeySize);
+  return true;
+}
+
+void SecureContext::countHandshake(bool ok, bool resumed) {
+  pthread_mutex_lock(&_lock);
+  if (!ok) {
+    _stats.failedHandshakes++;
+  } else if (resumed) {
+    _stats.resumedHandshakes++;
+  } else {
+    _stats.fullHandshakes++;
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+SecureTransport::SecureTransport(shared_ptr<SecureContext> ctx,
+                                 shared_ptr<Transport> lower, bool client,
+                                 const string &peer)
+    : _ctx(ctx), _lower(lower), _client(client), _peer(peer),
+      _resumed(false),
+      _state(client ? STATE_SERVER_HELLO : STATE_CLIENT_HELLO),
+      _sendSeq(0), _recvSeq(0), _ephemeral(NULL) {
+  pthread_mutex_init(&_lock, NULL);
+}
+
+SecureTransport::~SecureTransport() {
+  _lower->setReceiveCallback(NULL);
+  _lower->setDisconnectCallback(NULL);
+  _lower->disconnect();
+  for (list<IOBuffer *>::iterator i = _pending.begin();
+       i != _pending.end(); ++i) {
+    delete *i;
+  }
+  EVP_PKEY_free(_ephemeral);
+  pthread_mutex_destroy(&_lock);
+}
+
+void SecureTransport::receiveThunk(weak_ptr<SecureTransport> t,
+                                   IOBuffer *buf) {
+  shared_ptr<SecureTransport> p = t.lock();
+  if (p) {
+    p->onReceive(buf);
+  }
+}
+
+void SecureTransport::disconnectThunk(weak_ptr<SecureTransport> t) {
+  shared_ptr<SecureTransport> p = t.lock();
+  if (p) {
+    p->onLowerDisconnect();
+  }
+}
+
+void SecureTransport::start() {
+  // The lower transport only holds weak references so dropping this
+  // transport tears the stack down.
+  weak_ptr<SecureTransport> self(shared_from_this());
+  _lower->setReceiveCallback(std::tr1::bind(
+      &SecureTransport::receiveThunk, self, std::tr1::placeholders::_1));
+  _lower->setDisconnectCallback(std::tr1::bind(
+      &SecureTransport::disconnectThunk, self));
+  _lower->start();
+
+  if (_client) {
+    SecureContext::Session session;
+    string ticket;
+    if (_ctx->findSession(_peer, &session)) {
+      ticket = session.ticket;
+      _offeredSecret = session.secret;
+    }
+    string pub;
+    _ephemeral = generateKey(&pub);
+    _random = randomBytes(kRandomSize);
+    _clientHello = string(1, kClientHello) + string(1, kVersion) + _random +
+        pub + encodeLE(ticket.size(), 2) + ticket;
+    sendRecord(_clientHello);
+  }
+}
+
+void SecureTransport::write(IOBuffer *buf) {
+  pthread_mutex_lock(&_lock);
+  if (_state == STATE_ESTABLISHED) {
+    sealAndSend(buf);
+  } else if (_state == STATE_CLOSED) {
+    delete buf;
+  } else {
+    _pending.push_back(buf);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void SecureTransport::disconnect() {
+  pthread_mutex_lock(&_lock);
+  _state = STATE_CLOSED;
+  pthread_mutex_unlock(&_lock);
+  _lower->disconnect();
+}
+
+bool SecureTransport::isDisconnected() const {
+  pthread_mutex_lock(const_cast<pthread_mutex_t *>(&_lock));
+  bool closed = _state == STATE_CLOSED;
+  pthread_mutex_unlock(const_cast<pthread_mutex_t *>(&_lock));
+  return closed || _lower->isDisconnected();
+}
+
+void SecureTransport::sendRecord(const string &msg) {
+  string rec = encodeLE(msg.size(), kLengthSize) + msg;
+  _lower->write(new IOBuffer(rec.data(), rec.size()));
+}
+
+void SecureTransport::sealAndSend(IOBuffer *buf) {
+  const size_t len = buf->size();
+  if (len == 0) {
+    delete buf;
+    return;
+  }
+  const char *data = buf->pulldown(len);
+
+  // Lay every record of the write out in one buffer and seal them in a
+  // single batch.
+  const size_t records = (len + kMaxRecord - 1) / kMaxRecord;
+  vector<char> out(len + records * (kLengthSize + BlockCipher::kOverhead));
+  vector<char *> bufs;
+  vector<size_t> lens;
+  vector<string> aads;
+  size_t off = 0;
+  for (size_t pos = 0; pos < len; pos += kMaxRecord) {
+    const size_t n = std::min(kMaxRecord, len - pos);
+    putLE(&out[off], n + BlockCipher::kOverhead, kLengthSize);
+    char *rec = &out[off + kLengthSize];
+    memcpy(rec + BlockCipher::kNonceSize, data + pos, n);
+    bufs.push_back(rec);
+    lens.push_back(n);
+    aads.push_back(encodeLE(_sendSeq++, 8));
+    off += kLengthSize + BlockCipher::kOverhead + n;
+  }
+  delete buf;
+  if (!_send->encryptBlocks(bufs, lens, aads)) {
+    // We hold _lock, so leave the disconnect to a worker.
+    LOG(ERROR) << "Unable to seal records, dropping connection.";
+    _state = STATE_CLOSED;
+    _lower->getEventManager()->enqueue(
+        std::tr1::bind(&Transport::disconnect, _lower));
+    return;
+  }
+  _lower->write(new IOBuffer(&out[0], out.size()));
+}
+
+void SecureTransport::onReceive(IOBuffer *buf) {
+  const size_t len = buf->size();
+  if (len) {
+    const char *data = buf->pulldown(len);
+    _rbuf.insert(_rbuf.end(), data, data + len);
+    buf->consume(len);
+  }
+
+  size_t off = 0;
+  while (_rbuf.size() - off >= kLengthSize) {
+    const size_t n = getLE(&_rbuf[off], kLengthSize);
+    if (n > kMaxRecord + BlockCipher::kOverhead) {
+      fail("oversized record");
+      return;
+    }
+    if (_rbuf.size() - off - kLengthSize < n) {
+      break;
+    }
+    char *rec = &_rbuf[off + kLengthSize];
+    off += kLengthSize + n;
+
+    pthread_mutex_lock(&_lock);
+    const State state = _state;
+    pthread_mutex_unlock(&_lock);
+    switch (state) {
+      case STATE_CLIENT_HELLO:
+        if (!onClientHello(rec, n)) {
+          fail("bad ClientHello");
+          return;
+        }
+        break;
+      case STATE_SERVER_HELLO:
+        if (!onServerHello(rec, n)) {
+          fail("bad ServerHello");
+          return;
+        }
+        break;
+      case STATE_CLIENT_FINISHED:
+        if (!onClientFinished(rec, n)) {
+          fail("bad ClientFinished");
+          return;
+        }
+        break;
+      case STATE_ESTABLISHED: {
+        // Records are opened where they lie in the receive buffer.
+        ssize_t m = _recv->decrypt(rec, n, encodeLE(_recvSeq++, 8));
+        if (m < 0) {
+          fail("record failed to authenticate");
+          return;
+        }
+        IOBuffer plain(rec + BlockCipher::kNonceSize, m);
+        if (_receiveCallback) {
+          _receiveCallback(&plain);
+        }
+        break;
+      }
+      case STATE_CLOSED:
+        return;
+    }
+  }
+  _rbuf.erase(_rbuf.begin(), _rbuf.begin() + off);
+}
+
+void SecureTransport::onLowerDisconnect() {
+  pthread_mutex_lock(&_lock);
+  const State state = _state;
+  _state = STATE_CLOSED;
+  pthread_mutex_unlock(&_lock);
+  if (state == STATE_CLOSED) {
+    return;
+  }
+  if (state != STATE_ESTABLISHED) {
+    _ctx->countHandshake(false, false);
+  }
+  if (_disconnectCallback) {
+    _disconnectCallback();
+  }
+}
+
+bool SecureTransport::onClientHello(const char *msg, size_t len) {
+  if (len < kClientHelloSize || msg[0] != kClientHello ||
+      msg[1] != kVersion) {
+    return false;
+  }
+  const char *clientRandom = msg + 2;
+  const char *clientPub = clientRandom + kRandomSize;
+  const size_t ticketLen = getLE(clientPub + kPublicKeySize, 2);
+  if (len != kClientHelloSize + ticketLen) {
+    return false;
+  }
+  const string ticket(msg + kClientHelloSize, ticketLen);
+
+  // Resume if the ticket is good, otherwise fall back to a key exchange
+  // using the public key the client sent along with it.
+  string ikm = _ctx->_psk;
+  string secret;
+  string pub(kPublicKeySize, 0);
+  if (!ticket.empty() && _ctx->openTicket(ticket, &secret)) {
+    _resumed = true;
+    ikm += secret;
+  } else {
+    _ephemeral = generateKey(&pub);
+    if (!agree(_ephemeral, clientPub, &secret)) {
+      return false;
+    }
+    ikm += secret;
+  }
+  _random = randomBytes(kRandomSize);
+  const string core = string(1, kServerHello) +
+      string(1, _resumed ? kModeResumed : kModeFull) + _random + pub;
+  if (!deriveKeys(string(clientRandom, kRandomSize) + _random + ikm,
+                  string(msg, len) + core)) {
+    return false;
+  }
+  const string newTicket = _ctx->sealTicket(_resumptionSecret);
+  sendRecord(core + encodeLE(newTicket.size(), 2) + newTicket +
+             hmac(_finishedKey, _transcript + newTicket + "server"));
+  pthread_mutex_lock(&_lock);
+  _state = STATE_CLIENT_FINISHED;
+  pthread_mutex_unlock(&_lock);
+  return true;
+}
+
+bool SecureTransport::onServerHello(const char *msg, size_t len) {
+  if (len < kServerHelloCoreSize + 2 + kMacSize || msg[0] != kServerHello) {
+    return false;
+  }
+  const char *serverRandom = msg + 2;
+  const char *serverPub = serverRandom + kRandomSize;
+  const size_t ticketLen = getLE(msg + kServerHelloCoreSize, 2);
+  if (len != kServerHelloCoreSize + 2 + ticketLen + kMacSize) {
+    return false;
+  }
+  const string ticket(msg + kServerHelloCoreSize + 2, ticketLen);
+  const char *mac = msg + len - kMacSize;
+
+  string ikm = _ctx->_psk;
+  if (msg[1] == kModeResumed && !_offeredSecret.empty()) {
+    _resumed = true;
+    ikm += _offeredSecret;
+  } else if (msg[1] == kModeFull) {
+    string secret;
+    if (!agree(_ephemeral, serverPub, &secret)) {
+      return false;
+    }
+    ikm += secret;
+  } else {
+    return false;
+  }
+  if (!deriveKeys(_random + string(serverRandom, kRandomSize) + ikm,
+                  _clientHello + string(msg, kServerHelloCoreSize)) ||
+      !macEqual(hmac(_finishedKey, _transcript + ticket + "server"), mac)) {
+    return false;
+  }
+
+  if (!ticket.empty()) {
+    SecureContext::Session session;
+    session.ticket = ticket;
+    session.secret = _resumptionSecret;
+    _ctx->saveSession(_peer, session);
+  }
+  sendRecord(string(1, kClientFinished) +
+             hmac(_finishedKey, _transcript + "client"));
+  established();
+  return true;
+}
+
+bool SecureTransport::onClientFinished(const char *msg, size_t len) {
+  if (len != 1 + kMacSize || msg[0] != kClientFinished ||
+      !macEqual(hmac(_finishedKey, _transcript + "client"), msg + 1)) {
+    return false;
+  }
+  established();
+  return true;
+}
+
+bool SecureTransport::deriveKeys(const string &material,
+                                 const string &transcript) {
+  // HKDF style: extract with the randoms as salt, then expand one key per
+  // purpose bound to a hash of the handshake so far.
+  const string salt = material.substr(0, 2 * kRandomSize);
+  const string prk = hmac(salt, material.substr(2 * kRandomSize));
+  _transcript = util::sha256(transcript.data(), transcript.size());
+  const string c2s = hmac(prk, "client to server" + _transcript);
+  const string s2c = hmac(prk, "server to client" + _transcript);
+  _finishedKey = hmac(prk, "finished" + _transcript);
+  _resumptionSecret = hmac(prk, "resumption" + _transcript);
+  if (c2s.size() != BlockCipher::kKeySize) {
+    return false;
+  }
+  _send.reset(new BlockCipher(_client ? c2s : s2c));
+  _recv.reset(new BlockCipher(_client ? s2c : c2s));
+  return true;
+}
+
+void SecureTransport::established() {
+  EVP_PKEY_free(_ephemeral);
+  _ephemeral = NULL;
+  _offeredSecret.clear();
+  _finishedKey.clear();
+  _resumptionSecret.clear();
+  _ctx->countHandshake(true, _resumed);
+
+  pthread_mutex_lock(&_lock);
+  if (_state != STATE_CLOSED) {
+    _state = STATE_ESTABLISHED;
+    while (!_pending.empty()) {
+      sealAndSend(_pending.front());
+      _pending.pop_front();
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void SecureTransport::fail(const char *why) {
+  LOG(ERROR) << "Secure transport"
+             << (_peer.empty() ? string() : " to " + _peer) << ": " << why;
+  pthread_mutex_lock(&_lock);
+  const State state = _state;
+  _state = STATE_CLOSED;
+  while (!_pending.empty()) {
+    delete _pending.front();
+    _pending.pop_front();
+  }
+  pthread_mutex_unlock(&_lock);
+  if (state == STATE_CLOSED) {
+    return;
+  }
+  if (state != STATE_ESTABLISHED) {
+    // Don't offer the same ticket again in case it was the problem.
+    _ctx->countHandshake(false, false);
+    if (_client) {
+      _ctx->forgetSession(_peer);
+    }
+  }
+  _lower->disconnect();
+  if (_disconnectCallback) {
+    _disconnectCallback();
+  }
+}
+
+}  // end rpc namespace
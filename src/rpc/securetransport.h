@@ -0,0 +1,239 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _RPC_SECURETRANSPORT_H_
+#define _RPC_SECURETRANSPORT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+#include <openssl/evp.h>
+
+#include "rpc/transport.h"
+#include "util/blockcipher.h"
+
+namespace rpc {
+
+using std::list;
+using std::map;
+using std::string;
+using std::tr1::enable_shared_from_this;
+using std::tr1::weak_ptr;
+using std::vector;
+
+class SecureTransport;
+
+/**
+ * State shared by the SecureTransports of a node: the cluster key that
+ * peers authenticate each other with, the key session tickets are sealed
+ * with and the tickets held for servers this node has connected to.
+ *
+ * The ticket key is derived from the cluster key so any node in the
+ * cluster, including one that has just restarted, can resume a session
+ * issued by another. After a restart the rest of the mesh reconnects with
+ * a ticket exchange rather than a key exchange each.
+ */
+class SecureContext : public enable_shared_from_this<SecureContext> {
+ public:
+  static const size_t kKeySize = 32;
+
+  struct Stats {
+    Stats() : fullHandshakes(0), resumedHandshakes(0), failedHandshakes(0) { }
+    uint64_t fullHandshakes;
+    uint64_t resumedHandshakes;
+    uint64_t failedHandshakes;
+  };
+
+  /**
+   * @param psk kKeySize bytes shared by every node in the cluster.
+   * @param ticketLifetime seconds a session may be resumed for.
+   */
+  static shared_ptr<SecureContext> create(const string &psk,
+                                          int ticketLifetime = 86400) {
+    return shared_ptr<SecureContext>(new SecureContext(psk, ticketLifetime));
+  }
+  virtual ~SecureContext();
+
+  /**
+   * Wraps the client end of a connection to peer, an identifier such as
+   * "host:port" under which its session ticket is kept. Data written
+   * before the handshake completes is queued.
+   */
+  shared_ptr<Transport> clientTransport(shared_ptr<Transport> lower,
+                                        const string &peer);
+
+  /**
+   * Wraps the server end of an accepted connection. Suitable for use as
+   * the TransportFactory of an RPCServer.
+   */
+  shared_ptr<Transport> serverTransport(shared_ptr<Transport> lower);
+
+  /**
+   * Drops any session ticket held for peer.
+   */
+  void forgetSession(const string &peer);
+
+  Stats stats();
+
+ private:
+  friend class SecureTransport;
+
+  struct Session {
+    string ticket;
+    string secret;
+  };
+
+  SecureContext(const string &psk, int ticketLifetime);
+
+  bool findSession(const string &peer, Session *session);
+  void saveSession(const string &peer, const Session &session);
+  string sealTicket(const string &secret);
+  bool openTicket(const string &ticket, string *secret);
+  void countHandshake(bool ok, bool resumed);
+
+  string _psk;
+  int _ticketLifetime;
+  util::BlockCipher _tickets;
+  pthread_mutex_t _lock;
+  map<string, Session> _sessions;
+  Stats _stats;
+};
+
+/**
+ * An authenticated, encrypted Transport stacked on another one.
+ *
+ * A full handshake exchanges X25519 ephemeral keys and mixes in the
+ * cluster key, so only nodes holding it can complete one, and traffic
+ * keys are forward secret. A resumed handshake presents a ticket from an
+ * earlier session instead and skips the key exchange. Either way both
+ * sides contribute fresh randoms so every connection gets its own keys.
+ *
+ * Data travels in records of at most kMaxRecord bytes sealed with
+ * AES-256-GCM by util::BlockCipher, with the record's sequence number as
+ * associated data so records can't be replayed, dropped or reordered.
+ */
+class SecureTransport : public Transport,
+                        public enable_shared_from_this<SecureTransport> {
+ public:
+  static const size_t kMaxRecord = 65536;
+
+  virtual ~SecureTransport();
+
+  virtual void start();
+  virtual void write(IOBuffer *buf);
+  virtual void disconnect();
+  virtual bool isDisconnected() const;
+  virtual void setReceiveCallback(function<void(IOBuffer *)> cb) {
+    _receiveCallback = cb;
+  }
+  virtual void setDisconnectCallback(function<void()> cb) {
+    _disconnectCallback = cb;
+  }
+  virtual EventManager *getEventManager() {
+    return _lower->getEventManager();
+  }
+  virtual void setPaused(bool paused) { _lower->setPaused(paused); }
+
+  /**
+   * Returns true once the handshake has completed by resuming a session.
+   */
+  bool isResumed() const { return _resumed; }
+
+ private:
+  friend class SecureContext;
+
+  enum State {
+    STATE_CLIENT_HELLO,     // Server waiting for ClientHello.
+    STATE_SERVER_HELLO,     // Client waiting for ServerHello.
+    STATE_CLIENT_FINISHED,  // Server waiting for ClientFinished.
+    STATE_ESTABLISHED,
+    STATE_CLOSED
+  };
+
+  SecureTransport(shared_ptr<SecureContext> ctx, shared_ptr<Transport> lower,
+                  bool client, const string &peer);
+
+  static void receiveThunk(weak_ptr<SecureTransport> t, IOBuffer *buf);
+  static void disconnectThunk(weak_ptr<SecureTransport> t);
+
+  void onReceive(IOBuffer *buf);
+  void onLowerDisconnect();
+
+  bool onClientHello(const char *msg, size_t len);
+  bool onServerHello(const char *msg, size_t len);
+  bool onClientFinished(const char *msg, size_t len);
+  bool deriveKeys(const string &ikm, const string &transcript);
+  void established();
+
+  /**
+   * Sends a plaintext handshake message.
+   */
+  void sendRecord(const string &msg);
+
+  /**
+   * Seals buf into records and sends them. Called with _lock held.
+   */
+  void sealAndSend(IOBuffer *buf);
+  void fail(const char *why);
+
+  shared_ptr<SecureContext> _ctx;
+  shared_ptr<Transport> _lower;
+  bool _client;
+  string _peer;
+  bool _resumed;
+  function<void(IOBuffer *)> _receiveCallback;
+  function<void()> _disconnectCallback;
+
+  pthread_mutex_t _lock;  // Guards _state, _pending and _sendSeq.
+  State _state;
+  list<IOBuffer *> _pending;
+  uint64_t _sendSeq;
+  uint64_t _recvSeq;
+  vector<char> _rbuf;
+
+  // Handshake state.
+  EVP_PKEY *_ephemeral;
+  string _random;
+  string _clientHello;
+  string _offeredSecret;
+  string _finishedKey;
+  string _transcript;
+  string _resumptionSecret;
+
+  shared_ptr<util::BlockCipher> _send;
+  shared_ptr<util::BlockCipher> _recv;
+};
+
+}  // end rpc namespace
+#endif
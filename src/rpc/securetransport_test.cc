@@ -0,0 +1,150 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "securetransport.h"
+#include "rpc.h"
+
+#include "util/blockcipher.h"
+
+#include <epoll_threadpool/eventmanager.h>
+#include <epoll_threadpool/notification.h>
+#include <epoll_threadpool/tcp.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using epoll_threadpool::EventManager;
+using epoll_threadpool::Notification;
+using epoll_threadpool::TcpListenSocket;
+using epoll_threadpool::TcpSocket;
+using rpc::RPCClient;
+using rpc::RPCServer;
+using rpc::SecureContext;
+using rpc::TcpTransport;
+using std::tr1::shared_ptr;
+using std::string;
+
+namespace {
+string toUpperStr(string in) {
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = ::toupper(in[i]);
+  }
+  return in;
+}
+
+string bigString(string in) {
+  return string(300000, in[0]);
+}
+
+/**
+ * Starts an RPCServer on a random port whose connections are secured with
+ * ctx, returning the port.
+ */
+int startServer(EventManager *em, shared_ptr<SecureContext> ctx,
+                shared_ptr<RPCServer> *r) {
+  int port;
+  shared_ptr<TcpListenSocket> s;
+  while(s.get() == NULL) {
+    port = (rand()%40000) + 1024;
+    s = TcpListenSocket::create(em, port);
+  }
+  *r = RPCServer::create(s, std::tr1::bind(&SecureContext::serverTransport,
+                                           ctx, std::tr1::placeholders::_1));
+  (*r)->registerFunction<string, string>("toUpper", &toUpperStr);
+  (*r)->registerFunction<string, string>("bigString", &bigString);
+  (*r)->start();
+  return port;
+}
+}
+
+TEST(SecureTransport, CallAndResume) {
+  EventManager em;
+  em.start(4);
+
+  const string psk = util::BlockCipher::generateKey();
+  shared_ptr<SecureContext> serverCtx = SecureContext::create(psk);
+  shared_ptr<SecureContext> clientCtx = SecureContext::create(psk);
+  shared_ptr<RPCServer> r;
+  int port = startServer(&em, serverCtx, &r);
+
+  // The first connection runs a full handshake, later ones resume it.
+  for (int i = 0; i < 3; i++) {
+    RPCClient c(clientCtx->clientTransport(
+        TcpTransport::create(TcpSocket::connect(&em, "127.0.0.1", port)),
+        "127.0.0.1"));
+    c.start();
+    string ret = c.call<string, string>("toUpper", "hello");
+    EXPECT_EQ("HELLO", ret);
+    // Larger than a record each way.
+    ret = c.call<string, string>("bigString", string(100000, 'x'));
+    EXPECT_EQ(string(300000, 'x'), ret);
+    c.disconnect();
+  }
+  EXPECT_EQ(1, clientCtx->stats().fullHandshakes);
+  EXPECT_EQ(2, clientCtx->stats().resumedHandshakes);
+
+  // Tickets are sealed under the cluster key so a restarted server, or
+  // any other node, accepts them too.
+  r.reset();
+  serverCtx = SecureContext::create(psk);
+  port = startServer(&em, serverCtx, &r);
+  RPCClient c(clientCtx->clientTransport(
+      TcpTransport::create(TcpSocket::connect(&em, "127.0.0.1", port)),
+      "127.0.0.1"));
+  c.start();
+  string ret = c.call<string, string>("toUpper", "again");
+  EXPECT_EQ("AGAIN", ret);
+  EXPECT_EQ(3, clientCtx->stats().resumedHandshakes);
+  EXPECT_EQ(0, serverCtx->stats().fullHandshakes);
+  c.disconnect();
+}
+
+TEST(SecureTransport, WrongKey) {
+  EventManager em;
+  em.start(4);
+
+  shared_ptr<SecureContext> serverCtx =
+      SecureContext::create(util::BlockCipher::generateKey());
+  shared_ptr<SecureContext> clientCtx =
+      SecureContext::create(util::BlockCipher::generateKey());
+  shared_ptr<RPCServer> r;
+  int port = startServer(&em, serverCtx, &r);
+
+  Notification n;
+  RPCClient c(clientCtx->clientTransport(
+      TcpTransport::create(TcpSocket::connect(&em, "127.0.0.1", port)),
+      "127.0.0.1"));
+  c.setDisconnectCallback(std::tr1::bind(&Notification::signal, &n));
+  c.start();
+  c.call<string, string>("toUpper", "hello");
+  n.wait();
+  EXPECT_EQ(1, clientCtx->stats().failedHandshakes);
+  EXPECT_EQ(0, clientCtx->stats().fullHandshakes);
+  c.disconnect();
+}
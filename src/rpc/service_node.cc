@@ -28,54 +28,120 @@
 */
 #include "service_node.h"
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+
 namespace rpc {
 
 namespace {
+// How long in seconds a peer may stay unreachable before we stop
+// reconnecting and forget it.
+const double PEER_EXPIRY = 600.0;
+
+// Seconds between gossip rounds, and how long a round's first exchange may
+// go unanswered before later rounds stop waiting on it.
+const double GOSSIP_INTERVAL = 0.5;
+const double GOSSIP_TIMEOUT = 10.0;
+
+// Most entries sent in one gossip message. Anything beyond this follows in
+// later rounds.
+const size_t GOSSIP_MAX_ENTRIES = 10000;
+
+// Seconds between anti-entropy passes, and how long an expired node's
+// entries are refused in case other nodes still hold them.
+const double ANTI_ENTROPY_INTERVAL = 5.0;
+const double TOMBSTONE_EXPIRY = 2 * PEER_EXPIRY;
+
+// Depth of the hash tree over group state. At 4096 leaves, 100k entries
+// come to about 25 a leaf.
+const int MERKLE_DEPTH = 12;
+
+// Tree levels compared per call while looking for differences, and the
+// most nodes asked about or leaves synced at once. What doesn't fit is
+// picked up by the next pass.
+const int32_t MERKLE_LEVELS = 4;
+const size_t MERKLE_MAX_NODES = 64;
+
+const RPCMethod<GossipMessage, const GossipMessage &> kGossip(
+    "serviceNode.gossip", true);
+const RPCMethod<vector<uint64_t>, const vector<uint32_t> &, int32_t> kMerkle(
+    "serviceNode.merkle", true);
+const RPCMethod<GossipMessage, const vector<uint32_t> &,
+                const GossipMessage &> kSync("serviceNode.sync", true);
+
+/**
+ * Origins are named "host:port/incarnation". Splits one into the part
+ * shared by every run of the node and the incarnation.
+ */
+void ParseOrigin(const string &origin, string *prefix, uint64_t *incarnation) {
+  const size_t slash = origin.rfind('/');
+  *prefix = origin.substr(0, slash + 1);
+  *incarnation = strtoull(origin.c_str() + slash + 1, NULL, 10);
+}
+
+/**
+ * Identifies one origin's entry for a member in the hash tree.
+ */
+string EntryKey(const string &origin, const string &group,
+                const string &name) {
+  string key(origin);
+  key += '\0';
+  key += group;
+  key += '\0';
+  key += name;
+  return key;
+}
+
+uint64_t EntryHash(const string &key, int count, uint64_t version) {
+  char buf[48];
+  snprintf(buf, sizeof(buf), "%d/%llu", count, (unsigned long long)version);
+  return MerkleTree::hash(key + '\0' + buf);
+}
+
 void DummyFunc(shared_ptr<RPCClient> client) {
   // Dummy function used to ensure we don't destroy out peer before we get a result.
 }
 }  // end anonymous namespace
 
 
+const char ServiceNode::kServiceName[] = "serviceNode";
+
 shared_ptr<ServiceNode> ServiceNode::create(
     EventManager* em, const string& host) {
-  uint16_t port;
-  shared_ptr<TcpListenSocket> s;
-  while(s.get() == NULL) {
-    port = (rand()%40000) + 1024;
-    s = TcpListenSocket::create(em, port);
-  }
-  return shared_ptr<ServiceNode>(
-      new ServiceNode(em, host, port, s));
+  return create(Mesh::create(em, host));
 }
 
 shared_ptr<ServiceNode> ServiceNode::create(
     EventManager* em, const string& host, int port) {
-  shared_ptr<TcpListenSocket> s(TcpListenSocket::create(em, port));
-  if (s != NULL) {
-    return shared_ptr<ServiceNode>(
-        new ServiceNode(em, host, port, s));
+  shared_ptr<Mesh> mesh(Mesh::create(em, host, port));
+  if (mesh != NULL) {
+    return create(mesh);
   } else {
     return shared_ptr<ServiceNode>();
   }
 }
 
-ServiceNode::ServiceNode(
-    EventManager *em, 
-    const string& host, int port, 
-    shared_ptr<TcpListenSocket> s) : 
-        _rpc_server(RPCServer::create(s)),
-        _internal(new Internal(em, host, port)) {
+shared_ptr<ServiceNode> ServiceNode::create(shared_ptr<Mesh> mesh) {
+  return shared_ptr<ServiceNode>(new ServiceNode(mesh));
+}
+
+ServiceNode::ServiceNode(shared_ptr<Mesh> mesh) :
+        _mesh(mesh),
+        _rpc_server(RPCServer::create(shared_ptr<TcpListenSocket>())),
+        _internal(new Internal(mesh)) {
   _rpc_server->registerFunction<bool, string, uint16_t>("addPeer",
       bind(&ServiceNode::Internal::RPCAddPeer, 
            _internal, _1, _2));
-  _rpc_server->registerFunction<bool, string, string>("addToGroup",
-      bind(&ServiceNode::Internal::RPCAddToGroup, 
-           _internal, _1, _2));
-  _rpc_server->registerFunction<bool, string, string>("removeFromGroup",
-      bind(&ServiceNode::Internal::RPCRemoveFromGroup, 
-           _internal, _1, _2));
-  _rpc_server->start();
+  _rpc_server->registerFunction(kGossip,
+      bind(&ServiceNode::Internal::RPCGossip, _internal, _1));
+  _rpc_server->registerFunction(kMerkle,
+      bind(&ServiceNode::Internal::RPCMerkle, _internal, _1, _2));
+  _rpc_server->registerFunction(kSync,
+      bind(&ServiceNode::Internal::RPCSync, _internal, _1, _2));
+  _mesh->addService(kServiceName, _rpc_server);
+  _internal->start();
 }
 
 ServiceNode::~ServiceNode() {
@@ -84,10 +150,19 @@ ServiceNode::~ServiceNode() {
   _internal.reset();
 }
 
-ServiceNode::Internal::Internal(
-    EventManager *em, const string& host, uint16_t port)
-        : _em(em), _host(host), _port(port) {
+ServiceNode::Internal::Internal(shared_ptr<Mesh> mesh)
+        : _em(mesh->getEventManager()), _mesh(mesh), _host(mesh->host()),
+          _port(mesh->port()), _shutdown(false),
+          _merkle(MERKLE_DEPTH), _leaves(_merkle.numLeaves()),
+          _roundStarted(0), _syncStarted(0), _syncing(false) {
   pthread_mutex_init(&_mutex, 0);
+  // A restarted node starts its versions over, so it needs a new name.
+  // Later runs get larger names and replace the earlier ones.
+  std::ostringstream self;
+  self << _host << ":" << _port << "/"
+       << (uint64_t)(EventManager::currentTime() * 1000000);
+  _self = self.str();
+  _origins[_self];
 }
 
 ServiceNode::Internal::~Internal() {
@@ -103,68 +178,413 @@ ServiceNode::Internal::~Internal() {
   pthread_mutex_destroy(&_mutex);
 }
 
+void ServiceNode::Internal::start() {
+  _em->enqueue(bind(&ServiceNode::Internal::roundLater,
+                    weak_ptr<Internal>(shared_from_this())),
+               EventManager::currentTime() + GOSSIP_INTERVAL);
+}
+
 void ServiceNode::Internal::shutdown() {
-  _peers.clear();
+  map<HostPortPair, shared_ptr<RPCClient> > peers;
+  pthread_mutex_lock(&_mutex);
+  _shutdown = true;
+  peers.swap(_peers);
+  pthread_mutex_unlock(&_mutex);
 }
 
 void ServiceNode::Internal::addToGroup(
     const string &group, const string &name) {
   pthread_mutex_lock(&_mutex);
+  // Our own changes are written as the next version of our origin and
+  // picked up by the next gossip round.
+  Origin &self = _origins[_self];
+  const GroupMember member(group, name);
+  map<GroupMember, Entry>::const_iterator i = self.entries.find(member);
+  const int count = i == self.entries.end() ? 0 : i->second.count;
+  apply(_self, member, count + 1, self.version + 1);
+  pthread_mutex_unlock(&_mutex);
+}
 
-  // Notify other peers. We do this even if reference count > 1 so they all
-  // have the same state.
-  for (map< HostPortPair, shared_ptr<RPCClient> >::iterator i = _peers.begin();
-     i != _peers.end(); ++i) {
-    i->second->call<bool, string, string>("addToGroup", group, name)
-        .addCallback(bind(&DummyFunc, i->second));
+void ServiceNode::Internal::removeFromGroup(
+    const string &group, const string &name) {
+  pthread_mutex_lock(&_mutex);
+  Origin &self = _origins[_self];
+  const GroupMember member(group, name);
+  map<GroupMember, Entry>::const_iterator i = self.entries.find(member);
+  if (i != self.entries.end() && i->second.count > 0) {
+    apply(_self, member, i->second.count - 1, self.version + 1);
+  } else {
+    DLOG(ERROR) << "Reference count decremented below zero.";
   }
+  pthread_mutex_unlock(&_mutex);
+}
 
-  // Group membership is reference counted. Events will only fire the first
-  // time a member is added
-  if (_groups[group].find(name) != _groups[group].end()) {
-    _groups[group][name]++;
+void ServiceNode::Internal::apply(const string &origin,
+                                  const GroupMember &member,
+                                  int count, uint64_t version, bool advance) {
+  if (!admit(origin)) {
+    return;
+  }
+  Origin &o = _origins[origin];
+  if (advance) {
+    o.version = std::max(o.version, version);
+  }
+  map<GroupMember, Entry>::iterator i = o.entries.find(member);
+  if (i != o.entries.end() && i->second.version >= version) {
+    return;
+  }
+  const string key = EntryKey(origin, member.first, member.second);
+  int delta = count;
+  if (i != o.entries.end()) {
+    delta -= i->second.count;
+    o.byVersion.erase(i->second.version);
+    _merkle.toggle(i->second.leaf, i->second.hash);
   } else {
-    _groups[group][name] = 1;
-    // Trigger local callbacks.
-    for(vector<function<void(const string&, bool)> >::iterator i = 
-        _group_callbacks[group].begin();
-        i != _group_callbacks[group].end(); ++i) {
-      (*i)(name, true);
+    i = o.entries.insert(std::make_pair(member, Entry())).first;
+    i->second.leaf = _merkle.leafFor(MerkleTree::hash(key));
+    _leaves[i->second.leaf].insert(std::make_pair(origin, member));
+  }
+  i->second.count = count;
+  i->second.version = version;
+  i->second.hash = EntryHash(key, count, version);
+  _merkle.toggle(i->second.leaf, i->second.hash);
+  o.byVersion[version] = member;
+  if (delta) {
+    adjust(member, delta);
+  }
+}
+
+bool ServiceNode::Internal::admit(const string &origin) {
+  if (_origins.find(origin) != _origins.end()) {
+    return true;
+  }
+  if (_expired.find(origin) != _expired.end()) {
+    return false;
+  }
+  string prefix;
+  uint64_t incarnation;
+  ParseOrigin(origin, &prefix, &incarnation);
+  // Names sort by address first, so other runs of the node are adjacent.
+  vector<string> older;
+  for (map<string, Origin>::const_iterator i = _origins.lower_bound(prefix);
+       i != _origins.end() && i->first.compare(0, prefix.size(), prefix) == 0;
+       ++i) {
+    string unused;
+    uint64_t other;
+    ParseOrigin(i->first, &unused, &other);
+    if (other > incarnation) {
+      // A run we have already seen replaced.
+      _expired[origin] = EventManager::currentTime();
+      return false;
     }
+    older.push_back(i->first);
   }
-  pthread_mutex_unlock(&_mutex);
+  for (size_t i = 0; i < older.size(); i++) {
+    expire(older[i]);
+  }
+  return true;
 }
 
-void ServiceNode::Internal::removeFromGroup(
-    const string &group, const string &name) {
-  pthread_mutex_lock(&_mutex);
+void ServiceNode::Internal::expire(const string &origin) {
+  map<string, Origin>::iterator o = _origins.find(origin);
+  if (origin == _self || o == _origins.end()) {
+    return;
+  }
+  DLOG(INFO) << "Expiring " << o->second.entries.size()
+             << " group entries from " << origin;
+  for (map<GroupMember, Entry>::const_iterator i = o->second.entries.begin();
+       i != o->second.entries.end(); ++i) {
+    _merkle.toggle(i->second.leaf, i->second.hash);
+    _leaves[i->second.leaf].erase(std::make_pair(origin, i->first));
+    if (i->second.count > 0) {
+      adjust(i->first, -i->second.count);
+    }
+  }
+  _origins.erase(o);
+  _expired[origin] = EventManager::currentTime();
+}
 
-  // Notify other peers.
-  for (map< HostPortPair, shared_ptr<RPCClient> >::iterator i = _peers.begin();
-       i != _peers.end(); ++i) {
-    i->second->call<bool, string, string>("removeFromGroup", group, name)
-        .addCallback(bind(&DummyFunc, i->second));
-  }
-
-  // Trigger local event if reference count went to zero.
-  if (_groups[group].find(name) != _groups[group].end()) {
-    if (_groups[group][name] == 1) {
-      _groups[group].erase(name);
-      if (_group_callbacks.find(group) != _group_callbacks.end()) {
-        for(vector<function<void(const string&, bool)> >::iterator i = _group_callbacks[group].begin();
-            i != _group_callbacks[group].end(); ++i) {
-          (*i)(name, false);
-        }
-      }
+void ServiceNode::Internal::adjust(const GroupMember &member, int delta) {
+  map<string, int> &group = _groups[member.first];
+  map<string, int>::iterator i = group.find(member.second);
+  const int before = i == group.end() ? 0 : i->second;
+  const int after = before + delta;
+  if (after > 0) {
+    group[member.second] = after;
+  } else if (i != group.end()) {
+    group.erase(i);
+  }
+  // Events only fire when a member first appears or finally goes.
+  if ((before > 0) == (after > 0) ||
+      _group_callbacks.find(member.first) == _group_callbacks.end()) {
+    return;
+  }
+  vector<function<void(const string&, bool)> > &callbacks =
+      _group_callbacks[member.first];
+  for (vector<function<void(const string&, bool)> >::iterator j =
+       callbacks.begin(); j != callbacks.end(); ++j) {
+    (*j)(member.second, after > 0);
+  }
+}
+
+GossipMessage ServiceNode::Internal::digest(
+    const map<string, uint64_t> *theirs) const {
+  GossipMessage msg;
+  size_t entries = 0;
+  for (map<string, Origin>::const_iterator i = _origins.begin();
+       i != _origins.end(); ++i) {
+    msg.versions[i->first] = i->second.version;
+    if (!theirs || entries >= GOSSIP_MAX_ENTRIES) {
+      continue;
     }
-  } else {
-    if (_groups[group][name] > 1) {
-      _groups[group][name]--;
+    map<string, uint64_t>::const_iterator seen = theirs->find(i->first);
+    const uint64_t since = seen == theirs->end() ? 0 : seen->second;
+    map<uint64_t, GroupMember>::const_iterator j =
+        i->second.byVersion.upper_bound(since);
+    if (j == i->second.byVersion.end()) {
+      continue;
+    }
+    // Entries go in version order so that a batch cut short still leaves
+    // the receiver with every change up to the last one it got.
+    vector<GossipEntry> &deltas = msg.deltas[i->first];
+    for (; j != i->second.byVersion.end() && entries < GOSSIP_MAX_ENTRIES;
+         ++j, ++entries) {
+      const Entry &entry = i->second.entries.find(j->second)->second;
+      deltas.push_back(GossipEntry());
+      deltas.back().group = j->second.first;
+      deltas.back().name = j->second.second;
+      deltas.back().count = entry.count;
+      deltas.back().version = entry.version;
+    }
+  }
+  return msg;
+}
+
+void ServiceNode::Internal::merge(const GossipMessage &msg, bool advance) {
+  // Hearing of a node's new run is enough to drop what its last run added.
+  for (map<string, uint64_t>::const_iterator i = msg.versions.begin();
+       i != msg.versions.end(); ++i) {
+    if (admit(i->first)) {
+      _origins[i->first];
+    }
+  }
+  for (map<string, vector<GossipEntry> >::const_iterator i =
+       msg.deltas.begin(); i != msg.deltas.end(); ++i) {
+    if (i->first == _self) {
+      // Nobody knows our entries better than we do.
+      continue;
+    }
+    for (vector<GossipEntry>::const_iterator j = i->second.begin();
+         j != i->second.end(); ++j) {
+      apply(i->first, GroupMember(j->group, j->name), j->count, j->version,
+            advance);
+    }
+  }
+}
+
+GossipMessage ServiceNode::Internal::collect(
+    const vector<uint32_t> &leaves) const {
+  GossipMessage msg;
+  for (size_t i = 0; i < leaves.size(); i++) {
+    const set< std::pair<string, GroupMember> > &leaf = _leaves[leaves[i]];
+    for (set< std::pair<string, GroupMember> >::const_iterator j =
+         leaf.begin(); j != leaf.end(); ++j) {
+      const Entry &entry =
+          _origins.find(j->first)->second.entries.find(j->second)->second;
+      vector<GossipEntry> &deltas = msg.deltas[j->first];
+      deltas.push_back(GossipEntry());
+      deltas.back().group = j->second.first;
+      deltas.back().name = j->second.second;
+      deltas.back().count = entry.count;
+      deltas.back().version = entry.version;
+    }
+  }
+  return msg;
+}
+
+void ServiceNode::Internal::roundLater(weak_ptr<Internal> internal) {
+  shared_ptr<Internal> self = internal.lock();
+  if (self) {
+    self->round();
+  }
+}
+
+void ServiceNode::Internal::round() {
+  const EventManager::WallTime now = EventManager::currentTime();
+  PeerList peers;
+  shared_ptr<RPCClient> syncPeer;
+  pthread_mutex_lock(&_mutex);
+  if (_shutdown) {
+    pthread_mutex_unlock(&_mutex);
+    return;
+  }
+  for (map<string, EventManager::WallTime>::iterator i = _expired.begin();
+       i != _expired.end(); ) {
+    if (now - i->second >= TOMBSTONE_EXPIRY) {
+      _expired.erase(i++);
     } else {
-      DLOG(ERROR) << "Reference count decremented below zero.";
+      ++i;
+    }
+  }
+  if (_roundStarted == 0 || now - _roundStarted >= GOSSIP_TIMEOUT) {
+    for (map<HostPortPair, shared_ptr<RPCClient> >::iterator i =
+         _peers.begin(); i != _peers.end(); ++i) {
+      if (_downSince.find(i->first) == _downSince.end()) {
+        peers.push_back(*i);
+      }
+    }
+    // Pick ceil(log2(N + 1)) peers at random.
+    const size_t fanout = std::min(peers.size(),
+        (size_t)ceil(log(peers.size() + 1.0) / log(2.0)));
+    for (size_t i = 0; i < fanout; i++) {
+      std::swap(peers[i], peers[i + rand() % (peers.size() - i)]);
+    }
+    peers.resize(fanout);
+    if (!peers.empty()) {
+      _roundStarted = now;
+    }
+  }
+  if (now - _syncStarted >= (_syncing ? GOSSIP_TIMEOUT : ANTI_ENTROPY_INTERVAL)) {
+    vector<shared_ptr<RPCClient> > up;
+    for (map<HostPortPair, shared_ptr<RPCClient> >::iterator i =
+         _peers.begin(); i != _peers.end(); ++i) {
+      if (_downSince.find(i->first) == _downSince.end()) {
+        up.push_back(i->second);
+      }
+    }
+    if (!up.empty()) {
+      syncPeer = up[rand() % up.size()];
+      _syncStarted = now;
+      _syncing = true;
     }
   }
   pthread_mutex_unlock(&_mutex);
+
+  if (!peers.empty()) {
+    const std::pair<HostPortPair, shared_ptr<RPCClient> > first = peers[0];
+    peers.erase(peers.begin());
+    exchange(first.first, first.second, true, peers);
+  }
+  if (syncPeer) {
+    sync(syncPeer);
+  }
+  _em->enqueue(bind(&ServiceNode::Internal::roundLater,
+                    weak_ptr<Internal>(shared_from_this())),
+               now + GOSSIP_INTERVAL);
+}
+
+void ServiceNode::Internal::exchange(HostPortPair addr,
+                                     shared_ptr<RPCClient> peer,
+                                     bool first, PeerList rest) {
+  pthread_mutex_lock(&_mutex);
+  // Push what the peer was missing last time we heard from it. Peers we
+  // haven't heard from yet are only asked for what we are missing.
+  map<HostPortPair, map<string, uint64_t> >::const_iterator known =
+      _peerVersions.find(addr);
+  GossipMessage msg = digest(known == _peerVersions.end() ?
+                             NULL : &known->second);
+  pthread_mutex_unlock(&_mutex);
+
+  Future<GossipMessage> reply = peer->call(kGossip, msg);
+  reply.addCallback(bind(&ServiceNode::Internal::onExchange,
+                         weak_ptr<Internal>(shared_from_this()), addr,
+                         reply, first, rest));
+}
+
+void ServiceNode::Internal::onExchange(weak_ptr<Internal> internal,
+                                       HostPortPair addr,
+                                       Future<GossipMessage> reply,
+                                       bool first, PeerList rest) {
+  shared_ptr<Internal> self = internal.lock();
+  if (!self) {
+    return;
+  }
+  pthread_mutex_lock(&self->_mutex);
+  // A failed call leaves an empty reply; every node has its own version.
+  if (!reply.get().versions.empty()) {
+    self->merge(reply.get());
+    self->_peerVersions[addr] = reply.get().versions;
+  }
+  if (first) {
+    self->_roundStarted = 0;
+  }
+  pthread_mutex_unlock(&self->_mutex);
+
+  for (size_t i = 0; i < rest.size(); i++) {
+    self->exchange(rest[i].first, rest[i].second, false, PeerList());
+  }
+}
+
+void ServiceNode::Internal::sync(shared_ptr<RPCClient> peer) {
+  // Compare the roots first; in the common case that is all it takes.
+  descend(peer, vector<uint32_t>(1, 1), 0);
+}
+
+void ServiceNode::Internal::descend(shared_ptr<RPCClient> peer,
+                                    const vector<uint32_t> &nodes,
+                                    int32_t levels) {
+  Future< vector<uint64_t> > reply = peer->call(kMerkle, nodes, levels);
+  reply.addCallback(bind(&ServiceNode::Internal::onDescend,
+                         weak_ptr<Internal>(shared_from_this()), peer,
+                         nodes, levels, reply));
+}
+
+void ServiceNode::Internal::onDescend(weak_ptr<Internal> internal,
+                                      shared_ptr<RPCClient> peer,
+                                      vector<uint32_t> nodes, int32_t levels,
+                                      Future< vector<uint64_t> > reply) {
+  shared_ptr<Internal> self = internal.lock();
+  if (!self) {
+    return;
+  }
+  const vector<uint64_t> &theirs = reply.get();
+  vector<uint32_t> differing;
+  pthread_mutex_lock(&self->_mutex);
+  size_t k = 0;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const vector<uint64_t> mine = self->_merkle.descendants(nodes[i], levels);
+    const uint32_t first = self->_merkle.firstDescendant(nodes[i], levels);
+    for (size_t j = 0; j < mine.size(); j++, k++) {
+      if (k < theirs.size() && mine[j] != theirs[k]) {
+        differing.push_back(first + j);
+      }
+    }
+  }
+  // A failed call leaves an empty reply.
+  if (theirs.size() != k || differing.empty()) {
+    self->_syncing = false;
+    pthread_mutex_unlock(&self->_mutex);
+    return;
+  }
+  if (differing.size() > MERKLE_MAX_NODES) {
+    differing.resize(MERKLE_MAX_NODES);
+  }
+  if (!self->_merkle.isLeafNode(differing[0])) {
+    pthread_mutex_unlock(&self->_mutex);
+    self->descend(peer, differing, MERKLE_LEVELS);
+    return;
+  }
+  // Every node in a reply is at the same depth, so these are all leaves.
+  for (size_t i = 0; i < differing.size(); i++) {
+    differing[i] -= self->_merkle.numLeaves();
+  }
+  GossipMessage msg = self->collect(differing);
+  pthread_mutex_unlock(&self->_mutex);
+
+  Future<GossipMessage> synced = peer->call(kSync, differing, msg);
+  synced.addCallback(bind(&ServiceNode::Internal::onSync, internal, synced));
+}
+
+void ServiceNode::Internal::onSync(weak_ptr<Internal> internal,
+                                   Future<GossipMessage> reply) {
+  shared_ptr<Internal> self = internal.lock();
+  if (!self) {
+    return;
+  }
+  pthread_mutex_lock(&self->_mutex);
+  self->merge(reply.get(), false);
+  self->_syncing = false;
+  pthread_mutex_unlock(&self->_mutex);
 }
 
 void ServiceNode::Internal::addGroupCallback(
@@ -186,13 +606,78 @@ void ServiceNode::Internal::removeGroupCallback(const string& group) {
   pthread_mutex_unlock(&_mutex);
 }
 
+void ServiceNode::Internal::PeerDown(HostPortPair addr) {
+  pthread_mutex_lock(&_mutex);
+  DLOG(INFO) << "Internal::PeerDown( " << addr.first << ":" << addr.second << ")";
+  EventManager::WallTime now = EventManager::currentTime();
+  if (_peers.find(addr) != _peers.end() &&
+      _downSince.find(addr) == _downSince.end()) {
+    _downSince[addr] = now;
+    _em->enqueue(bind(&ServiceNode::Internal::ExpirePeer,
+                      weak_ptr<Internal>(shared_from_this()), addr),
+                 now + PEER_EXPIRY);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+void ServiceNode::Internal::PeerUp(HostPortPair addr) {
+  pthread_mutex_lock(&_mutex);
+  DLOG(INFO) << "Internal::PeerUp( " << addr.first << ":" << addr.second << ")";
+  _downSince.erase(addr);
+  pthread_mutex_unlock(&_mutex);
+}
+
+void ServiceNode::Internal::ExpirePeer(weak_ptr<Internal> internal,
+                                       HostPortPair addr) {
+  shared_ptr<Internal> self = internal.lock();
+  if (!self) {
+    return;
+  }
+  pthread_mutex_lock(&self->_mutex);
+  map<HostPortPair, EventManager::WallTime>::iterator i =
+      self->_downSince.find(addr);
+  if (i == self->_downSince.end()) {
+    // Reconnected in the meantime.
+    pthread_mutex_unlock(&self->_mutex);
+    return;
+  }
+  EventManager::WallTime expiry = i->second + PEER_EXPIRY;
+  if (EventManager::currentTime() < expiry) {
+    // Went down again since this check was scheduled.
+    self->_em->enqueue(bind(&ServiceNode::Internal::ExpirePeer,
+                            internal, addr), expiry);
+    pthread_mutex_unlock(&self->_mutex);
+    return;
+  }
+  pthread_mutex_unlock(&self->_mutex);
+  self->RemovePeer(addr);
+}
+
 void ServiceNode::Internal::RemovePeer(HostPortPair addr) {
   pthread_mutex_lock(&_mutex);
   DLOG(INFO) << "Internal::RemovePeer( " << addr.first << ":" << addr.second << ")";
   shared_ptr<RPCClient> peer = _peers[addr];
-  // TODO: Remove from any groups this peer is registered in.
   _peers.erase(addr);
+  _downSince.erase(addr);
+  _peerVersions.erase(addr);
+  // Drop whatever the peer added, from this and any earlier run of it.
+  std::ostringstream prefix;
+  prefix << addr.first << ":" << addr.second << "/";
+  vector<string> origins;
+  for (map<string, Origin>::const_iterator i =
+       _origins.lower_bound(prefix.str());
+       i != _origins.end() &&
+       i->first.compare(0, prefix.str().size(), prefix.str()) == 0; ++i) {
+    origins.push_back(i->first);
+  }
+  for (size_t i = 0; i < origins.size(); i++) {
+    expire(origins[i]);
+  }
   pthread_mutex_unlock(&_mutex);
+  if (peer) {
+    peer->setDisconnectCallback(NULL);
+    peer->disconnect();
+  }
 }
 
 Future<bool> ServiceNode::Internal::RPCAddPeer(string host, uint16_t port) {
@@ -201,16 +686,37 @@ Future<bool> ServiceNode::Internal::RPCAddPeer(string host, uint16_t port) {
     // Already connected.
     return true;
   } else {
-    shared_ptr<TcpSocket> s = TcpSocket::connect(_em, host, port);
+    // Peers share the connection to them with our other services.
+    shared_ptr<Mesh> mesh = _mesh.lock();
+    shared_ptr<Transport> s;
+    if (mesh) {
+      s = mesh->open(host, port, ServiceNode::kServiceName,
+                     Multiplexer::PRIORITY_CONTROL);
+    }
     if (s == NULL) {
       DLOG(INFO) << "Failed to connect to peer at " << host << ":" << port;
       return false;
     }
     pthread_mutex_lock(&_mutex);
 
+    // A peer we gave up on may be back with the same run; accept its
+    // entries again.
+    std::ostringstream prefix;
+    prefix << host << ":" << port << "/";
+    for (map<string, EventManager::WallTime>::iterator i =
+         _expired.lower_bound(prefix.str());
+         i != _expired.end() &&
+         i->first.compare(0, prefix.str().size(), prefix.str()) == 0; ) {
+      _expired.erase(i++);
+    }
+
     shared_ptr<RPCClient> peer(new RPCClient(s));
+    peer->setReconnect(mesh->connector(host, port, ServiceNode::kServiceName,
+                                       Multiplexer::PRIORITY_CONTROL));
     peer->setDisconnectCallback(
-        bind(&ServiceNode::Internal::RemovePeer, shared_from_this(), addr));
+        bind(&ServiceNode::Internal::PeerDown, shared_from_this(), addr));
+    peer->setReconnectCallback(
+        bind(&ServiceNode::Internal::PeerUp, shared_from_this(), addr));
     _peers[addr] = peer;
 
     peer->start();
@@ -232,54 +738,59 @@ Future<bool> ServiceNode::Internal::RPCAddPeer(string host, uint16_t port) {
       }
     }
 
-    // Notify host of our group memberships
-    for (map<string, map< string, int> >::iterator i = _groups.begin();
-         i != _groups.end(); ++i) {
-      for (map<string, int>::iterator j = i->second.begin();
-         j != i->second.end(); ++j) {
-        peer->call<bool, string, string>("addToGroup", i->first, j->first)
-            .addCallback(bind(&DummyFunc, peer));
-      }
-    }
+    // Group memberships reach the host by gossip.
     pthread_mutex_unlock(&_mutex);
     return ret;
   }
 }
 
-Future<bool> ServiceNode::Internal::RPCAddToGroup(string group, string value) {
+Future<GossipMessage> ServiceNode::Internal::RPCGossip(
+    const GossipMessage &msg) {
   pthread_mutex_lock(&_mutex);
-  if (_groups[group].find(value) != _groups[group].end()) {
-    _groups[group][value]++;
-  } else {
-    _groups[group][value] = 1;
-    if (_group_callbacks.find(group) != _group_callbacks.end()) {
-      for(vector<function<void(const string&, bool)> >::iterator i = _group_callbacks[group].begin();
-          i != _group_callbacks[group].end(); ++i) {
-        (*i)(value, true);
-      }
+  merge(msg);
+  GossipMessage ret = digest(&msg.versions);
+  pthread_mutex_unlock(&_mutex);
+  return ret;
+}
+
+Future< vector<uint64_t> > ServiceNode::Internal::RPCMerkle(
+    const vector<uint32_t> &nodes, int32_t levels) {
+  vector<uint64_t> ret;
+  if (nodes.size() > MERKLE_MAX_NODES || levels < 0 ||
+      levels > MERKLE_LEVELS) {
+    return ret;
+  }
+  pthread_mutex_lock(&_mutex);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i] < 1 || nodes[i] >= 2 * _merkle.numLeaves()) {
+      ret.clear();
+      break;
     }
+    const vector<uint64_t> hashes = _merkle.descendants(nodes[i], levels);
+    ret.insert(ret.end(), hashes.begin(), hashes.end());
   }
   pthread_mutex_unlock(&_mutex);
-  return true;
+  return ret;
 }
 
-Future<bool> ServiceNode::Internal::RPCRemoveFromGroup(string group, string value) {
-  pthread_mutex_lock(&_mutex);
-  if (_groups[group].find(value) != _groups[group].end()) {
-    if (_groups[group][value] == 1) {
-      _groups[group].erase(value);
-      if (_group_callbacks.find(group) != _group_callbacks.end()) {
-        for(vector<function<void(const string&, bool)> >::iterator i = _group_callbacks[group].begin();
-            i != _group_callbacks[group].end(); ++i) {
-          (*i)(value, false);
-        }
-      }
+Future<GossipMessage> ServiceNode::Internal::RPCSync(
+    const vector<uint32_t> &leaves, const GossipMessage &msg) {
+  GossipMessage ret;
+  if (leaves.size() > MERKLE_MAX_NODES) {
+    return ret;
+  }
+  for (size_t i = 0; i < leaves.size(); i++) {
+    if (leaves[i] >= _merkle.numLeaves()) {
+      return ret;
     }
-  } else {
-    _groups[group][value]--;
   }
+  pthread_mutex_lock(&_mutex);
+  // Reply with what we held before taking theirs, so that the caller
+  // gets back only what it might be missing.
+  ret = collect(leaves);
+  merge(msg, false);
   pthread_mutex_unlock(&_mutex);
-  return true;
+  return ret;
 }
 
 }  // end rpc namespace
@@ -30,14 +30,44 @@
 #define _RPC_SERVICE_NODE_H_
 
 #include "epoll_threadpool/eventmanager.h"
+#include "rpc/mesh.h"
 #include "rpc/rpc.h"
+#include "util/merkletree.h"
+
+#include <set>
 
 using epoll_threadpool::EventManager;
 using std::list;
 using std::map;
+using std::set;
+using util::MerkleTree;
 
 namespace rpc {
 
+/**
+ * The latest state of one group member as held by the node it came from.
+ */
+struct GossipEntry {
+  GossipEntry() : count(0), version(0) { }
+
+  string group;
+  string name;
+  int32_t count;     // References the node holds, 0 once all are removed.
+  uint64_t version;  // The node's change counter when this was written.
+  MSGPACK_DEFINE(group, name, count, version);
+};
+
+/**
+ * One side of a gossip exchange: the sender's version vector, holding
+ * the highest change counter it has seen from each node, and a batch of
+ * entries the receiver is missing, by node and in version order.
+ */
+struct GossipMessage {
+  map<string, uint64_t> versions;
+  map<string, vector<GossipEntry> > deltas;
+  MSGPACK_DEFINE(versions, deltas);
+};
+
 /**
  * Encapsulates functionality to run a full-mesh RPC-based P2P node.
  * The node acts as an RPCServer so you can add your own custom RPC methods
@@ -45,17 +75,31 @@ namespace rpc {
  * registration of services provided by the local node. The contents of
  * this directory are shared with all other peers with eventual consistency
  * semantics. (We provide no timing or ordering guarentees)
+ *
+ * Nodes talk over control priority streams of a Mesh, which other services
+ * of the same process may share.
  */
 class ServiceNode {
  public:
   /**
    * Given a publically addressable IP and local port to listen on,
-   * creates a new P2P Discovery Service Node.
+   * creates a new P2P Discovery Service Node with a Mesh of its own.
    */
   static shared_ptr<ServiceNode> create(
     EventManager* em, const string& host);
   static shared_ptr<ServiceNode> create(
       EventManager* em, const string& host, int port);
+
+  /**
+   * Creates a node serving over an existing Mesh, reaching peers through
+   * the connections the Mesh already has to them.
+   */
+  static shared_ptr<ServiceNode> create(shared_ptr<Mesh> mesh);
+
+  /**
+   * The name ServiceNodes register with their Mesh.
+   */
+  static const char kServiceName[];
   virtual ~ServiceNode();
 
   /**
@@ -78,18 +122,27 @@ class ServiceNode {
   }
 
   /**
-   * Adds an item to a group. Either strings may be anything.
-   * The network + processing cost is O(N) in number of peers.
+   * Adds an item to a group. Either strings may be anything. Group
+   * membership is reference counted across nodes.
+   * Changes are batched and gossiped: every round each node swaps version
+   * vectors with log(N) random peers and receives just the changes it
+   * hasn't seen, so a change reaches all N peers in O(log N) rounds and a
+   * joining node downloads the existing entries about once.
    */
   void addToGroup(const string &group, const string &name) {
     _internal->addToGroup(group, name);
   }
 
   /**
-   * Removes an item to a group. Does nothing if the group and/or item
-   * don't exist. This will also be done automatically if the peer
-   * disconnects.
-   * The network + processing cost is O(N) in number of peers.
+   * Removes a reference this node added to an item in a group. Does
+   * nothing if this node holds no reference to it. Changes spread as for
+   * addToGroup().
+   *
+   * Every reference is tagged with the node that added it. When a peer
+   * is forgotten, or restarts and so can no longer remove what it added
+   * before, its references are dropped in one go. Anything gossip misses
+   * is repaired in the background by comparing hash trees of the group
+   * state with a random peer and swapping only the entries that differ.
    */
   void removeFromGroup(const string &group, const string &name) {
     _internal->removeFromGroup(group, name);
@@ -114,8 +167,7 @@ class ServiceNode {
   }
 
  protected:
-  ServiceNode(EventManager *em, const string& host, int port, 
-              shared_ptr<TcpListenSocket> s);
+  explicit ServiceNode(shared_ptr<Mesh> mesh);
 
   /**
    * Internal class that does most of our work. We reference count 
@@ -123,9 +175,14 @@ class ServiceNode {
    */
   class Internal : public enable_shared_from_this<Internal> {
    public:
-    Internal(EventManager* em, const string& host, uint16_t port);
+    Internal(shared_ptr<Mesh> mesh);
     virtual ~Internal();
 
+    /**
+     * Starts the periodic gossip rounds.
+     */
+    void start();
+
     /**
      * Kills all peer connections.
      */
@@ -140,18 +197,121 @@ class ServiceNode {
     void removeGroupCallback(const string& group);
    private:
     typedef std::pair<string, uint16_t> HostPortPair;
+    typedef std::pair<string, string> GroupMember;
+    typedef vector< std::pair<HostPortPair, shared_ptr<RPCClient> > > PeerList;
+
+    /**
+     * The entries written by one node, indexed by member and by version.
+     */
+    struct Entry {
+      int count;
+      uint64_t version;
+      uint32_t leaf;  // Where the entry sits in _merkle, and its hash there.
+      uint64_t hash;
+    };
+    struct Origin {
+      Origin() : version(0) { }
+
+      uint64_t version;  // Highest seen, this origin's version vector entry.
+      map<GroupMember, Entry> entries;
+      map<uint64_t, GroupMember> byVersion;
+    };
 
     pthread_mutex_t _mutex;
     EventManager *_em;
+    weak_ptr<Mesh> _mesh;
     string _host;
     uint16_t _port;
+    string _self;  // Names this node, and this run of it, as an origin.
+    bool _shutdown;
 
     map<HostPortPair, shared_ptr<RPCClient> > _peers;
-    map<string, map<string, int> > _groups;
+    map<HostPortPair, EventManager::WallTime> _downSince;  // Reconnecting.
+    map<HostPortPair, map<string, uint64_t> > _peerVersions;
+    map<string, Origin> _origins;
+    map<string, EventManager::WallTime> _expired;  // Origins dropped, when.
+    MerkleTree _merkle;  // Over every origin's entries.
+    vector< set< std::pair<string, GroupMember> > > _leaves;  // Per leaf.
+    map<string, map<string, int> > _groups;  // Summed over origins.
     map<string, vector< function<void(const string&, bool)> > > _group_callbacks;
+    EventManager::WallTime _roundStarted;  // 0 once its first reply is in.
+    EventManager::WallTime _syncStarted;
+    bool _syncing;
+
+    /**
+     * Records an origin's entry for member if it is newer than ours.
+     * Entries that arrive out of order, as repairs do, must not advance
+     * the origin's version or gossip would skip the entries before them.
+     */
+    void apply(const string &origin, const GroupMember &member,
+               int count, uint64_t version, bool advance = true);
+
+    /**
+     * Returns whether entries from origin should be kept. Meeting a newer
+     * incarnation of a node expires the older ones.
+     */
+    bool admit(const string &origin);
+
+    /**
+     * Drops every entry an origin wrote and ignores it from then on.
+     */
+    void expire(const string &origin);
+
+    /**
+     * Adjusts member's summed reference count, firing callbacks when it
+     * appears or disappears.
+     */
+    void adjust(const GroupMember &member, int delta);
+
+    /**
+     * Returns our version vector and, if theirs is given, the entries it
+     * is missing, up to a batch limit.
+     */
+    GossipMessage digest(const map<string, uint64_t> *theirs) const;
+    void merge(const GossipMessage &msg, bool advance = true);
+
+    /**
+     * Returns every entry in the given _merkle leaves.
+     */
+    GossipMessage collect(const vector<uint32_t> &leaves) const;
+
+    /**
+     * Gossip rounds. The first exchange of a round runs alone so that a
+     * node catching up downloads what it is missing once, not from every
+     * peer it picked; the rest then only see what is still missing.
+     */
+    void round();
+    static void roundLater(weak_ptr<Internal> internal);
+    void exchange(HostPortPair addr, shared_ptr<RPCClient> peer, bool first,
+                  PeerList rest);
+    static void onExchange(weak_ptr<Internal> internal, HostPortPair addr,
+                           Future<GossipMessage> reply, bool first,
+                           PeerList rest);
+
+    /**
+     * Anti-entropy. Compares the root of our hash tree with a peer's and
+     * walks down the branches that differ, a few levels per call, then
+     * swaps the entries under the differing leaves.
+     */
+    void sync(shared_ptr<RPCClient> peer);
+    void descend(shared_ptr<RPCClient> peer, const vector<uint32_t> &nodes,
+                 int32_t levels);
+    static void onDescend(weak_ptr<Internal> internal,
+                          shared_ptr<RPCClient> peer, vector<uint32_t> nodes,
+                          int32_t levels, Future< vector<uint64_t> > reply);
+    static void onSync(weak_ptr<Internal> internal,
+                       Future<GossipMessage> reply);
+
+    /**
+     * Callback methods triggered when a connection is lost and when it is
+     * re-established. A peer that stays down too long is expired.
+     */
+    void PeerDown(HostPortPair addr);
+    void PeerUp(HostPortPair addr);
+    static void ExpirePeer(weak_ptr<Internal> internal, HostPortPair addr);
 
     /**
-     * Callback method triggered when a connection is lost.
+     * Forgets a peer and stops reconnecting to it.
      */
     void RemovePeer(HostPortPair addr);
 
@@ -160,11 +320,15 @@ class ServiceNode {
      * RPC Functions
      */
     Future<bool> RPCAddPeer(string host, uint16_t port);
-    Future<bool> RPCAddToGroup(string group, string value);
-    Future<bool> RPCRemoveFromGroup(string group, string value);
+    Future<GossipMessage> RPCGossip(const GossipMessage &msg);
+    Future< vector<uint64_t> > RPCMerkle(const vector<uint32_t> &nodes,
+                                         int32_t levels);
+    Future<GossipMessage> RPCSync(const vector<uint32_t> &leaves,
+                                  const GossipMessage &msg);
   };
 
  private:
+  shared_ptr<Mesh> _mesh;
   shared_ptr<RPCServer> _rpc_server;
   shared_ptr<Internal> _internal;
 };
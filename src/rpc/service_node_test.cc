@@ -34,8 +34,9 @@
 #include <epoll_threadpool/eventmanager.h>
 #include <epoll_threadpool/notification.h>
 
-#include <string>
 #include <list>
+#include <sstream>
+#include <string>
 
 #include <gtest/gtest.h>
 
@@ -45,10 +46,13 @@ namespace rpc {
 
 using epoll_threadpool::EventManager;
 using epoll_threadpool::Notification;
+using rpc::Mesh;
+using rpc::Multiplexer;
 using rpc::ServiceNode;
 using std::tr1::shared_ptr;
 using std::list;
 using std::string;
+using std::vector;
 
 void GroupCallbackHelper(string expectedValue,
                          Notification *n,
@@ -121,4 +125,215 @@ TEST(ServiceNodeTest, Basics) {
   usleep(10000);
 }
 
+void RemovedHelper(string expectedValue, Notification *n,
+                   const string& value, bool isAdded) {
+  if (expectedValue == value && !isAdded) {
+    n->signal();
+  }
+}
+
+/**
+ * Counts group members as they come and go, signalling when the count
+ * reaches 'target'.
+ */
+struct MemberCounter {
+  MemberCounter(int target) : target(target), count(0) {
+    pthread_mutex_init(&lock, NULL);
+  }
+  ~MemberCounter() { pthread_mutex_destroy(&lock); }
+
+  void update(const string& value, bool isAdded) {
+    pthread_mutex_lock(&lock);
+    count += isAdded ? 1 : -1;
+    if (count == target) {
+      reached.signal();
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  int get() {
+    pthread_mutex_lock(&lock);
+    const int ret = count;
+    pthread_mutex_unlock(&lock);
+    return ret;
+  }
+
+  pthread_mutex_t lock;
+  int target;
+  int count;
+  Notification reached;
+};
+
+TEST(ServiceNodeTest, JoinAndRemove) {
+  EventManager em;
+
+  em.start(4);
+
+  shared_ptr<ServiceNode> node1(ServiceNode::create(&em, "127.0.0.1"));
+  shared_ptr<ServiceNode> node2(ServiceNode::create(&em, "127.0.0.1"));
+  shared_ptr<ServiceNode> node3(ServiceNode::create(&em, "127.0.0.1"));
+  node1->addPeer("127.0.0.1", node2->port());
+
+  // Members added before a node joins reach it in a batch.
+  for (int i = 0; i < 1000; i++) {
+    std::ostringstream name;
+    name << "member" << i;
+    node1->addToGroup("bulk", name.str());
+    node2->addToGroup("bulk", name.str());
+  }
+  MemberCounter joined(1000);
+  node3->addGroupCallback("bulk",
+      bind(&MemberCounter::update, &joined, _1, _2));
+  node3->addPeer("127.0.0.1", node1->port());
+  joined.reached.wait();
+  // Give node2's references time to arrive too.
+  usleep(2000000);
+
+  // Membership is reference counted across nodes, so a member leaves
+  // only once every node that added it has removed it.
+  Notification removed;
+  node3->addGroupCallback("bulk",
+      bind(&RemovedHelper, "member0", &removed, _1, _2));
+  node1->removeFromGroup("bulk", "member0");
+  usleep(2000000);
+  EXPECT_EQ(1000, joined.get());
+  node2->removeFromGroup("bulk", "member0");
+  removed.wait();
+  EXPECT_EQ(999, joined.get());
+
+  node1.reset();
+  node2.reset();
+  node3.reset();
+  usleep(10000);
+}
+
+/**
+ * Returns a node's hashes for the tree nodes 'levels' below each of nodes.
+ */
+vector<uint64_t> MerkleNodes(shared_ptr<Mesh> via, uint16_t port,
+                             const vector<uint32_t> &nodes, int32_t levels) {
+  RPCClient c(via->open("127.0.0.1", port, ServiceNode::kServiceName,
+                        Multiplexer::PRIORITY_CONTROL));
+  c.start();
+  vector<uint64_t> ret = c.call<vector<uint64_t>, vector<uint32_t>, int32_t>(
+      "serviceNode.merkle", nodes, levels).get();
+  c.disconnect();
+  return ret;
+}
+
+/**
+ * Returns the root of a node's hash tree over its group state.
+ */
+uint64_t MerkleRoot(shared_ptr<Mesh> via, uint16_t port) {
+  vector<uint64_t> root = MerkleNodes(via, port, vector<uint32_t>(1, 1), 0);
+  EXPECT_EQ(1u, root.size());
+  return root.empty() ? 0 : root[0];
+}
+
+TEST(ServiceNodeTest, RestartExpiresOldEntries) {
+  EventManager em;
+
+  em.start(4);
+  shared_ptr<Mesh> via(Mesh::create(&em, "127.0.0.1"));
+
+  shared_ptr<ServiceNode> node1(ServiceNode::create(&em, "127.0.0.1"));
+  shared_ptr<ServiceNode> node2(ServiceNode::create(&em, "127.0.0.1"));
+  const uint16_t port2 = node2->port();
+  node1->addPeer("127.0.0.1", port2);
+  MemberCounter added(100);
+  node1->addGroupCallback("restart",
+      bind(&MemberCounter::update, &added, _1, _2));
+  for (int i = 0; i < 100; i++) {
+    std::ostringstream name;
+    name << "member" << i;
+    node2->addToGroup("restart", name.str());
+  }
+  added.reached.wait();
+
+  // Both nodes now hold the same entries, so their trees agree.
+  EXPECT_NE(0u, MerkleRoot(via, node1->port()));
+  EXPECT_EQ(MerkleRoot(via, node1->port()), MerkleRoot(via, port2));
+
+  // A new run of node2 can't remove what the old one added, so node1
+  // drops all of it as soon as it hears from the new run.
+  MemberCounter removed(0);
+  node1->addGroupCallback("restart",
+      bind(&MemberCounter::update, &removed, _1, _2));
+  node2.reset();
+  for (int i = 0; i < 50 && !node2; i++) {
+    usleep(100000);
+    node2 = ServiceNode::create(&em, "127.0.0.1", port2);
+  }
+  ASSERT_TRUE(node2 != NULL);
+  node2->addPeer("127.0.0.1", node1->port());
+  removed.reached.wait();
+  EXPECT_EQ(0, added.get());
+
+  node1.reset();
+  node2.reset();
+  usleep(10000);
+}
+
+TEST(ServiceNodeTest, SyncRepairsDivergence) {
+  EventManager em;
+
+  em.start(4);
+  shared_ptr<Mesh> via(Mesh::create(&em, "127.0.0.1"));
+
+  // The nodes aren't peers, so nothing is gossiped between them.
+  shared_ptr<ServiceNode> node1(ServiceNode::create(&em, "127.0.0.1"));
+  shared_ptr<ServiceNode> node2(ServiceNode::create(&em, "127.0.0.1"));
+  node1->addToGroup("diverge", "only1");
+  Notification arrived;
+  node2->addGroupCallback("diverge",
+      bind(&GroupCallbackHelper, "only1", &arrived, _1, _2));
+  EXPECT_NE(MerkleRoot(via, node1->port()), MerkleRoot(via, node2->port()));
+
+  // Walk down to the leaf that differs four levels at a time, as nodes do
+  // themselves. Trees have 4096 leaves, numbered from 4096.
+  const uint32_t kLeaves = 4096;
+  vector<uint32_t> nodes(1, 1);
+  while (nodes[0] < kLeaves) {
+    vector<uint64_t> a = MerkleNodes(via, node1->port(), nodes, 4);
+    vector<uint64_t> b = MerkleNodes(via, node2->port(), nodes, 4);
+    ASSERT_EQ(16 * nodes.size(), a.size());
+    ASSERT_EQ(a.size(), b.size());
+    vector<uint32_t> differing;
+    for (size_t i = 0; i < a.size(); i++) {
+      if (a[i] != b[i]) {
+        differing.push_back((nodes[i / 16] << 4) + i % 16);
+      }
+    }
+    ASSERT_EQ(1u, differing.size());
+    nodes = differing;
+  }
+  vector<uint32_t> leaves(1, nodes[0] - kLeaves);
+
+  // Swap what each side has under that leaf.
+  RPCClient c1(via->open("127.0.0.1", node1->port(),
+                         ServiceNode::kServiceName,
+                         Multiplexer::PRIORITY_CONTROL));
+  RPCClient c2(via->open("127.0.0.1", node2->port(),
+                         ServiceNode::kServiceName,
+                         Multiplexer::PRIORITY_CONTROL));
+  c1.start();
+  c2.start();
+  GossipMessage entries =
+      c1.call<GossipMessage, vector<uint32_t>, GossipMessage>(
+          "serviceNode.sync", leaves, GossipMessage()).get();
+  EXPECT_EQ(1u, entries.deltas.size());
+  GossipMessage reply =
+      c2.call<GossipMessage, vector<uint32_t>, GossipMessage>(
+          "serviceNode.sync", leaves, entries).get();
+  arrived.wait();
+  EXPECT_TRUE(reply.deltas.empty());
+  EXPECT_EQ(MerkleRoot(via, node1->port()), MerkleRoot(via, node2->port()));
+  c1.disconnect();
+  c2.disconnect();
+
+  node1.reset();
+  node2.reset();
+  usleep(10000);
+}
+
 }
@@ -0,0 +1,138 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _RPC_TRANSPORT_H_
+#define _RPC_TRANSPORT_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <tr1/functional>
+#include <tr1/memory>
+
+#include <epoll_threadpool/eventmanager.h>
+#include <epoll_threadpool/iobuffer.h>
+#include <epoll_threadpool/tcp.h>
+
+namespace rpc {
+
+using epoll_threadpool::EventManager;
+using epoll_threadpool::IOBuffer;
+using epoll_threadpool::TcpSocket;
+using std::string;
+using std::tr1::function;
+using std::tr1::shared_ptr;
+
+/**
+ * A reliable, ordered byte stream to a single peer. RPCClient and
+ * RPCServer run over this rather than a TcpSocket directly so that layers
+ * such as SecureTransport can be stacked beneath them.
+ *
+ * The semantics match TcpSocket: nothing is received until start() is
+ * called, the receive callback is never called from two threads at once
+ * and is expected to consume the data it is given, and the disconnect
+ * callback fires once when the stream closes.
+ */
+class Transport {
+ public:
+  virtual ~Transport() { }
+
+  /**
+   * Starts delivering data to the receive callback.
+   */
+  virtual void start() = 0;
+
+  /**
+   * Queues data to be sent. May be called from any thread.
+   * @note Takes ownership of buf.
+   */
+  virtual void write(IOBuffer *buf) = 0;
+
+  virtual void disconnect() = 0;
+  virtual bool isDisconnected() const = 0;
+  virtual void setReceiveCallback(function<void(IOBuffer *)> cb) = 0;
+  virtual void setDisconnectCallback(function<void()> cb) = 0;
+  virtual EventManager *getEventManager() = 0;
+
+  /**
+   * Stops or resumes delivery to the receive callback. Transports with
+   * flow control hold data back while paused, so the peer soon stops
+   * sending. Others, such as TcpTransport, carry on delivering and the
+   * receiver has to bound what it buffers itself.
+   */
+  virtual void setPaused(bool paused) { }
+};
+
+/**
+ * Wraps an existing TcpSocket.
+ */
+class TcpTransport : public Transport {
+ public:
+  static shared_ptr<Transport> create(shared_ptr<TcpSocket> s) {
+    return shared_ptr<Transport>(s ? new TcpTransport(s) : NULL);
+  }
+
+  /**
+   * Connects to host:port, returning NULL on failure. Bound to its
+   * arguments this makes a connector for RPCClient::setReconnect().
+   */
+  static shared_ptr<Transport> connect(EventManager *em, const string &host,
+                                       uint16_t port) {
+    return create(TcpSocket::connect(em, host, port));
+  }
+  virtual ~TcpTransport() { }
+
+  virtual void start() { _socket->start(); }
+  virtual void write(IOBuffer *buf) { _socket->write(buf); }
+  virtual void disconnect() { _socket->disconnect(); }
+  virtual bool isDisconnected() const { return _socket->isDisconnected(); }
+  virtual void setReceiveCallback(function<void(IOBuffer *)> cb) {
+    _socket->setReceiveCallback(cb);
+  }
+  virtual void setDisconnectCallback(function<void()> cb) {
+    _socket->setDisconnectCallback(cb);
+  }
+  virtual EventManager *getEventManager() {
+    return _socket->getEventManager();
+  }
+
+ private:
+  TcpTransport(shared_ptr<TcpSocket> s) : _socket(s) { }
+
+  shared_ptr<TcpSocket> _socket;
+};
+
+/**
+ * Builds the transport an accepted connection is served over, such as
+ * SecureContext::serverTransport().
+ */
+typedef function<shared_ptr<Transport>(shared_ptr<Transport>)>
+    TransportFactory;
+
+}  // end rpc namespace
+#endif
@@ -0,0 +1,168 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "blockcipher.h"
+
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#include <glog/logging.h>
+
+namespace util {
+
+BlockCipher::BlockCipher(const string &key) : _counter(0) {
+  CHECK_EQ(kKeySize, key.size());
+  pthread_mutex_init(&_lock, NULL);
+  if (RAND_bytes(_prefix, sizeof(_prefix)) != 1) {
+    LOG(FATAL) << "Unable to generate a nonce prefix.";
+  }
+  // Key both contexts once. Later calls only change the nonce, which
+  // skips the key schedule.
+  const unsigned char *k = (const unsigned char *)key.data();
+  _encrypt = EVP_CIPHER_CTX_new();
+  _decrypt = EVP_CIPHER_CTX_new();
+  CHECK(_encrypt && _decrypt);
+  CHECK_EQ(1, EVP_EncryptInit_ex(_encrypt, EVP_aes_256_gcm(), NULL, NULL,
+                                 NULL));
+  CHECK_EQ(1, EVP_EncryptInit_ex(_encrypt, NULL, NULL, k, NULL));
+  CHECK_EQ(1, EVP_DecryptInit_ex(_decrypt, EVP_aes_256_gcm(), NULL, NULL,
+                                 NULL));
+  CHECK_EQ(1, EVP_DecryptInit_ex(_decrypt, NULL, NULL, k, NULL));
+}
+
+BlockCipher::~BlockCipher() {
+  EVP_CIPHER_CTX_free(_encrypt);
+  EVP_CIPHER_CTX_free(_decrypt);
+  pthread_mutex_destroy(&_lock);
+}
+
+string BlockCipher::generateKey() {
+  unsigned char key[kKeySize];
+  if (RAND_bytes(key, sizeof(key)) != 1) {
+    LOG(FATAL) << "Unable to generate a key.";
+  }
+  return string((const char *)key, sizeof(key));
+}
+
+bool BlockCipher::encrypt(char *buf, size_t len, const string &aad) {
+  pthread_mutex_lock(&_lock);
+  bool ret = encryptLocked(buf, len, aad);
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+ssize_t BlockCipher::decrypt(char *buf, size_t len, const string &aad) {
+  pthread_mutex_lock(&_lock);
+  ssize_t ret = decryptLocked(buf, len, aad);
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+bool BlockCipher::encryptBlocks(const vector<char *> &bufs,
+                                const vector<size_t> &lens,
+                                const vector<string> &aads) {
+  bool ok = true;
+  pthread_mutex_lock(&_lock);
+  for (size_t i = 0; i < bufs.size(); i++) {
+    ok = encryptLocked(bufs[i], lens[i], aads[i]) && ok;
+  }
+  pthread_mutex_unlock(&_lock);
+  return ok;
+}
+
+vector<ssize_t> BlockCipher::decryptBlocks(const vector<char *> &bufs,
+                                           const vector<size_t> &lens,
+                                           const vector<string> &aads) {
+  vector<ssize_t> ret(bufs.size());
+  pthread_mutex_lock(&_lock);
+  for (size_t i = 0; i < bufs.size(); i++) {
+    ret[i] = decryptLocked(bufs[i], lens[i], aads[i]);
+  }
+  pthread_mutex_unlock(&_lock);
+  return ret;
+}
+
+void BlockCipher::nextNonce(unsigned char *nonce) {
+  if (++_counter == 0) {
+    // 2^32 blocks under this prefix; move to a fresh one.
+    if (RAND_bytes(_prefix, sizeof(_prefix)) != 1) {
+      LOG(FATAL) << "Unable to generate a nonce prefix.";
+    }
+  }
+  memcpy(nonce, _prefix, sizeof(_prefix));
+  for (int i = 0; i < 4; i++) {
+    nonce[sizeof(_prefix) + i] = _counter >> (8 * i);
+  }
+}
+
+bool BlockCipher::encryptLocked(char *buf, size_t len, const string &aad) {
+  unsigned char *nonce = (unsigned char *)buf;
+  unsigned char *data = nonce + kNonceSize;
+  nextNonce(nonce);
+  int outl;
+  if (EVP_EncryptInit_ex(_encrypt, NULL, NULL, NULL, nonce) != 1 ||
+      (aad.size() &&
+       EVP_EncryptUpdate(_encrypt, NULL, &outl,
+                         (const unsigned char *)aad.data(),
+                         aad.size()) != 1) ||
+      (len && EVP_EncryptUpdate(_encrypt, data, &outl, data, len) != 1) ||
+      EVP_EncryptFinal_ex(_encrypt, data + len, &outl) != 1 ||
+      EVP_CIPHER_CTX_ctrl(_encrypt, EVP_CTRL_GCM_GET_TAG, kTagSize,
+                          data + len) != 1) {
+    LOG(ERROR) << "Block encryption failed.";
+    return false;
+  }
+  return true;
+}
+
+ssize_t BlockCipher::decryptLocked(char *buf, size_t len,
+                                   const string &aad) {
+  if (len < kOverhead) {
+    return -1;
+  }
+  const unsigned char *nonce = (const unsigned char *)buf;
+  unsigned char *data = (unsigned char *)buf + kNonceSize;
+  const size_t dataLen = len - kOverhead;
+  int outl;
+  if (EVP_DecryptInit_ex(_decrypt, NULL, NULL, NULL, nonce) != 1 ||
+      (aad.size() &&
+       EVP_DecryptUpdate(_decrypt, NULL, &outl,
+                         (const unsigned char *)aad.data(),
+                         aad.size()) != 1) ||
+      (dataLen &&
+       EVP_DecryptUpdate(_decrypt, data, &outl, data, dataLen) != 1) ||
+      EVP_CIPHER_CTX_ctrl(_decrypt, EVP_CTRL_GCM_SET_TAG, kTagSize,
+                          data + dataLen) != 1 ||
+      EVP_DecryptFinal_ex(_decrypt, data + dataLen, &outl) != 1) {
+    return -1;
+  }
+  return dataLen;
+}
+
+}
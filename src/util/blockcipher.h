@@ -0,0 +1,128 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_BLOCKCIPHER_H_
+#define _UTIL_BLOCKCIPHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+namespace util {
+
+using std::string;
+using std::vector;
+
+/**
+ * Authenticated encryption of blocks with AES-256-GCM through OpenSSL's
+ * EVP interface, which uses AES-NI and PCLMULQDQ where the CPU has them.
+ *
+ * Blocks are encrypted in place. A sealed block is laid out as a 12 byte
+ * nonce, the ciphertext and a 16 byte tag, so callers stage plaintext
+ * kNonceSize bytes into a buffer with kTagSize bytes spare after it and no
+ * temporary copy is made. Nonces are a random per-instance prefix plus a
+ * counter, so they never repeat under one key.
+ *
+ * A single EVP context is keyed once and reused for every block, with the
+ * batch calls sharing one lock acquisition. Instances may be shared
+ * between threads.
+ */
+class BlockCipher {
+ public:
+  static const size_t kKeySize = 32;
+  static const size_t kNonceSize = 12;
+  static const size_t kTagSize = 16;
+  static const size_t kOverhead = kNonceSize + kTagSize;
+
+  /**
+   * @param key kKeySize bytes of key material.
+   */
+  explicit BlockCipher(const string &key);
+  ~BlockCipher();
+
+  /**
+   * Encrypts the len bytes of plaintext at buf + kNonceSize in place,
+   * filling in the nonce before it and the tag after it.
+   * @param aad data authenticated along with the block, such as its key,
+   *        that must be given again to decrypt it.
+   * @returns false on error.
+   */
+  bool encrypt(char *buf, size_t len, const string &aad);
+
+  /**
+   * Verifies and decrypts a sealed block of len bytes in place, leaving
+   * the plaintext at buf + kNonceSize.
+   * @returns the plaintext length or -1 if the block is damaged, was
+   *          sealed under another key or with different aad.
+   */
+  ssize_t decrypt(char *buf, size_t len, const string &aad);
+
+  /**
+   * Encrypts several blocks, as encrypt().
+   * @returns false if any failed.
+   */
+  bool encryptBlocks(const vector<char *> &bufs, const vector<size_t> &lens,
+                     const vector<string> &aads);
+
+  /**
+   * Decrypts several blocks, as decrypt(), returning each one's plaintext
+   * length or -1.
+   */
+  vector<ssize_t> decryptBlocks(const vector<char *> &bufs,
+                                const vector<size_t> &lens,
+                                const vector<string> &aads);
+
+  /**
+   * Returns kKeySize random bytes suitable for use as a key.
+   */
+  static string generateKey();
+
+ private:
+  BlockCipher(const BlockCipher &);
+  BlockCipher &operator=(const BlockCipher &);
+
+  bool encryptLocked(char *buf, size_t len, const string &aad);
+  ssize_t decryptLocked(char *buf, size_t len, const string &aad);
+  void nextNonce(unsigned char *nonce);
+
+  pthread_mutex_t _lock;
+  EVP_CIPHER_CTX *_encrypt;
+  EVP_CIPHER_CTX *_decrypt;
+  unsigned char _prefix[8];
+  uint32_t _counter;
+};
+
+}
+#endif
@@ -0,0 +1,145 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "blockcipher.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+using std::string;
+using std::vector;
+using util::BlockCipher;
+
+namespace {
+/**
+ * Returns a buffer holding len random bytes of plaintext staged for
+ * in place encryption.
+ */
+vector<char> stage(size_t len) {
+  vector<char> buf(len + BlockCipher::kOverhead);
+  for (size_t i = 0; i < len; i++) {
+    buf[BlockCipher::kNonceSize + i] = rand();
+  }
+  return buf;
+}
+}
+
+TEST(BlockCipher, RoundTrip) {
+  BlockCipher cipher(BlockCipher::generateKey());
+  const size_t sizes[] = { 0, 1, 15, 16, 17, 4096, 65536 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    vector<char> buf = stage(sizes[i]);
+    vector<char> plain = buf;
+    ASSERT_TRUE(cipher.encrypt(&buf[0], sizes[i], "key"));
+    if (sizes[i] >= 16) {
+      EXPECT_NE(0, memcmp(&buf[BlockCipher::kNonceSize],
+                          &plain[BlockCipher::kNonceSize], sizes[i]));
+    }
+    ASSERT_EQ((ssize_t)sizes[i], cipher.decrypt(&buf[0], buf.size(), "key"));
+    EXPECT_EQ(0, memcmp(&buf[BlockCipher::kNonceSize],
+                        &plain[BlockCipher::kNonceSize], sizes[i]));
+  }
+}
+
+TEST(BlockCipher, UniqueNonces) {
+  BlockCipher cipher(BlockCipher::generateKey());
+  vector<char> a = stage(64);
+  vector<char> b = a;
+  ASSERT_TRUE(cipher.encrypt(&a[0], 64, "key"));
+  ASSERT_TRUE(cipher.encrypt(&b[0], 64, "key"));
+  EXPECT_NE(0, memcmp(&a[0], &b[0], BlockCipher::kNonceSize));
+  EXPECT_NE(0, memcmp(&a[BlockCipher::kNonceSize],
+                      &b[BlockCipher::kNonceSize], 64));
+}
+
+TEST(BlockCipher, Tamper) {
+  BlockCipher cipher(BlockCipher::generateKey());
+  BlockCipher other(BlockCipher::generateKey());
+  vector<char> sealed = stage(1000);
+  ASSERT_TRUE(cipher.encrypt(&sealed[0], 1000, "key"));
+
+  // Every byte of nonce, ciphertext and tag is covered.
+  const size_t offsets[] = { 0, BlockCipher::kNonceSize + 500,
+                             sealed.size() - 1 };
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    vector<char> buf = sealed;
+    buf[offsets[i]] ^= 1;
+    EXPECT_EQ(-1, cipher.decrypt(&buf[0], buf.size(), "key"));
+  }
+  vector<char> buf = sealed;
+  EXPECT_EQ(-1, cipher.decrypt(&buf[0], buf.size(), "other key"));
+  buf = sealed;
+  EXPECT_EQ(-1, other.decrypt(&buf[0], buf.size(), "key"));
+  EXPECT_EQ(-1, cipher.decrypt(&buf[0], BlockCipher::kOverhead - 1, "key"));
+  buf = sealed;
+  EXPECT_EQ(1000, cipher.decrypt(&buf[0], buf.size(), "key"));
+}
+
+TEST(BlockCipher, Batch) {
+  BlockCipher cipher(BlockCipher::generateKey());
+  vector<vector<char> > blocks;
+  vector<char *> bufs;
+  vector<size_t> lens;
+  vector<string> aads;
+  for (int i = 0; i < 8; i++) {
+    blocks.push_back(stage(100 * i));
+    lens.push_back(100 * i);
+    aads.push_back(string("block") + (char)('0' + i));
+  }
+  vector<vector<char> > plain = blocks;
+  for (int i = 0; i < 8; i++) {
+    bufs.push_back(&blocks[i][0]);
+  }
+  ASSERT_TRUE(cipher.encryptBlocks(bufs, lens, aads));
+
+  // Decrypt one block singly to show the formats agree, then the rest
+  // as a batch with one block's aad swapped.
+  ASSERT_EQ(300, cipher.decrypt(bufs[3], lens[3] + BlockCipher::kOverhead,
+                                aads[3]));
+  bufs.erase(bufs.begin() + 3);
+  aads.erase(aads.begin() + 3);
+  lens.erase(lens.begin() + 3);
+  for (size_t i = 0; i < lens.size(); i++) {
+    lens[i] += BlockCipher::kOverhead;
+  }
+  std::swap(aads[0], aads[1]);
+  vector<ssize_t> ret = cipher.decryptBlocks(bufs, lens, aads);
+  ASSERT_EQ(7u, ret.size());
+  EXPECT_EQ(-1, ret[0]);
+  EXPECT_EQ(-1, ret[1]);
+  for (int i = 2; i < 7; i++) {
+    EXPECT_EQ((ssize_t)(lens[i] - BlockCipher::kOverhead), ret[i]);
+    EXPECT_EQ(0, memcmp(bufs[i] + BlockCipher::kNonceSize,
+                        &plain[i < 3 ? i : i + 1][BlockCipher::kNonceSize],
+                        ret[i]));
+  }
+}
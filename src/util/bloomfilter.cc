@@ -140,8 +140,7 @@ BloomFilter &BloomFilter::deserialize(const vector<uint8_t> &src) {
         << " != " << (((size+7)/8)+sizeof(uint32_t)+sizeof(uint32_t)) << ")";
     return *this;
   }
-  _seed = seed;
-  _size = size;
+  reset(size, seed);
   memcpy(_hash, &src[sizeof(uint32_t)*2], (_size+7)/8);
   return *this;
 }
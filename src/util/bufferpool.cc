@@ -0,0 +1,103 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "bufferpool.h"
+
+#include <glog/logging.h>
+
+#include <map>
+
+#include <stdlib.h>
+
+namespace util {
+
+using std::map;
+
+namespace {
+pthread_mutex_t shared_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+map<size_t, BufferPool *> shared_pools;
+}
+
+const size_t BufferPool::kAlignment;
+
+BufferPool::BufferPool(size_t bufsize, size_t maxIdle)
+    : _bufsize(align(bufsize)), _maxIdle(maxIdle), _allocations(0) {
+  pthread_mutex_init(&_mutex, 0);
+}
+
+BufferPool::~BufferPool() {
+  for (vector<char *>::iterator i = _idle.begin(); i != _idle.end(); ++i) {
+    free(*i);
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+BufferPool *BufferPool::get(size_t bufsize) {
+  bufsize = align(bufsize);
+  pthread_mutex_lock(&shared_pools_mutex);
+  BufferPool *&pool = shared_pools[bufsize];
+  if (!pool) {
+    pool = new BufferPool(bufsize);
+  }
+  pthread_mutex_unlock(&shared_pools_mutex);
+  return pool;
+}
+
+char *BufferPool::acquire() {
+  pthread_mutex_lock(&_mutex);
+  if (!_idle.empty()) {
+    char *buf = _idle.back();
+    _idle.pop_back();
+    pthread_mutex_unlock(&_mutex);
+    return buf;
+  }
+  _allocations++;
+  pthread_mutex_unlock(&_mutex);
+
+  void *buf = NULL;
+  if (posix_memalign(&buf, kAlignment, _bufsize) != 0) {
+    LOG(ERROR) << "Failed to allocate aligned buffer of " << _bufsize
+               << " bytes.";
+    return NULL;
+  }
+  return reinterpret_cast<char *>(buf);
+}
+
+void BufferPool::release(char *buf) {
+  if (!buf) {
+    return;
+  }
+  pthread_mutex_lock(&_mutex);
+  if (_idle.size() < _maxIdle) {
+    _idle.push_back(buf);
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&_mutex);
+  free(buf);
+}
+}
@@ -0,0 +1,109 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_BUFFERPOOL_H_
+#define _UTIL_BUFFERPOOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace util {
+
+using std::vector;
+
+/**
+ * A thread-safe pool of fixed size buffers aligned to kAlignment bytes.
+ * Buffers are suitable for O_DIRECT I/O and are recycled rather than freed
+ * so the block read/write paths don't hit the allocator on every call.
+ *
+ * Pools are normally obtained via BufferPool::get() so that every BlockStore
+ * using blocks of a given size draws from the same set of buffers. The RPC
+ * layer stages frames in util::SlabBuffer instead, since it doesn't know
+ * block sizes.
+ */
+class BufferPool {
+ public:
+  static const size_t kAlignment = 4096;
+
+  /**
+   * Creates a pool of buffers of at least bufsize bytes. The real buffer
+   * size is rounded up to a multiple of kAlignment. At most maxIdle unused
+   * buffers are retained; any beyond that are freed on release().
+   */
+  explicit BufferPool(size_t bufsize, size_t maxIdle = 64);
+  virtual ~BufferPool();
+
+  /**
+   * Returns the process-wide pool for buffers of the given size, creating
+   * it if required. Shared pools are never destroyed.
+   */
+  static BufferPool *get(size_t bufsize);
+
+  /**
+   * Returns an aligned buffer of bufferSize() bytes or NULL if we are out
+   * of memory. The buffer must be handed back via release().
+   */
+  char *acquire();
+
+  /**
+   * Returns a buffer previously obtained from acquire() to the pool.
+   */
+  void release(char *buf);
+
+  /**
+   * Returns the usable size of each buffer in bytes.
+   */
+  size_t bufferSize() const { return _bufsize; }
+
+  /**
+   * Returns the number of times acquire() had to allocate a new buffer.
+   */
+  uint64_t numAllocations() const { return _allocations; }
+
+  /**
+   * Rounds len up to the next multiple of kAlignment.
+   */
+  static size_t align(size_t len) {
+    return (len + kAlignment - 1) & ~(kAlignment - 1);
+  }
+
+ private:
+  BufferPool(const BufferPool &);
+  BufferPool &operator=(const BufferPool &);
+
+  pthread_mutex_t _mutex;
+  size_t _bufsize;
+  size_t _maxIdle;
+  uint64_t _allocations;
+  vector<char *> _idle;
+};
+}
+#endif
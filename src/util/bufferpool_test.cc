@@ -0,0 +1,71 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "bufferpool.h"
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <string.h>
+
+TEST(BufferPool, Alignment) {
+  util::BufferPool pool(1000);
+  EXPECT_EQ(util::BufferPool::kAlignment, pool.bufferSize());
+
+  char *buf = pool.acquire();
+  ASSERT_TRUE(buf != NULL);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(buf) % util::BufferPool::kAlignment);
+  memset(buf, 0xff, pool.bufferSize());
+  pool.release(buf);
+}
+
+TEST(BufferPool, Reuse) {
+  util::BufferPool pool(65536, 2);
+
+  char *a = pool.acquire();
+  char *b = pool.acquire();
+  char *c = pool.acquire();
+  EXPECT_EQ(3, pool.numAllocations());
+  pool.release(a);
+  pool.release(b);
+  pool.release(c);  // Exceeds maxIdle so this one is freed.
+
+  char *d = pool.acquire();
+  char *e = pool.acquire();
+  EXPECT_TRUE(d == a || d == b);
+  EXPECT_TRUE(e == a || e == b);
+  EXPECT_EQ(3, pool.numAllocations());
+  pool.release(d);
+  pool.release(e);
+}
+
+TEST(BufferPool, Shared) {
+  EXPECT_EQ(util::BufferPool::get(65536), util::BufferPool::get(65536));
+  EXPECT_EQ(util::BufferPool::get(100), util::BufferPool::get(4096));
+  EXPECT_NE(util::BufferPool::get(4096), util::BufferPool::get(65536));
+}
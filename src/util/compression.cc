@@ -0,0 +1,151 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "compression.h"
+
+#include <string.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+namespace util {
+
+namespace {
+// Bytes compressed by looksCompressible() and the ratio the sample must
+// reach for the block to be compressed.
+const size_t kSampleSize = 4096;
+const double kSampleRatio = 0.9;
+
+// Zstd level used for blocks. Low levels are faster than most uplinks.
+const int kZstdLevel = 1;
+
+void putLE32(char *buf, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = v >> (8 * i);
+  }
+}
+
+uint32_t getLE32(const char *buf) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)(uint8_t)buf[i] << (8 * i);
+  }
+  return v;
+}
+
+/**
+ * Compresses data into dst, returning the compressed size or 0 if it
+ * didn't fit in dstLen bytes.
+ */
+size_t compress(Codec codec, const char *data, size_t len, char *dst,
+                size_t dstLen) {
+  switch (codec) {
+    case CODEC_LZ4: {
+      int r = LZ4_compress_default(data, dst, len, dstLen);
+      return r > 0 ? r : 0;
+    }
+    case CODEC_ZSTD: {
+      size_t r = ZSTD_compress(dst, dstLen, data, len, kZstdLevel);
+      return ZSTD_isError(r) ? 0 : r;
+    }
+    default:
+      return 0;
+  }
+}
+}
+
+bool looksCompressible(const char *data, size_t len) {
+  if (len <= kSampleSize) {
+    return true;
+  }
+  char sample[LZ4_COMPRESSBOUND(kSampleSize)];
+  int r = LZ4_compress_fast(data, sample, kSampleSize, sizeof(sample), 8);
+  return r > 0 && r < kSampleSize * kSampleRatio;
+}
+
+size_t compressFrame(Codec codec, const char *data, size_t len, char *dst) {
+  dst[0] = CODEC_NONE;
+  putLE32(dst + 1, len);
+  if (codec != CODEC_NONE && len > 0 && looksCompressible(data, len)) {
+    // Only keep the result if it saves at least 1/16th.
+    size_t r = compress(codec, data, len, dst + kFrameHeaderSize,
+                        len - len / 16);
+    if (r > 0) {
+      dst[0] = codec;
+      return kFrameHeaderSize + r;
+    }
+  }
+  if (len) {
+    memcpy(dst + kFrameHeaderSize, data, len);
+  }
+  return kFrameHeaderSize + len;
+}
+
+ssize_t frameDataSize(const char *frame, size_t len, size_t maxSize) {
+  if (len < kFrameHeaderSize) {
+    return -1;
+  }
+  const uint32_t size = getLE32(frame + 1);
+  if (size > maxSize) {
+    return -1;
+  }
+  switch (frame[0]) {
+    case CODEC_NONE:
+      return size == len - kFrameHeaderSize ? (ssize_t)size : -1;
+    case CODEC_LZ4:
+    case CODEC_ZSTD:
+      return size;
+    default:
+      return -1;
+  }
+}
+
+ssize_t decompressFrame(const char *frame, size_t len, char *dst,
+                        size_t dstLen) {
+  const ssize_t size = frameDataSize(frame, len, dstLen);
+  if (size < 0) {
+    return -1;
+  }
+  const char *src = frame + kFrameHeaderSize;
+  const size_t srcLen = len - kFrameHeaderSize;
+  switch (frame[0]) {
+    case CODEC_NONE:
+      memcpy(dst, src, size);
+      return size;
+    case CODEC_LZ4:
+      return LZ4_decompress_safe(src, dst, srcLen, size) == size ? size : -1;
+    case CODEC_ZSTD: {
+      size_t r = ZSTD_decompress(dst, size, src, srcLen);
+      return !ZSTD_isError(r) && r == (size_t)size ? size : -1;
+    }
+    default:
+      return -1;
+  }
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_COMPRESSION_H_
+#define _UTIL_COMPRESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace util {
+
+/**
+ * Block compression codecs. The values are stored on disk and sent over
+ * the wire so must not change.
+ */
+enum Codec {
+  CODEC_NONE = 0,
+  CODEC_LZ4 = 1,
+  CODEC_ZSTD = 2,
+};
+
+/**
+ * Every frame starts with a one byte codec followed by the uncompressed
+ * length as a little endian uint32.
+ */
+const size_t kFrameHeaderSize = 5;
+
+/**
+ * Returns the largest frame compressFrame() can produce for len bytes.
+ * Data that doesn't compress is stored as is, so this is just the header
+ * on top.
+ */
+inline size_t maxFrameSize(size_t len) { return len + kFrameHeaderSize; }
+
+/**
+ * Largest uncompressed size a frame from an untrusted source may claim.
+ * Well above any block size in use, but small enough that a forged header
+ * can't make the reader allocate gigabytes.
+ */
+const size_t kMaxFrameData = 4 << 20;
+
+/**
+ * Cheaply guesses whether data is worth compressing by compressing a small
+ * sample from its start. Already compressed or encrypted data fails.
+ */
+bool looksCompressible(const char *data, size_t len);
+
+/**
+ * Writes len bytes of data to dst as a frame compressed with codec. Falls
+ * back to CODEC_NONE when the data looks incompressible or compressing it
+ * doesn't save enough to be worth decompressing later.
+ * @param dst must have room for maxFrameSize(len) bytes.
+ * @returns the size of the frame.
+ */
+size_t compressFrame(Codec codec, const char *data, size_t len, char *dst);
+
+/**
+ * Returns the uncompressed size of a frame or -1 if it is malformed or
+ * claims more than maxSize bytes.
+ */
+ssize_t frameDataSize(const char *frame, size_t len, size_t maxSize);
+
+/**
+ * Decompresses a frame into dst, which holds dstLen bytes.
+ * @returns the uncompressed size or -1 if the frame is malformed or too
+ *          large for dst.
+ */
+ssize_t decompressFrame(const char *frame, size_t len, char *dst,
+                        size_t dstLen);
+
+}
+#endif
@@ -0,0 +1,131 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "compression.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+using std::vector;
+using util::Codec;
+
+namespace {
+/**
+ * Compresses data with codec, checks it decompresses back to the original
+ * and returns the frame.
+ */
+vector<char> roundTrip(Codec codec, const vector<char> &data) {
+  vector<char> frame(util::maxFrameSize(data.size()));
+  frame.resize(util::compressFrame(codec, data.empty() ? NULL : &data[0],
+                                   data.size(), &frame[0]));
+  EXPECT_EQ((ssize_t)data.size(),
+            util::frameDataSize(&frame[0], frame.size(), data.size()));
+  vector<char> out(data.size() + 1);
+  EXPECT_EQ((ssize_t)data.size(),
+            util::decompressFrame(&frame[0], frame.size(), &out[0],
+                                  out.size()));
+  out.resize(data.size());
+  EXPECT_TRUE(out == data);
+  return frame;
+}
+}
+
+TEST(CompressionTest, RoundTrip) {
+  const Codec codecs[] = { util::CODEC_NONE, util::CODEC_LZ4,
+                           util::CODEC_ZSTD };
+  vector<char> text;
+  while (text.size() < 65536) {
+    const char *s = "the quick brown fox jumps over the lazy dog ";
+    text.insert(text.end(), s, s + strlen(s));
+  }
+  vector<char> noise(65536);
+  srand(1);
+  for (size_t i = 0; i < noise.size(); i++) {
+    noise[i] = rand();
+  }
+
+  for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+    vector<char> frame = roundTrip(codecs[c], text);
+    EXPECT_EQ(codecs[c], frame[0]);
+    if (codecs[c] != util::CODEC_NONE) {
+      EXPECT_LT(frame.size(), text.size() / 10);
+    }
+
+    // Incompressible data is stored as is.
+    frame = roundTrip(codecs[c], noise);
+    EXPECT_EQ(util::CODEC_NONE, frame[0]);
+    EXPECT_EQ(util::maxFrameSize(noise.size()), frame.size());
+
+    roundTrip(codecs[c], vector<char>());
+    roundTrip(codecs[c], vector<char>(1, 'x'));
+  }
+}
+
+TEST(CompressionTest, Heuristic) {
+  vector<char> data(65536, 'a');
+  EXPECT_TRUE(util::looksCompressible(&data[0], data.size()));
+  srand(2);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+  EXPECT_FALSE(util::looksCompressible(&data[0], data.size()));
+}
+
+TEST(CompressionTest, Malformed) {
+  vector<char> data(10000, 'z');
+  vector<char> frame(util::maxFrameSize(data.size()));
+  frame.resize(util::compressFrame(util::CODEC_LZ4, &data[0], data.size(),
+                                   &frame[0]));
+  vector<char> out(data.size());
+
+  EXPECT_EQ(-1, util::frameDataSize(&frame[0], 3, data.size()));
+  // Claims more than the caller will accept.
+  EXPECT_EQ(-1, util::frameDataSize(&frame[0], frame.size(),
+                                    data.size() - 1));
+  // Too small a destination.
+  EXPECT_EQ(-1, util::decompressFrame(&frame[0], frame.size(), &out[0],
+                                      out.size() - 1));
+  // Truncated payload.
+  EXPECT_EQ(-1, util::decompressFrame(&frame[0], frame.size() - 2, &out[0],
+                                      out.size()));
+  // Unknown codec.
+  frame[0] = 9;
+  EXPECT_EQ(-1, util::frameDataSize(&frame[0], frame.size(), data.size()));
+  // Raw frames must match their recorded length.
+  frame[0] = util::CODEC_NONE;
+  EXPECT_EQ(-1, util::frameDataSize(&frame[0], frame.size(), data.size()));
+  // A forged header can't ask for a huge buffer.
+  frame[0] = util::CODEC_LZ4;
+  frame[1] = frame[2] = frame[3] = frame[4] = (char)0xff;
+  EXPECT_EQ(-1, util::frameDataSize(&frame[0], frame.size(),
+                                    util::kMaxFrameData));
+}
@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace util {
+
+namespace {
+const uint32_t kPolynomial = 0x82f63b78;  // Reflected Castagnoli.
+
+struct Table {
+  uint32_t entries[256];
+  Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (c >> 1) ^ kPolynomial : c >> 1;
+      }
+      entries[i] = c;
+    }
+  }
+};
+const Table kTable;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cSSE42(const void *data, size_t len, uint32_t crc) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  uint64_t c = ~crc;
+  // Align to 8 bytes then consume a word per instruction.
+  while (len && (reinterpret_cast<uintptr_t>(p) & 7)) {
+    c = _mm_crc32_u8(c, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return ~static_cast<uint32_t>(c);
+}
+
+bool detectSSE42() {
+  // Required when called during static initialisation.
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+const bool kHaveSSE42 = detectSSE42();
+#else
+const bool kHaveSSE42 = false;
+#endif
+}
+
+uint32_t crc32cPortable(const void *data, size_t len, uint32_t crc) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  uint32_t c = ~crc;
+  while (len--) {
+    c = kTable.entries[(c ^ *p++) & 0xff] ^ (c >> 8);
+  }
+  return ~c;
+}
+
+uint32_t crc32c(const void *data, size_t len, uint32_t crc) {
+#if defined(__x86_64__)
+  if (kHaveSSE42) {
+    return crc32cSSE42(data, len, crc);
+  }
+#endif
+  return crc32cPortable(data, len, crc);
+}
+
+bool crc32cHardware() {
+  return kHaveSSE42;
+}
+}
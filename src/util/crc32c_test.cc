@@ -0,0 +1,70 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "crc32c.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+using std::vector;
+
+TEST(CRC32CTest, KnownValues) {
+  EXPECT_EQ(0, util::crc32c("", 0));
+  EXPECT_EQ(0xe3069283, util::crc32c("123456789", 9));
+  EXPECT_EQ(0xe3069283, util::crc32cPortable("123456789", 9));
+
+  char zeros[32];
+  memset(zeros, 0, sizeof(zeros));
+  EXPECT_EQ(0x8a9136aa, util::crc32c(zeros, sizeof(zeros)));
+}
+
+TEST(CRC32CTest, MatchesPortable) {
+  vector<uint8_t> data(65536 + 13);
+  srand(7);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+  // Odd offsets and lengths exercise the unaligned head and tail.
+  for (size_t off = 0; off < 9; off++) {
+    for (size_t len = 0; len < 40; len++) {
+      EXPECT_EQ(util::crc32cPortable(&data[off], len),
+                util::crc32c(&data[off], len));
+    }
+  }
+  uint32_t whole = util::crc32c(&data[0], data.size());
+  EXPECT_EQ(util::crc32cPortable(&data[0], data.size()), whole);
+
+  // Checksums can be computed incrementally.
+  uint32_t crc = util::crc32c(&data[0], 1000);
+  crc = util::crc32c(&data[1000], data.size() - 1000, crc);
+  EXPECT_EQ(whole, crc);
+}
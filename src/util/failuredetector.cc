@@ -0,0 +1,145 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "failuredetector.h"
+
+#include <algorithm>
+#include <math.h>
+
+namespace util {
+
+FailureDetector::Options::Options()
+    : windowSize(100), minStdDev(0.5), acceptablePause(1.0),
+      firstInterval(1.0), slowPhi(3.0), deadPhi(8.0) {
+}
+
+FailureDetector::FailureDetector(const Options &options)
+    : _options(options), _sum(0), _sumSquares(0), _last(-1),
+      _heartbeats(0), _lateHeartbeats(0), _falseDeaths(0) {
+}
+
+void FailureDetector::heartbeat(double now) {
+  if (_last >= 0) {
+    const double p = phi(now);
+    if (p >= _options.deadPhi) {
+      _falseDeaths++;
+    }
+    if (p >= _options.slowPhi) {
+      _lateHeartbeats++;
+    }
+    const double interval = std::max(now - _last, 0.0);
+    _intervals.push_back(interval);
+    _sum += interval;
+    _sumSquares += interval * interval;
+    if (_intervals.size() > _options.windowSize) {
+      _sum -= _intervals.front();
+      _sumSquares -= _intervals.front() * _intervals.front();
+      _intervals.pop_front();
+    }
+  }
+  _last = now;
+  _heartbeats++;
+}
+
+double FailureDetector::mean() const {
+  if (_intervals.empty()) {
+    return _options.firstInterval;
+  }
+  return _sum / _intervals.size();
+}
+
+double FailureDetector::stdDev() const {
+  double variance;
+  if (_intervals.empty()) {
+    variance = _options.firstInterval * _options.firstInterval / 16;
+  } else {
+    const double m = _sum / _intervals.size();
+    variance = _sumSquares / _intervals.size() - m * m;
+  }
+  return std::max(sqrt(std::max(variance, 0.0)), _options.minStdDev);
+}
+
+double FailureDetector::phiAfter(double elapsed) const {
+  // Logistic approximation of the normal CDF's tail, which unlike erfc()
+  // stays accurate far enough out to tell slow from dead.
+  const double y = (elapsed - mean() - _options.acceptablePause) / stdDev();
+  const double e = exp(-y * (1.5976 + 0.070566 * y * y));
+  if (y > 0) {
+    return -log10(e / (1 + e));
+  }
+  return -log10(1 - 1 / (1 + e));
+}
+
+double FailureDetector::phi(double now) const {
+  if (_last < 0) {
+    return 0;
+  }
+  return phiAfter(now - _last);
+}
+
+FailureDetector::State FailureDetector::state(double now) const {
+  const double p = phi(now);
+  if (p >= _options.deadPhi) {
+    return DEAD;
+  }
+  return p >= _options.slowPhi ? SLOW : ALIVE;
+}
+
+double FailureDetector::silenceFor(double threshold) const {
+  // phiAfter() increases with elapsed, so bisect for the crossing.
+  double lo = 0;
+  double hi = mean() + _options.acceptablePause + stdDev();
+  while (phiAfter(hi) < threshold) {
+    hi *= 2;
+  }
+  for (int i = 0; i < 50; i++) {
+    const double mid = (lo + hi) / 2;
+    if (phiAfter(mid) < threshold) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return hi;
+}
+
+FailureDetector::Stats FailureDetector::stats(double now) const {
+  Stats s;
+  s.heartbeats = _heartbeats;
+  s.meanInterval = mean();
+  s.stdDev = stdDev();
+  s.phi = phi(now);
+  s.state = state(now);
+  s.slowAfter = silenceFor(_options.slowPhi);
+  s.deadAfter = silenceFor(_options.deadPhi);
+  s.lateHeartbeats = _lateHeartbeats;
+  s.falseDeaths = _falseDeaths;
+  return s;
+}
+
+}
@@ -0,0 +1,123 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_FAILUREDETECTOR_H_
+#define _UTIL_FAILUREDETECTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+
+namespace util {
+
+using std::deque;
+
+/**
+ * Phi accrual failure detector. Rather than declaring a peer failed after
+ * a fixed timeout, it keeps a window of recent heartbeat intervals and
+ * reports phi = -log10(P(the next heartbeat is still on its way)), which
+ * grows the longer a heartbeat is overdue relative to those intervals. A
+ * phi of 1 means a 10% chance of wrongly suspecting a live peer, 2 means
+ * 1% and so on. Peers between slowPhi and deadPhi are slow; beyond deadPhi
+ * they are dead. Times are in seconds. Not thread-safe.
+ */
+class FailureDetector {
+ public:
+  enum State { ALIVE, SLOW, DEAD };
+
+  struct Options {
+    Options();
+
+    size_t windowSize;       // Heartbeat intervals remembered.
+    double minStdDev;        // Floor on the interval deviation.
+    double acceptablePause;  // Added to the mean interval.
+    double firstInterval;    // Assumed mean before a second heartbeat.
+    double slowPhi;
+    double deadPhi;
+  };
+
+  /**
+   * A snapshot of the detector, for monitoring.
+   */
+  struct Stats {
+    uint64_t heartbeats;
+    double meanInterval;
+    double stdDev;
+    double phi;
+    State state;
+    double slowAfter;        // Silence after which the peer is slow...
+    double deadAfter;        // ...and dead, given the intervals so far.
+    uint64_t lateHeartbeats;   // Arrived once the peer was slow.
+    uint64_t falseDeaths;      // Arrived once the peer was dead.
+  };
+
+  explicit FailureDetector(const Options &options = Options());
+  virtual ~FailureDetector() { }
+
+  /**
+   * Records a heartbeat, or anything else heard from the peer, at now.
+   */
+  void heartbeat(double now);
+
+  /**
+   * Returns the suspicion level at now, 0 before the first heartbeat.
+   */
+  double phi(double now) const;
+
+  State state(double now) const;
+  Stats stats(double now) const;
+
+  const Options &options() const { return _options; }
+
+ private:
+  double mean() const;
+  double stdDev() const;
+
+  /**
+   * Returns phi after 'elapsed' seconds of silence.
+   */
+  double phiAfter(double elapsed) const;
+
+  /**
+   * Returns the silence after which phi reaches threshold.
+   */
+  double silenceFor(double threshold) const;
+
+  Options _options;
+  deque<double> _intervals;
+  double _sum;
+  double _sumSquares;
+  double _last;  // Time of the last heartbeat, < 0 before the first.
+  uint64_t _heartbeats;
+  uint64_t _lateHeartbeats;
+  uint64_t _falseDeaths;
+};
+
+}
+#endif
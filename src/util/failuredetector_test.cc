@@ -0,0 +1,93 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "failuredetector.h"
+
+#include <gtest/gtest.h>
+
+using util::FailureDetector;
+
+TEST(FailureDetector, SuspicionGrowsWithSilence) {
+  FailureDetector d;
+  EXPECT_EQ(0, d.phi(100.0));
+  EXPECT_EQ(FailureDetector::ALIVE, d.state(100.0));
+
+  double t = 0;
+  for (int i = 0; i < 50; i++) {
+    d.heartbeat(t);
+    t += 1.0;
+  }
+  t -= 1.0;
+  EXPECT_EQ(FailureDetector::ALIVE, d.state(t + 1.0));
+  EXPECT_LT(d.phi(t + 1.0), d.phi(t + 2.0));
+  EXPECT_LT(d.phi(t + 2.0), d.phi(t + 3.0));
+
+  FailureDetector::Stats s = d.stats(t);
+  EXPECT_EQ(50u, s.heartbeats);
+  EXPECT_DOUBLE_EQ(1.0, s.meanInterval);
+  EXPECT_LT(s.slowAfter, s.deadAfter);
+
+  // Silence is slow once it passes slowAfter and dead past deadAfter.
+  EXPECT_EQ(FailureDetector::ALIVE, d.state(t + s.slowAfter - 0.01));
+  EXPECT_EQ(FailureDetector::SLOW, d.state(t + s.slowAfter + 0.01));
+  EXPECT_EQ(FailureDetector::SLOW, d.state(t + s.deadAfter - 0.01));
+  EXPECT_EQ(FailureDetector::DEAD, d.state(t + s.deadAfter + 0.01));
+  EXPECT_NEAR(d.options().slowPhi, d.phi(t + s.slowAfter), 0.01);
+}
+
+TEST(FailureDetector, CountsFalseSuspicions) {
+  FailureDetector d;
+  double t = 0;
+  for (int i = 0; i < 20; i++) {
+    d.heartbeat(t);
+    t += 1.0;
+  }
+  t -= 1.0;
+  FailureDetector::Stats s = d.stats(t);
+  t += (s.slowAfter + s.deadAfter) / 2;
+  d.heartbeat(t);
+  t += 100.0;
+  d.heartbeat(t);
+  s = d.stats(t);
+  EXPECT_EQ(2u, s.lateHeartbeats);
+  EXPECT_EQ(1u, s.falseDeaths);
+}
+
+TEST(FailureDetector, AdaptsToInterval) {
+  // The same silence is more suspicious for a peer that is usually chatty.
+  FailureDetector::Options options;
+  options.minStdDev = 0.01;
+  options.acceptablePause = 0;
+  FailureDetector fast(options), slow(options);
+  for (int i = 0; i <= 100; i++) {
+    fast.heartbeat(i * 0.1);
+    slow.heartbeat(i * 1.0);
+  }
+  EXPECT_EQ(FailureDetector::DEAD, fast.state(10.0 + 1.0));
+  EXPECT_EQ(FailureDetector::ALIVE, slow.state(100.0 + 1.0));
+}
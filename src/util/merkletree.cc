@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "merkletree.h"
+
+#include "sha256.h"
+
+#include <string.h>
+
+namespace util {
+
+MerkleTree::MerkleTree(int depth)
+    : _depth(depth), _nodes(2 << depth, 0) {
+}
+
+uint64_t MerkleTree::hash(const string &data) {
+  const string digest = sha256(data.data(), data.size());
+  // Decoded explicitly so nodes of either byte order agree on the tree.
+  uint64_t ret = 0;
+  for (int i = 0; i < 8; i++) {
+    ret |= (uint64_t)(uint8_t)digest[i] << (8 * i);
+  }
+  return ret;
+}
+
+void MerkleTree::toggle(uint32_t leaf, uint64_t itemHash) {
+  for (uint32_t n = leafNode(leaf); n >= 1; n >>= 1) {
+    _nodes[n] ^= itemHash;
+  }
+}
+
+uint32_t MerkleTree::firstDescendant(uint32_t n, int levels) const {
+  while (levels-- > 0 && !isLeafNode(n)) {
+    n <<= 1;
+  }
+  return n;
+}
+
+vector<uint64_t> MerkleTree::descendants(uint32_t n, int levels) const {
+  const uint32_t first = firstDescendant(n, levels);
+  // Each level down doubles the node numbers, so count them the same way.
+  uint32_t count = 1;
+  for (uint32_t m = n; m < first; m <<= 1) {
+    count <<= 1;
+  }
+  return vector<uint64_t>(_nodes.begin() + first,
+                          _nodes.begin() + first + count);
+}
+
+}
@@ -0,0 +1,104 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_MERKLETREE_H_
+#define _UTIL_MERKLETREE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace util {
+
+using std::string;
+using std::vector;
+
+/**
+ * Fixed shape hash tree over a set of items, for finding where two copies
+ * of the set differ without comparing them item by item. Items hash into
+ * one of 2^depth leaves, and every node holds the XOR of the hashes of
+ * the items beneath it. XOR lets an item be added, changed or removed in
+ * O(depth) without rehashing its neighbours. Nodes are numbered as in a
+ * binary heap: the root is 1 and node n has children 2n and 2n + 1.
+ * Not thread-safe.
+ */
+class MerkleTree {
+ public:
+  explicit MerkleTree(int depth = 12);
+  virtual ~MerkleTree() { }
+
+  /**
+   * Returns a 64 bit hash of data that is the same on every machine.
+   */
+  static uint64_t hash(const string &data);
+
+  /**
+   * Returns the leaf an item with the given key hash belongs in.
+   */
+  uint32_t leafFor(uint64_t keyHash) const {
+    return keyHash >> (64 - _depth);
+  }
+
+  /**
+   * Adds or removes an item's hash under leaf. Adding the same hash
+   * again removes it, so changing an item is one call with its old hash
+   * and one with its new.
+   */
+  void toggle(uint32_t leaf, uint64_t itemHash);
+
+  uint64_t node(uint32_t n) const { return _nodes[n]; }
+  uint64_t root() const { return _nodes[1]; }
+  int depth() const { return _depth; }
+  uint32_t numLeaves() const { return 1 << _depth; }
+
+  /**
+   * Returns the node number of leaf.
+   */
+  uint32_t leafNode(uint32_t leaf) const { return numLeaves() + leaf; }
+  bool isLeafNode(uint32_t n) const { return n >= numLeaves(); }
+
+  /**
+   * Returns the hashes of the nodes 'levels' below n, or of n's leaves if
+   * they are nearer, left to right.
+   */
+  vector<uint64_t> descendants(uint32_t n, int levels) const;
+
+  /**
+   * Returns the node number of the first node that descendants(n, levels)
+   * covers. The rest follow it in order.
+   */
+  uint32_t firstDescendant(uint32_t n, int levels) const;
+
+ private:
+  int _depth;
+  vector<uint64_t> _nodes;
+};
+
+}
+#endif
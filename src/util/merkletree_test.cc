@@ -0,0 +1,103 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "merkletree.h"
+
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+using util::MerkleTree;
+
+TEST(MerkleTree, ToggleIsReversible) {
+  MerkleTree t(4);
+  EXPECT_EQ(16u, t.numLeaves());
+  EXPECT_EQ(0u, t.root());
+
+  const uint64_t a = MerkleTree::hash("a");
+  const uint64_t b = MerkleTree::hash("b");
+  EXPECT_NE(a, b);
+  EXPECT_EQ(a, MerkleTree::hash("a"));
+  t.toggle(t.leafFor(a), a);
+  t.toggle(t.leafFor(b), b);
+  EXPECT_EQ(a ^ b, t.root());
+  EXPECT_EQ(a, t.node(t.leafNode(t.leafFor(a))) ^
+               (t.leafFor(a) == t.leafFor(b) ? b : 0));
+
+  // Order doesn't matter, and toggling again removes an item.
+  MerkleTree u(4);
+  u.toggle(u.leafFor(b), b);
+  u.toggle(u.leafFor(a), a);
+  EXPECT_EQ(t.root(), u.root());
+  u.toggle(u.leafFor(a), a);
+  u.toggle(u.leafFor(b), b);
+  EXPECT_EQ(0u, u.root());
+}
+
+TEST(MerkleTree, FindsDifferences) {
+  MerkleTree t(8), u(8);
+  for (int i = 0; i < 1000; i++) {
+    const uint64_t h = MerkleTree::hash(string(1, 'a' + i % 26) +
+                                        string(i / 26 + 1, 'x'));
+    t.toggle(t.leafFor(h), h);
+    u.toggle(u.leafFor(h), h);
+  }
+  EXPECT_EQ(t.root(), u.root());
+  const uint64_t extra = MerkleTree::hash("extra");
+  u.toggle(u.leafFor(extra), extra);
+  EXPECT_NE(t.root(), u.root());
+
+  // Walking down four levels at a time through the differing nodes leads
+  // to the one differing leaf.
+  vector<uint32_t> differing(1, 1);
+  while (!t.isLeafNode(differing[0])) {
+    ASSERT_EQ(1u, differing.size());
+    const uint32_t n = differing[0];
+    vector<uint64_t> mine = t.descendants(n, 4);
+    vector<uint64_t> theirs = u.descendants(n, 4);
+    ASSERT_EQ(mine.size(), theirs.size());
+    differing.clear();
+    for (size_t i = 0; i < mine.size(); i++) {
+      if (mine[i] != theirs[i]) {
+        differing.push_back(t.firstDescendant(n, 4) + i);
+      }
+    }
+  }
+  ASSERT_EQ(1u, differing.size());
+  EXPECT_EQ(t.leafNode(t.leafFor(extra)), differing[0]);
+}
+
+TEST(MerkleTree, DescendantsStopAtLeaves) {
+  MerkleTree t(6);
+  EXPECT_EQ(16u, t.descendants(1, 4).size());
+  EXPECT_EQ(16u * 2, t.firstDescendant(2, 4));
+  // Only two levels remain below the depth 4 nodes.
+  EXPECT_EQ(4u, t.descendants(16, 4).size());
+  EXPECT_EQ(64u, t.firstDescendant(16, 4));
+  EXPECT_EQ(1u, t.descendants(64, 4).size());
+}
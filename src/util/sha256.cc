@@ -0,0 +1,64 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "sha256.h"
+
+#include <stdint.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+namespace util {
+
+string sha256(const void *data, size_t len) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256((const unsigned char *)data, len, digest);
+  return string((const char *)digest, sizeof(digest));
+}
+
+string sha256Hex(const void *data, size_t len) {
+  static const char kHex[] = "0123456789abcdef";
+  string digest = sha256(data, len);
+  string ret(digest.size() * 2, '0');
+  for (size_t i = 0; i < digest.size(); i++) {
+    ret[2 * i] = kHex[(uint8_t)digest[i] >> 4];
+    ret[2 * i + 1] = kHex[(uint8_t)digest[i] & 0xf];
+  }
+  return ret;
+}
+
+string hmacSha256(const string &key, const string &data) {
+  unsigned char mac[SHA256_DIGEST_LENGTH];
+  unsigned int len = 0;
+  HMAC(EVP_sha256(), key.data(), key.size(),
+       (const unsigned char *)data.data(), data.size(), mac, &len);
+  return string((const char *)mac, len);
+}
+
+}
@@ -0,0 +1,228 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slaballocator.h"
+
+#include <glog/logging.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace util {
+
+namespace {
+// Every buffer is preceded by a header recording its size class, padded to
+// keep the buffer 16 byte aligned.
+struct Header {
+  int sizeClass;  // kNumClasses for buffers too big to pool.
+  size_t len;
+} __attribute__((aligned(16)));
+
+// Free buffers are linked through their first bytes.
+struct FreeBuffer {
+  FreeBuffer *next;
+};
+
+// How many free buffers of a class one thread keeps. Half are handed to
+// the depot when it has more.
+size_t cacheLimit(int sizeClass) {
+  const size_t n = (1 << 20) / (SlabAllocator::kMinSize << sizeClass);
+  return n < 4 ? 4 : n > 64 ? 64 : n;
+}
+
+__thread FreeBuffer *cache[SlabAllocator::kNumClasses];
+__thread size_t cacheSize[SlabAllocator::kNumClasses];
+__thread bool cacheRegistered;
+
+pthread_mutex_t depotMutex = PTHREAD_MUTEX_INITIALIZER;
+FreeBuffer *depot[SlabAllocator::kNumClasses];
+size_t depotSize[SlabAllocator::kNumClasses];
+
+pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t exitKey;
+
+uint64_t numAllocations = 0;
+uint64_t numReuses = 0;
+uint64_t numFrees = 0;
+
+int sizeClassFor(size_t len) {
+  int c = 0;
+  while (c < SlabAllocator::kNumClasses &&
+         (SlabAllocator::kMinSize << c) < len) {
+    c++;
+  }
+  return c;
+}
+
+void releaseToMalloc(FreeBuffer *b) {
+  __sync_fetch_and_add(&numFrees, 1);
+  ::free(reinterpret_cast<Header *>(b) - 1);
+}
+
+/**
+ * Moves all but keep of the calling thread's cached buffers of a class to
+ * the depot, freeing any the depot has no room for.
+ */
+void spill(int c, size_t keep) {
+  FreeBuffer *list = NULL;
+  while (cacheSize[c] > keep) {
+    FreeBuffer *b = cache[c];
+    cache[c] = b->next;
+    cacheSize[c]--;
+    b->next = list;
+    list = b;
+  }
+  pthread_mutex_lock(&depotMutex);
+  while (list && depotSize[c] < 16 * cacheLimit(c)) {
+    FreeBuffer *b = list;
+    list = b->next;
+    b->next = depot[c];
+    depot[c] = b;
+    depotSize[c]++;
+  }
+  pthread_mutex_unlock(&depotMutex);
+  while (list) {
+    FreeBuffer *b = list;
+    list = b->next;
+    releaseToMalloc(b);
+  }
+}
+
+void onThreadExit(void *) {
+  for (int c = 0; c < SlabAllocator::kNumClasses; c++) {
+    spill(c, 0);
+  }
+}
+
+void createKey() {
+  pthread_key_create(&exitKey, &onThreadExit);
+}
+
+/**
+ * Refills the calling thread's cache of a class from the depot.
+ */
+void refill(int c) {
+  const size_t want = cacheLimit(c) / 2;
+  pthread_mutex_lock(&depotMutex);
+  while (depot[c] && cacheSize[c] < want) {
+    FreeBuffer *b = depot[c];
+    depot[c] = b->next;
+    depotSize[c]--;
+    b->next = cache[c];
+    cache[c] = b;
+    cacheSize[c]++;
+  }
+  pthread_mutex_unlock(&depotMutex);
+}
+}  // end anonymous namespace
+
+const size_t SlabAllocator::kMinSize;
+const size_t SlabAllocator::kMaxSize;
+const int SlabAllocator::kNumClasses;
+
+char *SlabAllocator::alloc(size_t len) {
+  const int c = sizeClassFor(len);
+  if (c < kNumClasses) {
+    if (!cache[c]) {
+      refill(c);
+    }
+    if (cache[c]) {
+      FreeBuffer *b = cache[c];
+      cache[c] = b->next;
+      cacheSize[c]--;
+      __sync_fetch_and_add(&numReuses, 1);
+      return reinterpret_cast<char *>(b);
+    }
+    len = kMinSize << c;
+  }
+  Header *h = reinterpret_cast<Header *>(malloc(sizeof(Header) + len));
+  CHECK(h != NULL) << "Out of memory allocating " << len << " bytes.";
+  h->sizeClass = c;
+  h->len = len;
+  __sync_fetch_and_add(&numAllocations, 1);
+  return reinterpret_cast<char *>(h + 1);
+}
+
+void SlabAllocator::free(char *buf) {
+  if (!buf) {
+    return;
+  }
+  const int c = (reinterpret_cast<Header *>(buf) - 1)->sizeClass;
+  FreeBuffer *b = reinterpret_cast<FreeBuffer *>(buf);
+  if (c == kNumClasses) {
+    releaseToMalloc(b);
+    return;
+  }
+  if (!cacheRegistered) {
+    // Hand this thread's buffers back when it exits.
+    pthread_once(&keyOnce, &createKey);
+    pthread_setspecific(exitKey, &cacheRegistered);
+    cacheRegistered = true;
+  }
+  b->next = cache[c];
+  cache[c] = b;
+  if (++cacheSize[c] > cacheLimit(c)) {
+    spill(c, cacheLimit(c) / 2);
+  }
+}
+
+size_t SlabAllocator::capacity(const char *buf) {
+  return (reinterpret_cast<const Header *>(buf) - 1)->len;
+}
+
+SlabAllocator::Stats SlabAllocator::stats() {
+  Stats s;
+  s.allocations = __sync_fetch_and_add(&numAllocations, 0);
+  s.reuses = __sync_fetch_and_add(&numReuses, 0);
+  s.frees = __sync_fetch_and_add(&numFrees, 0);
+  return s;
+}
+
+SlabBuffer::SlabBuffer(const char *data, size_t len)
+    : _data(SlabAllocator::alloc(len)), _size(len) {
+  memcpy(_data, data, len);
+}
+
+void SlabBuffer::write(const char *data, size_t len) {
+  if (!_data || _size + len > SlabAllocator::capacity(_data)) {
+    size_t want = _data ? 2 * SlabAllocator::capacity(_data) : 0;
+    if (want < _size + len) {
+      want = _size + len;
+    }
+    char *grown = SlabAllocator::alloc(want);
+    if (_size) {
+      memcpy(grown, _data, _size);
+    }
+    SlabAllocator::free(_data);
+    _data = grown;
+  }
+  memcpy(_data + _size, data, len);
+  _size += len;
+}
+}
@@ -0,0 +1,102 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_SLABALLOCATOR_H_
+#define _UTIL_SLABALLOCATOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace util {
+
+/**
+ * Process-wide allocator for short lived variable sized buffers such as
+ * RPC frames. Requests are rounded up to a power of two size class between
+ * kMinSize and kMaxSize and freed buffers are kept on a per-thread free
+ * list for their class, so a thread that keeps encoding and decoding
+ * frames stops calling malloc once it has warmed up. Threads that free
+ * more than they allocate hand the surplus to a shared depot other
+ * threads draw from. Requests larger than kMaxSize go straight to malloc.
+ *
+ * All methods are thread-safe.
+ */
+class SlabAllocator {
+ public:
+  static const size_t kMinSize = 256;
+  static const size_t kMaxSize = 4 << 20;
+  static const int kNumClasses = 15;
+
+  struct Stats {
+    uint64_t allocations;  // Buffers obtained from malloc.
+    uint64_t reuses;       // Buffers handed out again from a free list.
+    uint64_t frees;        // Buffers returned to malloc.
+  };
+
+  /**
+   * Returns a buffer of at least len bytes. Never returns NULL.
+   */
+  static char *alloc(size_t len);
+
+  /**
+   * Returns a buffer obtained from alloc(). NULL is ignored.
+   */
+  static void free(char *buf);
+
+  /**
+   * Returns the usable size of a buffer obtained from alloc().
+   */
+  static size_t capacity(const char *buf);
+
+  static Stats stats();
+};
+
+/**
+ * Growable byte buffer in SlabAllocator memory. Has the write() method
+ * msgpack expects of a stream so it can stand in for msgpack::sbuffer.
+ */
+class SlabBuffer {
+ public:
+  SlabBuffer() : _data(NULL), _size(0) { }
+  SlabBuffer(const char *data, size_t len);
+  ~SlabBuffer() { SlabAllocator::free(_data); }
+
+  void write(const char *data, size_t len);
+  void clear() { _size = 0; }
+
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+
+ private:
+  SlabBuffer(const SlabBuffer &);
+  SlabBuffer &operator=(const SlabBuffer &);
+
+  char *_data;
+  size_t _size;
+};
+}
+#endif
@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slaballocator.h"
+
+#include <gtest/gtest.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using util::SlabAllocator;
+using util::SlabBuffer;
+
+TEST(SlabAllocator, Reuse) {
+  char *a = SlabAllocator::alloc(1000);
+  EXPECT_EQ(1024, SlabAllocator::capacity(a));
+  memset(a, 0xff, 1000);
+  SlabAllocator::free(a);
+
+  // The next buffer of the same class on this thread is the one we freed.
+  SlabAllocator::Stats before = SlabAllocator::stats();
+  char *b = SlabAllocator::alloc(600);
+  EXPECT_EQ(a, b);
+  SlabAllocator::Stats after = SlabAllocator::stats();
+  EXPECT_EQ(before.allocations, after.allocations);
+  EXPECT_EQ(before.reuses + 1, after.reuses);
+  SlabAllocator::free(b);
+}
+
+TEST(SlabAllocator, Large) {
+  SlabAllocator::Stats before = SlabAllocator::stats();
+  char *a = SlabAllocator::alloc(SlabAllocator::kMaxSize + 1);
+  EXPECT_EQ(SlabAllocator::kMaxSize + 1, SlabAllocator::capacity(a));
+  SlabAllocator::free(a);
+  SlabAllocator::Stats after = SlabAllocator::stats();
+  EXPECT_EQ(before.allocations + 1, after.allocations);
+  EXPECT_EQ(before.frees + 1, after.frees);
+}
+
+void *allocMany(void *arg) {
+  vector<char *> *bufs = reinterpret_cast<vector<char *> *>(arg);
+  for (int i = 0; i < 1000; i++) {
+    bufs->push_back(SlabAllocator::alloc(4096));
+  }
+  return NULL;
+}
+
+TEST(SlabAllocator, CrossThread) {
+  // Buffers allocated on one thread and freed on another flow back
+  // through the depot rather than being malloced again.
+  vector<char *> bufs;
+  for (int round = 0; round < 3; round++) {
+    SlabAllocator::Stats before = SlabAllocator::stats();
+    pthread_t t;
+    pthread_create(&t, NULL, &allocMany, &bufs);
+    pthread_join(t, NULL);
+    for (size_t i = 0; i < bufs.size(); i++) {
+      SlabAllocator::free(bufs[i]);
+    }
+    bufs.clear();
+    SlabAllocator::Stats after = SlabAllocator::stats();
+    if (round > 0) {
+      EXPECT_LT(after.allocations - before.allocations, 1000);
+    }
+  }
+}
+
+TEST(SlabBuffer, Write) {
+  SlabBuffer buf;
+  string expected;
+  for (int i = 0; i < 1000; i++) {
+    string s(i % 37, 'a' + i % 26);
+    buf.write(s.data(), s.size());
+    expected += s;
+  }
+  ASSERT_EQ(expected.size(), buf.size());
+  EXPECT_EQ(0, memcmp(expected.data(), buf.data(), buf.size()));
+
+  SlabBuffer copy(buf.data(), buf.size());
+  EXPECT_EQ(0, memcmp(expected.data(), copy.data(), copy.size()));
+}
@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slotallocator.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace util {
+
+namespace {
+/**
+ * Returns the index of the first word at or after 'start' that has a
+ * clear bit, or 'size' if there is none. Full words are all ones so the
+ * SSE2 path compares two words at a time against ~0 and skips ahead while
+ * both are full.
+ */
+uint64_t findFirstNonFull(const uint64_t *words, uint64_t start,
+                          uint64_t size) {
+  uint64_t i = start;
+#ifdef __SSE2__
+  const __m128i full = _mm_set1_epi32(-1);
+  for (; i + 2 <= size; i += 2) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, full)) != 0xffff) {
+      break;
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    if (words[i] != ~0ULL) {
+      return i;
+    }
+  }
+  return size;
+}
+}
+
+void SlotAllocator::reset(uint64_t numSlots) {
+  _numSlots = numSlots;
+  _numUsed = 0;
+  _hint = 0;
+  _bitmap.assign((numSlots + 63) / 64, 0);
+  // Mark the tail of the last word as permanently allocated so searches
+  // never return a slot past the end.
+  if (numSlots & 63) {
+    _bitmap.back() = ~0ULL << (numSlots & 63);
+  }
+}
+
+int64_t SlotAllocator::allocate() {
+  if (_bitmap.empty()) {
+    return -1;
+  }
+  uint64_t i = findFirstNonFull(&_bitmap[0], _hint, _bitmap.size());
+  _hint = i;
+  if (i == _bitmap.size()) {
+    return -1;
+  }
+  int bit = __builtin_ctzll(~_bitmap[i]);
+  _bitmap[i] |= 1ULL << bit;
+  _numUsed++;
+  return (int64_t)(i * 64 + bit);
+}
+
+bool SlotAllocator::allocate(uint64_t slot) {
+  if (slot >= _numSlots || isAllocated(slot)) {
+    return false;
+  }
+  _bitmap[slot >> 6] |= 1ULL << (slot & 63);
+  _numUsed++;
+  return true;
+}
+
+void SlotAllocator::release(uint64_t slot) {
+  if (!isAllocated(slot)) {
+    return;
+  }
+  _bitmap[slot >> 6] &= ~(1ULL << (slot & 63));
+  _numUsed--;
+  if ((slot >> 6) < _hint) {
+    _hint = slot >> 6;
+  }
+}
+}
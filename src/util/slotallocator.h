@@ -0,0 +1,87 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _UTIL_SLOTALLOCATOR_H_
+#define _UTIL_SLOTALLOCATOR_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace util {
+
+using std::vector;
+
+/**
+ * Exact allocator for a fixed number of equally sized slots, backed by a
+ * bitmap. Counts are maintained incrementally so free/used queries are
+ * O(1). Not thread-safe.
+ */
+class SlotAllocator {
+ public:
+  explicit SlotAllocator(uint64_t numSlots = 0) { reset(numSlots); }
+  virtual ~SlotAllocator() { }
+
+  /**
+   * Resizes the allocator to numSlots slots, all of them free.
+   */
+  void reset(uint64_t numSlots);
+
+  /**
+   * Allocates the lowest numbered free slot.
+   * @returns the slot number or -1 if every slot is in use.
+   */
+  int64_t allocate();
+
+  /**
+   * Marks a specific slot as allocated.
+   * @returns false if the slot is out of range or already in use.
+   */
+  bool allocate(uint64_t slot);
+
+  /**
+   * Returns a slot to the free pool. Releasing a free slot is a no-op.
+   */
+  void release(uint64_t slot);
+
+  bool isAllocated(uint64_t slot) const {
+    return slot < _numSlots && (_bitmap[slot >> 6] >> (slot & 63)) & 1;
+  }
+
+  uint64_t numSlots() const { return _numSlots; }
+  uint64_t numUsed() const { return _numUsed; }
+  uint64_t numFree() const { return _numSlots - _numUsed; }
+
+ private:
+  uint64_t _numSlots;
+  uint64_t _numUsed;
+  uint64_t _hint;  // No word before this index has a free bit.
+  vector<uint64_t> _bitmap;
+};
+}
+#endif
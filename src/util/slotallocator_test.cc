@@ -0,0 +1,90 @@
+/*
+ Copyright (c) 2011 Aaron Drew
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 1. Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+ 3. Neither the name of the copyright holders nor the names of its
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "slotallocator.h"
+
+#include <gtest/gtest.h>
+
+TEST(SlotAllocator, AllocateRelease) {
+  util::SlotAllocator a(100);
+  EXPECT_EQ(100, a.numSlots());
+  EXPECT_EQ(100, a.numFree());
+
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(i, a.allocate());
+  }
+  EXPECT_EQ(0, a.numFree());
+  EXPECT_EQ(100, a.numUsed());
+  EXPECT_EQ(-1, a.allocate());
+
+  a.release(70);
+  a.release(3);
+  a.release(3);
+  EXPECT_EQ(2, a.numFree());
+  EXPECT_FALSE(a.isAllocated(3));
+  EXPECT_EQ(3, a.allocate());
+  EXPECT_EQ(70, a.allocate());
+  EXPECT_EQ(-1, a.allocate());
+}
+
+TEST(SlotAllocator, AllocateSpecific) {
+  util::SlotAllocator a(10);
+  EXPECT_TRUE(a.allocate(0));
+  EXPECT_TRUE(a.allocate(5));
+  EXPECT_FALSE(a.allocate(5));
+  EXPECT_FALSE(a.allocate(10));
+  EXPECT_EQ(8, a.numFree());
+  EXPECT_EQ(1, a.allocate());
+}
+
+TEST(SlotAllocator, Reset) {
+  util::SlotAllocator a(3);
+  a.allocate();
+  a.reset(64);
+  EXPECT_EQ(64, a.numFree());
+  for (int i = 0; i < 64; i++) {
+    EXPECT_EQ(i, a.allocate());
+  }
+  EXPECT_EQ(-1, a.allocate());
+
+  util::SlotAllocator empty;
+  EXPECT_EQ(0, empty.numFree());
+  EXPECT_EQ(-1, empty.allocate());
+}
+
+TEST(SlotAllocator, Sparse) {
+  // Exercises the multi-word scan with the only free slot deep in the map.
+  util::SlotAllocator a(64 * 1000 + 5);
+  while (a.allocate() != -1) { }
+  EXPECT_EQ(0, a.numFree());
+  a.release(64 * 777 + 13);
+  EXPECT_EQ(64 * 777 + 13, a.allocate());
+  a.release(64 * 1000 + 4);
+  EXPECT_EQ(64 * 1000 + 4, a.allocate());
+  EXPECT_EQ(-1, a.allocate());
+}